@@ -0,0 +1,651 @@
+// Batch mode: many input files in one process, on a work-stealing pool.
+//
+// Files are handed out largest first. The thread that takes a file maps it, finds the pairs array
+// and cuts it into chunks of about BATCH_CHUNK_SIZE bytes; it keeps the first chunk and pushes the
+// others onto its own deque, where idle threads steal them from the other end. So a huge file gets
+// every core while small files fill in around it. Each chunk sums its pairs a sum block at a time
+// from a buffer on the stack, nothing is allocated per file.
+//
+// NOTE(alex): Workers can't touch the profiler, so everything they call here is unprofiled and
+// allocation free. The file list and results are set up on the main thread.
+//
+// Chunks start at the first "{" after their nominal offset, which only works for arrays of flat
+// objects (what haversine_generator writes). Each chunk checks that it ended exactly where the next
+// one started; if any didn't, the file is parsed again serially with the cursor, which takes any
+// JSON. Chunk sums are combined in order, so a file's result depends only on its size and contents,
+// not on the thread count, but isn't bitwise the same as the in-memory run (different block
+// boundaries).
+
+#define BATCH_CHUNK_SIZE (4 * 1024 * 1024)
+#define BATCH_MAX_CHUNKS 64
+
+enum BatchStatus {
+    BatchStatus_Pending,
+    BatchStatus_Done,
+    BatchStatus_CantOpen,
+    BatchStatus_Compressed,
+    BatchStatus_NoPairs,
+    BatchStatus_Malformed,
+    
+    BatchStatus_Count,
+};
+
+struct BatchChunk {
+    CompensatedSum sum;
+    u64 pairCount;
+    bool valid;
+};
+
+struct BatchFile {
+    const char* path;
+    u64 size;
+    
+    MappedFile file;
+    u64 arrayStart;    // Just past the "["
+    u32 chunkCount;
+    volatile u32 chunksLeft;
+    BatchChunk chunks[BATCH_MAX_CHUNKS];
+    
+    BatchStatus status;
+    u64 pairCount;
+    double sum;
+    u64 startTime;     // OS timer
+    u64 endTime;
+};
+
+// Tasks are (file << 32) | chunk. top and bottom only grow, the ring holds [top, bottom).
+struct BatchDeque {
+    volatile u32 lock;
+    u32 top;
+    u32 bottom;
+    u64 tasks[BATCH_MAX_CHUNKS];
+};
+
+struct BatchScheduler {
+    BatchFile* files;
+    u32* order;         // File indices, largest first
+    u32 fileCount;
+    
+    volatile u32 nextFile;
+    volatile u32 finishedCount;
+    
+    JsonSchema schema;
+    
+    u32 threadCount;
+    BatchDeque deques[MAX_THREAD_COUNT];
+};
+
+struct BatchWorker {
+    BatchScheduler* scheduler;
+    u32 threadIndex;
+};
+
+static const char* describe_batch_status(BatchStatus status) {
+    const char* result;
+    
+    switch(status) {
+        case BatchStatus_Pending: { result = "not processed"; } break;
+        case BatchStatus_Done: { result = "done"; } break;
+        case BatchStatus_CantOpen: { result = "can't open"; } break;
+        case BatchStatus_Compressed: { result = "compressed input isn't supported in batch mode"; } break;
+        case BatchStatus_NoPairs: { result = "no \"pairs\" array"; } break;
+        case BatchStatus_Malformed: { result = "malformed pairs array"; } break;
+        default: { result = "UNKNOWN"; } break;
+    }
+    
+    return result;
+}
+
+//
+// Deques
+//
+
+static void lock_batch_deque(BatchDeque* deque) {
+    while (!atomic_compare_exchange_u32(&deque->lock, 0, 1)) {
+        _mm_pause();
+    }
+}
+
+static void unlock_batch_deque(BatchDeque* deque) {
+    atomic_compare_exchange_u32(&deque->lock, 1, 0);
+}
+
+// Owner only. Returns false when full, the owner then runs the task itself.
+static bool push_batch_task(BatchDeque* deque, u64 task) {
+    lock_batch_deque(deque);
+    
+    bool result = (deque->bottom - deque->top) < ARRAY_COUNT(deque->tasks);
+    if (result) {
+        deque->tasks[deque->bottom++ % ARRAY_COUNT(deque->tasks)] = task;
+    }
+    
+    unlock_batch_deque(deque);
+    
+    return result;
+}
+
+// Owner end, newest first
+static bool pop_batch_task(BatchDeque* deque, u64* task) {
+    lock_batch_deque(deque);
+    
+    bool result = (deque->bottom != deque->top);
+    if (result) {
+        *task = deque->tasks[--deque->bottom % ARRAY_COUNT(deque->tasks)];
+    }
+    
+    unlock_batch_deque(deque);
+    
+    return result;
+}
+
+// Thief end, oldest first
+static bool steal_batch_task(BatchDeque* deque, u64* task) {
+    // Unlocked peek so idle threads don't fight over empty deques
+    if (deque->bottom == deque->top) {
+        return false;
+    }
+    
+    lock_batch_deque(deque);
+    
+    bool result = (deque->bottom != deque->top);
+    if (result) {
+        *task = deque->tasks[deque->top++ % ARRAY_COUNT(deque->tasks)];
+    }
+    
+    unlock_batch_deque(deque);
+    
+    return result;
+}
+
+//
+// Chunks
+//
+
+// Reads the rest of a flat object whose "{" was just returned. Values that aren't numbers read as
+// 0, containers fail.
+static bool parse_flat_pair(JsonParser* parser, JsonSchema* schema, HaversinePair* pair) {
+    *pair = {};
+    
+    JsonToken token = get_json_token(parser);
+    if (token.type == Token_close_brace) {
+        return true;
+    }
+    
+    while (token.type == Token_string_literal) {
+        JsonToken colon = get_json_token(parser);
+        JsonToken value = get_json_token(parser);
+        
+        bool isScalar = ((value.type == Token_number) || (value.type == Token_string_literal) ||
+                         (value.type == Token_true) || (value.type == Token_false) || (value.type == Token_null));
+        if ((colon.type != Token_colon) || !isScalar) {
+            return false;
+        }
+        
+        u32 slot = schema->slots[get_json_schema_slot(schema, token.hash)];
+        if (slot) {
+            JsonFieldDesc* field = schema->fields + (slot - 1);
+            if ((field->hash == token.hash) && are_equal_json_string(token.value, field->name)) {
+                store_json_field(field, value, (u8*)pair);
+            }
+        }
+        
+        JsonToken next = get_json_token(parser);
+        if (next.type == Token_close_brace) {
+            return true;
+        }
+        
+        if (next.type != Token_comma) {
+            return false;
+        }
+        
+        token = get_json_token(parser);
+    }
+    
+    return false;
+}
+
+static void flush_batch_pairs(BatchChunk* chunk, u64 count, HaversinePair* pairs) {
+    double distances[SUM_BLOCK_PAIR_COUNT];
+    haversine_distances(count, pairs, distances);
+    
+    CompensatedSum block = sum_neumaier(count, distances);
+    add_compensated(&chunk->sum, block.sum);
+    chunk->sum.compensation += block.compensation;
+    chunk->pairCount += count;
+}
+
+// Sums the pair objects starting in [start, end). Valid if the next object starts exactly at end,
+// or if the array closes and end is the end of the input (nothing after this chunk has pairs).
+static void sum_batch_chunk(String json, JsonSchema* schema, u64 start, u64 end, BatchChunk* chunk) {
+    *chunk = {};
+    
+    if (start >= end) {
+        chunk->valid = true;
+        return;
+    }
+    
+    JsonParser parser = {};
+    parser.source = json;
+    parser.at = start;
+    
+    HaversinePair pairs[SUM_BLOCK_PAIR_COUNT];
+    u64 bufferedCount = 0;
+    bool afterObject = false;
+    
+    while (true) {
+        JsonToken token = get_json_token(&parser);
+        
+        if (token.type == Token_close_bracket) {
+            chunk->valid = (end == json.count);
+            break;
+        }
+        
+        if (afterObject) {
+            if (token.type != Token_comma) {
+                break;
+            }
+            token = get_json_token(&parser);
+        }
+        
+        if (token.type != Token_open_brace) {
+            break;
+        }
+        
+        u64 offset = token.value.data - json.data;
+        if (offset >= end) {
+            chunk->valid = (offset == end);
+            break;
+        }
+        
+        if (!parse_flat_pair(&parser, schema, pairs + bufferedCount)) {
+            break;
+        }
+        
+        if (++bufferedCount == SUM_BLOCK_PAIR_COUNT) {
+            flush_batch_pairs(chunk, bufferedCount, pairs);
+            bufferedCount = 0;
+        }
+        
+        afterObject = true;
+    }
+    
+    if (bufferedCount) {
+        flush_batch_pairs(chunk, bufferedCount, pairs);
+    }
+}
+
+// The general path, for arrays the chunks couldn't split: any JSON goes, pairs can have nested
+// values. Valid if the whole array parsed.
+static void sum_batch_array(String json, JsonSchema* schema, BatchChunk* chunk) {
+    *chunk = {};
+    
+    JsonCursor cursor = open_json_cursor(json);
+    JsonIteration root = begin_json_iteration(&cursor, get_json_cursor_root(&cursor));
+    
+    JsonToken pairsArray = {};
+    if (find_json_field(&cursor, &root, CONSTANT_STRING("pairs"), &pairsArray)) {
+        JsonIteration array = begin_json_iteration(&cursor, pairsArray);
+        
+        HaversinePair pairs[SUM_BLOCK_PAIR_COUNT];
+        u64 bufferedCount = 0;
+        
+        JsonToken element;
+        while (next_json_child(&cursor, &array, 0, 0, &element)) {
+            HaversinePair* pair = pairs + bufferedCount++;
+            *pair = {};
+            parse_json_record(&cursor, element, schema, pair);
+            
+            if (bufferedCount == SUM_BLOCK_PAIR_COUNT) {
+                flush_batch_pairs(chunk, bufferedCount, pairs);
+                bufferedCount = 0;
+            }
+        }
+        
+        if (bufferedCount) {
+            flush_batch_pairs(chunk, bufferedCount, pairs);
+        }
+    }
+    
+    chunk->valid = !cursor.parser.hadError;
+}
+
+// Where chunk starts: the first "{" at or after its nominal offset, the end of the input if none.
+static u64 get_batch_chunk_start(BatchFile* file, u32 chunk) {
+    String json = file->file.data;
+    
+    if (chunk == 0) {
+        return file->arrayStart;
+    }
+    
+    if (chunk >= file->chunkCount) {
+        return json.count;
+    }
+    
+    u64 at = file->arrayStart + (u64)chunk * ((json.count - file->arrayStart) / file->chunkCount);
+    u8* brace = (u8*)memchr(json.data + at, '{', json.count - at);
+    
+    u64 result = brace ? (u64)(brace - json.data) : json.count;
+    return result;
+}
+
+static void finish_batch_file(BatchScheduler* scheduler, BatchFile* file) {
+    bool valid = true;
+    for (u32 i = 0; i < file->chunkCount; i++) {
+        valid = valid && file->chunks[i].valid;
+    }
+    
+    if (!valid) {
+        // Chunk boundaries didn't line up or the pairs aren't flat, go over it with the cursor
+        file->chunkCount = 1;
+        sum_batch_array(file->file.data, &scheduler->schema, file->chunks);
+        valid = file->chunks[0].valid;
+    }
+    
+    if (valid) {
+        CompensatedSum total = {};
+        for (u32 i = 0; i < file->chunkCount; i++) {
+            add_compensated(&total, file->chunks[i].sum.sum);
+            total.compensation += file->chunks[i].sum.compensation;
+            file->pairCount += file->chunks[i].pairCount;
+        }
+        
+        file->sum = file->pairCount ? ((total.sum + total.compensation) / (double)file->pairCount) : 0.0;
+        file->status = BatchStatus_Done;
+    } else {
+        file->status = BatchStatus_Malformed;
+    }
+    
+    unmap_file(&file->file);
+    file->endTime = read_os_timer();
+    
+    atomic_add_u32(&scheduler->finishedCount, 1);
+}
+
+static void run_batch_chunk(BatchScheduler* scheduler, u32 fileIndex, u32 chunk) {
+    BatchFile* file = scheduler->files + fileIndex;
+    
+    u64 start = get_batch_chunk_start(file, chunk);
+    u64 end = get_batch_chunk_start(file, chunk + 1);
+    sum_batch_chunk(file->file.data, &scheduler->schema, start, end, file->chunks + chunk);
+    
+    // The last chunk to finish (on whichever thread) finishes the file
+    if (atomic_add_u32(&file->chunksLeft, (u32)-1) == 1) {
+        finish_batch_file(scheduler, file);
+    }
+}
+
+// Maps the file, splits it and runs its first chunk. The other chunks go on this thread's deque.
+static void start_batch_file(BatchScheduler* scheduler, u32 fileIndex, u32 threadIndex) {
+    BatchFile* file = scheduler->files + fileIndex;
+    file->startTime = read_os_timer();
+    
+    file->file = map_file(file->path);
+    String json = file->file.data;
+    
+    BatchStatus failure = BatchStatus_Pending;
+    if (!json.data) {
+        failure = BatchStatus_CantOpen;
+    } else if (is_gzip(json)) {
+        failure = BatchStatus_Compressed;
+    } else {
+        JsonCursor cursor = open_json_cursor(json);
+        JsonIteration root = begin_json_iteration(&cursor, get_json_cursor_root(&cursor));
+        
+        JsonToken pairsArray = {};
+        if (find_json_field(&cursor, &root, CONSTANT_STRING("pairs"), &pairsArray) &&
+            (pairsArray.type == Token_open_bracket)) {
+            file->arrayStart = (pairsArray.value.data - json.data) + 1;
+        } else {
+            failure = BatchStatus_NoPairs;
+        }
+    }
+    
+    if (failure != BatchStatus_Pending) {
+        unmap_file(&file->file);
+        file->status = failure;
+        file->endTime = read_os_timer();
+        atomic_add_u32(&scheduler->finishedCount, 1);
+        return;
+    }
+    
+    u64 chunkCount = (json.count - file->arrayStart) / BATCH_CHUNK_SIZE;
+    chunkCount = (chunkCount < 1) ? 1 : ((chunkCount > BATCH_MAX_CHUNKS) ? BATCH_MAX_CHUNKS : chunkCount);
+    file->chunkCount = (u32)chunkCount;
+    file->chunksLeft = file->chunkCount;
+    
+    BatchDeque* deque = scheduler->deques + threadIndex;
+    for (u32 chunk = file->chunkCount - 1; chunk > 0; chunk--) {
+        if (!push_batch_task(deque, ((u64)fileIndex << 32) | chunk)) {
+            run_batch_chunk(scheduler, fileIndex, chunk);
+        }
+    }
+    
+    run_batch_chunk(scheduler, fileIndex, 0);
+}
+
+// Own deque first, then stealing, then a new file, so started files finish before new ones open.
+static void batch_worker(void* data) {
+    BatchWorker* worker = (BatchWorker*)data;
+    BatchScheduler* scheduler = worker->scheduler;
+    u32 threadIndex = worker->threadIndex;
+    
+    while (scheduler->finishedCount < scheduler->fileCount) {
+        u64 task;
+        bool found = pop_batch_task(scheduler->deques + threadIndex, &task);
+        
+        for (u32 i = 1; !found && (i < scheduler->threadCount); i++) {
+            found = steal_batch_task(scheduler->deques + ((threadIndex + i) % scheduler->threadCount), &task);
+        }
+        
+        if (found) {
+            run_batch_chunk(scheduler, (u32)(task >> 32), (u32)task);
+        } else if (scheduler->nextFile < scheduler->fileCount) {
+            u32 next = atomic_add_u32(&scheduler->nextFile, 1);
+            if (next < scheduler->fileCount) {
+                start_batch_file(scheduler, scheduler->order[next], threadIndex);
+            }
+        } else {
+            _mm_pause();
+        }
+    }
+}
+
+//
+// File list
+//
+
+struct BatchList {
+    String paths;       // Null terminated paths back to back
+    u64 used;
+    u32 count;
+};
+
+static void add_batch_path(void* context, const char* path) {
+    BatchList* list = (BatchList*)context;
+    u64 length = strlen(path) + 1;
+    
+    if ((list->used + length) > list->paths.count) {
+        u64 size = 2 * (list->paths.count + length);
+        String grown = allocate_string(size);
+        if (!grown.data) {
+            return;
+        }
+        
+        if (list->used) {
+            memcpy(grown.data, list->paths.data, list->used);
+        }
+        free_string(&list->paths);
+        list->paths = grown;
+    }
+    
+    memcpy(list->paths.data + list->used, path, length);
+    list->used += length;
+    ++list->count;
+}
+
+// spec is a glob pattern if it has wildcards, otherwise a manifest with one path per line (blank
+// lines and lines starting with "#" are skipped).
+static bool list_batch_files(char* spec, BatchList* list) {
+    *list = {};
+    
+    if (strpbrk(spec, "*?")) {
+        for_each_matching_file(spec, add_batch_path, list);
+    } else {
+        MappedFile manifestFile = map_file(spec);
+        String manifest = manifestFile.data;
+        if (!manifestFile.file) {
+            fprintf(stderr, "ERROR: Can't open batch manifest \"%s\"\n", spec);
+            return false;
+        }
+        
+        char line[4096];
+        u64 at = 0;
+        while (at < manifest.count) {
+            u64 lineStart = at;
+            while ((at < manifest.count) && (manifest.data[at] != '\n')) {
+                ++at;
+            }
+            
+            u64 lineEnd = at++;
+            while ((lineEnd > lineStart) && ((manifest.data[lineEnd - 1] == '\r') || (manifest.data[lineEnd - 1] == ' '))) {
+                --lineEnd;
+            }
+            
+            u64 length = lineEnd - lineStart;
+            if (length && (manifest.data[lineStart] != '#') && (length < sizeof(line))) {
+                memcpy(line, manifest.data + lineStart, length);
+                line[length] = 0;
+                add_batch_path(list, line);
+            }
+        }
+        
+        unmap_file(&manifestFile);
+    }
+    
+    if (!list->count) {
+        fprintf(stderr, "ERROR: No input files in \"%s\"\n", spec);
+    }
+    
+    return list->count != 0;
+}
+
+// Processes every file in spec and prints one line per file (in list order) plus the totals.
+// Returns false if any file failed.
+static bool run_batch(char* spec, u32 threadCount) {
+    BatchList list;
+    if (!list_batch_files(spec, &list)) {
+        free_string(&list.paths);
+        return false;
+    }
+    
+    String schedulerMemory = allocate_string(sizeof(BatchScheduler));
+    String fileMemory = allocate_string(list.count * sizeof(BatchFile));
+    String orderMemory = allocate_string(list.count * sizeof(u32));
+    
+    bool result = (schedulerMemory.data && fileMemory.data && orderMemory.data);
+    
+    if (result) {
+        memset(schedulerMemory.data, 0, schedulerMemory.count);
+        memset(fileMemory.data, 0, fileMemory.count);
+        
+        BatchScheduler* scheduler = (BatchScheduler*)schedulerMemory.data;
+        scheduler->files = (BatchFile*)fileMemory.data;
+        scheduler->order = (u32*)orderMemory.data;
+        scheduler->fileCount = list.count;
+        scheduler->threadCount = clamp_thread_count(threadCount);
+        compile_json_schema(&scheduler->schema, gHaversinePairFields, ARRAY_COUNT(gHaversinePairFields));
+        
+        u64 totalSize = 0;
+        char* path = (char*)list.paths.data;
+        for (u32 i = 0; i < list.count; i++) {
+            BatchFile* file = scheduler->files + i;
+            file->path = path;
+            file->size = get_file_info(path).size;
+            totalSize += file->size;
+            
+            scheduler->order[i] = i;
+            path += strlen(path) + 1;
+        }
+        
+        // Largest first, ties in list order. Insertion sort keeps it stable.
+        for (u32 i = 1; i < list.count; i++) {
+            u32 index = scheduler->order[i];
+            u32 at = i;
+            while (at && (scheduler->files[scheduler->order[at - 1]].size < scheduler->files[index].size)) {
+                scheduler->order[at] = scheduler->order[at - 1];
+                --at;
+            }
+            scheduler->order[at] = index;
+        }
+        
+        u64 osFreq = get_os_timer_freq();
+        u64 startTime = read_os_timer();
+        
+        {
+            PROFILE_SCOPE_DATA("batch", totalSize);
+            
+            Thread threads[MAX_THREAD_COUNT];
+            BatchWorker workers[MAX_THREAD_COUNT];
+            u32 startedCount = 0;
+            
+            for (u32 i = 1; i < scheduler->threadCount; i++) {
+                BatchWorker* worker = workers + startedCount;
+                worker->scheduler = scheduler;
+                worker->threadIndex = i;
+                
+                if (create_thread(threads + startedCount, batch_worker, worker)) {
+                    startedCount++;
+                }
+            }
+            
+            BatchWorker self = {};
+            self.scheduler = scheduler;
+            batch_worker(&self);
+            
+            for (u32 i = 0; i < startedCount; i++) {
+                join_thread(threads + i);
+            }
+        }
+        
+        u64 endTime = read_os_timer();
+        
+        u64 pairCount = 0;
+        u64 processedSize = 0;
+        u32 failedCount = 0;
+        
+        for (u32 i = 0; i < list.count; i++) {
+            BatchFile* file = scheduler->files + i;
+            double ms = 1000.0 * (double)(file->endTime - file->startTime) / (double)osFreq;
+            
+            if (file->status == BatchStatus_Done) {
+                double mb = (double)file->size / (1024.0 * 1024.0);
+                fprintf(stdout, "%s: %llu pairs, sum %.16f, %.3fmb in %.3fms\n", file->path, file->pairCount, file->sum, mb, ms);
+                
+                pairCount += file->pairCount;
+                processedSize += file->size;
+            } else {
+                fprintf(stdout, "%s: ERROR %s\n", file->path, describe_batch_status(file->status));
+                ++failedCount;
+            }
+        }
+        
+        double seconds = (double)(endTime - startTime) / (double)osFreq;
+        double gigabyte = 1024.0 * 1024.0 * 1024.0;
+        fprintf(stdout, "\nBatch: %u files (%u failed), %llu pairs, %.3fmb in %.3fms on %u threads",
+                list.count, failedCount, pairCount, (double)processedSize / (1024.0 * 1024.0), 1000.0 * seconds,
+                scheduler->threadCount);
+        if (seconds > 0.0) {
+            fprintf(stdout, ", %.3fgb/s, %.0f files/s", (double)processedSize / gigabyte / seconds, (double)list.count / seconds);
+        }
+        fprintf(stdout, "\n");
+        
+        result = (failedCount == 0);
+    }
+    
+    free_string(&orderMemory);
+    free_string(&fileMemory);
+    free_string(&schedulerMemory);
+    free_string(&list.paths);
+    
+    return result;
+}
\ No newline at end of file
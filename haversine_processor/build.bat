@@ -26,7 +26,7 @@ goto :main
 
 	set linkerFlags=-WX -opt:ref -incremental:no %subsystem%
 		
-	set  sharedLibs=kernel32.lib shell32.lib user32.lib
+	set  sharedLibs=kernel32.lib shell32.lib user32.lib ws2_32.lib
 	set  debugLibs=
 	set  releaseLibs=
 
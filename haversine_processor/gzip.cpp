@@ -0,0 +1,766 @@
+// gzip (RFC 1952) reader with its own DEFLATE (RFC 1951) decoder, so compressed inputs don't
+// need zlib or anything else from the system.
+//
+// A file can be a series of gzip members. When every member carries the BGZF "BC" extra field
+// (what bgzip writes), the compressed size of each member is known up front and the uncompressed
+// size is in its trailer, so members are inflated in parallel straight into their place in the
+// output. Anything else is inflated one member after the other.
+
+#define GZIP_FAST_BITS 10
+#define GZIP_MAX_CODE_LENGTH 15
+#define DEFLATE_MAX_RATIO 1032 // Most bytes a compressed byte can inflate to (258 byte matches)
+#define BGZF_MAX_BLOCK_SIZE 65536 // Most a BGZF member inflates to
+
+struct HuffmanTable {
+    u16 counts[GZIP_MAX_CODE_LENGTH + 1];
+    u16 symbols[288];
+    u16 fast[1 << GZIP_FAST_BITS]; // (symbol << 4) | length, 0 when the code is longer than GZIP_FAST_BITS
+};
+
+struct BitReader {
+    u8* at;
+    u8* end;
+    u64 bits;
+    u32 bitCount;
+    u32 paddingCount; // Zero bytes fed in past the end
+};
+
+struct InflateOutput {
+    u8* data;
+    u64 count;
+    u64 capacity;
+    bool canGrow; // Only when running on the main thread, growing goes through allocate_string
+    String memory;
+};
+
+// NOTE(alex): Slicing-by-8, eight table lookups per 8 input bytes instead of one per byte. The
+// byte at a time version was slower than inflating itself.
+static u32 gCrc32Table[8][256];
+
+static void init_crc32_table() {
+    if (gCrc32Table[0][1]) {
+        return;
+    }
+    
+    for (u32 i = 0; i < 256; i++) {
+        u32 crc = i;
+        for (u32 bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (0xEDB88320 ^ (crc >> 1)) : (crc >> 1);
+        }
+        gCrc32Table[0][i] = crc;
+    }
+    
+    for (u32 i = 0; i < 256; i++) {
+        for (u32 slice = 1; slice < 8; slice++) {
+            u32 previous = gCrc32Table[slice - 1][i];
+            gCrc32Table[slice][i] = gCrc32Table[0][previous & 0xFF] ^ (previous >> 8);
+        }
+    }
+}
+
+static u32 crc32(u8* data, u64 count) {
+    u32 crc = 0xFFFFFFFF;
+    
+    u64 i = 0;
+    for (; (i + 8) <= count; i += 8) {
+        u32 low;
+        u32 high;
+        memcpy(&low, data + i, sizeof(low));
+        memcpy(&high, data + i + 4, sizeof(high));
+        low ^= crc;
+        
+        crc = (gCrc32Table[7][low & 0xFF] ^ gCrc32Table[6][(low >> 8) & 0xFF] ^
+               gCrc32Table[5][(low >> 16) & 0xFF] ^ gCrc32Table[4][low >> 24] ^
+               gCrc32Table[3][high & 0xFF] ^ gCrc32Table[2][(high >> 8) & 0xFF] ^
+               gCrc32Table[1][(high >> 16) & 0xFF] ^ gCrc32Table[0][high >> 24]);
+    }
+    
+    for (; i < count; i++) {
+        crc = gCrc32Table[0][(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    
+    return crc ^ 0xFFFFFFFF;
+}
+
+static u32 read_u16_le(u8* data) {
+    u32 result = (u32)data[0] | ((u32)data[1] << 8);
+    return result;
+}
+
+static u32 read_u32_le(u8* data) {
+    u32 result = (u32)data[0] | ((u32)data[1] << 8) | ((u32)data[2] << 16) | ((u32)data[3] << 24);
+    return result;
+}
+
+//
+// Bits
+//
+
+// NOTE(alex): Past the end the reader feeds zeros so the hot loop never checks bounds. More than
+// 8 bytes of padding means a symbol was decoded from bits that don't exist.
+static bool refill_bits(BitReader* reader) {
+    if ((reader->end - reader->at) >= 8) {
+        // Whole word at a time, keeping only the bytes that fit
+        u64 word;
+        memcpy(&word, reader->at, sizeof(word));
+        reader->bits |= word << reader->bitCount;
+        reader->at += (63 - reader->bitCount) >> 3;
+        reader->bitCount |= 56;
+        return true;
+    }
+    
+    while (reader->bitCount <= 56) {
+        u64 byte = 0;
+        if (reader->at < reader->end) {
+            byte = *reader->at++;
+        } else {
+            reader->paddingCount++;
+        }
+        
+        reader->bits |= byte << reader->bitCount;
+        reader->bitCount += 8;
+    }
+    
+    bool result = (reader->paddingCount <= 8);
+    return result;
+}
+
+static u32 take_bits(BitReader* reader, u32 count) {
+    u32 result = (u32)(reader->bits & ((1ull << count) - 1));
+    reader->bits >>= count;
+    reader->bitCount -= count;
+    return result;
+}
+
+// Drops the partial byte and hands the whole buffered bytes back to the input.
+static bool align_to_byte(BitReader* reader) {
+    take_bits(reader, reader->bitCount % 8);
+    
+    u32 bufferedCount = reader->bitCount / 8;
+    if (reader->paddingCount > bufferedCount) {
+        return false;
+    }
+    
+    reader->at -= bufferedCount - reader->paddingCount;
+    reader->bits = 0;
+    reader->bitCount = 0;
+    reader->paddingCount = 0;
+    
+    return true;
+}
+
+//
+// Huffman
+//
+
+static bool build_huffman(HuffmanTable* table, u8* lengths, u32 count) {
+    memset(table->counts, 0, sizeof(table->counts));
+    memset(table->fast, 0, sizeof(table->fast));
+    
+    for (u32 i = 0; i < count; i++) {
+        table->counts[lengths[i]]++;
+    }
+    table->counts[0] = 0;
+    
+    // Over-subscribed sets can't be decoded, incomplete ones are allowed (a lone distance code)
+    s32 left = 1;
+    for (u32 length = 1; length <= GZIP_MAX_CODE_LENGTH; length++) {
+        left = (left << 1) - table->counts[length];
+        if (left < 0) {
+            return false;
+        }
+    }
+    
+    u16 offsets[GZIP_MAX_CODE_LENGTH + 1];
+    offsets[1] = 0;
+    for (u32 length = 1; length < GZIP_MAX_CODE_LENGTH; length++) {
+        offsets[length + 1] = offsets[length] + table->counts[length];
+    }
+    
+    for (u32 symbol = 0; symbol < count; symbol++) {
+        if (lengths[symbol]) {
+            table->symbols[offsets[lengths[symbol]]++] = (u16)symbol;
+        }
+    }
+    
+    // Canonical codes, bit reversed because DEFLATE packs them starting from the top bit
+    u32 code = 0;
+    u32 index = 0;
+    for (u32 length = 1; length <= GZIP_MAX_CODE_LENGTH; length++) {
+        for (u32 i = 0; i < table->counts[length]; i++) {
+            u32 symbol = table->symbols[index++];
+            
+            if (length <= GZIP_FAST_BITS) {
+                u32 reversed = 0;
+                for (u32 bit = 0; bit < length; bit++) {
+                    reversed |= ((code >> bit) & 1) << (length - 1 - bit);
+                }
+                
+                for (u32 fill = reversed; fill < (1u << GZIP_FAST_BITS); fill += (1u << length)) {
+                    table->fast[fill] = (u16)((symbol << 4) | length);
+                }
+            }
+            
+            code++;
+        }
+        
+        code <<= 1;
+    }
+    
+    return true;
+}
+
+// Needs at least GZIP_MAX_CODE_LENGTH bits buffered. Returns -1 for a code that isn't in the table.
+static s32 decode_symbol(BitReader* reader, HuffmanTable* table) {
+    u32 entry = table->fast[reader->bits & ((1 << GZIP_FAST_BITS) - 1)];
+    if (entry) {
+        take_bits(reader, entry & 0xF);
+        return (s32)(entry >> 4);
+    }
+    
+    // Long code, walk the canonical code one bit at a time
+    s32 code = 0;
+    s32 first = 0;
+    s32 index = 0;
+    for (u32 length = 1; length <= GZIP_MAX_CODE_LENGTH; length++) {
+        code |= (s32)take_bits(reader, 1);
+        
+        s32 count = table->counts[length];
+        if ((code - count) < first) {
+            return table->symbols[index + (code - first)];
+        }
+        
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    
+    return -1;
+}
+
+//
+// Inflate
+//
+
+static bool reserve_output(InflateOutput* output, u64 count) {
+    if ((output->count + count) <= output->capacity) {
+        return true;
+    }
+    
+    if (!output->canGrow) {
+        return false;
+    }
+    
+    u64 capacity = output->capacity * 2;
+    if (capacity < (output->count + count)) {
+        capacity = output->count + count;
+    }
+    
+    String memory = allocate_string(capacity);
+    if (!memory.data) {
+        return false;
+    }
+    
+    memcpy(memory.data, output->data, output->count);
+    free_string(&output->memory);
+    
+    output->memory = memory;
+    output->data = memory.data;
+    output->capacity = capacity;
+    
+    return true;
+}
+
+static bool inflate_stored_block(BitReader* reader, InflateOutput* output) {
+    if (!align_to_byte(reader) || ((reader->end - reader->at) < 4)) {
+        return false;
+    }
+    
+    u32 length = read_u16_le(reader->at);
+    u32 lengthComplement = read_u16_le(reader->at + 2);
+    reader->at += 4;
+    
+    if ((length != (~lengthComplement & 0xFFFF)) || ((u64)(reader->end - reader->at) < length) ||
+        !reserve_output(output, length)) {
+        return false;
+    }
+    
+    memcpy(output->data + output->count, reader->at, length);
+    output->count += length;
+    reader->at += length;
+    
+    return true;
+}
+
+static bool inflate_codes(BitReader* reader, InflateOutput* output, HuffmanTable* lengthTable, HuffmanTable* distanceTable) {
+    static const u16 lengthBase[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+    };
+    static const u8 lengthExtra[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+    };
+    static const u16 distanceBase[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+        1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+    };
+    static const u8 distanceExtra[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+    };
+    
+    while (true) {
+        // One refill covers the longest symbol: 15 + 5 + 15 + 13 bits
+        if (!refill_bits(reader)) {
+            return false;
+        }
+        
+        s32 symbol = decode_symbol(reader, lengthTable);
+        
+        if ((symbol >= 0) && (symbol < 256)) {
+            if ((output->count == output->capacity) && !reserve_output(output, 1)) {
+                return false;
+            }
+            output->data[output->count++] = (u8)symbol;
+        } else if (symbol == 256) {
+            return true;
+        } else {
+            symbol -= 257;
+            if ((symbol < 0) || (symbol >= 29)) {
+                return false;
+            }
+            
+            u32 length = lengthBase[symbol] + take_bits(reader, lengthExtra[symbol]);
+            
+            s32 distanceSymbol = decode_symbol(reader, distanceTable);
+            if ((distanceSymbol < 0) || (distanceSymbol >= 30)) {
+                return false;
+            }
+            
+            u32 distance = distanceBase[distanceSymbol] + take_bits(reader, distanceExtra[distanceSymbol]);
+            
+            if ((distance > output->count) || !reserve_output(output, length)) {
+                return false;
+            }
+            
+            u8* to = output->data + output->count;
+            u8* from = to - distance;
+            if ((distance >= 8) && ((output->count + length + 8) <= output->capacity)) {
+                // Most matches are short, copying whole words (and a little past the end, which
+                // the next symbols overwrite) beats memcpy. 8 bytes back, a word never overlaps
+                // its own source.
+                for (u32 i = 0; i < length; i += 8) {
+                    u64 word;
+                    memcpy(&word, from + i, sizeof(word));
+                    memcpy(to + i, &word, sizeof(word));
+                }
+            } else if (distance >= length) {
+                memcpy(to, from, length);
+            } else {
+                // Overlapping copy repeats the last distance bytes
+                for (u32 i = 0; i < length; i++) {
+                    to[i] = from[i];
+                }
+            }
+            
+            output->count += length;
+        }
+    }
+}
+
+static bool inflate_fixed_block(BitReader* reader, InflateOutput* output) {
+    u8 lengths[288 + 30];
+    u32 symbol = 0;
+    for (; symbol < 144; symbol++) { lengths[symbol] = 8; }
+    for (; symbol < 256; symbol++) { lengths[symbol] = 9; }
+    for (; symbol < 280; symbol++) { lengths[symbol] = 7; }
+    for (; symbol < 288; symbol++) { lengths[symbol] = 8; }
+    for (; symbol < (288 + 30); symbol++) { lengths[symbol] = 5; }
+    
+    HuffmanTable lengthTable;
+    HuffmanTable distanceTable;
+    build_huffman(&lengthTable, lengths, 288);
+    build_huffman(&distanceTable, lengths + 288, 30);
+    
+    bool result = inflate_codes(reader, output, &lengthTable, &distanceTable);
+    return result;
+}
+
+static bool inflate_dynamic_block(BitReader* reader, InflateOutput* output) {
+    static const u8 codeLengthOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    
+    if (!refill_bits(reader)) {
+        return false;
+    }
+    
+    u32 lengthCount = take_bits(reader, 5) + 257;
+    u32 distanceCount = take_bits(reader, 5) + 1;
+    u32 codeLengthCount = take_bits(reader, 4) + 4;
+    
+    if ((lengthCount > 286) || (distanceCount > 30)) {
+        return false;
+    }
+    
+    u8 codeLengths[19] = {};
+    for (u32 i = 0; i < codeLengthCount; i++) {
+        if (!refill_bits(reader)) {
+            return false;
+        }
+        codeLengths[codeLengthOrder[i]] = (u8)take_bits(reader, 3);
+    }
+    
+    HuffmanTable codeLengthTable;
+    if (!build_huffman(&codeLengthTable, codeLengths, 19)) {
+        return false;
+    }
+    
+    u8 lengths[286 + 30];
+    u32 index = 0;
+    while (index < (lengthCount + distanceCount)) {
+        if (!refill_bits(reader)) {
+            return false;
+        }
+        
+        s32 symbol = decode_symbol(reader, &codeLengthTable);
+        if (symbol < 0) {
+            return false;
+        }
+        
+        if (symbol < 16) {
+            lengths[index++] = (u8)symbol;
+        } else {
+            u8 repeated = 0;
+            u32 repeatCount = 0;
+            
+            if (symbol == 16) {
+                if (index == 0) {
+                    return false;
+                }
+                repeated = lengths[index - 1];
+                repeatCount = 3 + take_bits(reader, 2);
+            } else if (symbol == 17) {
+                repeatCount = 3 + take_bits(reader, 3);
+            } else {
+                repeatCount = 11 + take_bits(reader, 7);
+            }
+            
+            if ((index + repeatCount) > (lengthCount + distanceCount)) {
+                return false;
+            }
+            
+            while (repeatCount--) {
+                lengths[index++] = repeated;
+            }
+        }
+    }
+    
+    // Without an end-of-block code the block could never finish
+    if (lengths[256] == 0) {
+        return false;
+    }
+    
+    HuffmanTable lengthTable;
+    HuffmanTable distanceTable;
+    if (!build_huffman(&lengthTable, lengths, lengthCount) ||
+        !build_huffman(&distanceTable, lengths + lengthCount, distanceCount)) {
+        return false;
+    }
+    
+    bool result = inflate_codes(reader, output, &lengthTable, &distanceTable);
+    return result;
+}
+
+// Inflates one raw DEFLATE stream. reader is left on the byte after it.
+static bool inflate_deflate(BitReader* reader, InflateOutput* output) {
+    bool isFinal = false;
+    
+    while (!isFinal) {
+        if (!refill_bits(reader)) {
+            return false;
+        }
+        
+        isFinal = take_bits(reader, 1) != 0;
+        u32 type = take_bits(reader, 2);
+        
+        bool valid = false;
+        switch (type) {
+            case 0: { valid = inflate_stored_block(reader, output); } break;
+            case 1: { valid = inflate_fixed_block(reader, output); } break;
+            case 2: { valid = inflate_dynamic_block(reader, output); } break;
+            default: {} break;
+        }
+        
+        if (!valid) {
+            return false;
+        }
+    }
+    
+    bool result = align_to_byte(reader);
+    return result;
+}
+
+//
+// gzip members
+//
+
+struct GzipMember {
+    u64 start;
+    u64 dataStart;  // First byte of the DEFLATE stream
+    u64 blockSize;  // Whole member size from the BGZF "BC" field, 0 without one
+};
+
+static bool is_gzip(String data) {
+    bool result = (data.count >= 18) && (data.data[0] == 0x1F) && (data.data[1] == 0x8B);
+    return result;
+}
+
+// NOTE(alex): gzip ignores whatever follows the last member if it doesn't start like another one
+// (tapes and some tools pad files with zeros), so only the first member has to be there.
+static bool is_past_last_gzip_member(String input, u64 at) {
+    bool result = (at > 0) && (((input.count - at) < 2) || (input.data[at] != 0x1F) || (input.data[at + 1] != 0x8B));
+    return result;
+}
+
+static bool parse_gzip_header(String input, u64 at, GzipMember* member) {
+    *member = {};
+    member->start = at;
+    
+    // ID1 ID2 CM FLG MTIME(4) XFL OS
+    if (((input.count - at) < 18) ||
+        (input.data[at] != 0x1F) || (input.data[at + 1] != 0x8B) || (input.data[at + 2] != 8)) {
+        return false;
+    }
+    
+    u8 flags = input.data[at + 3];
+    if (flags & 0xE0) {
+        return false;
+    }
+    at += 10;
+    
+    if (flags & 0x04) { // FEXTRA
+        if ((input.count - at) < 2) {
+            return false;
+        }
+        
+        u64 extraSize = read_u16_le(input.data + at);
+        at += 2;
+        if ((input.count - at) < extraSize) {
+            return false;
+        }
+        
+        // Subfields are SI1 SI2 LEN(2) data
+        u64 extraEnd = at + extraSize;
+        while ((at + 4) <= extraEnd) {
+            u64 fieldSize = read_u16_le(input.data + at + 2);
+            if ((input.data[at] == 'B') && (input.data[at + 1] == 'C') && (fieldSize == 2) && ((at + 6) <= extraEnd)) {
+                member->blockSize = read_u16_le(input.data + at + 4) + 1;
+            }
+            at += 4 + fieldSize;
+        }
+        at = extraEnd;
+    }
+    
+    for (u32 flag = 0x08; flag <= 0x10; flag <<= 1) { // FNAME, FCOMMENT
+        if (flags & flag) {
+            while ((at < input.count) && input.data[at]) {
+                ++at;
+            }
+            ++at;
+        }
+    }
+    
+    if (flags & 0x02) { // FHCRC
+        at += 2;
+    }
+    
+    member->dataStart = at;
+    
+    bool result = (at + 8) <= input.count;
+    return result;
+}
+
+struct GzipBlocksContext {
+    String input;
+    GzipMember* members;
+    u64* outputOffsets; // memberCount + 1 entries
+    u8* output;
+    volatile u32 failedCount;
+};
+
+static void inflate_block_task(void* data, u64 taskIndex, u32 threadIndex) {
+    (void)threadIndex;
+    GzipBlocksContext* context = (GzipBlocksContext*)data;
+    GzipMember* member = context->members + taskIndex;
+    
+    u64 memberEnd = member->start + member->blockSize;
+    
+    BitReader reader = {};
+    reader.at = context->input.data + member->dataStart;
+    reader.end = context->input.data + memberEnd - 8;
+    
+    InflateOutput output = {};
+    output.data = context->output + context->outputOffsets[taskIndex];
+    output.capacity = context->outputOffsets[taskIndex + 1] - context->outputOffsets[taskIndex];
+    
+    bool valid = (inflate_deflate(&reader, &output) &&
+                  (reader.at == reader.end) &&
+                  (output.count == output.capacity) &&
+                  (crc32(output.data, output.count) == read_u32_le(reader.end)));
+    
+    if (!valid) {
+        atomic_add_u32(&context->failedCount, 1);
+    }
+}
+
+// Returns the members if the whole input is a chain of BGZF blocks, memberCount 0 otherwise.
+static String find_bgzf_members(String input, u64* memberCount) {
+    *memberCount = 0;
+    
+    u64 count = 0;
+    for (u64 at = 0; (at < input.count) && !is_past_last_gzip_member(input, at); count++) {
+        GzipMember member;
+        if (!parse_gzip_header(input, at, &member) ||
+            (member.blockSize < (member.dataStart - at + 8)) || ((input.count - at) < member.blockSize) ||
+            (read_u32_le(input.data + at + member.blockSize - 4) > BGZF_MAX_BLOCK_SIZE)) {
+            return {};
+        }
+        at += member.blockSize;
+    }
+    
+    String result = allocate_string(count * sizeof(GzipMember));
+    if (result.data) {
+        GzipMember* members = (GzipMember*)result.data;
+        u64 at = 0;
+        for (u64 i = 0; i < count; i++) {
+            parse_gzip_header(input, at, members + i);
+            at += members[i].blockSize;
+        }
+        
+        *memberCount = count;
+    }
+    
+    return result;
+}
+
+static String inflate_bgzf(u32 threadCount, String input, GzipMember* members, u64 memberCount) {
+    String result = {};
+    
+    String offsetMemory = allocate_string((memberCount + 1) * sizeof(u64));
+    if (!offsetMemory.data) {
+        return result;
+    }
+    
+    u64* offsets = (u64*)offsetMemory.data;
+    u64 total = 0;
+    for (u64 i = 0; i < memberCount; i++) {
+        offsets[i] = total;
+        total += read_u32_le(input.data + members[i].start + members[i].blockSize - 4);
+    }
+    offsets[memberCount] = total;
+    
+    result = allocate_string(total);
+    if (result.data) {
+        GzipBlocksContext context = {};
+        context.input = input;
+        context.members = members;
+        context.outputOffsets = offsets;
+        context.output = result.data;
+        
+        run_parallel(threadCount, memberCount, inflate_block_task, &context);
+        
+        if (context.failedCount) {
+            fprintf(stderr, "ERROR: %u corrupt gzip blocks\n", context.failedCount);
+            free_string(&result);
+        }
+    }
+    
+    free_string(&offsetMemory);
+    
+    return result;
+}
+
+static String inflate_members(String input) {
+    InflateOutput output = {};
+    output.canGrow = true;
+    
+    // The last trailer has the size of the last member, a good first guess for single member files
+    // (and 0 with padding after it, which then starts small and grows). Nothing is checked yet, so
+    // it's capped at what the input could inflate to at all.
+    u64 guess = read_u32_le(input.data + input.count - 4);
+    if (guess > (input.count * DEFLATE_MAX_RATIO)) {
+        guess = input.count * DEFLATE_MAX_RATIO;
+    }
+    output.memory = allocate_string(guess ? guess : 4096);
+    output.data = output.memory.data;
+    output.capacity = output.memory.count;
+    
+    u64 at = 0;
+    bool valid = (output.data != 0);
+    
+    while (valid && (at < input.count) && !is_past_last_gzip_member(input, at)) {
+        GzipMember member;
+        if (!parse_gzip_header(input, at, &member)) {
+            fprintf(stderr, "ERROR: Bad gzip member header at byte %llu\n", at);
+            valid = false;
+            break;
+        }
+        
+        BitReader reader = {};
+        reader.at = input.data + member.dataStart;
+        reader.end = input.data + input.count;
+        
+        u64 memberOutputStart = output.count;
+        if (!inflate_deflate(&reader, &output) || ((reader.end - reader.at) < 8)) {
+            fprintf(stderr, "ERROR: Corrupt gzip data in member at byte %llu\n", at);
+            valid = false;
+            break;
+        }
+        
+        u64 memberOutputCount = output.count - memberOutputStart;
+        if ((crc32(output.data + memberOutputStart, memberOutputCount) != read_u32_le(reader.at)) ||
+            ((u32)memberOutputCount != read_u32_le(reader.at + 4))) {
+            fprintf(stderr, "ERROR: gzip checksum mismatch in member at byte %llu\n", at);
+            valid = false;
+            break;
+        }
+        
+        at = (reader.at + 8) - input.data;
+    }
+    
+    String result = {};
+    if (valid && (output.count == output.memory.count)) {
+        result = output.memory;
+    } else {
+        if (valid) {
+            // Size guess was off, trim so the allocation matches what the caller will free
+            result = allocate_string(output.count);
+            if (result.data) {
+                memcpy(result.data, output.data, output.count);
+            }
+        }
+        
+        free_string(&output.memory);
+    }
+    
+    return result;
+}
+
+// Inflates a whole gzip file. Returns an allocated String, empty if the data was corrupt.
+static String inflate_gzip(u32 threadCount, String input) {
+    PROFILE_FUNC_DATA(input.count);
+    
+    init_crc32_table();
+    
+    String result = {};
+    
+    u64 memberCount = 0;
+    String memberMemory = find_bgzf_members(input, &memberCount);
+    
+    if (memberCount) {
+        result = inflate_bgzf(threadCount, input, (GzipMember*)memberMemory.data, memberCount);
+    } else {
+        result = inflate_members(input);
+    }
+    
+    free_string(&memberMemory);
+    
+    return result;
+}
\ No newline at end of file
@@ -0,0 +1,375 @@
+#include <emmintrin.h> // SSE2
+
+static double square(double l) {
+    double result = l * l;
+    return result;
+}
+
+static double radians_from_degrees(double Degrees) {
+    double Result = 0.01745329251994329577 * Degrees;
+    return Result;
+}
+
+// NOTE(alex): EarthRadius is generally expected to be 6372.8
+static double reference_haversine(double x0, double y0, double x1, double y1, double earthRadius) {
+    double lat1 = y0;
+    double lat2 = y1;
+    double lon1 = x0;
+    double lon2 = x1;
+    
+    double dLat = radians_from_degrees(lat2 - lat1);
+    double dLon = radians_from_degrees(lon2 - lon1);
+    lat1 = radians_from_degrees(lat1);
+    lat2 = radians_from_degrees(lat2);
+    
+    double a = square(sin(dLat / 2.0)) + cos(lat1) * cos(lat2) * square(sin(dLon / 2));
+    double c = 2.0 * asin(sqrt(a));
+    
+    double result = earthRadius * c;
+    
+    return result;
+}
+
+// NOTE(alex): Per-pair kernel shared by the sum and the validation, so whatever replaces
+// reference_haversine here is what gets checked against the answers file.
+static void haversine_distances(u64 pairCount, HaversinePair* pairs, double* distances) {
+    double earthRadius = 6372.8;
+    
+    for (u64 i = 0; i < pairCount; i++) {
+        HaversinePair pair = pairs[i];
+        distances[i] = reference_haversine(pair.x0, pair.y0, pair.x1, pair.y1, earthRadius);
+    }
+}
+
+//
+// Batched queries
+//
+
+// NOTE(alex): Two lanes of sin and cos as Taylor polynomials, the kernels below need them on
+// known ranges only: |x| <= pi / 2 for the latitudes and the half latitude difference, |x| <= pi
+// for the half longitude difference (folded back with sin(x) = sin(pi - x)). Eleven terms put the
+// truncation error below 1e-17 there, so what's left is rounding, a few ULPs off libm.
+static __m128d sin_pd_half_pi(__m128d x) {
+    __m128d x2 = _mm_mul_pd(x, x);
+    
+    __m128d p = _mm_set1_pd(1.0 / 51090942171709440000.0); // 1/21!
+    p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(-1.0 / 121645100408832000.0));
+    p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(1.0 / 355687428096000.0));
+    p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(-1.0 / 1307674368000.0));
+    p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(1.0 / 6227020800.0));
+    p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(-1.0 / 39916800.0));
+    p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(1.0 / 362880.0));
+    p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(-1.0 / 5040.0));
+    p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(1.0 / 120.0));
+    p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(-1.0 / 6.0));
+    p = _mm_mul_pd(_mm_mul_pd(p, x2), x);
+    
+    __m128d result = _mm_add_pd(x, p);
+    return result;
+}
+
+static __m128d cos_pd_half_pi(__m128d x) {
+    __m128d x2 = _mm_mul_pd(x, x);
+    
+    __m128d p = _mm_set1_pd(1.0 / 2432902008176640000.0); // 1/20!
+    p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(-1.0 / 6402373705728000.0));
+    p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(1.0 / 20922789888000.0));
+    p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(-1.0 / 87178291200.0));
+    p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(1.0 / 479001600.0));
+    p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(-1.0 / 3628800.0));
+    p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(1.0 / 40320.0));
+    p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(-1.0 / 720.0));
+    p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(1.0 / 24.0));
+    p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(-0.5));
+    p = _mm_mul_pd(p, x2);
+    
+    __m128d result = _mm_add_pd(_mm_set1_pd(1.0), p);
+    return result;
+}
+
+static __m128d sin_pd_pi(__m128d x) {
+    __m128d signBit = _mm_set1_pd(-0.0);
+    __m128d halfPi = _mm_set1_pd(1.57079632679489661923);
+    
+    __m128d sign = _mm_and_pd(x, signBit);
+    __m128d magnitude = _mm_andnot_pd(signBit, x);
+    
+    __m128d folded = _mm_sub_pd(_mm_set1_pd(3.14159265358979323846), magnitude);
+    __m128d fold = _mm_cmpgt_pd(magnitude, halfPi);
+    magnitude = _mm_or_pd(_mm_and_pd(fold, folded), _mm_andnot_pd(fold, magnitude));
+    
+    __m128d result = _mm_xor_pd(sin_pd_half_pi(magnitude), sign);
+    return result;
+}
+
+// NOTE(alex): One origin against many destinations. The origin's radians and cos(lat1) are
+// hoisted out of the loop, two destinations go through the SSE2 polynomials above at a time and
+// only the final asin is libm, like in haversine_matrix_row. Destinations outside the ranges the
+// polynomials cover (longitudes more than 360 degrees from the origin, latitudes past the poles)
+// and an odd tail take the scalar path instead.
+static void haversine_one_to_many_scalar(double originX, double originY, double cosLat1, double x, double y,
+                                         double* distance, double diameter) {
+    double dLat = radians_from_degrees(y - originY);
+    double dLon = radians_from_degrees(x - originX);
+    double lat2 = radians_from_degrees(y);
+    
+    double a = square(sin(dLat / 2.0)) + cosLat1 * cos(lat2) * square(sin(dLon / 2));
+    *distance = diameter * asin(sqrt(a));
+}
+
+static void haversine_one_to_many_range(double originX, double originY, u64 count, double* xs, double* ys, double* distances, double earthRadius) {
+    double lat1 = radians_from_degrees(originY);
+    double cosLat1 = cos(lat1);
+    double diameter = 2.0 * earthRadius;
+    
+    __m128d originXs = _mm_set1_pd(originX);
+    __m128d originYs = _mm_set1_pd(originY);
+    __m128d cosLat1s = _mm_set1_pd(cosLat1);
+    __m128d radiansPerDegree = _mm_set1_pd(0.01745329251994329577);
+    __m128d halfRadiansPerDegree = _mm_set1_pd(0.5 * 0.01745329251994329577);
+    __m128d signBit = _mm_set1_pd(-0.0);
+    __m128d halfPi = _mm_set1_pd(1.57079632679489661923);
+    __m128d pi = _mm_set1_pd(3.14159265358979323846);
+    __m128d one = _mm_set1_pd(1.0);
+    
+    u64 evenCount = count & ~(u64)1;
+    
+    for (u64 i = 0; i < evenCount; i += 2) {
+        __m128d x = _mm_loadu_pd(xs + i);
+        __m128d y = _mm_loadu_pd(ys + i);
+        
+        __m128d halfDLat = _mm_mul_pd(_mm_sub_pd(y, originYs), halfRadiansPerDegree);
+        __m128d halfDLon = _mm_mul_pd(_mm_sub_pd(x, originXs), halfRadiansPerDegree);
+        __m128d lat2 = _mm_mul_pd(y, radiansPerDegree);
+        
+        __m128d outOfRange = _mm_or_pd(_mm_cmpgt_pd(_mm_andnot_pd(signBit, halfDLon), pi),
+                                       _mm_or_pd(_mm_cmpgt_pd(_mm_andnot_pd(signBit, halfDLat), halfPi),
+                                                 _mm_cmpgt_pd(_mm_andnot_pd(signBit, lat2), halfPi)));
+        
+        // Also catches NaNs, whose comparisons above are all false
+        __m128d notNan = _mm_cmpeq_pd(_mm_add_pd(halfDLon, lat2), _mm_add_pd(halfDLon, lat2));
+        
+        if (_mm_movemask_pd(outOfRange) || (_mm_movemask_pd(notNan) != 3)) {
+            haversine_one_to_many_scalar(originX, originY, cosLat1, xs[i], ys[i], distances + i, diameter);
+            haversine_one_to_many_scalar(originX, originY, cosLat1, xs[i + 1], ys[i + 1], distances + i + 1, diameter);
+            continue;
+        }
+        
+        __m128d sinHalfDLat = sin_pd_half_pi(halfDLat);
+        __m128d sinHalfDLon = sin_pd_pi(halfDLon);
+        __m128d cosLat2 = cos_pd_half_pi(lat2);
+        
+        __m128d a = _mm_add_pd(_mm_mul_pd(sinHalfDLat, sinHalfDLat),
+                               _mm_mul_pd(_mm_mul_pd(cosLat1s, cosLat2), _mm_mul_pd(sinHalfDLon, sinHalfDLon)));
+        a = _mm_min_pd(_mm_max_pd(a, _mm_setzero_pd()), one);
+        
+        _mm_storeu_pd(distances + i, _mm_sqrt_pd(a));
+        distances[i] = diameter * asin(distances[i]);
+        distances[i + 1] = diameter * asin(distances[i + 1]);
+    }
+    
+    if (evenCount != count) {
+        haversine_one_to_many_scalar(originX, originY, cosLat1, xs[evenCount], ys[evenCount], distances + evenCount, diameter);
+    }
+}
+
+#define HAVERSINE_ONE_TO_MANY_CHUNK 16384
+
+struct OneToManyContext {
+    double originX;
+    double originY;
+    u64 count;
+    double* xs;
+    double* ys;
+    double* distances;
+    double earthRadius;
+};
+
+static void one_to_many_task(void* data, u64 taskIndex, u32 threadIndex) {
+    (void)threadIndex;
+    OneToManyContext* context = (OneToManyContext*)data;
+    
+    u64 first = taskIndex * HAVERSINE_ONE_TO_MANY_CHUNK;
+    u64 count = context->count - first;
+    if (count > HAVERSINE_ONE_TO_MANY_CHUNK) {
+        count = HAVERSINE_ONE_TO_MANY_CHUNK;
+    }
+    
+    haversine_one_to_many_range(context->originX, context->originY, count,
+                                context->xs + first, context->ys + first, context->distances + first,
+                                context->earthRadius);
+}
+
+// distances[i] = haversine(origin, (xs[i], ys[i])), written into the caller's buffer.
+static void haversine_one_to_many(u32 threadCount, double originX, double originY,
+                                  u64 count, double* xs, double* ys, double* distances, double earthRadius) {
+    OneToManyContext context = {};
+    context.originX = originX;
+    context.originY = originY;
+    context.count = count;
+    context.xs = xs;
+    context.ys = ys;
+    context.distances = distances;
+    context.earthRadius = earthRadius;
+    
+    u64 taskCount = (count + HAVERSINE_ONE_TO_MANY_CHUNK - 1) / HAVERSINE_ONE_TO_MANY_CHUNK;
+    run_parallel(threadCount, taskCount, one_to_many_task, &context);
+}
+
+// NOTE(alex): For N x M every point takes part in many pairs, so all of its trig is precomputed
+// once. With half-angle sines and cosines the differences expand as
+//     sin((b - a) / 2) = sin(b / 2) cos(a / 2) - cos(b / 2) sin(a / 2)
+// and cos(lat) = cos^2(lat / 2) - sin^2(lat / 2), which leaves one asin per pair and plain
+// multiply-adds for everything else.
+struct HaversinePointTable {
+    u64 count;
+    double* sinHalfLat;
+    double* cosHalfLat;
+    double* sinHalfLon;
+    double* cosHalfLon;
+    double* cosLat;
+    
+    String memory;
+};
+
+static HaversinePointTable precompute_haversine_points(u64 count, double* xs, double* ys) {
+    HaversinePointTable result = {};
+    
+    // Rounded to an even count so the SSE loop never needs a tail
+    u64 paddedCount = (count + 1) & ~(u64)1;
+    result.memory = allocate_string(5 * paddedCount * sizeof(double));
+    
+    if (result.memory.data) {
+        double* at = (double*)result.memory.data;
+        result.count = count;
+        result.sinHalfLat = at; at += paddedCount;
+        result.cosHalfLat = at; at += paddedCount;
+        result.sinHalfLon = at; at += paddedCount;
+        result.cosHalfLon = at; at += paddedCount;
+        result.cosLat = at;
+        
+        for (u64 i = 0; i < paddedCount; i++) {
+            double halfLat = 0.5 * radians_from_degrees((i < count) ? ys[i] : 0.0);
+            double halfLon = 0.5 * radians_from_degrees((i < count) ? xs[i] : 0.0);
+            
+            result.sinHalfLat[i] = sin(halfLat);
+            result.cosHalfLat[i] = cos(halfLat);
+            result.sinHalfLon[i] = sin(halfLon);
+            result.cosHalfLon[i] = cos(halfLon);
+            result.cosLat[i] = square(result.cosHalfLat[i]) - square(result.sinHalfLat[i]);
+        }
+    }
+    
+    return result;
+}
+
+static void free_haversine_points(HaversinePointTable* table) {
+    free_string(&table->memory);
+    *table = {};
+}
+
+// One origin against destinations [first, first + count), count even
+static void haversine_matrix_row(HaversinePointTable* origins, u64 origin,
+                                 HaversinePointTable* dests, u64 first, u64 count,
+                                 double* row, double earthRadius) {
+    __m128d sinHalfLat1 = _mm_set1_pd(origins->sinHalfLat[origin]);
+    __m128d cosHalfLat1 = _mm_set1_pd(origins->cosHalfLat[origin]);
+    __m128d sinHalfLon1 = _mm_set1_pd(origins->sinHalfLon[origin]);
+    __m128d cosHalfLon1 = _mm_set1_pd(origins->cosHalfLon[origin]);
+    __m128d cosLat1 = _mm_set1_pd(origins->cosLat[origin]);
+    __m128d one = _mm_set1_pd(1.0);
+    
+    for (u64 j = first; j < (first + count); j += 2) {
+        __m128d sinHalfLat2 = _mm_loadu_pd(dests->sinHalfLat + j);
+        __m128d cosHalfLat2 = _mm_loadu_pd(dests->cosHalfLat + j);
+        __m128d sinHalfLon2 = _mm_loadu_pd(dests->sinHalfLon + j);
+        __m128d cosHalfLon2 = _mm_loadu_pd(dests->cosHalfLon + j);
+        __m128d cosLat2 = _mm_loadu_pd(dests->cosLat + j);
+        
+        __m128d sinHalfDLat = _mm_sub_pd(_mm_mul_pd(sinHalfLat2, cosHalfLat1), _mm_mul_pd(cosHalfLat2, sinHalfLat1));
+        __m128d sinHalfDLon = _mm_sub_pd(_mm_mul_pd(sinHalfLon2, cosHalfLon1), _mm_mul_pd(cosHalfLon2, sinHalfLon1));
+        
+        __m128d a = _mm_add_pd(_mm_mul_pd(sinHalfDLat, sinHalfDLat),
+                               _mm_mul_pd(_mm_mul_pd(cosLat1, cosLat2), _mm_mul_pd(sinHalfDLon, sinHalfDLon)));
+        a = _mm_min_pd(a, one);
+        
+        _mm_storeu_pd(row + (j - first), _mm_sqrt_pd(a));
+    }
+    
+    double diameter = 2.0 * earthRadius;
+    for (u64 j = 0; j < count; j++) {
+        row[j] = diameter * asin(row[j]);
+    }
+}
+
+// Tiles are sized so a tile's destinations stay in L1 while every origin row of the tile runs
+#define HAVERSINE_TILE_ORIGINS 64
+#define HAVERSINE_TILE_DESTS 256
+
+struct MatrixContext {
+    HaversinePointTable origins;
+    HaversinePointTable dests;
+    
+    u64 tileColumnCount;
+    double* distances;
+    u64 rowStride;
+    double earthRadius;
+};
+
+static void matrix_tile_task(void* data, u64 taskIndex, u32 threadIndex) {
+    (void)threadIndex;
+    MatrixContext* context = (MatrixContext*)data;
+    
+    u64 originStart = (taskIndex / context->tileColumnCount) * HAVERSINE_TILE_ORIGINS;
+    u64 destStart = (taskIndex % context->tileColumnCount) * HAVERSINE_TILE_DESTS;
+    
+    u64 originEnd = originStart + HAVERSINE_TILE_ORIGINS;
+    if (originEnd > context->origins.count) {
+        originEnd = context->origins.count;
+    }
+    
+    u64 destCount = context->dests.count - destStart;
+    if (destCount > HAVERSINE_TILE_DESTS) {
+        destCount = HAVERSINE_TILE_DESTS;
+    }
+    
+    // The kernel works two destinations at a time. An odd tail goes through a scratch row so
+    // the caller's buffer is never written past its last column.
+    u64 evenCount = destCount & ~(u64)1;
+    
+    for (u64 origin = originStart; origin < originEnd; origin++) {
+        double* row = context->distances + origin * context->rowStride + destStart;
+        
+        if (evenCount) {
+            haversine_matrix_row(&context->origins, origin, &context->dests, destStart, evenCount, row, context->earthRadius);
+        }
+        
+        if (evenCount != destCount) {
+            double tail[2];
+            haversine_matrix_row(&context->origins, origin, &context->dests, destStart + evenCount, 2, tail, context->earthRadius);
+            row[evenCount] = tail[0];
+        }
+    }
+}
+
+// distances[i * rowStride + j] = haversine(origin i, destination j), rowStride >= destCount.
+static void haversine_many_to_many(u32 threadCount,
+                                   u64 originCount, double* originXs, double* originYs,
+                                   u64 destCount, double* destXs, double* destYs,
+                                   double* distances, u64 rowStride, double earthRadius) {
+    MatrixContext context = {};
+    context.origins = precompute_haversine_points(originCount, originXs, originYs);
+    context.dests = precompute_haversine_points(destCount, destXs, destYs);
+    context.tileColumnCount = (destCount + HAVERSINE_TILE_DESTS - 1) / HAVERSINE_TILE_DESTS;
+    context.distances = distances;
+    context.rowStride = rowStride;
+    context.earthRadius = earthRadius;
+    
+    if (context.origins.memory.data && context.dests.memory.data) {
+        u64 tileRowCount = (originCount + HAVERSINE_TILE_ORIGINS - 1) / HAVERSINE_TILE_ORIGINS;
+        run_parallel(threadCount, tileRowCount * context.tileColumnCount, matrix_tile_task, &context);
+    }
+    
+    free_haversine_points(&context.origins);
+    free_haversine_points(&context.dests);
+}
\ No newline at end of file
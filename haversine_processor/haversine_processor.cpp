@@ -10,6 +10,9 @@ typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 
+typedef int32_t s32;
+typedef int64_t s64;
+
 #define U64Max UINT64_MAX
 
 #define ARRAY_COUNT(arr) (sizeof(arr) / sizeof(arr[0]))
@@ -21,43 +24,35 @@ struct HaversinePair {
 
 #define PROFILER 1
 #define PROFILER_BLOCK_TIMER read_cpu_timer
+#define PROFILER_BLOCK_TIMER_FREQ get_cpu_timer_freq
+#ifndef PROFILER_COUNTERS
+#define PROFILER_COUNTERS 0 // Page faults, LLC and dTLB misses per block, build with -DPROFILER_COUNTERS=1
+#endif
 
 #include "metrics.cpp"
 #include "profiler.cpp"
 #include "string.cpp"
+#include "threads.cpp"
+#include "platform.cpp"
+#include "parallel.cpp"
+#include "pair_store.cpp"
+#include "gzip.cpp"
 #include "json_parser.cpp"
+#include "json_tape.cpp"
+#include "json_cursor.cpp"
+#include "json_parallel.cpp"
+#include "json_schema.cpp"
+#include "pair_stream.cpp"
+#include "haversine.cpp"
+#include "spatial_index.cpp"
+#include "validation.cpp"
+#include "summation.cpp"
+#include "parse_cache.cpp"
+#include "batch.cpp"
+#include "service.cpp"
 
-static double square(double l) {
-    double result = l * l;
-    return result;
-}
-
-static double radians_from_degrees(double Degrees) {
-    double Result = 0.01745329251994329577 * Degrees;
-    return Result;
-}
-
-// NOTE(alex): EarthRadius is generally expected to be 6372.8
-static double reference_haversine(double x0, double y0, double x1, double y1, double earthRadius) {
-    double lat1 = y0;
-    double lat2 = y1;
-    double lon1 = x0;
-    double lon2 = x1;
-    
-    double dLat = radians_from_degrees(lat2 - lat1);
-    double dLon = radians_from_degrees(lon2 - lon1);
-    lat1 = radians_from_degrees(lat1);
-    lat2 = radians_from_degrees(lat2);
-    
-    double a = square(sin(dLat / 2.0)) + cos(lat1) * cos(lat2) * square(sin(dLon / 2));
-    double c = 2.0 * asin(sqrt(a));
-    
-    double result = earthRadius * c;
-    
-    return result;
-}
-
-static String read_file(char* path) {
+// The buffer's pages are spread over the NUMA nodes first, for the parallel passes over it.
+static String read_file(char* path, u32 threadCount) {
     PROFILE_FUNC();
     
     String result = {};
@@ -72,13 +67,15 @@ static String read_file(char* path) {
     struct __stat64 stat;
     _stat64(path, &stat);
 #else
-    struct stat Stat;
-    stat(path, &stat);
+    struct stat stat;
+    fstat(fileno(file), &stat);
 #endif
     
     result = allocate_string(stat.st_size);
     
     if (result.data) {
+        spread_memory_over_nodes(threadCount, result.data, result.count);
+        
         PROFILE_SCOPE_DATA("fread", result.count);
         if (fread(result.data, result.count, 1, file) != 1) {
             // Can't read file
@@ -91,108 +88,932 @@ static String read_file(char* path) {
     return result;
 }
 
-static double sum_haversine_distances(u64 pairCount, HaversinePair* pairs) {
+// read_file, inflating gzip input on the way.
+static String read_input_file(char* path, u32 threadCount, bool* wasCompressed) {
+    String result = read_file(path, threadCount);
+    
+    *wasCompressed = is_gzip(result);
+    if (*wasCompressed) {
+        String inflated = inflate_gzip(threadCount, result);
+        free_string(&result);
+        result = inflated;
+    }
+    
+    return result;
+}
+
+// The answers file mapped as is, or inflated when it was gzipped.
+struct AnswersFile {
+    MappedFile file;
+    String inflated;
+    String data;
+};
+
+static AnswersFile open_answers_file(char* path, u32 threadCount) {
+    AnswersFile result = {};
+    result.file = map_file(path);
+    result.data = result.file.data;
+    
+    if (is_gzip(result.data)) {
+        result.inflated = inflate_gzip(threadCount, result.data);
+        result.data = result.inflated;
+    }
+    
+    return result;
+}
+
+static void close_answers_file(AnswersFile* answers) {
+    free_string(&answers->inflated);
+    unmap_file(&answers->file);
+    *answers = {};
+}
+
+// stats (optional) gets the distance statistics from the same pass as the sum.
+static double sum_haversine_distances(u64 pairCount, HaversinePair* pairs, SumMode mode, u32 threadCount,
+                                      DistanceStats* stats) {
     PROFILE_FUNC_DATA(pairCount * sizeof(HaversinePair));
     
     double sum = 0;
     
-    double sumCoeff = 1 / (double)pairCount;
-    for (u64 i = 0; i < pairCount; i++) {
-        HaversinePair pair = pairs[i];
-        double earthRadius = 6372.8;
-        double dist = reference_haversine(pair.x0, pair.y0, pair.x1, pair.y1, earthRadius);
-        sum += sumCoeff * dist;
+    // NOTE(alex): One block per mode so each gets its own anchor (and bandwidth) in the profile.
+    switch(mode) {
+        case SumMode_Naive: {
+            PROFILE_SCOPE("sum naive");
+            sum = mean_of_distances(mode, threadCount, pairCount, pairs, 0, stats);
+        } break;
+        
+        case SumMode_Pairwise: {
+            PROFILE_SCOPE("sum pairwise");
+            sum = mean_of_distances(mode, threadCount, pairCount, pairs, 0, stats);
+        } break;
+        
+        case SumMode_Neumaier: {
+            PROFILE_SCOPE("sum neumaier");
+            sum = mean_of_distances(mode, threadCount, pairCount, pairs, 0, stats);
+        } break;
+        
+        case SumMode_Exact: {
+            PROFILE_SCOPE("sum exact");
+            sum = mean_of_distances(mode, threadCount, pairCount, pairs, 0, stats);
+        } break;
+        
+        default: {
+            fprintf(stderr, "ERROR: Unrecognized sum mode\n");
+        } break;
     }
     
     return sum;
 }
 
-// [haversine_input.json]
-// [haversine_input.json] [answers.double]
+// Runs every mode twice: once with the distance kernel, once over precomputed distances so the
+// cost of the accumulation itself shows up in the profile. Returns the exact mean, stats come
+// from the exact run.
+static double compare_sum_modes(u64 pairCount, HaversinePair* pairs, u32 threadCount, DistanceStats* stats) {
+    double sums[SumMode_Count];
+    
+    for (u32 mode = 0; mode < SumMode_Count; mode++) {
+        sums[mode] = sum_haversine_distances(pairCount, pairs, (SumMode)mode, threadCount,
+                                             (mode == SumMode_Exact) ? stats : 0);
+    }
+    
+    String distanceMemory = allocate_string(pairCount * sizeof(double));
+    if (distanceMemory.count) {
+        double* distances = (double*)distanceMemory.data;
+        haversine_distances(pairCount, pairs, distances);
+        
+        u64 byteCount = pairCount * sizeof(double);
+        {
+            PROFILE_SCOPE_DATA("accumulate naive", byteCount);
+            mean_of_distances(SumMode_Naive, threadCount, pairCount, 0, distances, 0);
+        }
+        {
+            PROFILE_SCOPE_DATA("accumulate pairwise", byteCount);
+            mean_of_distances(SumMode_Pairwise, threadCount, pairCount, 0, distances, 0);
+        }
+        {
+            PROFILE_SCOPE_DATA("accumulate neumaier", byteCount);
+            mean_of_distances(SumMode_Neumaier, threadCount, pairCount, 0, distances, 0);
+        }
+        {
+            PROFILE_SCOPE_DATA("accumulate exact", byteCount);
+            mean_of_distances(SumMode_Exact, threadCount, pairCount, 0, distances, 0);
+        }
+    }
+    free_string(&distanceMemory);
+    
+    double exact = sums[SumMode_Exact];
+    for (u32 mode = 0; mode < SumMode_Count; mode++) {
+        fprintf(stdout, "Sum (%s): %.16f (%+.3e from exact)\n", describe_sum_mode((SumMode)mode), sums[mode], sums[mode] - exact);
+    }
+    
+    return exact;
+}
+
+static double relative_error(double value, double reference) {
+    double result = fabs(value - reference) / fmax(fabs(reference), DBL_MIN);
+    return result;
+}
+
+// Exercises the batched query APIs on the parsed points and checks them against
+// reference_haversine: pair 0's first point against every second point, then an N x N matrix
+// of the first N first points against the first N second points.
+static void run_batched_queries(u64 pairCount, HaversinePair* pairs, u64 matrixSize, u32 threadCount) {
+    double earthRadius = 6372.8;
+    
+    if (matrixSize > pairCount) {
+        matrixSize = pairCount;
+    }
+    
+    String coordMemory = allocate_string(4 * pairCount * sizeof(double));
+    String distanceMemory = allocate_string(pairCount * sizeof(double));
+    String matrixMemory = allocate_string(matrixSize * matrixSize * sizeof(double));
+    
+    if (pairCount && coordMemory.data && distanceMemory.data && matrixMemory.data) {
+        double* x0s = (double*)coordMemory.data;
+        double* y0s = x0s + pairCount;
+        double* x1s = y0s + pairCount;
+        double* y1s = x1s + pairCount;
+        
+        for (u64 i = 0; i < pairCount; i++) {
+            x0s[i] = pairs[i].x0;
+            y0s[i] = pairs[i].y0;
+            x1s[i] = pairs[i].x1;
+            y1s[i] = pairs[i].y1;
+        }
+        
+        double* distances = (double*)distanceMemory.data;
+        {
+            PROFILE_SCOPE_DATA("haversine_one_to_many", pairCount * 2 * sizeof(double));
+            haversine_one_to_many(threadCount, x0s[0], y0s[0], pairCount, x1s, y1s, distances, earthRadius);
+        }
+        
+        double maxError = 0;
+        for (u64 i = 0; i < pairCount; i++) {
+            double reference = reference_haversine(x0s[0], y0s[0], x1s[i], y1s[i], earthRadius);
+            maxError = fmax(maxError, relative_error(distances[i], reference));
+        }
+        fprintf(stdout, "One-to-many: %llu distances, max rel error %.3e\n", pairCount, maxError);
+        
+        double* matrix = (double*)matrixMemory.data;
+        {
+            PROFILE_SCOPE_DATA("haversine_many_to_many", matrixSize * matrixSize * sizeof(double));
+            haversine_many_to_many(threadCount, matrixSize, x0s, y0s, matrixSize, x1s, y1s, matrix, matrixSize, earthRadius);
+        }
+        
+        maxError = 0;
+        for (u64 i = 0; i < matrixSize; i++) {
+            for (u64 j = 0; j < matrixSize; j++) {
+                double reference = reference_haversine(x0s[i], y0s[i], x1s[j], y1s[j], earthRadius);
+                maxError = fmax(maxError, relative_error(matrix[i * matrixSize + j], reference));
+            }
+        }
+        fprintf(stdout, "Many-to-many: %llux%llu distances, max rel error %.3e\n", matrixSize, matrixSize, maxError);
+    }
+    
+    free_string(&matrixMemory);
+    free_string(&distanceMemory);
+    free_string(&coordMemory);
+}
+
+enum PairParser {
+    PairParser_Tree, // parse_json, linked JsonElement nodes
+    PairParser_Tape, // parse_json_tape, one flat array of tagged entries
+    PairParser_Cursor, // JsonCursor, only the four fields are looked at
+    PairParser_Parallel, // parse_json_array_parallel on the pairs array
+    PairParser_Schema, // JsonCursor with a compiled JsonSchema for HaversinePair
+    
+    PairParser_Count,
+};
+
+static const char* describe_pair_parser(PairParser parser) {
+    const char* result;
+    
+    switch(parser) {
+        case PairParser_Tree: { result = "tree"; } break;
+        case PairParser_Tape: { result = "tape"; } break;
+        case PairParser_Cursor: { result = "cursor"; } break;
+        case PairParser_Parallel: { result = "parallel"; } break;
+        case PairParser_Schema: { result = "schema"; } break;
+        default: { result = "UNKNOWN"; } break;
+    }
+    
+    return result;
+}
+
+static bool parse_pair_parser(const char* name, PairParser* parser) {
+    for (u32 i = 0; i < PairParser_Count; i++) {
+        if (strcmp(name, describe_pair_parser((PairParser)i)) == 0) {
+            *parser = (PairParser)i;
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+static u64 parse_pairs(PairParser parser, u32 threadCount, String inputJson, PairStore* store) {
+    u64 result = 0;
+    
+    switch(parser) {
+        case PairParser_Tree: { result = parse_haversine_pairs(inputJson, store); } break;
+        case PairParser_Tape: { result = parse_haversine_pairs_tape(inputJson, store); } break;
+        case PairParser_Cursor: { result = parse_haversine_pairs_cursor(inputJson, store); } break;
+        case PairParser_Parallel: { result = parse_haversine_pairs_parallel(threadCount, inputJson, store); } break;
+        case PairParser_Schema: { result = parse_haversine_pairs_schema(inputJson, store); } break;
+        default: { } break;
+    }
+    
+    // The parallel parser already wrote each node's pairs from that node
+    if (parser != PairParser_Parallel) {
+        spread_memory_over_nodes(threadCount, (u8*)store->pairs, result * sizeof(HaversinePair));
+    }
+    
+    return result;
+}
+
+struct ProcessorOptions {
+    char* jsonFilePath;
+    char* answersFilePath;
+    
+    u32 threadCount; // 0 means one per logical processor
+    
+    SumMode sumMode;
+    bool compareSumModes;
+    
+    PairParser parser;
+    PairStoreBacking pairStore;
+    
+    u64 matrixSize; // Non-zero runs the batched query check
+    
+    bool hasMaxUlp;
+    u64 maxUlp;
+    
+    // Spatial index queries, both centered on (queryX, queryY)
+    double queryX;
+    double queryY;
+    bool hasRadiusQuery;
+    double radiusKm;
+    bool hasKnnQuery;
+    u64 knnCount;
+    
+    bool useCache; // Map "<input>.pairs" instead of parsing when it matches the input
+    bool incremental; // Only parse what was appended since the cache was written
+    
+    char* jsonQuery; // Path for json_get, prints that value instead of processing pairs
+    
+    bool stream; // Read the input (a path, or stdin when missing or "-") in fixed blocks
+    
+    bool stats; // Distance min/max/mean/variance/percentiles/histogram, from the summing pass
+    
+    char* batch; // Manifest or glob of inputs to process in one run instead of jsonFilePath
+    
+    // Resident service, see service.cpp
+    char* serveSocket;
+    u32 serviceWorkers;
+    u64 serviceMemoryMb;
+    
+    char* clientSocket; // Send clientRequest about jsonFilePath to the service there
+    ServiceRequestType clientRequest;
+    u64 clientArgument;
+    u64 repeatCount;
+};
+
+static void print_usage(char* exe) {
+    fprintf(stderr, "Usage: %s [options] [haversine_input.json]\n", exe);
+    fprintf(stderr, "       %s --stream [options] [haversine_input.json | -] [answers.double]\n", exe);
+    fprintf(stderr, "       %s [options] [haversine_input.json] [answers.double]\n", exe);
+    fprintf(stderr, "       %s --batch (manifest.txt | \"dir/*.json\") [--threads N]\n", exe);
+    fprintf(stderr, "       %s --serve SOCKET [--service-workers N] [--service-memory MB] [options]\n", exe);
+    fprintf(stderr, "       %s --client SOCKET (sum | stats | pair:N | evict | shutdown) [haversine_input.json] [--repeat N]\n", exe);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --threads N    Worker threads for the parallel stages (default: one per logical processor).\n");
+    fprintf(stderr, "  --no-numa      Don't pin threads to NUMA nodes or place the input and pairs on the nodes that use them.\n");
+    fprintf(stderr, "  --max-ulp N    Fail validation if any pair is more than N ULPs away from its answer.\n");
+    fprintf(stderr, "  --matrix N     Check the batched one-to-many and N x N query APIs on the parsed points.\n");
+    fprintf(stderr, "  --sum-mode M   naive, pairwise, neumaier (default) or exact. \"all\" runs and times every mode.\n");
+    fprintf(stderr, "  --parser P     JSON parser for the pairs: tree (default), tape, cursor, parallel or schema.\n");
+    fprintf(stderr, "  --pair-store M Memory for the parsed pairs: memory (default), huge (huge pages) or spill\n");
+    fprintf(stderr, "                 (a temporary \"<input>.spill\" file the OS can page them out to, it must not exist).\n");
+    fprintf(stderr, "  --stats        Also print distance min, max, mean, variance, percentiles and a histogram,\n");
+    fprintf(stderr, "                 gathered in the same pass as the sum.\n");
+    fprintf(stderr, "  --cache        Reuse (or write) the parsed pairs in \"<input>.pairs\" next to the JSON.\n");
+    fprintf(stderr, "  --incremental  Like --cache, but when pairs were only appended to the input since, parse just those.\n");
+    fprintf(stderr, "  --json-get P   Print the value at path P (like \"pairs[3].x0\") instead of processing pairs.\n");
+    fprintf(stderr, "  --stream       Read the input in fixed blocks with constant memory, from stdin if no path or \"-\".\n");
+    fprintf(stderr, "                 Always sums in neumaier mode.\n");
+    fprintf(stderr, "  --batch S      Sum every input listed in the manifest S (one path per line) or matching the\n");
+    fprintf(stderr, "                 glob S, chunks of all of them sharing the threads. Prints a line per file and the totals.\n");
+    fprintf(stderr, "  --serve SOCKET Stay resident and answer requests on the local socket SOCKET, keeping parsed inputs\n");
+    fprintf(stderr, "                 (and their sums and stats) in memory until the file changes or memory runs short.\n");
+    fprintf(stderr, "  --service-workers N  Connections served at once (default 4).\n");
+    fprintf(stderr, "  --service-memory MB  Memory for cached inputs (default 1024), least recently used ones are dropped.\n");
+    fprintf(stderr, "  --client SOCKET R    Ask the service on SOCKET for R about the input and print the answer.\n");
+    fprintf(stderr, "                 The service opens the path itself, relative paths are from its working directory.\n");
+    fprintf(stderr, "  --repeat N     With --client, send the request N times on one connection and print round trip times.\n");
+    fprintf(stderr, "  --radius-query X Y KM  Index the parsed points and list the ones within KM of (X, Y).\n");
+    fprintf(stderr, "  --knn-query X Y K      Index the parsed points and list the K nearest to (X, Y).\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Inputs and answers files (not --stream input) can be gzipped. bgzip (BGZF) files are inflated in parallel.\n");
+    fprintf(stderr, "Build with -DPROFILER_COUNTERS=1 to add page faults, LLC and dTLB misses to every profile block.\n");
+    fprintf(stderr, "The LLC and dTLB misses are the main thread's only, not the worker threads'.\n");
+}
+
+static bool parse_options(int argc, char** argv, ProcessorOptions* options) {
+    u32 positionalCount = 0;
+    
+    for (int i = 1; i < argc; i++) {
+        char* arg = argv[i];
+        bool hasValue = (i + 1) < argc;
+        
+        if ((strcmp(arg, "--threads") == 0) && hasValue) {
+            options->threadCount = (u32)atol(argv[++i]);
+        } else if ((strcmp(arg, "--max-ulp") == 0) && hasValue) {
+            options->hasMaxUlp = true;
+            options->maxUlp = strtoull(argv[++i], 0, 10);
+        } else if ((strcmp(arg, "--matrix") == 0) && hasValue) {
+            options->matrixSize = strtoull(argv[++i], 0, 10);
+        } else if ((strcmp(arg, "--parser") == 0) && hasValue) {
+            char* parserName = argv[++i];
+            if (!parse_pair_parser(parserName, &options->parser)) {
+                fprintf(stderr, "ERROR: Unknown parser \"%s\".\n", parserName);
+                return false;
+            }
+        } else if ((strcmp(arg, "--pair-store") == 0) && hasValue) {
+            char* backingName = argv[++i];
+            if (!parse_pair_store_backing(backingName, &options->pairStore)) {
+                fprintf(stderr, "ERROR: Unknown pair store \"%s\".\n", backingName);
+                return false;
+            }
+        } else if ((strcmp(arg, "--batch") == 0) && hasValue) {
+            options->batch = argv[++i];
+        } else if ((strcmp(arg, "--serve") == 0) && hasValue) {
+            options->serveSocket = argv[++i];
+        } else if ((strcmp(arg, "--service-workers") == 0) && hasValue) {
+            options->serviceWorkers = (u32)atol(argv[++i]);
+        } else if ((strcmp(arg, "--service-memory") == 0) && hasValue) {
+            options->serviceMemoryMb = strtoull(argv[++i], 0, 10);
+        } else if ((strcmp(arg, "--client") == 0) && ((i + 2) < argc)) {
+            options->clientSocket = argv[++i];
+            char* requestName = argv[++i];
+            if (strncmp(requestName, "pair:", 5) == 0) {
+                options->clientRequest = ServiceRequest_Pair;
+                options->clientArgument = strtoull(requestName + 5, 0, 10);
+            } else if (!parse_service_request(requestName, &options->clientRequest) ||
+                       (options->clientRequest == ServiceRequest_Pair)) {
+                fprintf(stderr, "ERROR: Unknown service request \"%s\".\n", requestName);
+                return false;
+            }
+        } else if ((strcmp(arg, "--repeat") == 0) && hasValue) {
+            options->repeatCount = strtoull(argv[++i], 0, 10);
+        } else if (strcmp(arg, "--no-numa") == 0) {
+            disable_numa();
+        } else if (strcmp(arg, "--stats") == 0) {
+            options->stats = true;
+        } else if (strcmp(arg, "--cache") == 0) {
+            options->useCache = true;
+        } else if ((strcmp(arg, "--json-get") == 0) && hasValue) {
+            options->jsonQuery = argv[++i];
+        } else if (strcmp(arg, "--stream") == 0) {
+            options->stream = true;
+        } else if (strcmp(arg, "--incremental") == 0) {
+            options->useCache = true;
+            options->incremental = true;
+        } else if ((strcmp(arg, "--radius-query") == 0) && ((i + 3) < argc)) {
+            options->hasRadiusQuery = true;
+            options->queryX = atof(argv[++i]);
+            options->queryY = atof(argv[++i]);
+            options->radiusKm = atof(argv[++i]);
+        } else if ((strcmp(arg, "--knn-query") == 0) && ((i + 3) < argc)) {
+            options->hasKnnQuery = true;
+            options->queryX = atof(argv[++i]);
+            options->queryY = atof(argv[++i]);
+            options->knnCount = strtoull(argv[++i], 0, 10);
+        } else if ((strcmp(arg, "--sum-mode") == 0) && hasValue) {
+            char* modeName = argv[++i];
+            if (strcmp(modeName, "all") == 0) {
+                options->compareSumModes = true;
+            } else if (!parse_sum_mode(modeName, &options->sumMode)) {
+                fprintf(stderr, "ERROR: Unknown sum mode \"%s\".\n", modeName);
+                return false;
+            }
+        } else if ((arg[0] == '-') && (arg[1] == '-')) {
+            fprintf(stderr, "ERROR: Unknown option \"%s\".\n", arg);
+            return false;
+        } else if (positionalCount == 0) {
+            options->jsonFilePath = arg;
+            positionalCount++;
+        } else if (positionalCount == 1) {
+            options->answersFilePath = arg;
+            positionalCount++;
+        } else {
+            return false;
+        }
+    }
+    
+    bool result = ((options->jsonFilePath != nullptr) || options->stream || options->batch || options->serveSocket ||
+                   (options->clientSocket && (options->clientRequest == ServiceRequest_Shutdown)));
+    return result;
+}
+
+// Builds the spatial index over every parsed point and answers the requested queries, checking
+// each answer against a brute force scan. The same query is then repeated around the first
+// points of the input so the profile shows a per-query cost.
+static void run_spatial_queries(ProcessorOptions* options, u64 pairCount, HaversinePair* pairs) {
+    SpatialIndex index = build_spatial_index(options->threadCount, pairCount, pairs);
+    if (!index.memory.data) {
+        fprintf(stderr, "ERROR: Can't allocate the spatial index\n");
+        return;
+    }
+    
+    fprintf(stdout, "Spatial index: %llu points, %ux%u cells of %.3f degrees\n",
+            index.pointCount, index.rowCount, index.columnCount, index.cellDegrees);
+    
+    String resultMemory = allocate_string(index.pointCount * sizeof(SpatialResult));
+    String distanceMemory = allocate_string(index.pointCount * sizeof(double));
+    
+    if (resultMemory.data && distanceMemory.data) {
+        SpatialResult* results = (SpatialResult*)resultMemory.data;
+        double* distances = (double*)distanceMemory.data;
+        u64 repeatCount = (index.pointCount < 1000) ? index.pointCount : 1000;
+        
+        if (options->hasRadiusQuery) {
+            double x = options->queryX;
+            double y = options->queryY;
+            double radiusKm = options->radiusKm;
+            
+            u64 foundCount = 0;
+            {
+                PROFILE_SCOPE("radius query");
+                foundCount = spatial_within_radius(&index, x, y, radiusKm, index.pointCount, results);
+            }
+            
+            u64 bruteCount = 0;
+            for (u64 i = 0; i < pairCount; i++) {
+                bruteCount += (reference_haversine(x, y, pairs[i].x0, pairs[i].y0, SPATIAL_EARTH_RADIUS) <= radiusKm);
+                bruteCount += (reference_haversine(x, y, pairs[i].x1, pairs[i].y1, SPATIAL_EARTH_RADIUS) <= radiusKm);
+            }
+            
+            fprintf(stdout, "Radius query: %llu points within %.3f km of (%.6f, %.6f) (brute force %llu%s)\n",
+                    foundCount, radiusKm, x, y, bruteCount, (foundCount == bruteCount) ? "" : ", MISMATCH");
+            
+            u64 queryFoundCount = 0;
+            {
+                PROFILE_SCOPE("repeated radius queries");
+                for (u64 i = 0; i < repeatCount; i++) {
+                    HaversinePair* pair = pairs + (i / 2);
+                    double qx = (i & 1) ? pair->x1 : pair->x0;
+                    double qy = (i & 1) ? pair->y1 : pair->y0;
+                    queryFoundCount += spatial_within_radius(&index, qx, qy, radiusKm, 0, 0);
+                }
+            }
+            fprintf(stdout, "Repeated radius queries: %llu, %llu points found\n", repeatCount, queryFoundCount);
+        }
+        
+        if (options->hasKnnQuery) {
+            double x = options->queryX;
+            double y = options->queryY;
+            u64 k = (options->knnCount < index.pointCount) ? options->knnCount : index.pointCount;
+            
+            u64 foundCount = 0;
+            {
+                PROFILE_SCOPE("knn query");
+                foundCount = spatial_nearest(&index, x, y, k, results);
+            }
+            
+            // The k-th smallest brute force distance has to match the k-th result
+            for (u64 i = 0; i < pairCount; i++) {
+                distances[2 * i + 0] = reference_haversine(x, y, pairs[i].x0, pairs[i].y0, SPATIAL_EARTH_RADIUS);
+                distances[2 * i + 1] = reference_haversine(x, y, pairs[i].x1, pairs[i].y1, SPATIAL_EARTH_RADIUS);
+            }
+            
+            bool matches = (foundCount == k);
+            if (matches && k) {
+                double kthDistance = results[k - 1].distance;
+                u64 closerCount = 0;
+                for (u64 i = 0; i < index.pointCount; i++) {
+                    closerCount += (distances[i] < kthDistance);
+                }
+                matches = (closerCount < k);
+                
+                for (u64 i = 0; i < k; i++) {
+                    matches = matches && (distances[results[i].pointId] == results[i].distance);
+                }
+            }
+            
+            fprintf(stdout, "KNN query: %llu nearest to (%.6f, %.6f)%s\n", foundCount, x, y, matches ? "" : ", MISMATCH with brute force");
+            for (u64 i = 0; (i < foundCount) && (i < 10); i++) {
+                fprintf(stdout, "  point %llu (pair %llu): %.6f km\n", results[i].pointId, results[i].pointId / 2, results[i].distance);
+            }
+            
+            {
+                PROFILE_SCOPE("repeated knn queries");
+                for (u64 i = 0; i < repeatCount; i++) {
+                    HaversinePair* pair = pairs + (i / 2);
+                    double qx = (i & 1) ? pair->x1 : pair->x0;
+                    double qy = (i & 1) ? pair->y1 : pair->y0;
+                    spatial_nearest(&index, qx, qy, k, results);
+                }
+            }
+            fprintf(stdout, "Repeated knn queries: %llu\n", repeatCount);
+        }
+    }
+    
+    free_string(&distanceMemory);
+    free_string(&resultMemory);
+    free_spatial_index(&index);
+}
+
+// A streamed run passes the validation it did block by block (and no pairs). Returns false when
+// validation failed.
+// answersFile is options->answersFilePath, opened by the caller.
+static bool validate_against_answers(ProcessorOptions* options, AnswersFile* answersFile, u64 pairCount,
+                                     HaversinePair* pairs, double sum, PairValidation* streamed) {
+    bool result = true;
+    
+    if (answersFile->data.count >= sizeof(double)) {
+        double* answerValues = (double*)answersFile->data.data;
+        
+        fprintf(stdout, "\nValidation:\n");
+        
+        u64 refAnswerCount = (answersFile->data.count - sizeof(double)) / sizeof(double);
+        if (pairCount != refAnswerCount) {
+            fprintf(stdout, "FAILED - pair count doesn't match %llu.\n", refAnswerCount);
+            result = false;
+        }
+        
+        double refSum = answerValues[refAnswerCount];
+        
+        fprintf(stdout, "Reference sum: %.16f\n", refSum);
+        fprintf(stdout, "Difference: %.16f\n", sum - refSum);
+        
+        PairValidation validation;
+        if (streamed) {
+            validation = *streamed;
+        } else {
+            u64 checkCount = (pairCount < refAnswerCount) ? pairCount : refAnswerCount;
+            validation = validate_pair_distances(options->threadCount, checkCount, pairs, answerValues);
+        }
+        print_pair_validation(&validation, pairs, answerValues);
+        
+        if (validation.failed) {
+            fprintf(stdout, "FAILED - not enough memory to check every pair.\n");
+            result = false;
+        }
+        
+        if (options->hasMaxUlp) {
+            if (validation.maxUlpDistance > options->maxUlp) {
+                fprintf(stdout, "FAILED - max ULP distance exceeds %llu.\n", options->maxUlp);
+                result = false;
+            } else if (result) {
+                fprintf(stdout, "PASSED\n");
+            }
+        }
+        
+        fprintf(stdout, "\n");
+    } else {
+        fprintf(stderr, "Can't open answers file \"%s\"\n", options->answersFilePath);
+        result = false;
+    }
+    
+    return result;
+}
+
+// Sums the pairs and runs whatever checks were asked for. A cached sum is reused when it was made
+// in the requested mode and no statistics were asked for. Returns false when validation failed.
+static bool process_pairs(ProcessorOptions* options, u64 inputSize, u64 pairCount, HaversinePair* pairs,
+                          ParseCacheHeader* cached, SumMode* sumMode, double* sum) {
+    bool result = true;
+    
+    DistanceStats stats;
+    init_distance_stats(&stats);
+    DistanceStats* wantedStats = options->stats ? &stats : 0;
+    
+    if (cached && cached->hasSum && !options->compareSumModes && !options->stats &&
+        (cached->sumMode == (u32)options->sumMode)) {
+        *sumMode = options->sumMode;
+        *sum = cached->sum;
+    } else if (options->compareSumModes) {
+        *sumMode = SumMode_Exact;
+        *sum = compare_sum_modes(pairCount, pairs, options->threadCount, wantedStats);
+    } else {
+        *sumMode = options->sumMode;
+        *sum = sum_haversine_distances(pairCount, pairs, options->sumMode, options->threadCount, wantedStats);
+    }
+    
+    fprintf(stdout, "Input size: %llu\n", inputSize);
+    fprintf(stdout, "Pair count: %llu\n", pairCount);
+    fprintf(stdout, "Haversine sum: %.16f\n", *sum);
+    
+    if (options->stats) {
+        print_distance_stats(&stats);
+    }
+    
+    if (options->matrixSize) {
+        run_batched_queries(pairCount, pairs, options->matrixSize, options->threadCount);
+    }
+    
+    if (options->hasRadiusQuery || options->hasKnnQuery) {
+        run_spatial_queries(options, pairCount, pairs);
+    }
+    
+    if (options->answersFilePath) {
+        AnswersFile answersFile = open_answers_file(options->answersFilePath, options->threadCount);
+        result = validate_against_answers(options, &answersFile, pairCount, pairs, *sum, 0);
+        close_answers_file(&answersFile);
+    }
+    
+    return result;
+}
+
+#define STREAM_SUM_BLOCK_COUNT 16 // Sum blocks read (and summed in parallel) per stream block
+
+// Reads the pairs from a pipe or file a block at a time, summing (and validating) each block as it
+// arrives, so memory use doesn't grow with the input. Sums in SumMode_Neumaier, which through
+// resume_neumaier_sum gives the same result as the in-memory run. Returns false on failure.
+static bool run_stream(ProcessorOptions* options) {
+    PairStream stream;
+    if (!open_pair_stream(&stream, options->jsonFilePath)) {
+        fprintf(stderr, "Can't open input stream \"%s\"\n", options->jsonFilePath ? options->jsonFilePath : "-");
+        close_pair_stream(&stream);
+        return false;
+    }
+    
+    AnswersFile answersFile = {};
+    double* answers = 0;
+    u64 answerCount = 0;
+    if (options->answersFilePath) {
+        answersFile = open_answers_file(options->answersFilePath, options->threadCount);
+        if (answersFile.data.count >= sizeof(double)) {
+            answers = (double*)answersFile.data.data;
+            answerCount = (answersFile.data.count - sizeof(double)) / sizeof(double);
+        }
+    }
+    
+    u64 blockPairCount = STREAM_SUM_BLOCK_COUNT * SUM_BLOCK_PAIR_COUNT;
+    String pairMemory = allocate_string(blockPairCount * sizeof(HaversinePair));
+    
+    u64 pairCount = 0;
+    double total = 0.0;
+    SumCheckpoint checkpoint = {};
+    PairValidation validation = {};
+    
+    DistanceStats stats;
+    init_distance_stats(&stats);
+    DistanceStats* wantedStats = options->stats ? &stats : 0;
+    
+    if (pairMemory.data) {
+        HaversinePair* pairs = (HaversinePair*)pairMemory.data;
+        
+        while (true) {
+            u64 count = read_pair_stream(&stream, blockPairCount, pairs);
+            
+            if (count) {
+                {
+                    PROFILE_SCOPE_DATA("stream sum", count * sizeof(HaversinePair));
+                    total = resume_neumaier_sum(options->threadCount, count, pairs, &checkpoint, wantedStats);
+                }
+                
+                if (pairCount < answerCount) {
+                    u64 checkCount = ((answerCount - pairCount) < count) ? (answerCount - pairCount) : count;
+                    PairValidation block = validate_pair_distances(options->threadCount, checkCount, pairs, answers + pairCount);
+                    accumulate_validation(&validation, &block, pairCount);
+                }
+                
+                pairCount += count;
+            }
+            
+            if (count < blockPairCount) {
+                break;
+            }
+        }
+    }
+    
+    double sum = pairCount ? (total / (double)pairCount) : 0.0;
+    
+    fprintf(stdout, "Input size: %llu\n", stream.byteCount);
+    fprintf(stdout, "Pair count: %llu\n", pairCount);
+    fprintf(stdout, "Haversine sum: %.16f\n", sum);
+    
+    if (options->stats) {
+        print_distance_stats(&stats);
+    }
+    
+    bool result = (pairMemory.data != 0) && !stream.hadError;
+    
+    free_string(&pairMemory);
+    close_pair_stream(&stream);
+    
+    if (options->answersFilePath) {
+        result = validate_against_answers(options, &answersFile, pairCount, 0, sum, &validation) && result;
+    }
+    
+    close_answers_file(&answersFile);
+    
+    return result;
+}
+
+// Parses the whole input and prints the element at options->jsonQuery. Returns false if the
+// path doesn't exist.
+static bool run_json_query(ProcessorOptions* options) {
+    bool wasCompressed = false;
+    String inputJson = read_input_file(options->jsonFilePath, options->threadCount, &wasCompressed);
+    
+    if (!inputJson.data) {
+        fprintf(stderr, "Can't open JSON file \"%s\"\n", options->jsonFilePath);
+        return false;
+    }
+    
+    JsonElement* json = parse_json(inputJson);
+    
+    JsonElement* element = 0;
+    {
+        PROFILE_SCOPE("json_get");
+        element = json_get(json, options->jsonQuery);
+    }
+    
+    if (!element) {
+        fprintf(stdout, "%s: not found\n", options->jsonQuery);
+    } else if (is_json_object(element) || is_json_array(element)) {
+        fprintf(stdout, "%s: %s with %u children\n", options->jsonQuery,
+                is_json_object(element) ? "object" : "array", element->childCount);
+    } else {
+        fprintf(stdout, "%s: %.*s\n", options->jsonQuery, (u32)element->value.count, (char*)element->value.data);
+    }
+    
+    bool result = (element != 0);
+    
+    free_json(json);
+    free_string(&inputJson);
+    
+    return result;
+}
+
+// service_load_func for run_service, context is the ProcessorOptions. Parses with the parser and
+// pair store asked for and sums in the sum mode asked for.
+static bool load_service_dataset(void* context, char* path, PairStore* store, double* sum, DistanceStats* stats) {
+    ProcessorOptions* options = (ProcessorOptions*)context;
+    
+    bool wasCompressed = false;
+    String inputJson = read_input_file(path, options->threadCount, &wasCompressed);
+    
+    u32 minimumJsonPairEncoding = 6 * 4;
+    u64 maxPairCount = inputJson.count / minimumJsonPairEncoding;
+    
+    char spillPath[PARSE_CACHE_MAX_PATH];
+    snprintf(spillPath, sizeof(spillPath), "%s.spill", path);
+    
+    bool result = (maxPairCount && open_pair_store(store, maxPairCount, options->pairStore, spillPath));
+    if (result) {
+        parse_pairs(options->parser, options->threadCount, inputJson, store);
+        *sum = sum_haversine_distances(store->count, store->pairs, options->sumMode, options->threadCount, stats);
+    }
+    
+    free_string(&inputJson);
+    
+    return result;
+}
+
+// [options] [haversine_input.json]
+// [options] [haversine_input.json] [answers.double]
 int main(int argc, char** argv) {
     begin_profile();
     
     int result = 1;
     
-    if (argc <= 1 || argc >= 4) {
-        fprintf(stderr, "Usage: %s [haversine_input.json]\n", argv[0]);
-        fprintf(stderr, "       %s [haversine_input.json] [answers.double]\n", argv[0]);
+    ProcessorOptions options = {};
+    options.sumMode = SumMode_Neumaier;
+    if (!parse_options(argc, argv, &options)) {
+        print_usage(argv[0]);
         return 1;
     }
     
-    char* jsonFilePath = nullptr;
-    char* answersFilePath = nullptr;
+    bool valid = true;
     
-    if (argc >= 2) {
-        jsonFilePath = argv[1];
+    if (options.stream) {
+        valid = run_stream(&options);
+        end_profile_and_print();
+        return valid ? 0 : 1;
     }
     
-    if (argc >= 3) {
-        answersFilePath = argv[2];
+    if (options.batch) {
+        valid = run_batch(options.batch, options.threadCount);
+        end_profile_and_print();
+        return valid ? 0 : 1;
     }
     
-    String inputJson = read_file(jsonFilePath);
+    if (options.serveSocket) {
+        u64 memoryBudget = (options.serviceMemoryMb ? options.serviceMemoryMb : 1024) * 1024 * 1024;
+        valid = run_service(options.serveSocket, options.serviceWorkers ? options.serviceWorkers : 4, memoryBudget,
+                            load_service_dataset, &options);
+        end_profile_and_print();
+        return valid ? 0 : 1;
+    }
     
-    if (inputJson.data == nullptr) {
-        fprintf(stderr, "Can't open JSON file \"%s\"", jsonFilePath);
-        return 0;
+    if (options.clientSocket) {
+        valid = run_service_client(options.clientSocket, options.clientRequest, options.jsonFilePath,
+                                   options.clientArgument, options.repeatCount);
+        return valid ? 0 : 1;
     }
     
-    if (argc >= 3) {
-        String answers = read_file(answersFilePath);
+    if (options.jsonQuery) {
+        valid = run_json_query(&options);
+        end_profile_and_print();
+        return valid ? 0 : 1;
+    }
+    
+    char cachePath[PARSE_CACHE_MAX_PATH];
+    FileFingerprint fingerprint = {};
+    bool useCache = (options.useCache &&
+                     make_parse_cache_path(options.jsonFilePath, cachePath, sizeof(cachePath)) &&
+                     fingerprint_file(options.jsonFilePath, &fingerprint));
+    
+    ParseCache cache = {};
+    if (useCache) {
+        cache = open_parse_cache(cachePath);
         
-        if (answers.data == nullptr) {
-            fprintf(stderr, "Can't open answers file \"%s\"", answersFilePath);
-            return 0;
+        if (cache.pairs && !are_equal(&cache.header->source, &fingerprint)) {
+            bool resumed = (options.incremental &&
+                            resume_parse_cache(&cache, options.threadCount, options.jsonFilePath, cachePath, &fingerprint));
+            if (!resumed) {
+                close_parse_cache(&cache);
+            }
         }
     }
     
-    u32 minimumJsonPairEncoding = 6 * 4;
-    u64 maxPairCount = inputJson.count / minimumJsonPairEncoding;
-    if (maxPairCount) {
-        String parsedValues = allocate_string(maxPairCount * sizeof(HaversinePair));
-        if (parsedValues.count) {
-            HaversinePair* pairs = (HaversinePair*)parsedValues.data;
-            u64 pairCount = parse_haversine_pairs(inputJson, maxPairCount, pairs);
-            double sum = sum_haversine_distances(pairCount, pairs);
-            
-            fprintf(stdout, "Input size: %llu\n", inputJson.count);
-            fprintf(stdout, "Pair count: %llu\n", pairCount);
-            fprintf(stdout, "Haversine sum: %.16f\n", sum);
+    if (cache.pairs) {
+        fprintf(stdout, "Parse cache: using \"%s\"\n", cachePath);
+        
+        SumMode sumMode;
+        double sum;
+        valid = process_pairs(&options, fingerprint.size, cache.header->pairCount, cache.pairs, cache.header, &sumMode, &sum);
+        
+        close_parse_cache(&cache);
+    } else {
+        bool wasCompressed = false;
+        String inputJson = read_input_file(options.jsonFilePath, options.threadCount, &wasCompressed);
+        
+        if (inputJson.data == nullptr) {
+            fprintf(stderr, "Can't open JSON file \"%s\"", options.jsonFilePath);
+            return 0;
+        }
+        
+        u32 minimumJsonPairEncoding = 6 * 4;
+        u64 maxPairCount = inputJson.count / minimumJsonPairEncoding;
+        if (maxPairCount) {
+            char spillPath[PARSE_CACHE_MAX_PATH];
+            snprintf(spillPath, sizeof(spillPath), "%s.spill", options.jsonFilePath);
             
-            if (argc == 3) {
-                String answersDouble = read_file(argv[2]);
-                if (answersDouble.count >= sizeof(double)) {
-                    
-                    double* answerValues = (double*)answersDouble.data;
-                    
-                    fprintf(stdout, "\nValidation:\n");
+            PairStore store;
+            if (open_pair_store(&store, maxPairCount, options.pairStore, spillPath)) {
+                u64 pairCount = parse_pairs(options.parser, options.threadCount, inputJson, &store);
+                HaversinePair* pairs = store.pairs;
+                
+                SumMode sumMode;
+                double sum;
+                
+                // NOTE(alex): The parsers return no pairs when the JSON doesn't parse, an input
+                // that really has none has nothing to sum either.
+                if (pairCount) {
+                    valid = process_pairs(&options, inputJson.count, pairCount, pairs, 0, &sumMode, &sum);
+                } else {
+                    fprintf(stderr, "ERROR: No haversine pairs parsed from \"%s\"\n", options.jsonFilePath);
+                    valid = false;
+                }
+                
+                if (useCache && pairCount) {
+                    ParseCacheHeader header = {};
+                    header.source = fingerprint;
+                    header.pairCount = pairCount;
+                    header.hasSum = isfinite(sum);
+                    header.sumMode = sumMode;
+                    header.sum = sum;
                     
-                    u64 refAnswerCount = (answersDouble.count - sizeof(double)) / sizeof(double);
-                    if (pairCount != refAnswerCount) {
-                        fprintf(stdout, "FAILED - pair count doesn't match %llu.\n", refAnswerCount);
+                    // Offsets into the inflated text mean nothing for the compressed file on disk
+                    if (!wasCompressed) {
+                        checkpoint_parse_cache(&header, options.threadCount, inputJson, pairs);
                     }
                     
-                    double refSum = answerValues[refAnswerCount];
-                    
-                    fprintf(stdout, "Reference sum: %.16f\n", refSum);
-                    fprintf(stdout, "Difference: %.16f\n", sum - refSum);
-                    
-                    fprintf(stdout, "\n");
+                    if (write_parse_cache(cachePath, &header, pairs)) {
+                        fprintf(stdout, "Parse cache: wrote \"%s\"\n", cachePath);
+                    }
                 }
+            } else {
+                valid = false;
             }
+            
+            close_pair_store(&store);
+        } else {
+            fprintf(stderr, "Malformed input JSON\n");
+            valid = false;
         }
         
-        free_string(&parsedValues);
-    } else {
-        fprintf(stderr, "Malformed input JSON\n");
+        free_string(&inputJson);
     }
     
-    free_string(&inputJson);
-    
     end_profile_and_print();
     
-    result = 0;
+    result = valid ? 0 : 1;
     
     return result;
 }
@@ -0,0 +1,240 @@
+// On-demand navigation of a JSON document, straight off the tokenizer. Nothing is allocated:
+// callers walk arrays and objects with JsonIteration and ask for fields by name, and whatever
+// they don't look at is fast-forwarded by bracket matching instead of being tokenized. Values
+// come back as tokens, so numbers are only converted if the caller asks (json_cursor_double).
+//
+// Iterations are strictly nested like the document. Leaving one early is fine: the next call on
+// an outer iteration skips to the end of anything still open inside it. Going back to an outer
+// iteration and then continuing an inner one isn't.
+
+struct JsonCursor {
+    JsonParser parser;
+    u32 depth;           // Containers begun and not yet closed
+    bool pendingSkip;    // The last value returned was a container nobody began
+};
+
+struct JsonIteration {
+    u64 firstAt;         // Just past the open brace/bracket, for find_json_field's wrap around
+    u32 depth;
+    u32 count;           // Children returned so far
+    JsonTokenType endType;
+    bool isObject;
+    bool done;
+};
+
+static JsonCursor open_json_cursor(String inputJson) {
+    JsonCursor result = {};
+    result.parser.source = inputJson;
+    return result;
+}
+
+// NOTE(alex): Only brackets and quotes matter here. Brackets inside strings are ignored and a
+// backslash always hides the next byte, so escaped quotes don't end a string early.
+//
+// Returns the offset just past the bracket closing the container whose contents start at at, or
+// U64Max if source ends first.
+static u64 find_json_container_end(String source, u64 at) {
+    u32 nesting = 1;
+    
+    while (nesting && (at < source.count)) {
+        u8 val = source.data[at++];
+        
+        if (val == '"') {
+            while ((at < source.count) && (source.data[at] != '"')) {
+                at += (source.data[at] == '\\') ? 2 : 1;
+            }
+            ++at;
+        } else if ((val == '{') || (val == '[')) {
+            ++nesting;
+        } else if ((val == '}') || (val == ']')) {
+            --nesting;
+        }
+    }
+    
+    u64 result = (nesting || (at > source.count)) ? U64Max : at;
+    return result;
+}
+
+static void skip_json_container(JsonCursor* cursor) {
+    String source = cursor->parser.source;
+    u64 end = find_json_container_end(source, cursor->parser.at);
+    
+    if (end == U64Max) {
+        cursor->parser.hadError = true;
+        fprintf(stderr, "ERROR: JSON ended inside a container\n");
+        end = source.count;
+    }
+    
+    cursor->parser.at = end;
+}
+
+// The first value of the document
+static JsonToken get_json_cursor_root(JsonCursor* cursor) {
+    JsonToken result = get_json_token(&cursor->parser);
+    cursor->pendingSkip = (result.type == Token_open_brace) || (result.type == Token_open_bracket);
+    return result;
+}
+
+// Starts iterating the children of open, which has to be the container value just returned.
+static JsonIteration begin_json_iteration(JsonCursor* cursor, JsonToken open) {
+    JsonIteration result = {};
+    
+    if (cursor->pendingSkip && ((open.type == Token_open_brace) || (open.type == Token_open_bracket))) {
+        cursor->pendingSkip = false;
+        
+        result.firstAt = cursor->parser.at;
+        result.depth = ++cursor->depth;
+        result.isObject = (open.type == Token_open_brace);
+        result.endType = result.isObject ? Token_close_brace : Token_close_bracket;
+    } else {
+        parser_error(&cursor->parser, open, "Expected an array or object");
+        result.done = true;
+    }
+    
+    return result;
+}
+
+// Moves to the next child of iteration. For objects label and labelHash are filled too (labels
+// can be null for arrays). Returns false past the last child or on error.
+static bool next_json_child(JsonCursor* cursor, JsonIteration* iteration, String* label, u32* labelHash, JsonToken* value) {
+    if (iteration->done || cursor->parser.hadError) {
+        return false;
+    }
+    
+    // Whatever the caller left open below this iteration
+    while (cursor->depth > iteration->depth) {
+        skip_json_container(cursor);
+        --cursor->depth;
+    }
+    
+    if (cursor->pendingSkip) {
+        skip_json_container(cursor);
+        cursor->pendingSkip = false;
+    }
+    
+    JsonToken token = get_json_token(&cursor->parser);
+    
+    if (iteration->count) {
+        if (token.type == Token_comma) {
+            token = get_json_token(&cursor->parser);
+        } else if (token.type != iteration->endType) {
+            parser_error(&cursor->parser, token, "Unexpected token in JSON");
+        }
+    }
+    
+    if ((token.type == iteration->endType) || cursor->parser.hadError) {
+        iteration->done = true;
+        --cursor->depth;
+        return false;
+    }
+    
+    if (iteration->isObject) {
+        if (token.type != Token_string_literal) {
+            parser_error(&cursor->parser, token, "Expected field name");
+            iteration->done = true;
+            return false;
+        }
+        
+        if (label) {
+            *label = token.value;
+            *labelHash = token.hash;
+        }
+        
+        JsonToken colon = get_json_token(&cursor->parser);
+        if (colon.type != Token_colon) {
+            parser_error(&cursor->parser, colon, "Expected colon after field name");
+            iteration->done = true;
+            return false;
+        }
+        
+        token = get_json_token(&cursor->parser);
+    }
+    
+    *value = token;
+    cursor->pendingSkip = (token.type == Token_open_brace) || (token.type == Token_open_bracket);
+    ++iteration->count;
+    
+    return true;
+}
+
+// Looks for a field of the object being iterated, starting after the last one returned and
+// wrapping around once, so fields asked for in document order cost a single pass.
+static bool find_json_field(JsonCursor* cursor, JsonIteration* iteration, String elementName, JsonToken* value) {
+    if (!iteration->isObject) {
+        return false;
+    }
+    
+    u32 hash = hash_json_label(elementName);
+    u32 startCount = iteration->count;
+    bool wrapped = false;
+    
+    for (;;) {
+        String label;
+        u32 labelHash;
+        while (next_json_child(cursor, iteration, &label, &labelHash, value)) {
+            if ((labelHash == hash) && are_equal_json_string(label, elementName)) {
+                return true;
+            }
+            
+            if (wrapped && (iteration->count >= startCount)) {
+                return false;
+            }
+        }
+        
+        if (wrapped || !startCount || cursor->parser.hadError) {
+            return false;
+        }
+        
+        // Back to the first field
+        cursor->parser.at = iteration->firstAt;
+        cursor->depth = iteration->depth;
+        cursor->pendingSkip = false;
+        iteration->count = 0;
+        iteration->done = false;
+        wrapped = true;
+    }
+}
+
+static double json_cursor_double(JsonToken value) {
+    double result = (value.type == Token_number) ? convert_json_double(value.value) : 0.0;
+    return result;
+}
+
+static double find_json_double(JsonCursor* cursor, JsonIteration* object, String elementName) {
+    JsonToken value = {};
+    find_json_field(cursor, object, elementName, &value);
+    
+    double result = json_cursor_double(value);
+    return result;
+}
+
+static u64 parse_haversine_pairs_cursor(String inputJson, PairStore* store) {
+    PROFILE_FUNC_DATA(inputJson.count);
+    
+    u64 pairCount = 0;
+    
+    JsonCursor cursor = open_json_cursor(inputJson);
+    JsonIteration root = begin_json_iteration(&cursor, get_json_cursor_root(&cursor));
+    
+    JsonToken pairsArray = {};
+    if (find_json_field(&cursor, &root, CONSTANT_STRING("pairs"), &pairsArray)) {
+        JsonIteration array = begin_json_iteration(&cursor, pairsArray);
+        
+        JsonToken element;
+        while (next_json_child(&cursor, &array, 0, 0, &element)) {
+            HaversinePair* pair = push_pairs(store, 1);
+            if (!pair) {
+                break;
+            }
+            ++pairCount;
+            
+            JsonIteration object = begin_json_iteration(&cursor, element);
+            pair->x0 = find_json_double(&cursor, &object, CONSTANT_STRING("x0"));
+            pair->y0 = find_json_double(&cursor, &object, CONSTANT_STRING("y0"));
+            pair->x1 = find_json_double(&cursor, &object, CONSTANT_STRING("x1"));
+            pair->y1 = find_json_double(&cursor, &object, CONSTANT_STRING("y1"));
+        }
+    }
+    
+    return pairCount;
+}
\ No newline at end of file
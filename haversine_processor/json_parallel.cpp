@@ -0,0 +1,569 @@
+// Parallel parse of one large JSON array into a JsonTape.
+//
+// The bytes after the array's "[" are cut into chunks. A chunk can start anywhere, including in
+// the middle of a string, so there are two passes:
+//   1. Quote pass (SIMD, 64 bytes at a time): per chunk, the parity of unescaped quotes and the
+//      bracket/separator counts outside strings. The string mask of a chunk that starts inside a
+//      string is just the complement of one that starts outside, so both cases are counted at
+//      once. A serial prefix over the chunks then gives each chunk's real in-string state and
+//      nesting depth at its start, and finds the chunk where the depth drops below the array's
+//      own: the "]". Chunks after it hold whatever follows the array and are left out.
+//   2. Element pass: each chunk skips to its first comma at depth 0 and parses the elements that
+//      follow commas inside the chunk (chunk 0 also takes the first element) onto its own tape.
+//      An element belongs to the chunk its comma is in, however far past the chunk it runs.
+// The per-chunk tapes are then concatenated in order, with container indices shifted.
+//
+// NOTE(alex): Workers don't allocate or profile: chunk tapes get fixed slices of one scratch
+// block sized from the quote pass counts. A chunk that still runs out (elements much bigger than
+// a chunk) is parsed again on the calling thread with a tape that can grow.
+
+#define JSON_PARALLEL_MIN_CHUNK_SIZE (64 * 1024)
+#define JSON_PARALLEL_CHUNKS_PER_THREAD 4
+#define JSON_PARALLEL_TAPE_SLACK 1024
+#define JSON_PARALLEL_CONVERT_BLOCK 4096
+
+struct JsonChunk {
+    u64 start;
+    u64 end;
+    
+    // Quote pass, [0] assuming the chunk starts outside a string and [1] inside
+    u32 quoteParity;
+    s64 depthDelta[2];
+    s64 minDepth[2]; // Lowest depth relative to the chunk start, 0 if it never goes below
+    u64 entryBound[2];
+    
+    bool startsInString;
+    s64 startDepth; // Relative to the array, so elements start at 0
+    bool pastArray; // Starts after the array's "]"
+    
+    // Element pass
+    JsonTape tape;
+    u64 elementCount;
+    u64 tapeOffset; // Where its entries go in the concatenated tape
+    bool sawArrayEnd;
+    bool hadError;
+};
+
+struct JsonParallelParse {
+    String source;
+    JsonChunk* chunks;
+    u64* entries; // Concatenated tape
+};
+
+struct JsonBlockMasks {
+    u64 quote;
+    u64 backslash;
+    u64 open;
+    u64 close;
+    u64 separator; // Commas and colons
+};
+
+static JsonBlockMasks get_json_block_masks(u8* data) {
+    JsonBlockMasks result = {};
+    
+    for (u32 i = 0; i < 4; i++) {
+        __m128i bytes = _mm_loadu_si128((__m128i*)(data + 16 * i));
+        u32 shift = 16 * i;
+        
+        u64 quote = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('"')));
+        u64 backslash = (u32)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('\\')));
+        u64 open = (u32)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('{')),
+                                                       _mm_cmpeq_epi8(bytes, _mm_set1_epi8('['))));
+        u64 close = (u32)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8('}')),
+                                                        _mm_cmpeq_epi8(bytes, _mm_set1_epi8(']'))));
+        u64 separator = (u32)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(',')),
+                                                            _mm_cmpeq_epi8(bytes, _mm_set1_epi8(':'))));
+        
+        result.quote |= quote << shift;
+        result.backslash |= backslash << shift;
+        result.open |= open << shift;
+        result.close |= close << shift;
+        result.separator |= separator << shift;
+    }
+    
+    return result;
+}
+
+// Bits of bytes escaped by a backslash: the byte after every odd length run of backslashes.
+// carry is set when the block ends in such a run, so the next block's first byte is escaped.
+static u64 find_escaped_bytes(u64 backslash, u64* carry) {
+    u64 evenBits = 0x5555555555555555ull;
+    
+    backslash &= ~*carry;
+    u64 followsEscape = (backslash << 1) | *carry;
+    
+    // Adding the run starts to the runs carries out of every run, the carry lands one past its end
+    u64 oddStarts = backslash & ~evenBits & ~followsEscape;
+    u64 sequencesStartingOnEvenBits = oddStarts + backslash;
+    *carry = (sequencesStartingOnEvenBits < oddStarts);
+    
+    u64 invertMask = sequencesStartingOnEvenBits << 1;
+    u64 result = (evenBits ^ invertMask) & followsEscape;
+    return result;
+}
+
+// Bit i is the xor of bits 0..i: set from an opening quote up to (not including) its close.
+static u64 prefix_xor(u64 bits) {
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+// Whether the byte at "at" is escaped, from the backslashes right before it
+static u64 get_json_escape_carry(String source, u64 at) {
+    u64 backslashCount = 0;
+    while (at && (source.data[at - 1] == '\\')) {
+        ++backslashCount;
+        --at;
+    }
+    
+    u64 result = backslashCount & 1;
+    return result;
+}
+
+static void json_quote_pass(void* context, u64 taskIndex, u32 threadIndex) {
+    (void)threadIndex;
+    JsonParallelParse* parse = (JsonParallelParse*)context;
+    JsonChunk* chunk = parse->chunks + taskIndex;
+    String source = parse->source;
+    
+    u64 escapeCarry = get_json_escape_carry(source, chunk->start);
+    u64 inString = 0;
+    u64 quoteCount = 0;
+    u64 opens[2] = {};
+    u64 closes[2] = {};
+    u64 separators[2] = {};
+    s64 depth[2] = {};
+    s64 minDepth[2] = {};
+    
+    for (u64 at = chunk->start; at < chunk->end; at += 64) {
+        u8 padded[64];
+        u8* block = source.data + at;
+        
+        if ((chunk->end - at) < 64) {
+            memset(padded, ' ', sizeof(padded));
+            memcpy(padded, block, chunk->end - at);
+            block = padded;
+        }
+        
+        JsonBlockMasks masks = get_json_block_masks(block);
+        
+        u64 quotes = masks.quote & ~find_escaped_bytes(masks.backslash, &escapeCarry);
+        u64 stringMask = prefix_xor(quotes) ^ inString;
+        inString = (u64)((s64)stringMask >> 63);
+        quoteCount += count_set_bits(quotes);
+        
+        opens[0] += count_set_bits(masks.open & ~stringMask);
+        opens[1] += count_set_bits(masks.open & stringMask);
+        closes[0] += count_set_bits(masks.close & ~stringMask);
+        closes[1] += count_set_bits(masks.close & stringMask);
+        separators[0] += count_set_bits(masks.separator & ~stringMask);
+        separators[1] += count_set_bits(masks.separator & stringMask);
+        
+        // NOTE(alex): Only blocks with a close can lower the minimum, walk their brackets in order.
+        for (u32 i = 0; i < 2; i++) {
+            u64 outside = i ? stringMask : ~stringMask;
+            u64 closeBits = masks.close & outside;
+            
+            if (closeBits) {
+                u64 brackets = (masks.open | masks.close) & outside;
+                while (brackets) {
+                    u64 bit = brackets & (0 - brackets);
+                    depth[i] += (closeBits & bit) ? -1 : 1;
+                    if (depth[i] < minDepth[i]) {
+                        minDepth[i] = depth[i];
+                    }
+                    brackets ^= bit;
+                }
+            } else {
+                depth[i] += count_set_bits(masks.open & outside);
+            }
+        }
+    }
+    
+    chunk->quoteParity = (u32)(quoteCount & 1);
+    for (u32 i = 0; i < 2; i++) {
+        chunk->depthDelta[i] = (s64)opens[i] - (s64)closes[i];
+        chunk->minDepth[i] = minDepth[i];
+        
+        // Every value and label follows an open or a separator, values take two entries and
+        // containers one more for the close
+        chunk->entryBound[i] = 2 * (opens[i] + separators[i] + 1) + opens[i];
+    }
+}
+
+// Start of the first element the chunk owns, or U64Max if it has none.
+static u64 find_owned_json_element(String source, JsonChunk* chunk, u64 taskIndex) {
+    if (taskIndex == 0) {
+        return chunk->start;
+    }
+    
+    bool inString = chunk->startsInString;
+    bool escaped = get_json_escape_carry(source, chunk->start);
+    s64 depth = chunk->startDepth;
+    
+    for (u64 at = chunk->start; at < chunk->end; at++) {
+        u8 val = source.data[at];
+        
+        if (inString) {
+            if (escaped) {
+                escaped = false;
+            } else if (val == '\\') {
+                escaped = true;
+            } else if (val == '"') {
+                inString = false;
+            }
+        } else if (val == '"') {
+            inString = true;
+        } else if ((val == '{') || (val == '[')) {
+            ++depth;
+        } else if ((val == '}') || (val == ']')) {
+            if (--depth < 0) {
+                break;
+            }
+        } else if ((val == ',') && (depth == 0)) {
+            return at + 1;
+        }
+    }
+    
+    return U64Max;
+}
+
+static void json_element_pass(void* context, u64 taskIndex, u32 threadIndex) {
+    (void)threadIndex;
+    JsonParallelParse* parse = (JsonParallelParse*)context;
+    JsonChunk* chunk = parse->chunks + taskIndex;
+    
+    if ((chunk->startDepth < 0) || chunk->pastArray) {
+        return;
+    }
+    
+    u64 elementStart = find_owned_json_element(parse->source, chunk, taskIndex);
+    if (elementStart == U64Max) {
+        return;
+    }
+    
+    JsonParser parser = {};
+    parser.source = parse->source;
+    parser.at = elementStart;
+    
+    JsonToken token = get_json_token(&parser);
+    if ((taskIndex == 0) && (token.type == Token_close_bracket)) {
+        chunk->sawArrayEnd = true;
+        return;
+    }
+    
+    for (;;) {
+        if (!append_json_tape_value(&chunk->tape, &parser, token)) {
+            chunk->hadError = !chunk->tape.overflowed;
+            break;
+        }
+        ++chunk->elementCount;
+        
+        token = get_json_token(&parser);
+        if (token.type == Token_close_bracket) {
+            chunk->sawArrayEnd = true;
+            break;
+        } else if (token.type != Token_comma) {
+            parser_error(&parser, token, "Unexpected token in JSON array");
+            chunk->hadError = true;
+            break;
+        }
+        
+        if ((u64)(token.value.data - parse->source.data) >= chunk->end) {
+            break;
+        }
+        
+        token = get_json_token(&parser);
+    }
+}
+
+static void json_concatenate_pass(void* context, u64 taskIndex, u32 threadIndex) {
+    (void)threadIndex;
+    JsonParallelParse* parse = (JsonParallelParse*)context;
+    JsonChunk* chunk = parse->chunks + taskIndex;
+    
+    u64* source = chunk->tape.entries;
+    u64* dest = parse->entries + chunk->tapeOffset;
+    u64 offset = chunk->tapeOffset;
+    
+    // Closes are one entry, everything else has a second word (counts, lengths, label hashes)
+    // that's copied as is
+    for (u64 i = 0; i < chunk->tape.count;) {
+        u64 entry = source[i];
+        JsonTapeType type = (JsonTapeType)(entry >> JSON_TAPE_TYPE_SHIFT);
+        
+        if ((type >= JsonTape_OpenObject) && (type <= JsonTape_CloseArray)) {
+            entry += offset;
+        }
+        
+        dest[i] = entry;
+        
+        if ((type == JsonTape_CloseObject) || (type == JsonTape_CloseArray)) {
+            i += 1;
+        } else {
+            dest[i + 1] = source[i + 1];
+            i += 2;
+        }
+    }
+}
+
+// Parses the array whose "[" is at arrayOpen in inputJson into a tape holding just that array
+// (offsets still into inputJson). On error the tape comes back empty.
+static JsonTape parse_json_array_parallel(u32 threadCount, String inputJson, u64 arrayOpen) {
+    PROFILE_FUNC_DATA(inputJson.count - arrayOpen);
+    
+    JsonTape result = {};
+    result.source = inputJson;
+    
+    if ((arrayOpen >= inputJson.count) || (inputJson.data[arrayOpen] != '[')) {
+        fprintf(stderr, "ERROR: No JSON array at byte %llu\n", arrayOpen);
+        return result;
+    }
+    
+    threadCount = clamp_thread_count(threadCount);
+    
+    u64 regionStart = arrayOpen + 1;
+    u64 regionSize = inputJson.count - regionStart;
+    
+    u64 chunkCount = (u64)threadCount * JSON_PARALLEL_CHUNKS_PER_THREAD;
+    if (chunkCount > (regionSize / JSON_PARALLEL_MIN_CHUNK_SIZE)) {
+        chunkCount = regionSize / JSON_PARALLEL_MIN_CHUNK_SIZE;
+    }
+    if (!chunkCount) {
+        chunkCount = 1;
+    }
+    
+    u64 chunkSize = (((regionSize + chunkCount - 1) / chunkCount) + 63) & ~63ull;
+    
+    String chunkMemory = allocate_string(chunkCount * sizeof(JsonChunk));
+    if (!chunkMemory.data) {
+        return result;
+    }
+    
+    JsonParallelParse parse = {};
+    parse.source = inputJson;
+    parse.chunks = (JsonChunk*)chunkMemory.data;
+    memset(parse.chunks, 0, chunkMemory.count);
+    
+    for (u64 i = 0; i < chunkCount; i++) {
+        JsonChunk* chunk = parse.chunks + i;
+        chunk->start = regionStart + i * chunkSize;
+        chunk->end = chunk->start + chunkSize;
+        
+        if (chunk->start > inputJson.count) {
+            chunk->start = inputJson.count;
+        }
+        if (chunk->end > inputJson.count) {
+            chunk->end = inputJson.count;
+        }
+    }
+    
+    {
+        PROFILE_SCOPE_DATA("Quote pass", regionSize);
+        run_parallel_data(threadCount, chunkCount, json_quote_pass, &parse, "Quote pass", regionSize);
+    }
+    
+    // Real string state and depth at each chunk start, and tape slices sized for what they hold
+    u64 scratchCount = 0;
+    {
+        bool inString = false;
+        bool pastArray = false;
+        s64 depth = 0;
+        for (u64 i = 0; i < chunkCount; i++) {
+            JsonChunk* chunk = parse.chunks + i;
+            chunk->startsInString = inString;
+            chunk->startDepth = depth;
+            chunk->pastArray = pastArray;
+            
+            pastArray = pastArray || ((depth + chunk->minDepth[inString]) < 0);
+            depth += chunk->depthDelta[inString];
+            inString ^= (chunk->quoteParity != 0);
+            
+            if ((chunk->startDepth >= 0) && !chunk->pastArray) {
+                chunk->tape.capacity = chunk->entryBound[chunk->startsInString] + JSON_PARALLEL_TAPE_SLACK;
+                scratchCount += chunk->tape.capacity;
+            }
+        }
+    }
+    
+    String scratch = allocate_string(scratchCount * sizeof(u64));
+    
+    bool valid = (scratch.data != 0);
+    if (valid) {
+        u64* entries = (u64*)scratch.data;
+        for (u64 i = 0; i < chunkCount; i++) {
+            JsonChunk* chunk = parse.chunks + i;
+            chunk->tape.source = inputJson;
+            chunk->tape.entries = entries;
+            chunk->tape.fixedCapacity = true;
+            entries += chunk->tape.capacity;
+        }
+        
+        {
+            PROFILE_SCOPE_DATA("Element pass", regionSize);
+            run_parallel_data(threadCount, chunkCount, json_element_pass, &parse, "Element pass", regionSize);
+        }
+        
+        u64 arrayEndCount = 0;
+        u64 elementCount = 0;
+        u64 entryCount = 2;
+        
+        for (u64 i = 0; i < chunkCount; i++) {
+            JsonChunk* chunk = parse.chunks + i;
+            
+            if (chunk->tape.overflowed) {
+                PROFILE_SCOPE("Element pass retry");
+                
+                u64 capacity = 2 * chunk->tape.capacity;
+                chunk->tape = {};
+                chunk->tape.source = inputJson;
+                chunk->elementCount = 0;
+                chunk->sawArrayEnd = false;
+                
+                if (reserve_tape(&chunk->tape, capacity)) {
+                    json_element_pass(&parse, i, 0);
+                } else {
+                    chunk->hadError = true;
+                }
+            }
+            
+            valid = valid && !chunk->hadError;
+            arrayEndCount += chunk->sawArrayEnd;
+            elementCount += chunk->elementCount;
+            
+            chunk->tapeOffset = entryCount;
+            entryCount += chunk->tape.count;
+        }
+        
+        if (valid && (arrayEndCount != 1)) {
+            fprintf(stderr, "ERROR: JSON array at byte %llu isn't closed\n", arrayOpen);
+            valid = false;
+        }
+        
+        if (valid && reserve_tape(&result, entryCount + 1)) {
+            parse.entries = result.entries;
+            
+            {
+                PROFILE_SCOPE_DATA("Tape concatenation", (entryCount + 1) * sizeof(u64));
+                run_parallel(threadCount, chunkCount, json_concatenate_pass, &parse);
+            }
+            
+            result.count = 0;
+            push_tape_entry(&result, JsonTape_OpenArray, entryCount);
+            result.entries[result.count++] = elementCount;
+            result.count = entryCount;
+            push_tape_entry(&result, JsonTape_CloseArray, 0);
+        }
+        
+        // Tapes that had to grow own their memory, the rest live in scratch
+        for (u64 i = 0; i < chunkCount; i++) {
+            free_json_tape(&parse.chunks[i].tape);
+        }
+    }
+    
+    free_string(&scratch);
+    free_string(&chunkMemory);
+    
+    if (!valid) {
+        free_json_tape(&result);
+    }
+    
+    return result;
+}
+
+struct PairConvertContext {
+    JsonTape* tape;
+    u64 arrayEnd;
+    u64* blockStarts;
+    u64 pairCount;
+    HaversinePair* pairs;
+};
+
+static void convert_pair_block(void* context, u64 taskIndex, u32 threadIndex) {
+    (void)threadIndex;
+    PairConvertContext* convert = (PairConvertContext*)context;
+    JsonTape* tape = convert->tape;
+    
+    u64 first = taskIndex * JSON_PARALLEL_CONVERT_BLOCK;
+    u64 last = first + JSON_PARALLEL_CONVERT_BLOCK;
+    if (last > convert->pairCount) {
+        last = convert->pairCount;
+    }
+    
+    JsonTapeIterator iterator = {};
+    iterator.at = convert->blockStarts[taskIndex];
+    iterator.end = convert->arrayEnd;
+    
+    for (u64 i = first; (i < last) && next_tape_child(tape, &iterator); i++) {
+        HaversinePair* pair = convert->pairs + i;
+        pair->x0 = convert_tape_element_to_double(tape, iterator.value, CONSTANT_STRING("x0"));
+        pair->y0 = convert_tape_element_to_double(tape, iterator.value, CONSTANT_STRING("y0"));
+        pair->x1 = convert_tape_element_to_double(tape, iterator.value, CONSTANT_STRING("x1"));
+        pair->y1 = convert_tape_element_to_double(tape, iterator.value, CONSTANT_STRING("y1"));
+    }
+}
+
+static u64 parse_haversine_pairs_parallel(u32 threadCount, String inputJson, PairStore* store) {
+    PROFILE_FUNC();
+    
+    u64 pairCount = 0;
+    
+    // Only the way to the pairs array is walked serially
+    JsonCursor cursor = open_json_cursor(inputJson);
+    JsonIteration root = begin_json_iteration(&cursor, get_json_cursor_root(&cursor));
+    
+    JsonToken pairsArray = {};
+    if (!find_json_field(&cursor, &root, CONSTANT_STRING("pairs"), &pairsArray) ||
+        (pairsArray.type != Token_open_bracket)) {
+        return pairCount;
+    }
+    
+    JsonTape tape = parse_json_array_parallel(threadCount, inputJson, pairsArray.value.data - inputJson.data);
+    
+    if (tape.count) {
+        pairCount = get_tape_child_count(&tape, 0);
+        if (pairCount > get_pair_store_room(store)) {
+            pairCount = get_pair_store_room(store);
+        }
+        
+        u64 blockCount = (pairCount + JSON_PARALLEL_CONVERT_BLOCK - 1) / JSON_PARALLEL_CONVERT_BLOCK;
+        String blockMemory = allocate_string((blockCount + 1) * sizeof(u64));
+        HaversinePair* pairs = blockMemory.data ? push_pairs(store, pairCount) : 0;
+        
+        if (blockMemory.data && pairs) {
+            PROFILE_SCOPE("Lookup and Convert");
+            
+            PairConvertContext convert = {};
+            convert.tape = &tape;
+            convert.arrayEnd = get_tape_payload(&tape, 0);
+            convert.blockStarts = (u64*)blockMemory.data;
+            convert.pairCount = pairCount;
+            convert.pairs = pairs;
+            
+            // One load per pair to find where each block starts
+            JsonTapeIterator iterator = iterate_tape(&tape, 0);
+            for (u64 i = 0; i < pairCount; i++) {
+                if ((i % JSON_PARALLEL_CONVERT_BLOCK) == 0) {
+                    convert.blockStarts[i / JSON_PARALLEL_CONVERT_BLOCK] = iterator.at;
+                }
+                next_tape_child(&tape, &iterator);
+            }
+            
+            run_parallel_data(threadCount, blockCount, convert_pair_block, &convert, "Convert pairs",
+                              pairCount * sizeof(HaversinePair));
+        } else {
+            pairCount = 0;
+        }
+        
+        free_string(&blockMemory);
+    }
+    
+    free_json_tape(&tape);
+    
+    return pairCount;
+}
\ No newline at end of file
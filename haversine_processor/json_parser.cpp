@@ -1,3 +1,5 @@
+#include <emmintrin.h> // SSE2
+
 enum JsonTokenType {
     Token_end_of_stream,
     Token_error,
@@ -18,24 +20,350 @@ enum JsonTokenType {
     Token_count,
 };
 
+// Objects and arrays with more children than this get a JsonIndex the first time they're
+// searched, smaller ones are just scanned.
+#define JSON_INDEX_MIN_CHILDREN 8
+
+// Strings with escapes are decoded into blocks of at least this many bytes
+#define JSON_ARENA_BLOCK_SIZE (64 * 1024)
+
 struct JsonToken {
     JsonTokenType type;
     String value;
+    u32 hash; // hash_json_label of string literals (of the decoded text if there are escapes)
+    bool hasEscapes; // value is the raw text between the quotes, see decode_json_string
+};
+
+struct JsonArena {
+    JsonArena* previous;
+    u64 used;
+    u64 size;
+    // size bytes follow
 };
 
+struct JsonIndex;
+
 struct JsonElement {
     String label;
     String value;
+    JsonTokenType type; // Token the value started with, Token_open_brace/bracket for containers
     JsonElement* firstSubElement;
     JsonElement* nextSibling;
+    
+    u32 labelHash;
+    u32 childCount;
+    JsonIndex* index; // Built lazily, see JSON_INDEX_MIN_CHILDREN
+    JsonArena* arena; // Root only: decoded strings of the whole document
+};
+
+struct JsonIndex {
+    u32 slotMask;  // Objects: open addressing table on labelHash. Arrays: unused, slots are in order.
+    JsonElement* slots[1];
 };
 
 struct JsonParser {
     String source;
     u64 at;
     bool hadError;
+    
+    JsonArena* arena; // Only parse_json_element decodes into it, the tape and cursor keep raw views
 };
 
+// FNV-1a
+#define JSON_HASH_SEED 0x811C9DC5u
+#define JSON_HASH_PRIME 0x01000193u
+
+static u32 hash_json_label(String label) {
+    u32 result = JSON_HASH_SEED;
+    for (u64 i = 0; i < label.count; i++) {
+        result = (result ^ label.data[i]) * JSON_HASH_PRIME;
+    }
+    
+    return result;
+}
+
+static u64 count_set_bits(u64 value) {
+#if _WIN32
+    u64 result = __popcnt64(value);
+#else
+    u64 result = __builtin_popcountll(value);
+#endif
+    return result;
+}
+
+static u32 count_trailing_zeros(u32 value) {
+#if _WIN32
+    unsigned long result;
+    _BitScanForward(&result, value);
+    return (u32)result;
+#else
+    u32 result = __builtin_ctz(value);
+    return result;
+#endif
+}
+
+static s32 get_json_hex4(String source, u64 at) {
+    s32 result = 0;
+    
+    if ((at + 4) > source.count) {
+        return -1;
+    }
+    
+    for (u32 i = 0; i < 4; i++) {
+        u8 val = source.data[at + i];
+        s32 digit;
+        if ((val >= '0') && (val <= '9')) {
+            digit = val - '0';
+        } else if ((val >= 'a') && (val <= 'f')) {
+            digit = val - 'a' + 10;
+        } else if ((val >= 'A') && (val <= 'F')) {
+            digit = val - 'A' + 10;
+        } else {
+            return -1;
+        }
+        
+        result = (result << 4) | digit;
+    }
+    
+    return result;
+}
+
+// Bytes taken by the escape at source.data[at] (a backslash): 2, 6 for \uXXXX or 12 for a
+// surrogate pair. 0 if it isn't valid JSON.
+static u32 get_json_escape_length(String source, u64 at) {
+    u32 result = 0;
+    
+    if (is_in_bound(source, at + 1)) {
+        switch (source.data[at + 1]) {
+            case '"':
+            case '\\':
+            case '/':
+            case 'b':
+            case 'f':
+            case 'n':
+            case 'r':
+            case 't': {
+                result = 2;
+            } break;
+            
+            case 'u': {
+                s32 code = get_json_hex4(source, at + 2);
+                if ((code >= 0xD800) && (code <= 0xDBFF)) {
+                    // A high surrogate has to be followed by a low one
+                    bool hasLow = ((at + 12) <= source.count) &&
+                                  (source.data[at + 6] == '\\') && (source.data[at + 7] == 'u');
+                    s32 low = hasLow ? get_json_hex4(source, at + 8) : -1;
+                    result = ((low >= 0xDC00) && (low <= 0xDFFF)) ? 12 : 0;
+                } else if ((code >= 0) && ((code < 0xDC00) || (code > 0xDFFF))) {
+                    result = 6;
+                }
+            } break;
+            
+            default: {
+            } break;
+        }
+    }
+    
+    return result;
+}
+
+// Bytes taken by the UTF-8 sequence starting with the non-ASCII byte at source.data[at], 0 if it
+// isn't well formed (overlong, surrogate, past U+10FFFF or cut short).
+static u32 get_utf8_sequence_length(String source, u64 at) {
+    u8 lead = source.data[at];
+    
+    u32 length = 0;
+    u8 secondMin = 0x80;
+    u8 secondMax = 0xBF;
+    
+    if ((lead >= 0xC2) && (lead <= 0xDF)) {
+        length = 2;
+    } else if ((lead >= 0xE0) && (lead <= 0xEF)) {
+        length = 3;
+        secondMin = (lead == 0xE0) ? 0xA0 : 0x80;
+        secondMax = (lead == 0xED) ? 0x9F : 0xBF;
+    } else if ((lead >= 0xF0) && (lead <= 0xF4)) {
+        length = 4;
+        secondMin = (lead == 0xF0) ? 0x90 : 0x80;
+        secondMax = (lead == 0xF4) ? 0x8F : 0xBF;
+    }
+    
+    if (!length || ((at + length) > source.count)) {
+        return 0;
+    }
+    
+    u8 second = source.data[at + 1];
+    if ((second < secondMin) || (second > secondMax)) {
+        return 0;
+    }
+    
+    for (u32 i = 2; i < length; i++) {
+        if ((source.data[at + i] & 0xC0) != 0x80) {
+            return 0;
+        }
+    }
+    
+    return length;
+}
+
+// Decodes the character at raw.data[*at] of a string the tokenizer already validated into out
+// (up to 4 bytes) and returns how many bytes it wrote.
+static u32 decode_json_char(String raw, u64* at, u8* out) {
+    u8 val = raw.data[*at];
+    
+    if (val != '\\') {
+        out[0] = val;
+        ++*at;
+        return 1;
+    }
+    
+    u8 escape = raw.data[*at + 1];
+    *at += 2;
+    
+    switch (escape) {
+        case 'b': { out[0] = '\b'; } break;
+        case 'f': { out[0] = '\f'; } break;
+        case 'n': { out[0] = '\n'; } break;
+        case 'r': { out[0] = '\r'; } break;
+        case 't': { out[0] = '\t'; } break;
+        
+        case 'u': {
+            u32 code = (u32)get_json_hex4(raw, *at);
+            *at += 4;
+            
+            if ((code >= 0xD800) && (code <= 0xDBFF)) {
+                u32 low = (u32)get_json_hex4(raw, *at + 2);
+                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                *at += 6;
+            }
+            
+            if (code < 0x80) {
+                out[0] = (u8)code;
+                return 1;
+            } else if (code < 0x800) {
+                out[0] = (u8)(0xC0 | (code >> 6));
+                out[1] = (u8)(0x80 | (code & 0x3F));
+                return 2;
+            } else if (code < 0x10000) {
+                out[0] = (u8)(0xE0 | (code >> 12));
+                out[1] = (u8)(0x80 | ((code >> 6) & 0x3F));
+                out[2] = (u8)(0x80 | (code & 0x3F));
+                return 3;
+            } else {
+                out[0] = (u8)(0xF0 | (code >> 18));
+                out[1] = (u8)(0x80 | ((code >> 12) & 0x3F));
+                out[2] = (u8)(0x80 | ((code >> 6) & 0x3F));
+                out[3] = (u8)(0x80 | (code & 0x3F));
+                return 4;
+            }
+        } break;
+        
+        default: { out[0] = escape; } break; // '"', '\\' and '/'
+    }
+    
+    return 1;
+}
+
+// Writes the decoded text of raw to dest, which needs raw.count bytes (escapes only shrink).
+static u64 decode_json_string(String raw, u8* dest) {
+    u64 result = 0;
+    
+    u64 at = 0;
+    while (at < raw.count) {
+        result += decode_json_char(raw, &at, dest + result);
+    }
+    
+    return result;
+}
+
+static u32 hash_json_string(String raw) {
+    u32 result = JSON_HASH_SEED;
+    
+    u64 at = 0;
+    while (at < raw.count) {
+        u8 decoded[4];
+        u32 count = decode_json_char(raw, &at, decoded);
+        for (u32 i = 0; i < count; i++) {
+            result = (result ^ decoded[i]) * JSON_HASH_PRIME;
+        }
+    }
+    
+    return result;
+}
+
+// Compares the raw (possibly escaped) text of a string with already decoded text, without
+// decoding it anywhere.
+static bool are_equal_json_string(String raw, String decoded) {
+    if (!memchr(raw.data, '\\', raw.count)) {
+        return are_equal(raw, decoded);
+    }
+    
+    u64 at = 0;
+    u64 decodedAt = 0;
+    
+    while (at < raw.count) {
+        u8 buffer[4];
+        u32 count = decode_json_char(raw, &at, buffer);
+        if (((decodedAt + count) > decoded.count) || memcmp(buffer, decoded.data + decodedAt, count)) {
+            return false;
+        }
+        decodedAt += count;
+    }
+    
+    bool result = (decodedAt == decoded.count);
+    return result;
+}
+
+static String push_json_arena(JsonArena** arena, u64 count) {
+    String result = {};
+    
+    if (!*arena || (((*arena)->used + count) > (*arena)->size)) {
+        u64 size = (count > JSON_ARENA_BLOCK_SIZE) ? count : JSON_ARENA_BLOCK_SIZE;
+        
+        JsonArena* block = (JsonArena*)malloc(sizeof(JsonArena) + size);
+        if (!block) {
+            return result;
+        }
+        PROFILE_ALLOCATION(sizeof(JsonArena) + size);
+        
+        block->previous = *arena;
+        block->used = 0;
+        block->size = size;
+        *arena = block;
+    }
+    
+    result.count = count;
+    result.data = (u8*)(*arena + 1) + (*arena)->used;
+    (*arena)->used += count;
+    
+    return result;
+}
+
+static void free_json_arena(JsonArena* arena) {
+    while (arena) {
+        JsonArena* previous = arena->previous;
+        PROFILE_FREE(sizeof(JsonArena) + arena->size);
+        free(arena);
+        arena = previous;
+    }
+}
+
+// The token's text, decoded into the parser's arena if it has escapes
+static String get_json_token_text(JsonParser* parser, JsonToken token) {
+    String result = token.value;
+    
+    if (token.hasEscapes) {
+        result = push_json_arena(&parser->arena, token.value.count);
+        if (result.data) {
+            result.count = decode_json_string(token.value, result.data);
+        } else {
+            parser->hadError = true;
+        }
+    }
+    
+    return result;
+}
+
 static bool is_json_digit(String source, u64 at) {
     bool result = false;
     
@@ -123,19 +451,67 @@ static JsonToken get_json_token(JsonParser* parser) {
                 result.type = Token_string_literal;
                 
                 u64 stringStart = at;
+                bool valid = true;
                 
-                while (is_in_bound(source, at) && (source.data[at] != '"')) {
-                    if (is_in_bound(source, (at + 1)) && (source.data[at] == '\\') && (source.data[at + 1] == '"')) {
-                        // Skip escaped quotation marks.
-                        ++at;
+                for (;;) {
+                    // 32 bytes at a time while it's plain ASCII with no quotes or backslashes.
+                    // Signed compare, so control characters and bytes >= 0x80 both stop it.
+                    while ((at + 32) <= source.count) {
+                        __m128i low = _mm_loadu_si128((__m128i*)(source.data + at));
+                        __m128i high = _mm_loadu_si128((__m128i*)(source.data + at + 16));
+                        
+                        __m128i lowSpecial = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(low, _mm_set1_epi8('"')),
+                                                                       _mm_cmpeq_epi8(low, _mm_set1_epi8('\\'))),
+                                                          _mm_cmplt_epi8(low, _mm_set1_epi8(0x20)));
+                        __m128i highSpecial = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(high, _mm_set1_epi8('"')),
+                                                                        _mm_cmpeq_epi8(high, _mm_set1_epi8('\\'))),
+                                                           _mm_cmplt_epi8(high, _mm_set1_epi8(0x20)));
+                        
+                        u32 special = (u32)_mm_movemask_epi8(lowSpecial) | ((u32)_mm_movemask_epi8(highSpecial) << 16);
+                        if (special) {
+                            at += count_trailing_zeros(special);
+                            break;
+                        }
+                        
+                        at += 32;
                     }
                     
-                    ++at;
+                    if (!is_in_bound(source, at)) {
+                        break;
+                    }
+                    
+                    u8 character = source.data[at];
+                    if (character == '"') {
+                        break;
+                    } else if (character == '\\') {
+                        u32 length = get_json_escape_length(source, at);
+                        valid = valid && length;
+                        result.hasEscapes = true;
+                        at += length ? length : 1;
+                    } else if (character >= 0x80) {
+                        u32 length = get_utf8_sequence_length(source, at);
+                        valid = valid && length;
+                        at += length ? length : 1;
+                    } else if (character < 0x20) {
+                        valid = false;
+                        ++at;
+                    } else {
+                        ++at;
+                    }
                 }
                 
                 result.value.data = source.data + stringStart;
                 result.value.count = at - stringStart;
                 
+                if (!valid) {
+                    result.type = Token_error;
+                    parser_error(parser, result, "Invalid escape or UTF-8 in string");
+                } else if (result.hasEscapes) {
+                    result.hash = hash_json_string(result.value);
+                } else {
+                    result.hash = hash_json_label(result.value);
+                }
+                
                 // Skip trailing quotation marks
                 if (is_in_bound(source, at)) {
                     ++at;
@@ -203,18 +579,19 @@ static JsonToken get_json_token(JsonParser* parser) {
     return result;
 }
 
-static JsonElement* parse_json_list(JsonParser* parser, JsonTokenType endType, bool hasLabels);
-static JsonElement* parse_json_element(JsonParser* parser, String label, JsonToken value) {
+static JsonElement* parse_json_list(JsonParser* parser, JsonTokenType endType, bool hasLabels, u32* childCount);
+static JsonElement* parse_json_element(JsonParser* parser, String label, u32 labelHash, JsonToken value) {
     PROFILE_FUNC();
     
     bool valid = true;
     
     JsonElement* subElement = 0;
+    u32 childCount = 0;
     
     if (value.type == Token_open_bracket) {
-        subElement = parse_json_list(parser, Token_close_bracket, false);
+        subElement = parse_json_list(parser, Token_close_bracket, false, &childCount);
     } else if (value.type == Token_open_brace) {
-        subElement = parse_json_list(parser, Token_close_brace, true);
+        subElement = parse_json_list(parser, Token_close_brace, true, &childCount);
     } else if((value.type == Token_string_literal) ||
               (value.type == Token_true) ||
               (value.type == Token_false) ||
@@ -229,26 +606,34 @@ static JsonElement* parse_json_element(JsonParser* parser, String label, JsonTok
     
     if (valid) {
         result = (JsonElement*)malloc(sizeof(JsonElement));
+        PROFILE_ALLOCATION(sizeof(JsonElement));
         result->label = label;
-        result->value = value.value;
+        result->value = (value.type == Token_string_literal) ? get_json_token_text(parser, value) : value.value;
+        result->type = value.type;
         result->firstSubElement = subElement;
         result->nextSibling = 0;
+        result->labelHash = labelHash;
+        result->childCount = childCount;
+        result->index = 0;
+        result->arena = 0;
     }
     
     return result;
 }
 
-static JsonElement* parse_json_list(JsonParser* parser, JsonTokenType endType, bool hasLabels) {
+static JsonElement* parse_json_list(JsonParser* parser, JsonTokenType endType, bool hasLabels, u32* childCount) {
     JsonElement* firstElement = {};
     JsonElement* lastElement = {};
     
     while (is_parsing(parser)) {
         String label = {};
+        u32 labelHash = 0;
         JsonToken value = get_json_token(parser);
         
         if (hasLabels) {
             if (value.type == Token_string_literal) {
-                label = value.value;
+                label = get_json_token_text(parser, value);
+                labelHash = value.hash;
                 
                 JsonToken colon = get_json_token(parser);
                 if (colon.type == Token_colon) {
@@ -261,9 +646,10 @@ static JsonElement* parse_json_list(JsonParser* parser, JsonTokenType endType, b
             }
         }
         
-        JsonElement* element = parse_json_element(parser, label, value);
+        JsonElement* element = parse_json_element(parser, label, labelHash, value);
         if (element) {
             lastElement = (lastElement ? lastElement->nextSibling : firstElement) = element;
+            ++*childCount;
         } else if (value.type == endType) {
             break;
         } else {
@@ -281,35 +667,151 @@ static JsonElement* parse_json_list(JsonParser* parser, JsonTokenType endType, b
     return firstElement;
 }
 
+// Hands the strings decoded while parsing over to root, which free_json releases them with.
+static void attach_json_arena(JsonParser* parser, JsonElement* root) {
+    if (root) {
+        root->arena = parser->arena;
+    } else {
+        free_json_arena(parser->arena);
+    }
+    
+    parser->arena = 0;
+}
+
 static JsonElement* parse_json(String inputJson) {
     PROFILE_FUNC();
     
     JsonParser parser = {};
     parser.source = inputJson;
     
-    JsonElement* result = parse_json_element(&parser, {}, get_json_token(&parser));
+    JsonElement* result = parse_json_element(&parser, {}, 0, get_json_token(&parser));
+    attach_json_arena(&parser, result);
+    
+    return result;
+}
+
+// From the element's type, not its text: a decoded string can start with '{' or '[' too.
+static bool is_json_object(JsonElement* element) {
+    bool result = (element->type == Token_open_brace);
+    return result;
+}
+
+static bool is_json_array(JsonElement* element) {
+    bool result = (element->type == Token_open_bracket);
+    return result;
+}
+
+static u32 json_index_slot_count(JsonElement* container) {
+    // Objects get a power of two table at most half full, arrays one slot per element
+    u32 result = container->childCount;
+    if (is_json_object(container)) {
+        result = 16;
+        while (result < (2 * container->childCount)) {
+            result *= 2;
+        }
+    }
     
     return result;
 }
 
+static u64 json_index_size(JsonElement* container) {
+    u64 result = sizeof(JsonIndex) + (json_index_slot_count(container) - 1) * sizeof(JsonElement*);
+    return result;
+}
+
 static void free_json(JsonElement* element) {
     while (element) {
         JsonElement* freeElement = element;
         element = element->nextSibling;
         
         free_json(freeElement->firstSubElement);
+        
+        free_json_arena(freeElement->arena);
+        
+        if (freeElement->index) {
+            PROFILE_FREE(json_index_size(freeElement));
+            free(freeElement->index);
+        }
+        
         free(freeElement);
+        PROFILE_FREE(sizeof(JsonElement));
     }
 }
 
-static JsonElement* lookup_element(JsonElement* object, String elementName) {
+// Like parse_json, but 0 whenever the parser hit an error, instead of the part it got through.
+static JsonElement* parse_json_strict(String inputJson) {
+    JsonParser parser = {};
+    parser.source = inputJson;
+    
+    JsonElement* result = parse_json_element(&parser, {}, 0, get_json_token(&parser));
+    if (parser.hadError) {
+        free_json(result);
+        result = 0;
+    }
+    attach_json_arena(&parser, result);
+    
+    return result;
+}
+
+// NOTE(alex): Built on first use, a document that's only walked front to back never pays for it.
+// With duplicate labels the first one wins, same as the linear scan.
+static JsonIndex* get_json_index(JsonElement* container) {
+    if (!container->index && (container->childCount > JSON_INDEX_MIN_CHILDREN)) {
+        bool isObject = is_json_object(container);
+        u32 slotCount = json_index_slot_count(container);
+        
+        u64 size = json_index_size(container);
+        JsonIndex* index = (JsonIndex*)malloc(size);
+        if (!index) {
+            return 0;
+        }
+        PROFILE_ALLOCATION(size);
+        
+        memset(index, 0, size);
+        index->slotMask = isObject ? (slotCount - 1) : 0;
+        
+        u32 position = 0;
+        for (JsonElement* child = container->firstSubElement; child; child = child->nextSibling) {
+            if (isObject) {
+                u32 slot = child->labelHash & index->slotMask;
+                while (index->slots[slot] && !are_equal(index->slots[slot]->label, child->label)) {
+                    slot = (slot + 1) & index->slotMask;
+                }
+                
+                if (!index->slots[slot]) {
+                    index->slots[slot] = child;
+                }
+            } else {
+                index->slots[position++] = child;
+            }
+        }
+        
+        container->index = index;
+    }
+    
+    return container->index;
+}
+
+static JsonElement* lookup_element(JsonElement* object, String elementName, u32 hash) {
     JsonElement* result = 0;
     
     if (object) {
-        for (JsonElement* search = object->firstSubElement; search; search = search->nextSibling) {
-            if (are_equal(search->label, elementName)) {
-                result = search;
-                break;
+        JsonIndex* index = is_json_object(object) ? get_json_index(object) : 0;
+        
+        if (index) {
+            for (u32 slot = hash & index->slotMask; index->slots[slot]; slot = (slot + 1) & index->slotMask) {
+                JsonElement* search = index->slots[slot];
+                if ((search->labelHash == hash) && are_equal(search->label, elementName)) {
+                    result = search;
+                    break;
+                }
+            }
+        } else {
+            for (JsonElement* search = object->firstSubElement; search; search = search->nextSibling) {
+                if ((search->labelHash == hash) && are_equal(search->label, elementName)) {
+                    result = search;
+                    break;
+                }
             }
         }
     }
@@ -317,6 +819,76 @@ static JsonElement* lookup_element(JsonElement* object, String elementName) {
     return result;
 }
 
+static JsonElement* lookup_element(JsonElement* object, String elementName) {
+    JsonElement* result = lookup_element(object, elementName, hash_json_label(elementName));
+    return result;
+}
+
+static JsonElement* json_array_at(JsonElement* array, u64 position) {
+    JsonElement* result = 0;
+    
+    if (array && (position < array->childCount)) {
+        JsonIndex* index = get_json_index(array);
+        
+        if (index) {
+            result = index->slots[position];
+        } else {
+            result = array->firstSubElement;
+            while (position--) {
+                result = result->nextSibling;
+            }
+        }
+    }
+    
+    return result;
+}
+
+// Follows a path like "pairs[3].x0" from root: labels separated by '.', array positions in
+// brackets (a leading "[n]" indexes a root array). Labels containing '.' or '[' can't be reached
+// this way. Returns 0 if any step is missing.
+static JsonElement* json_get(JsonElement* root, const char* path) {
+    JsonElement* result = root;
+    
+    const char* at = path;
+    while (result && *at) {
+        if (*at == '[') {
+            ++at;
+            
+            u64 position = 0;
+            bool hasDigits = false;
+            while ((*at >= '0') && (*at <= '9')) {
+                position = position * 10 + (u64)(*at++ - '0');
+                hasDigits = true;
+            }
+            
+            if (!hasDigits || (*at != ']') || !is_json_array(result)) {
+                return 0;
+            }
+            ++at;
+            
+            result = json_array_at(result, position);
+        } else {
+            if (*at == '.') {
+                ++at;
+            }
+            
+            const char* start = at;
+            while (*at && (*at != '.') && (*at != '[')) {
+                ++at;
+            }
+            
+            String label = {(u64)(at - start), (u8*)start};
+            if (!label.count || !is_json_object(result)) {
+                return 0;
+            }
+            
+            result = lookup_element(result, label);
+        }
+    }
+    
+    return result;
+}
+
 static double convert_json_sign(String source, u64* atResult) {
     u64 at = *atResult;
     
@@ -351,50 +923,62 @@ static double convert_json_number(String source, u64* atResult) {
     return result;
 }
 
-static double convert_element_to_double(JsonElement* object, String elementName) {
-    double result = 0.0;
+static double convert_json_double(String source) {
+    u64 at = 0;
     
-    JsonElement* element = lookup_element(object, elementName);
-    if (element) {
-        String source = element->value;
-        u64 at = 0;
-        
-        double sign = convert_json_sign(source, &at);
-        double number = convert_json_number(source, &at);
-        
-        if (is_in_bound(source, at) && (source.data[at] == '.')) {
-            ++at;
-            double c = 1.0 / 10.0;
-            while (is_in_bound(source, at)) {
-                u8 character = source.data[at] - (u8)'0';
-                if (character < 10) {
-                    number = number + c * (double)character;
-                    c *= 1.0 / 10.0;
-                    ++at;
-                } else {
-                    break;
-                }
+    double sign = convert_json_sign(source, &at);
+    double number = convert_json_number(source, &at);
+    
+    if (is_in_bound(source, at) && (source.data[at] == '.')) {
+        ++at;
+        double c = 1.0 / 10.0;
+        while (is_in_bound(source, at)) {
+            u8 character = source.data[at] - (u8)'0';
+            if (character < 10) {
+                number = number + c * (double)character;
+                c *= 1.0 / 10.0;
+                ++at;
+            } else {
+                break;
             }
         }
-        
-        if (is_in_bound(source, at) && ((source.data[at] == 'e') || (source.data[at] == 'E'))) {
+    }
+    
+    if (is_in_bound(source, at) && ((source.data[at] == 'e') || (source.data[at] == 'E'))) {
+        ++at;
+        if (is_in_bound(source, at) && (source.data[at] == '+')) {
             ++at;
-            if (is_in_bound(source, at) && (source.data[at] == '+')) {
-                ++at;
-            }
-            
-            double exponentSign = convert_json_sign(source, &at);
-            double exponent = exponentSign * convert_json_number(source, &at);
-            number *= pow(10.0, exponent);
         }
         
-        result = sign * number;
+        double exponentSign = convert_json_sign(source, &at);
+        double exponent = exponentSign * convert_json_number(source, &at);
+        number *= pow(10.0, exponent);
     }
     
+    double result = sign * number;
+    
     return result;
 }
 
-static u64 parse_haversine_pairs(String inputJson, u64 maxPairCount, HaversinePair* pairs) {
+static double convert_element_to_double(JsonElement* object, String elementName) {
+    double result = 0.0;
+    
+    JsonElement* element = lookup_element(object, elementName);
+    if (element) {
+        result = convert_json_double(element->value);
+    }
+    
+    return result;
+}
+
+static void convert_haversine_pair(JsonElement* element, HaversinePair* pair) {
+    pair->x0 = convert_element_to_double(element, CONSTANT_STRING("x0"));
+    pair->y0 = convert_element_to_double(element, CONSTANT_STRING("y0"));
+    pair->x1 = convert_element_to_double(element, CONSTANT_STRING("x1"));
+    pair->y1 = convert_element_to_double(element, CONSTANT_STRING("y1"));
+}
+
+static u64 parse_haversine_pairs(String inputJson, PairStore* store) {
     PROFILE_FUNC();
     
     u64 pairCount = 0;
@@ -404,15 +988,19 @@ static u64 parse_haversine_pairs(String inputJson, u64 maxPairCount, HaversinePa
     
     if (pairsArray) {
         PROFILE_SCOPE("Lookup and Convert");
-        for (JsonElement* element = pairsArray->firstSubElement;
-             element && (pairCount < maxPairCount);
-             element = element->nextSibling) {
-            HaversinePair* pair = pairs + pairCount++;
-            
-            pair->x0 = convert_element_to_double(element, CONSTANT_STRING("x0"));
-            pair->y0 = convert_element_to_double(element, CONSTANT_STRING("y0"));
-            pair->x1 = convert_element_to_double(element, CONSTANT_STRING("x1"));
-            pair->y1 = convert_element_to_double(element, CONSTANT_STRING("y1"));
+        
+        u64 count = pairsArray->childCount;
+        if (count > get_pair_store_room(store)) {
+            count = get_pair_store_room(store);
+        }
+        
+        HaversinePair* pairs = push_pairs(store, count);
+        if (pairs) {
+            for (JsonElement* element = pairsArray->firstSubElement;
+                 element && (pairCount < count);
+                 element = element->nextSibling) {
+                convert_haversine_pair(element, pairs + pairCount++);
+            }
         }
     }
     
@@ -421,5 +1009,86 @@ static u64 parse_haversine_pairs(String inputJson, u64 maxPairCount, HaversinePa
         free_json(json);
     }
     
+    return pairCount;
+}
+
+// Where pairs appended to the array go: just past the last pair, or past the "[" if there are
+// none. Assumes (like haversine_generator writes it) that the pairs array is the last member of
+// the root object. U64Max if the input doesn't end in "]}".
+static u64 find_pairs_append_point(String inputJson) {
+    u64 at = inputJson.count;
+    
+    char expected[] = {'}', ']'};
+    for (u32 i = 0; i < ARRAY_COUNT(expected); i++) {
+        while (at && is_json_whitespace(inputJson, at - 1)) {
+            --at;
+        }
+        
+        if (!at || (inputJson.data[at - 1] != expected[i])) {
+            return U64Max;
+        }
+        --at;
+    }
+    
+    while (at && is_json_whitespace(inputJson, at - 1)) {
+        --at;
+    }
+    
+    return at;
+}
+
+// Parses pair objects appended to the pairs array from its old append point onward. Returns how
+// many were parsed and the new append point, or U64Max if the tail isn't a continuation of the
+// array.
+static u64 parse_haversine_pair_tail(String inputJson, u64 at, bool hadPairs, u64 maxPairCount, HaversinePair* pairs,
+                                     u64* appendPoint) {
+    PROFILE_FUNC_DATA(inputJson.count - at);
+    
+    u64 pairCount = 0;
+    
+    JsonParser parser = {};
+    parser.source = inputJson;
+    parser.at = at;
+    
+    bool needComma = hadPairs;
+    bool closed = false;
+    *appendPoint = at;
+    
+    while (is_parsing(&parser)) {
+        JsonToken token = get_json_token(&parser);
+        
+        if (token.type == Token_close_bracket) {
+            closed = true;
+            break;
+        }
+        
+        if (needComma) {
+            if (token.type != Token_comma) {
+                parser_error(&parser, token, "Expected comma between pairs");
+                break;
+            }
+            token = get_json_token(&parser);
+        }
+        
+        if ((token.type != Token_open_brace) || (pairCount >= maxPairCount)) {
+            parser_error(&parser, token, "Expected a pair object");
+            break;
+        }
+        
+        JsonElement* element = parse_json_element(&parser, {}, 0, token);
+        attach_json_arena(&parser, element);
+        if (element) {
+            convert_haversine_pair(element, pairs + pairCount++);
+        }
+        free_json(element);
+        
+        *appendPoint = parser.at;
+        needComma = true;
+    }
+    
+    if (!closed || parser.hadError || (find_pairs_append_point(inputJson) != *appendPoint)) {
+        pairCount = U64Max;
+    }
+    
     return pairCount;
 }
\ No newline at end of file
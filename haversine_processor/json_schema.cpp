@@ -0,0 +1,282 @@
+#include <stddef.h> // offsetof
+
+// Typed record parsing from a field table. A schema lists (field name, member offset, type) for
+// a struct; objects are then read with the cursor straight into the struct, without a tree or a
+// label scan per field:
+//
+//     static JsonFieldDesc gPairFields[] = {
+//         JSON_FIELD(HaversinePair, x0, JsonField_F64),
+//         ...
+//     };
+//
+// Label hashes are computed at compile time. compile_json_schema then finds a multiplier that
+// maps every field's hash to its own slot, so each label in the input costs one multiply, one
+// table load and one compare. Labels not in the schema are skipped (containers without being
+// tokenized). parse_json_record leaves fields missing from the input as they were,
+// parse_json_record_array zeroes each record first.
+
+#define JSON_SCHEMA_MAX_FIELDS 64
+#define JSON_SCHEMA_MAX_SLOT_BITS 10
+#define JSON_SCHEMA_MAX_ATTEMPTS 4096
+
+enum JsonFieldType {
+    JsonField_F64,
+    JsonField_F32,
+    JsonField_S64,
+    JsonField_U64,
+    JsonField_Bool,
+    JsonField_String, // Raw view into the source, NOT decoded like JsonElement strings: escapes are
+                      // left as they are, decode_json_string turns it into the text
+    
+    JsonField_Count,
+};
+
+struct JsonFieldDesc {
+    String name;
+    u32 hash;
+    u32 offset;
+    JsonFieldType type;
+};
+
+struct JsonSchema {
+    JsonFieldDesc* fields;
+    u32 fieldCount;
+    
+    u32 multiplier;
+    u32 shift;
+    u8 slots[1 << JSON_SCHEMA_MAX_SLOT_BITS]; // Field index + 1, 0 for none
+};
+
+// hash_json_label, usable in static initializers
+static constexpr u32 hash_json_literal(const char* text, u32 hash) {
+    return *text ? hash_json_literal(text + 1, (hash ^ (u8)*text) * JSON_HASH_PRIME) : hash;
+}
+
+#define JSON_FIELD(type, member, fieldType) \
+    { CONSTANT_STRING(#member), hash_json_literal(#member, JSON_HASH_SEED), (u32)offsetof(type, member), fieldType }
+
+static u32 get_json_schema_slot(JsonSchema* schema, u32 hash) {
+    u32 result = (hash * schema->multiplier) >> schema->shift;
+    return result;
+}
+
+// NOTE(alex): Multipliers are tried from a fixed sequence, so the same table always compiles to
+// the same schema. With the table at least twice the field count a few tries are usually enough;
+// if none works the table doubles.
+static bool compile_json_schema(JsonSchema* schema, JsonFieldDesc* fields, u32 fieldCount) {
+    *schema = {};
+    
+    if (fieldCount > JSON_SCHEMA_MAX_FIELDS) {
+        fprintf(stderr, "ERROR: JSON schema has %u fields, at most %u are supported\n", fieldCount, JSON_SCHEMA_MAX_FIELDS);
+        return false;
+    }
+    
+    for (u32 i = 0; i < fieldCount; i++) {
+        for (u32 j = 0; j < i; j++) {
+            if (are_equal(fields[i].name, fields[j].name)) {
+                fprintf(stderr, "ERROR: JSON schema has \"%.*s\" twice\n", (u32)fields[i].name.count, (char*)fields[i].name.data);
+                return false;
+            }
+        }
+    }
+    
+    u32 slotBits = 2;
+    while ((1u << slotBits) < (2 * fieldCount)) {
+        ++slotBits;
+    }
+    
+    for (; slotBits <= JSON_SCHEMA_MAX_SLOT_BITS; slotBits++) {
+        u32 multiplier = 0x9E3779B1u;
+        
+        for (u32 attempt = 0; attempt < JSON_SCHEMA_MAX_ATTEMPTS; attempt++) {
+            memset(schema->slots, 0, sizeof(schema->slots));
+            schema->multiplier = multiplier;
+            schema->shift = 32 - slotBits;
+            
+            bool collided = false;
+            for (u32 i = 0; (i < fieldCount) && !collided; i++) {
+                u8* slot = schema->slots + get_json_schema_slot(schema, fields[i].hash);
+                collided = (*slot != 0);
+                *slot = (u8)(i + 1);
+            }
+            
+            if (!collided) {
+                schema->fields = fields;
+                schema->fieldCount = fieldCount;
+                return true;
+            }
+            
+            multiplier = (multiplier * 1664525u + 1013904223u) | 1;
+        }
+    }
+    
+    fprintf(stderr, "ERROR: No perfect hash for a JSON schema of %u fields\n", fieldCount);
+    return false;
+}
+
+// Integer fields only take plain integers that fit the field, anything else reads as 0.
+static bool convert_json_integer(String source, u64* magnitude, bool* negative) {
+    u64 at = 0;
+    *negative = is_in_bound(source, at) && (source.data[at] == '-');
+    at += *negative;
+    
+    u64 result = 0;
+    bool valid = is_in_bound(source, at);
+    for (; valid && (at < source.count); at++) {
+        u8 digit = source.data[at] - (u8)'0';
+        valid = (digit < 10) && (result <= ((U64Max - digit) / 10));
+        result = 10 * result + digit;
+    }
+    
+    *magnitude = valid ? result : 0;
+    return valid;
+}
+
+static void store_json_field(JsonFieldDesc* field, JsonToken value, u8* record) {
+    u8* member = record + field->offset;
+    
+    switch (field->type) {
+        case JsonField_F64: {
+            *(double*)member = (value.type == Token_number) ? convert_json_double(value.value) : 0.0;
+        } break;
+        
+        case JsonField_F32: {
+            *(float*)member = (value.type == Token_number) ? (float)convert_json_double(value.value) : 0.0f;
+        } break;
+        
+        case JsonField_S64: {
+            u64 magnitude = 0;
+            bool negative = false;
+            if (value.type == Token_number) {
+                convert_json_integer(value.value, &magnitude, &negative);
+            }
+            
+            // NOTE(alex): -2^63 has no positive counterpart, so it can't go through a negation.
+            s64 result = 0;
+            if (negative && (magnitude == ((u64)INT64_MAX + 1))) {
+                result = INT64_MIN;
+            } else if (magnitude <= (u64)INT64_MAX) {
+                result = negative ? -(s64)magnitude : (s64)magnitude;
+            }
+            *(s64*)member = result;
+        } break;
+        
+        case JsonField_U64: {
+            u64 magnitude = 0;
+            bool negative = false;
+            if (value.type == Token_number) {
+                convert_json_integer(value.value, &magnitude, &negative);
+            }
+            *(u64*)member = negative ? 0 : magnitude;
+        } break;
+        
+        case JsonField_Bool: {
+            *(bool*)member = (value.type == Token_true);
+        } break;
+        
+        case JsonField_String: {
+            *(String*)member = (value.type == Token_string_literal) ? value.value : String{};
+        } break;
+        
+        default: {
+        } break;
+    }
+}
+
+// Reads the object that starts with open (the value the cursor just returned) into record.
+// Returns a mask of the schema fields that were present.
+static u64 parse_json_record(JsonCursor* cursor, JsonToken open, JsonSchema* schema, void* record) {
+    u64 result = 0;
+    
+    if (open.type != Token_open_brace) {
+        return result;
+    }
+    
+    JsonIteration object = begin_json_iteration(cursor, open);
+    
+    String label;
+    u32 labelHash;
+    JsonToken value;
+    while (next_json_child(cursor, &object, &label, &labelHash, &value)) {
+        u32 slot = schema->slots[get_json_schema_slot(schema, labelHash)];
+        if (slot) {
+            JsonFieldDesc* field = schema->fields + (slot - 1);
+            if ((field->hash == labelHash) && are_equal_json_string(label, field->name)) {
+                store_json_field(field, value, (u8*)record);
+                result |= 1ull << (slot - 1);
+            }
+        }
+    }
+    
+    return result;
+}
+
+// Reads up to maxCount of the next objects of array into records, recordSize apart. Fewer means
+// the array ended, so arrays of unknown length can be read a buffer at a time.
+static u64 parse_json_record_array(JsonCursor* cursor, JsonIteration* array, JsonSchema* schema,
+                                   u64 recordSize, u64 maxCount, void* records) {
+    u64 result = 0;
+    
+    JsonToken element;
+    while ((result < maxCount) && next_json_child(cursor, array, 0, 0, &element)) {
+        u8* record = (u8*)records + result * recordSize;
+        memset(record, 0, recordSize);
+        parse_json_record(cursor, element, schema, record);
+        ++result;
+    }
+    
+    return result;
+}
+
+static JsonFieldDesc gHaversinePairFields[] = {
+    JSON_FIELD(HaversinePair, x0, JsonField_F64),
+    JSON_FIELD(HaversinePair, y0, JsonField_F64),
+    JSON_FIELD(HaversinePair, x1, JsonField_F64),
+    JSON_FIELD(HaversinePair, y1, JsonField_F64),
+};
+
+#define SCHEMA_PAIR_CHUNK_COUNT 4096
+
+static u64 parse_haversine_pairs_schema(String inputJson, PairStore* store) {
+    PROFILE_FUNC_DATA(inputJson.count);
+    
+    u64 pairCount = 0;
+    
+    JsonSchema schema;
+    if (!compile_json_schema(&schema, gHaversinePairFields, ARRAY_COUNT(gHaversinePairFields))) {
+        return pairCount;
+    }
+    
+    JsonCursor cursor = open_json_cursor(inputJson);
+    JsonIteration root = begin_json_iteration(&cursor, get_json_cursor_root(&cursor));
+    
+    JsonToken pairsArray = {};
+    if (find_json_field(&cursor, &root, CONSTANT_STRING("pairs"), &pairsArray) &&
+        (pairsArray.type == Token_open_bracket)) {
+        JsonIteration array = begin_json_iteration(&cursor, pairsArray);
+        
+        // The length isn't known up front, so the store grows a chunk at a time and gives back
+        // what the last chunk didn't use.
+        while (true) {
+            u64 chunkCount = get_pair_store_room(store);
+            if (chunkCount > SCHEMA_PAIR_CHUNK_COUNT) {
+                chunkCount = SCHEMA_PAIR_CHUNK_COUNT;
+            }
+            
+            HaversinePair* pairs = chunkCount ? push_pairs(store, chunkCount) : 0;
+            if (!pairs) {
+                break;
+            }
+            
+            u64 count = parse_json_record_array(&cursor, &array, &schema, sizeof(HaversinePair), chunkCount, pairs);
+            pop_pairs(store, chunkCount - count);
+            pairCount += count;
+            
+            if (count < chunkCount) {
+                break;
+            }
+        }
+    }
+    
+    return pairCount;
+}
\ No newline at end of file
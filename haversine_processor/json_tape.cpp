@@ -0,0 +1,388 @@
+// Flat "tape" form of a JSON document: one contiguous array of tagged 64-bit entries in document
+// order, instead of a tree of JsonElement nodes.
+//
+// Every entry has its JsonTapeType in the top 8 bits and a 56-bit payload:
+//   Open brace/bracket:  payload = tape index of the matching close, next entry = child count
+//   Close brace/bracket: payload = tape index of the matching open
+//   Label:               payload = source offset, next entry = (labelHash << 32) | length
+//   Scalars:             payload = source offset, next entry = length
+// Labels and values point back into the source like JsonElement does, but nothing is copied or
+// decoded: strings with escapes stay raw, and lookups compare them with are_equal_json_string.
+// An object member is its label followed by its value, so skipping any value (however deep) is
+// one load: containers jump past their close, everything else is two entries.
+
+enum JsonTapeType {
+    JsonTape_None,
+    
+    JsonTape_OpenObject,
+    JsonTape_CloseObject,
+    JsonTape_OpenArray,
+    JsonTape_CloseArray,
+    JsonTape_Label,
+    JsonTape_String,
+    JsonTape_Number,
+    JsonTape_True,
+    JsonTape_False,
+    JsonTape_Null,
+    
+    JsonTape_Count,
+};
+
+#define JSON_TAPE_TYPE_SHIFT 56
+#define JSON_TAPE_PAYLOAD_MASK ((1ull << JSON_TAPE_TYPE_SHIFT) - 1)
+#define JSON_TAPE_MAX_DEPTH 1024
+
+struct JsonTape {
+    String source;
+    String memory;
+    u64* entries;
+    u64 count;
+    u64 capacity;
+    
+    bool fixedCapacity; // entries were handed in (see json_parallel.cpp), running out fails instead of growing
+    bool overflowed;
+};
+
+// Position of one child while iterating a container. value is U64Max once the children ran out.
+struct JsonTapeIterator {
+    u64 at;
+    u64 end;
+    
+    String label;
+    u32 labelHash;
+    u64 value;
+};
+
+static JsonTapeType get_tape_type(JsonTape* tape, u64 at) {
+    JsonTapeType result = (JsonTapeType)(tape->entries[at] >> JSON_TAPE_TYPE_SHIFT);
+    return result;
+}
+
+static u64 get_tape_payload(JsonTape* tape, u64 at) {
+    u64 result = tape->entries[at] & JSON_TAPE_PAYLOAD_MASK;
+    return result;
+}
+
+static bool is_tape_container(JsonTapeType type) {
+    bool result = (type == JsonTape_OpenObject) || (type == JsonTape_OpenArray);
+    return result;
+}
+
+// NOTE(alex): Growing copies the whole tape. The first guess in parse_json_tape is big enough for
+// inputs shaped like haversine_generator output, so that only happens on denser documents.
+static bool reserve_tape(JsonTape* tape, u64 entryCount) {
+    if ((tape->count + entryCount) > tape->capacity) {
+        if (tape->fixedCapacity) {
+            tape->overflowed = true;
+            return false;
+        }
+        
+        u64 capacity = tape->capacity * 2;
+        if (capacity < (tape->count + entryCount)) {
+            capacity = tape->count + entryCount;
+        }
+        
+        String memory = allocate_string(capacity * sizeof(u64));
+        if (!memory.data) {
+            return false;
+        }
+        
+        if (tape->count) {
+            memcpy(memory.data, tape->entries, tape->count * sizeof(u64));
+        }
+        free_string(&tape->memory);
+        
+        tape->memory = memory;
+        tape->entries = (u64*)memory.data;
+        tape->capacity = capacity;
+    }
+    
+    return true;
+}
+
+static void push_tape_entry(JsonTape* tape, JsonTapeType type, u64 payload) {
+    tape->entries[tape->count++] = ((u64)type << JSON_TAPE_TYPE_SHIFT) | (payload & JSON_TAPE_PAYLOAD_MASK);
+}
+
+static JsonTapeType get_tape_scalar_type(JsonTokenType type) {
+    JsonTapeType result;
+    
+    switch (type) {
+        case Token_string_literal: { result = JsonTape_String; } break;
+        case Token_number: { result = JsonTape_Number; } break;
+        case Token_true: { result = JsonTape_True; } break;
+        case Token_false: { result = JsonTape_False; } break;
+        case Token_null: { result = JsonTape_Null; } break;
+        default: { result = JsonTape_None; } break;
+    }
+    
+    return result;
+}
+
+static void free_json_tape(JsonTape* tape) {
+    free_string(&tape->memory);
+    *tape = {};
+}
+
+// Same tokenizer and grammar as parse_json_element, without the recursion: open containers are
+// kept on an explicit stack until their close is seen and patched in. Appends the value starting
+// with token (already read) and returns false on error, leaving the tape partly written.
+static bool append_json_tape_value(JsonTape* tape, JsonParser* parser, JsonToken token) {
+    String inputJson = parser->source;
+    
+    u64 openStack[JSON_TAPE_MAX_DEPTH];
+    u32 depth = 0;
+    
+    for (;;) {
+        if (!reserve_tape(tape, 4)) {
+            parser->hadError = true;
+            break;
+        }
+        
+        u64 parent = depth ? openStack[depth - 1] : U64Max;
+        bool inObject = depth && (get_tape_type(tape, parent) == JsonTape_OpenObject);
+        
+        // A value, with its label first inside objects
+        if (inObject) {
+            if (token.type != Token_string_literal) {
+                parser_error(parser, token, "Expected field name");
+                break;
+            }
+            
+            push_tape_entry(tape, JsonTape_Label, token.value.data - inputJson.data);
+            tape->entries[tape->count++] = ((u64)token.hash << 32) | token.value.count;
+            
+            JsonToken colon = get_json_token(parser);
+            if (colon.type != Token_colon) {
+                parser_error(parser, colon, "Expected colon after field name");
+                break;
+            }
+            
+            token = get_json_token(parser);
+        }
+        
+        if (depth) {
+            ++tape->entries[parent + 1];
+        }
+        
+        bool closedEmpty = false;
+        
+        if ((token.type == Token_open_brace) || (token.type == Token_open_bracket)) {
+            if (depth == JSON_TAPE_MAX_DEPTH) {
+                parser_error(parser, token, "JSON nested too deep");
+                break;
+            }
+            
+            bool isObject = (token.type == Token_open_brace);
+            openStack[depth++] = tape->count;
+            push_tape_entry(tape, isObject ? JsonTape_OpenObject : JsonTape_OpenArray, 0);
+            tape->entries[tape->count++] = 0;
+            
+            token = get_json_token(parser);
+            if (token.type != (isObject ? Token_close_brace : Token_close_bracket)) {
+                continue;
+            }
+            
+            closedEmpty = true;
+        } else {
+            JsonTapeType type = get_tape_scalar_type(token.type);
+            if (type == JsonTape_None) {
+                parser_error(parser, token, "Unexpected token in JSON");
+                break;
+            }
+            
+            push_tape_entry(tape, type, token.value.data - inputJson.data);
+            tape->entries[tape->count++] = token.value.count;
+        }
+        
+        // Closes, then either a comma and the next sibling or the end of the document
+        bool expectClose = closedEmpty;
+        while (depth) {
+            if (!expectClose) {
+                token = get_json_token(parser);
+            }
+            expectClose = false;
+            
+            u64 open = openStack[depth - 1];
+            bool isObject = (get_tape_type(tape, open) == JsonTape_OpenObject);
+            
+            if (token.type == (isObject ? Token_close_brace : Token_close_bracket)) {
+                if (!reserve_tape(tape, 1)) {
+                    parser->hadError = true;
+                    break;
+                }
+                
+                tape->entries[open] |= tape->count;
+                push_tape_entry(tape, isObject ? JsonTape_CloseObject : JsonTape_CloseArray, open);
+                --depth;
+            } else if (token.type == Token_comma) {
+                token = get_json_token(parser);
+                break;
+            } else {
+                parser_error(parser, token, "Unexpected token in JSON");
+                break;
+            }
+        }
+        
+        if (!depth || parser->hadError) {
+            break;
+        }
+    }
+    
+    bool result = !parser->hadError && !depth;
+    return result;
+}
+
+// On error the tape comes back empty.
+static JsonTape parse_json_tape(String inputJson) {
+    PROFILE_FUNC_DATA(inputJson.count);
+    
+    JsonTape tape = {};
+    tape.source = inputJson;
+    
+    if (!reserve_tape(&tape, (inputJson.count / 4) + 16)) {
+        return tape;
+    }
+    
+    JsonParser parser = {};
+    parser.source = inputJson;
+    
+    if (!append_json_tape_value(&tape, &parser, get_json_token(&parser))) {
+        free_json_tape(&tape);
+    }
+    
+    return tape;
+}
+
+// Raw text of a label or scalar, escapes are left as they are (see decode_json_string)
+static String get_tape_string(JsonTape* tape, u64 at) {
+    String result = {};
+    
+    JsonTapeType type = get_tape_type(tape, at);
+    if (!is_tape_container(type) && (type != JsonTape_CloseObject) && (type != JsonTape_CloseArray)) {
+        result.data = tape->source.data + get_tape_payload(tape, at);
+        result.count = (u32)tape->entries[at + 1];
+    }
+    
+    return result;
+}
+
+static u64 get_tape_child_count(JsonTape* tape, u64 container) {
+    u64 result = is_tape_container(get_tape_type(tape, container)) ? tape->entries[container + 1] : 0;
+    return result;
+}
+
+// Tape index just past the value at "at"
+static u64 skip_tape_value(JsonTape* tape, u64 at) {
+    u64 result = at + 2;
+    if (is_tape_container(get_tape_type(tape, at))) {
+        result = get_tape_payload(tape, at) + 1;
+    }
+    
+    return result;
+}
+
+static JsonTapeIterator iterate_tape(JsonTape* tape, u64 container) {
+    JsonTapeIterator result = {};
+    result.value = U64Max;
+    
+    if (is_tape_container(get_tape_type(tape, container))) {
+        result.at = container + 2;
+        result.end = get_tape_payload(tape, container);
+    }
+    
+    return result;
+}
+
+// Moves to the next child, filling label (objects only) and value. Returns false past the last.
+static bool next_tape_child(JsonTape* tape, JsonTapeIterator* iterator) {
+    bool result = iterator->at < iterator->end;
+    
+    iterator->label = {};
+    iterator->labelHash = 0;
+    iterator->value = U64Max;
+    
+    if (result) {
+        u64 at = iterator->at;
+        if (get_tape_type(tape, at) == JsonTape_Label) {
+            iterator->label = get_tape_string(tape, at);
+            iterator->labelHash = (u32)(tape->entries[at + 1] >> 32);
+            at += 2;
+        }
+        
+        iterator->value = at;
+        iterator->at = skip_tape_value(tape, at);
+    }
+    
+    return result;
+}
+
+// Tape equivalent of lookup_element: the value labelled elementName in object, or U64Max.
+static u64 lookup_tape_element(JsonTape* tape, u64 object, String elementName, u32 hash) {
+    u64 result = U64Max;
+    
+    if ((object != U64Max) && (get_tape_type(tape, object) == JsonTape_OpenObject)) {
+        u64 end = get_tape_payload(tape, object);
+        
+        // Members are label, value: only the label's hash word is read until one matches
+        for (u64 at = object + 2; at < end; at = skip_tape_value(tape, at + 2)) {
+            if (((u32)(tape->entries[at + 1] >> 32) == hash) && are_equal_json_string(get_tape_string(tape, at), elementName)) {
+                result = at + 2;
+                break;
+            }
+        }
+    }
+    
+    return result;
+}
+
+static u64 lookup_tape_element(JsonTape* tape, u64 object, String elementName) {
+    u64 result = lookup_tape_element(tape, object, elementName, hash_json_label(elementName));
+    return result;
+}
+
+static double convert_tape_element_to_double(JsonTape* tape, u64 object, String elementName) {
+    double result = 0.0;
+    
+    u64 element = lookup_tape_element(tape, object, elementName);
+    if (element != U64Max) {
+        result = convert_json_double(get_tape_string(tape, element));
+    }
+    
+    return result;
+}
+
+static u64 parse_haversine_pairs_tape(String inputJson, PairStore* store) {
+    PROFILE_FUNC();
+    
+    u64 pairCount = 0;
+    
+    JsonTape tape = parse_json_tape(inputJson);
+    
+    if (tape.count) {
+        u64 pairsArray = lookup_tape_element(&tape, 0, CONSTANT_STRING("pairs"));
+        
+        PROFILE_SCOPE("Lookup and Convert");
+        if ((pairsArray != U64Max) && (get_tape_type(&tape, pairsArray) == JsonTape_OpenArray)) {
+            u64 count = get_tape_child_count(&tape, pairsArray);
+            if (count > get_pair_store_room(store)) {
+                count = get_pair_store_room(store);
+            }
+            
+            HaversinePair* pairs = push_pairs(store, count);
+            
+            JsonTapeIterator iterator = iterate_tape(&tape, pairsArray);
+            while (pairs && (pairCount < count) && next_tape_child(&tape, &iterator)) {
+                HaversinePair* pair = pairs + pairCount++;
+                pair->x0 = convert_tape_element_to_double(&tape, iterator.value, CONSTANT_STRING("x0"));
+                pair->y0 = convert_tape_element_to_double(&tape, iterator.value, CONSTANT_STRING("y0"));
+                pair->x1 = convert_tape_element_to_double(&tape, iterator.value, CONSTANT_STRING("x1"));
+                pair->y1 = convert_tape_element_to_double(&tape, iterator.value, CONSTANT_STRING("y1"));
+            }
+        }
+    }
+    
+    free_json_tape(&tape);
+    
+    return pairCount;
+}
\ No newline at end of file
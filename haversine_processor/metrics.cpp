@@ -1,18 +1,79 @@
+#include <stdlib.h> // strtoull(), getenv()
+#include <string.h> // strlen(), strchr()
+
+#if _WIN32
 #include <intrin.h> // __rdtsc()
+#define WIN32_LEAN_AND_MEAN // Keeps the old winsock.h out, platform.cpp uses winsock2.h
 #include <windows.h> // QueryPerformanceFrequency(), ...
 #include <psapi.h> // OpenProcess(), GetCurrentProcessId()
+#else
+#include <x86intrin.h> // __rdtsc()
+#include <time.h> // clock_gettime()
+#include <unistd.h> // syscall(), read()
+#include <sys/ioctl.h> // ioctl()
+#include <sys/resource.h> // getrusage()
+#include <sys/syscall.h> // SYS_perf_event_open
+#include <linux/perf_event.h> // perf_event_attr
+#include <sys/mman.h> // mmap()
+#include <sys/stat.h> // mkdir()
+#include <fcntl.h> // open()
+#include <cpuid.h> // __cpuid_count()
+#endif
+
+enum HardwareCounter {
+    HwCounter_LlcMisses,
+    HwCounter_DtlbMisses,
+    
+    HwCounter_Count,
+};
 
 struct OsMetrics {
     bool initialized;
+    bool hardwareCountersAvailable;
+    bool cycleCountersAvailable;
+    bool refCyclesAvailable; // Without them read_cycle_counters falls back to the task clock
+    u64 refCycleFreq; // Ticks per second of the reference read_cycle_counters gives, 0 = the TSC's
+#if _WIN32
     HANDLE processHandle;
+#else
+    int hardwareCounterGroup; // perf_event group leader, -1 if unavailable
+    int cycleCounterGroup;
+#endif
 };
 
 static OsMetrics gMetrics;
 
+#if _WIN32
+
+// NOTE(alex): Windows doesn't expose the PMU to user mode without an ETW session set up by an
+// administrator, so only the OS counters are available there.
+static bool init_hardware_counters() {
+    return false;
+}
+
+static void read_hardware_counters(u64* values) {
+    for (u32 i = 0; i < HwCounter_Count; i++) {
+        values[i] = 0;
+    }
+}
+
+// NOTE(alex): Same as above, APERF/MPERF are MSRs and need a kernel driver to read.
+// QueryThreadCycleTime doesn't help, it counts at the TSC rate rather than the core clock.
+static bool init_cycle_counters() {
+    return false;
+}
+
+static void read_cycle_counters(u64* coreCycles, u64* refCycles) {
+    *coreCycles = 0;
+    *refCycles = 0;
+}
+
 static void init_os_metrics() {
     if (!gMetrics.initialized) {
         gMetrics.initialized = true;
         gMetrics.processHandle = OpenProcess(PROCESS_QUERY_INFORMATION | PROCESS_VM_READ, FALSE, GetCurrentProcessId());
+        gMetrics.hardwareCountersAvailable = init_hardware_counters();
+        gMetrics.cycleCountersAvailable = init_cycle_counters();
     }
 }
 
@@ -25,6 +86,16 @@ static u64 read_os_page_fault_count() {
     return Result;
 }
 
+// NOTE(alex): Uses the pseudo handle so it works without init_os_metrics (counters off).
+static u64 read_os_peak_memory_bytes() {
+    PROCESS_MEMORY_COUNTERS_EX memoryCounters = {};
+    memoryCounters.cb = sizeof(memoryCounters);
+    GetProcessMemoryInfo(GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS *)&memoryCounters, sizeof(memoryCounters));
+    
+    u64 Result = memoryCounters.PeakWorkingSetSize;
+    return Result;
+}
+
 inline u64 read_cpu_timer() {
     return __rdtsc();
 }
@@ -41,8 +112,330 @@ static u64 read_os_timer() {
     return value.QuadPart;
 }
 
-static u64 estimate_cpu_timer_freq() {
-    u64 millisToWait = 100;
+static void read_cpuid(u32 leaf, u32 subleaf, u32* registers) {
+    int values[4];
+    __cpuidex(values, (int)leaf, (int)subleaf);
+    
+    for (u32 i = 0; i < 4; i++) {
+        registers[i] = (u32)values[i];
+    }
+}
+
+// NOTE(alex): Windows doesn't tell user mode the TSC frequency it calibrated.
+static u64 read_kernel_tsc_freq() {
+    return 0;
+}
+
+static u32 get_process_id() {
+    return GetCurrentProcessId();
+}
+
+// Per-user directory for small caches, with a trailing separator.
+static bool get_cache_directory(char* buffer, u32 bufferSize) {
+    const char* directory = getenv("LOCALAPPDATA");
+    
+    int length = (directory && directory[0]) ? snprintf(buffer, bufferSize, "%s\\", directory) : 0;
+    bool result = (length > 0) && ((u32)length < bufferSize);
+    return result;
+}
+
+static FILE* open_cache_file(const char* path) {
+    FILE* result = fopen(path, "rb");
+    return result;
+}
+
+// Creates path for writing, failing if anything is already there.
+static FILE* create_cache_file(const char* path) {
+    FILE* result = fopen(path, "wbx");
+    return result;
+}
+
+// Replaces to with from.
+static bool replace_cache_file(const char* from, const char* to) {
+    bool result = MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING);
+    return result;
+}
+
+#else // _WIN32
+
+// NOTE(alex): Only user mode (excludeKernel) works with the default perf_event_paranoid of 2.
+// Counts the calling thread only (pid 0, no inherit).
+static int open_perf_counter(u32 type, u64 config, int groupFd, bool excludeKernel) {
+    perf_event_attr attr = {};
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = (groupFd == -1);
+    attr.exclude_kernel = excludeKernel;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    
+    int result = (int)syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0);
+    return result;
+}
+
+static bool init_hardware_counters() {
+    u64 dtlbReadMiss = (PERF_COUNT_HW_CACHE_DTLB |
+                        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    
+    // NOTE(alex): Order must match HardwareCounter, the group is read back in creation order.
+    int group = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1, true);
+    int dtlb = -1;
+    if (group != -1) {
+        dtlb = open_perf_counter(PERF_TYPE_HW_CACHE, dtlbReadMiss, group, true);
+    }
+    
+    if (dtlb == -1) {
+        if (group != -1) {
+            close(group);
+        }
+        
+        gMetrics.hardwareCounterGroup = -1;
+        return false;
+    }
+    
+    ioctl(group, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    
+    gMetrics.hardwareCounterGroup = group;
+    return true;
+}
+
+static void read_hardware_counters(u64* values) {
+    // PERF_FORMAT_GROUP layout: { nr, values[nr] }
+    u64 buffer[1 + HwCounter_Count] = {};
+    
+    if (gMetrics.hardwareCountersAvailable) {
+        if (read(gMetrics.hardwareCounterGroup, buffer, sizeof(buffer)) != (ssize_t)sizeof(buffer)) {
+            buffer[0] = 0;
+        }
+    }
+    
+    for (u32 i = 0; i < HwCounter_Count; i++) {
+        values[i] = buffer[1 + i];
+    }
+}
+
+// Core clock cycles (what APERF counts) and reference cycles, which tick at the TSC rate like
+// MPERF, both only while this thread runs. Their ratio is how fast the core really ran compared to
+// the TSC, whatever turbo or throttling did in between. Both count the kernel too where
+// perf_event_paranoid allows it, user mode only otherwise.
+static bool init_cycle_counters() {
+    bool excludeKernel = false;
+    int group = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1, excludeKernel);
+    if (group == -1) {
+        excludeKernel = true;
+        group = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1, excludeKernel);
+    }
+    
+    int ref = -1;
+    if (group != -1) {
+        ref = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES, group, excludeKernel);
+        gMetrics.refCyclesAvailable = (ref != -1);
+        
+        // NOTE(alex): Most hypervisors pass cycles through but not ref-cycles. The nanoseconds the
+        // thread spent on a CPU (task clock) stand in for them then, but those always include the
+        // kernel, so they only compare with cycles counted there too. Nothing does for user mode
+        // only cycles: the TSC would add the kernel and descheduled time and read low.
+        if (!gMetrics.refCyclesAvailable && !excludeKernel) {
+            ref = open_perf_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, group, excludeKernel);
+            gMetrics.refCycleFreq = 1000000000;
+        }
+    }
+    
+    if (ref == -1) {
+        if (group != -1) {
+            close(group);
+        }
+        
+        gMetrics.cycleCounterGroup = -1;
+        return false;
+    }
+    
+    ioctl(group, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    
+    gMetrics.cycleCounterGroup = group;
+    return true;
+}
+
+static void read_cycle_counters(u64* coreCycles, u64* refCycles) {
+    // PERF_FORMAT_GROUP layout: { nr, values[nr] }
+    u64 buffer[3] = {};
+    
+    if (gMetrics.cycleCountersAvailable) {
+        if (read(gMetrics.cycleCounterGroup, buffer, sizeof(buffer)) != (ssize_t)sizeof(buffer)) {
+            buffer[1] = 0;
+            buffer[2] = 0;
+        }
+    }
+    
+    *coreCycles = buffer[1];
+    *refCycles = buffer[2];
+}
+
+static void init_os_metrics() {
+    if (!gMetrics.initialized) {
+        gMetrics.initialized = true;
+        gMetrics.hardwareCountersAvailable = init_hardware_counters();
+        gMetrics.cycleCountersAvailable = init_cycle_counters();
+    }
+}
+
+static u64 read_os_page_fault_count() {
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    
+    u64 Result = usage.ru_minflt + usage.ru_majflt;
+    return Result;
+}
+
+// Peak resident set size of the process so far
+static u64 read_os_peak_memory_bytes() {
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+    
+    u64 Result = (u64)usage.ru_maxrss * 1024; // Reported in kilobytes
+    return Result;
+}
+
+inline u64 read_cpu_timer() {
+    return __rdtsc();
+}
+
+static u64 get_os_timer_freq() {
+    return 1000000000;
+}
+
+static u64 read_os_timer() {
+    timespec value;
+    clock_gettime(CLOCK_MONOTONIC, &value);
+    return (u64)value.tv_sec * 1000000000 + (u64)value.tv_nsec;
+}
+
+static void read_cpuid(u32 leaf, u32 subleaf, u32* registers) {
+    __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+}
+
+// The kernel's own TSC calibration (tsc_khz), from the conversion it publishes for reading time
+// with rdtsc in user space: nanoseconds = (tsc * time_mult) >> time_shift. 0 if perf events
+// aren't allowed or the TSC isn't usable for that.
+static u64 read_kernel_tsc_freq() {
+    u64 result = 0;
+    
+    int counter = open_perf_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_DUMMY, -1, true);
+    if (counter == -1) {
+        return result;
+    }
+    
+    u64 pageSize = (u64)sysconf(_SC_PAGESIZE);
+    void* mapping = mmap(0, pageSize, PROT_READ, MAP_SHARED, counter, 0);
+    
+    // The page is filled in when the event is first scheduled
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    
+    if (mapping != MAP_FAILED) {
+        volatile perf_event_mmap_page* page = (volatile perf_event_mmap_page*)mapping;
+        
+        // Retry while the kernel is updating the page
+        u32 sequence;
+        u32 timeMult;
+        u16 timeShift;
+        bool usable;
+        do {
+            sequence = page->lock;
+            __sync_synchronize();
+            usable = page->cap_user_time;
+            timeMult = page->time_mult;
+            timeShift = page->time_shift;
+            __sync_synchronize();
+        } while (page->lock != sequence);
+        
+        if (usable && timeMult) {
+            result = (u64)((1000000000.0 * (double)(1ull << timeShift)) / (double)timeMult + 0.5);
+        }
+        
+        munmap(mapping, pageSize);
+    }
+    
+    close(counter);
+    
+    return result;
+}
+
+static u32 get_process_id() {
+    return (u32)getpid();
+}
+
+// Per-user directory for small caches, with a trailing separator: $XDG_CACHE_HOME, or
+// $HOME/.cache. Created if it isn't there yet.
+static bool get_cache_directory(char* buffer, u32 bufferSize) {
+    const char* xdgCache = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    
+    int length = 0;
+    if (xdgCache && (xdgCache[0] == '/')) {
+        length = snprintf(buffer, bufferSize, "%s/", xdgCache);
+    } else if (home && (home[0] == '/')) {
+        length = snprintf(buffer, bufferSize, "%s/.cache/", home);
+    }
+    
+    bool result = (length > 0) && ((u32)length < bufferSize);
+    if (result) {
+        mkdir(buffer, 0700);
+    }
+    
+    return result;
+}
+
+// NOTE(alex): O_NOFOLLOW so a symlink planted at the path isn't followed.
+static FILE* open_cache_file(const char* path) {
+    int file = open(path, O_RDONLY | O_NOFOLLOW);
+    
+    FILE* result = (file != -1) ? fdopen(file, "rb") : 0;
+    if (!result && (file != -1)) {
+        close(file);
+    }
+    
+    return result;
+}
+
+// Creates path for writing, readable only by this user, failing if anything is already there.
+static FILE* create_cache_file(const char* path) {
+    int file = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    
+    FILE* result = (file != -1) ? fdopen(file, "wb") : 0;
+    if (!result && (file != -1)) {
+        close(file);
+    }
+    
+    return result;
+}
+
+// Replaces to with from.
+static bool replace_cache_file(const char* from, const char* to) {
+    bool result = (rename(from, to) == 0);
+    return result;
+}
+
+#endif // _WIN32
+
+static const char* describe_hardware_counter(HardwareCounter counter) {
+    const char* result;
+    
+    switch(counter) {
+        case HwCounter_LlcMisses: { result = "LLC miss"; } break;
+        case HwCounter_DtlbMisses: { result = "dTLB miss"; } break;
+        default: { result = "UNKNOWN"; } break;
+    }
+    
+    return result;
+}
+
+// Fixed length calibration against the OS timer. The reference the other sources get compared
+// against in rdtsc_test, get_cpu_timer_freq is what everything else should use.
+static u64 estimate_cpu_timer_freq(u64 millisToWait) {
     u64 osFreq = get_os_timer_freq();
     
     u64 cpuStart = read_cpu_timer();
@@ -65,4 +458,326 @@ static u64 estimate_cpu_timer_freq() {
     }
     
     return cpuFreq;
+}
+
+//
+// CPU timer frequency
+//
+// NOTE(alex): Calibrating against the OS timer is what estimate_cpu_timer_freq does, and it needs
+// a long wait to be accurate. Most machines can just tell us instead: CPUID leaf 15h gives the
+// TSC as a ratio of the crystal clock, Linux publishes the frequency it calibrated at boot, and
+// hypervisors often have a leaf for it. Only when none of them answers do we calibrate, briefly
+// and only until the estimate settles, and keep the result in a file for the next run.
+
+enum CpuTimerFreqSource {
+    TimerFreqSource_Cpuid15,     // Crystal clock * TSC ratio, exact
+    TimerFreqSource_Kernel,      // The OS's own calibration
+    TimerFreqSource_Hypervisor,  // CPUID leaf 40000010h, VMware convention also used by KVM
+    TimerFreqSource_Cpuid16,     // Nominal base frequency, the TSC runs at it on Intel parts
+    TimerFreqSource_Cache,       // A calibration from an earlier run on this CPU
+    TimerFreqSource_Calibration,
+    
+    TimerFreqSource_Count,
+};
+
+struct CpuTimerFreq {
+    u64 freq;
+    CpuTimerFreqSource source;
+};
+
+static CpuTimerFreq gCpuTimerFreq;
+
+#define TIMER_FREQ_CALIBRATION_MIN_MS 1
+#define TIMER_FREQ_CALIBRATION_MAX_MS 64 // Total, across all the measurements
+#define TIMER_FREQ_CALIBRATION_TOLERANCE_PPM 100
+#define TIMER_FREQ_CACHE_TOLERANCE_PPM 2000 // How far a quick check may be off the cached value
+#define TIMER_FREQ_CACHE_FILE_NAME "haversine_cpu_timer_freq.txt"
+
+static const char* describe_cpu_timer_freq_source(CpuTimerFreqSource source) {
+    const char* result;
+    
+    switch(source) {
+        case TimerFreqSource_Cpuid15: { result = "CPUID 15h"; } break;
+        case TimerFreqSource_Kernel: { result = "kernel"; } break;
+        case TimerFreqSource_Hypervisor: { result = "hypervisor"; } break;
+        case TimerFreqSource_Cpuid16: { result = "CPUID 16h"; } break;
+        case TimerFreqSource_Cache: { result = "cache"; } break;
+        case TimerFreqSource_Calibration: { result = "calibration"; } break;
+        default: { result = "UNKNOWN"; } break;
+    }
+    
+    return result;
+}
+
+static u32 get_max_cpuid_leaf(u32 base) {
+    u32 registers[4];
+    read_cpuid(base, 0, registers);
+    return registers[0];
+}
+
+static bool is_intel_cpu() {
+    u32 registers[4];
+    read_cpuid(0, 0, registers);
+    
+    // "GenuineIntel" in ebx, edx, ecx
+    bool result = ((registers[1] == 0x756E6547) && (registers[3] == 0x49656E69) && (registers[2] == 0x6C65746E));
+    return result;
+}
+
+static u64 read_cpuid15_tsc_freq() {
+    u64 result = 0;
+    
+    if (get_max_cpuid_leaf(0) >= 0x15) {
+        u32 registers[4];
+        read_cpuid(0x15, 0, registers);
+        
+        u64 denominator = registers[0];
+        u64 numerator = registers[1];
+        u64 crystalHz = registers[2];
+        
+        if (denominator && numerator && crystalHz) {
+            result = crystalHz * numerator / denominator;
+        }
+    }
+    
+    return result;
+}
+
+static u64 read_cpuid16_tsc_freq() {
+    u64 result = 0;
+    
+    if (is_intel_cpu() && (get_max_cpuid_leaf(0) >= 0x16)) {
+        u32 registers[4];
+        read_cpuid(0x16, 0, registers);
+        
+        u64 baseMhz = registers[0] & 0xFFFF;
+        result = baseMhz * 1000000;
+    }
+    
+    return result;
+}
+
+static u64 read_hypervisor_tsc_freq() {
+    u64 result = 0;
+    
+    u32 registers[4];
+    read_cpuid(1, 0, registers);
+    bool underHypervisor = (registers[2] >> 31) & 1;
+    
+    if (underHypervisor && (get_max_cpuid_leaf(0x40000000) >= 0x40000010)) {
+        read_cpuid(0x40000010, 0, registers);
+        result = (u64)registers[0] * 1000; // kHz
+    }
+    
+    return result;
+}
+
+// One (cpu, os) timer reading, the OS read bracketed by the tightest pair of CPU reads out of a few.
+static void sample_cpu_and_os_timers(u64* cpuTime, u64* osTime) {
+    u64 bestSpread = UINT64_MAX;
+    
+    for (u32 i = 0; i < 8; i++) {
+        u64 cpuBefore = read_cpu_timer();
+        u64 os = read_os_timer();
+        u64 cpuAfter = read_cpu_timer();
+        
+        if ((cpuAfter - cpuBefore) < bestSpread) {
+            bestSpread = cpuAfter - cpuBefore;
+            *cpuTime = cpuBefore + bestSpread / 2;
+            *osTime = os;
+        }
+    }
+}
+
+static u64 measure_cpu_timer_freq(u64 millis) {
+    u64 osFreq = get_os_timer_freq();
+    
+    u64 cpuStart = 0;
+    u64 osStart = 0;
+    sample_cpu_and_os_timers(&cpuStart, &osStart);
+    
+    u64 osWaitTime = osFreq * millis / 1000;
+    while ((read_os_timer() - osStart) < osWaitTime) {
+    }
+    
+    u64 cpuEnd = 0;
+    u64 osEnd = 0;
+    sample_cpu_and_os_timers(&cpuEnd, &osEnd);
+    
+    u64 result = 0;
+    if (osEnd > osStart) {
+        result = (u64)((double)(cpuEnd - cpuStart) * (double)osFreq / (double)(osEnd - osStart) + 0.5);
+    }
+    
+    return result;
+}
+
+static u64 get_ppm_difference(u64 value, u64 reference) {
+    u64 difference = (value > reference) ? (value - reference) : (reference - value);
+    u64 result = reference ? (u64)(1000000.0 * (double)difference / (double)reference) : UINT64_MAX;
+    return result;
+}
+
+// Doubles the measuring time from TIMER_FREQ_CALIBRATION_MIN_MS until two estimates in a row
+// agree to TIMER_FREQ_CALIBRATION_TOLERANCE_PPM, or the next one would take the total past
+// maxMillis.
+static u64 calibrate_cpu_timer_freq(u64 maxMillis) {
+    u64 result = measure_cpu_timer_freq(TIMER_FREQ_CALIBRATION_MIN_MS);
+    u64 spentMillis = TIMER_FREQ_CALIBRATION_MIN_MS;
+    
+    for (u64 millis = 2 * TIMER_FREQ_CALIBRATION_MIN_MS; (spentMillis + millis) <= maxMillis; millis *= 2) {
+        u64 estimate = measure_cpu_timer_freq(millis);
+        spentMillis += millis;
+        bool settled = (get_ppm_difference(estimate, result) <= TIMER_FREQ_CALIBRATION_TOLERANCE_PPM);
+        
+        result = estimate;
+        if (settled) {
+            break;
+        }
+    }
+    
+    return result;
+}
+
+// What the cache file has to match: vendor, family/model/stepping and brand string.
+static void get_cpu_identity(char* buffer, u32 bufferSize) {
+    u32 vendor[4];
+    read_cpuid(0, 0, vendor);
+    
+    u32 signature[4];
+    read_cpuid(1, 0, signature);
+    
+    u32 brand[13] = {};
+    if (get_max_cpuid_leaf(0x80000000) >= 0x80000004) {
+        for (u32 i = 0; i < 3; i++) {
+            read_cpuid(0x80000002 + i, 0, brand + 4 * i);
+        }
+    }
+    
+    snprintf(buffer, bufferSize, "%.4s%.4s%.4s %08x %s", (char*)(vendor + 1), (char*)(vendor + 3), (char*)(vendor + 2),
+             signature[0], (char*)brand);
+}
+
+static bool get_cpu_timer_freq_cache_path(char* buffer, u32 bufferSize) {
+    bool result = get_cache_directory(buffer, bufferSize);
+    
+    u64 length = strlen(buffer);
+    result = result && ((length + sizeof(TIMER_FREQ_CACHE_FILE_NAME)) <= bufferSize);
+    if (result) {
+        memcpy(buffer + length, TIMER_FREQ_CACHE_FILE_NAME, sizeof(TIMER_FREQ_CACHE_FILE_NAME));
+    }
+    
+    return result;
+}
+
+// The cache is "<frequency>\n<cpu identity>\n". 0 if there's none for this CPU.
+static u64 read_cached_cpu_timer_freq() {
+    u64 result = 0;
+    
+    char path[1024];
+    FILE* file = get_cpu_timer_freq_cache_path(path, sizeof(path)) ? open_cache_file(path) : 0;
+    
+    if (file) {
+        char identity[256];
+        get_cpu_identity(identity, sizeof(identity));
+        
+        char contents[512] = {};
+        fread(contents, 1, sizeof(contents) - 1, file);
+        fclose(file);
+        
+        char* cachedIdentity = strchr(contents, '\n');
+        if (cachedIdentity) {
+            *cachedIdentity++ = 0;
+            
+            char* end = strchr(cachedIdentity, '\n');
+            if (end) {
+                *end = 0;
+            }
+            
+            if (strcmp(cachedIdentity, identity) == 0) {
+                result = strtoull(contents, 0, 10);
+            }
+        }
+    }
+    
+    return result;
+}
+
+// Written under a name of its own, then renamed over the cache, so readers never see half a file.
+static void write_cached_cpu_timer_freq(u64 freq) {
+    char path[1024];
+    char tempPath[1024 + 32];
+    
+    FILE* file = 0;
+    if (get_cpu_timer_freq_cache_path(path, sizeof(path))) {
+        snprintf(tempPath, sizeof(tempPath), "%s.%u.tmp", path, get_process_id());
+        file = create_cache_file(tempPath);
+    }
+    
+    if (file) {
+        char identity[256];
+        get_cpu_identity(identity, sizeof(identity));
+        
+        bool written = (fprintf(file, "%llu\n%s\n", freq, identity) > 0);
+        written = (fclose(file) == 0) && written;
+        
+        if (!written || !replace_cache_file(tempPath, path)) {
+            remove(tempPath);
+        }
+    }
+}
+
+// What source would give right now, 0 if it has nothing. Calibration takes up to maxMillis.
+static u64 read_cpu_timer_freq_from(CpuTimerFreqSource source, u64 maxMillis) {
+    u64 result = 0;
+    
+    switch(source) {
+        case TimerFreqSource_Cpuid15: { result = read_cpuid15_tsc_freq(); } break;
+        case TimerFreqSource_Kernel: { result = read_kernel_tsc_freq(); } break;
+        case TimerFreqSource_Hypervisor: { result = read_hypervisor_tsc_freq(); } break;
+        case TimerFreqSource_Cpuid16: { result = read_cpuid16_tsc_freq(); } break;
+        case TimerFreqSource_Cache: { result = read_cached_cpu_timer_freq(); } break;
+        case TimerFreqSource_Calibration: { result = calibrate_cpu_timer_freq(maxMillis); } break;
+        default: { } break;
+    }
+    
+    return result;
+}
+
+// NOTE(alex): A cached value is checked with a quick measurement first, in case the file came
+// from another machine with the same CPU (or the VM moved).
+static CpuTimerFreq find_cpu_timer_freq() {
+    CpuTimerFreq result = {};
+    
+    for (u32 i = 0; (i < TimerFreqSource_Count) && !result.freq; i++) {
+        result.source = (CpuTimerFreqSource)i;
+        result.freq = read_cpu_timer_freq_from(result.source, TIMER_FREQ_CALIBRATION_MAX_MS);
+        
+        if (result.freq && (result.source == TimerFreqSource_Cache)) {
+            u64 check = measure_cpu_timer_freq(2 * TIMER_FREQ_CALIBRATION_MIN_MS);
+            if (get_ppm_difference(check, result.freq) > TIMER_FREQ_CACHE_TOLERANCE_PPM) {
+                result.freq = 0;
+            }
+        }
+    }
+    
+    if (result.source == TimerFreqSource_Calibration) {
+        write_cached_cpu_timer_freq(result.freq);
+    }
+    
+    return result;
+}
+
+// Ticks per second of read_cpu_timer, looked up once per run.
+static u64 get_cpu_timer_freq() {
+    if (!gCpuTimerFreq.freq) {
+        gCpuTimerFreq = find_cpu_timer_freq();
+    }
+    
+    return gCpuTimerFreq.freq;
+}
+
+static CpuTimerFreqSource get_cpu_timer_freq_source() {
+    get_cpu_timer_freq();
+    return gCpuTimerFreq.source;
 }
\ No newline at end of file
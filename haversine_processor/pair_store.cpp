@@ -0,0 +1,162 @@
+// Growable storage for parsed pairs. The worst case pair count for an input (one pair per 24
+// bytes of JSON) is reserved as address space up front, but memory is only committed a block at
+// a time as pairs are pushed, so the pairs stay one contiguous array for the sum kernels,
+// validation and the spatial index while the memory used follows the pairs actually parsed.
+//
+// Parsers that know the array length push it in one go, the others a pair at a time. Blocks can
+// be backed by huge pages, or by a temporary file ("spill") the OS can write pairs out to when
+// there isn't enough memory for all of them.
+
+#define PAIR_STORE_BLOCK_SIZE (2ull * 1024 * 1024) // Commit granularity, also the huge page size
+
+enum PairStoreBacking {
+    PairStore_Memory,
+    PairStore_HugePages,
+    PairStore_Spill,
+    
+    PairStore_Count,
+};
+
+struct PairStore {
+    HaversinePair* pairs;
+    u64 count;
+    u64 capacity;        // Pairs with committed memory behind them
+    u64 maxCount;        // Pairs the reservation can hold
+    
+    PairStoreBacking backing;
+    u8* reservation;     // What reserve_memory returned, pairs is aligned up from it
+    u64 reservedSize;
+    u64 committedSize;
+    MappedFile spill;
+};
+
+static const char* describe_pair_store_backing(PairStoreBacking backing) {
+    const char* result;
+    
+    switch(backing) {
+        case PairStore_Memory: { result = "memory"; } break;
+        case PairStore_HugePages: { result = "huge"; } break;
+        case PairStore_Spill: { result = "spill"; } break;
+        default: { result = "UNKNOWN"; } break;
+    }
+    
+    return result;
+}
+
+static bool parse_pair_store_backing(const char* name, PairStoreBacking* backing) {
+    for (u32 i = 0; i < PairStore_Count; i++) {
+        if (strcmp(name, describe_pair_store_backing((PairStoreBacking)i)) == 0) {
+            *backing = (PairStoreBacking)i;
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+// spillPath is only used for PairStore_Spill. Returns false if the address space or the file
+// couldn't be had.
+static bool open_pair_store(PairStore* store, u64 maxPairCount, PairStoreBacking backing, const char* spillPath) {
+    *store = {};
+    store->backing = backing;
+    
+    u64 size = maxPairCount * sizeof(HaversinePair);
+    size = (size + PAIR_STORE_BLOCK_SIZE - 1) & ~(PAIR_STORE_BLOCK_SIZE - 1);
+    if (!size) {
+        return false;
+    }
+    
+    u8* pairs = 0;
+    if (backing == PairStore_Spill) {
+        store->spill = map_spill_file(spillPath, size);
+        pairs = store->spill.data.data;
+        
+        if (!pairs) {
+            fprintf(stderr, "ERROR: Can't create spill file \"%s\" (is something there already?)\n", spillPath);
+            unmap_file(&store->spill);
+            return false;
+        }
+    } else {
+        // NOTE(alex): One block extra so blocks can start on a huge page boundary.
+        store->reservedSize = size + PAIR_STORE_BLOCK_SIZE;
+        store->reservation = reserve_memory(store->reservedSize);
+        
+        if (!store->reservation) {
+            fprintf(stderr, "ERROR: Can't reserve %llu bytes for pairs\n", store->reservedSize);
+            return false;
+        }
+        
+        pairs = (u8*)(((u64)store->reservation + PAIR_STORE_BLOCK_SIZE - 1) & ~(PAIR_STORE_BLOCK_SIZE - 1));
+    }
+    
+    store->pairs = (HaversinePair*)pairs;
+    store->maxCount = size / sizeof(HaversinePair);
+    
+    return true;
+}
+
+// Commits whole blocks until pairCount pairs fit.
+static bool grow_pair_store(PairStore* store, u64 pairCount) {
+    if (pairCount > store->maxCount) {
+        return false;
+    }
+    
+    u64 size = pairCount * sizeof(HaversinePair);
+    size = (size + PAIR_STORE_BLOCK_SIZE - 1) & ~(PAIR_STORE_BLOCK_SIZE - 1);
+    
+    if (size > store->committedSize) {
+        u8* start = (u8*)store->pairs + store->committedSize;
+        u64 growth = size - store->committedSize;
+        
+        // Spill pages come from the file when they're first touched, nothing to commit
+        if (store->backing != PairStore_Spill) {
+            if (!commit_memory(start, growth, store->backing == PairStore_HugePages)) {
+                fprintf(stderr, "ERROR: Can't commit %llu more bytes for pairs\n", growth);
+                return false;
+            }
+        }
+        
+        PROFILE_ALLOCATION(growth);
+        store->committedSize = size;
+        store->capacity = size / sizeof(HaversinePair);
+    }
+    
+    return true;
+}
+
+// Room for count more pairs, 0 if the store can't grow that far.
+static HaversinePair* push_pairs(PairStore* store, u64 count) {
+    if (((store->capacity - store->count) < count) && !grow_pair_store(store, store->count + count)) {
+        return 0;
+    }
+    
+    HaversinePair* result = store->pairs + store->count;
+    store->count += count;
+    
+    return result;
+}
+
+// Takes back the last count pairs pushed, for callers that pushed more than they filled.
+static void pop_pairs(PairStore* store, u64 count) {
+    store->count -= (count < store->count) ? count : store->count;
+}
+
+// How many pairs can still be pushed
+static u64 get_pair_store_room(PairStore* store) {
+    u64 result = store->maxCount - store->count;
+    return result;
+}
+
+static void close_pair_store(PairStore* store) {
+    if (store->committedSize) {
+        PROFILE_FREE(store->committedSize);
+    }
+    
+    if (store->backing == PairStore_Spill) {
+        unmap_file(&store->spill);
+    } else if (store->reservation) {
+        release_memory(store->reservation, store->reservedSize);
+    }
+    
+    *store = {};
+}
\ No newline at end of file
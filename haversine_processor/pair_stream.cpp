@@ -0,0 +1,185 @@
+#if _WIN32
+#include <io.h> // _setmode
+#include <fcntl.h> // _O_BINARY
+#endif
+
+// Incremental pair reader for inputs that can't be mapped or sized up front (stdin, pipes, FIFOs).
+//
+// Input is read in PAIR_STREAM_BLOCK_SIZE blocks into one fixed buffer. Each pair object is
+// located by bracket matching (find_json_container_end, so braces in strings and nested values are
+// fine) and handed to the regular JSON parser on its own, so memory stays at the buffer plus
+// whatever block of pairs the caller asks for, no matter how long the stream is.
+//
+// NOTE(alex): Everything up to the first "[" is skipped, so the pairs array has to be the first
+// array in the document, as haversine_generator writes it.
+
+#define PAIR_STREAM_BLOCK_SIZE (1024 * 1024)
+
+struct PairStream {
+    FILE* file;
+    String buffer;
+    u64 at;
+    u64 end;
+    u64 byteCount; // Total bytes read so far
+    
+    bool inPairs;
+    bool afterPair; // Next has to be "," or "]"
+    bool afterComma; // Next has to be a pair
+    bool done;
+    bool endOfFile;
+    bool hadError;
+};
+
+static bool open_pair_stream(PairStream* stream, char* path) {
+    *stream = {};
+    
+    if (!path || (strcmp(path, "-") == 0)) {
+#if _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        stream->file = stdin;
+    } else {
+        stream->file = fopen(path, "rb");
+    }
+    
+    if (stream->file) {
+        stream->buffer = allocate_string(PAIR_STREAM_BLOCK_SIZE);
+    }
+    
+    bool result = (stream->file && stream->buffer.data);
+    return result;
+}
+
+static void close_pair_stream(PairStream* stream) {
+    if (stream->file && (stream->file != stdin)) {
+        fclose(stream->file);
+    }
+    
+    free_string(&stream->buffer);
+    *stream = {};
+}
+
+static void pair_stream_error(PairStream* stream, const char* message) {
+    stream->hadError = true;
+    stream->done = true;
+    fprintf(stderr, "ERROR: %s (stream byte %llu)\n", message, stream->byteCount - (stream->end - stream->at));
+}
+
+// Moves what's left to the front of the buffer and reads after it.
+static void refill_pair_stream(PairStream* stream) {
+    u64 remaining = stream->end - stream->at;
+    memmove(stream->buffer.data, stream->buffer.data + stream->at, remaining);
+    stream->at = 0;
+    stream->end = remaining;
+    
+    u64 readCount = 0;
+    {
+        u64 space = stream->buffer.count - stream->end;
+        PROFILE_SCOPE_DATA("fread", space);
+        readCount = fread(stream->buffer.data + stream->end, 1, space, stream->file);
+    }
+    
+    stream->end += readCount;
+    stream->byteCount += readCount;
+    
+    if (readCount == 0) {
+        stream->endOfFile = true;
+    }
+}
+
+// Fills pairs with up to maxPairCount of the next pairs in the stream. Returns how many, which is
+// less than maxPairCount only once the array has ended or the stream had an error.
+static u64 read_pair_stream(PairStream* stream, u64 maxPairCount, HaversinePair* pairs) {
+    PROFILE_FUNC();
+    
+    u64 pairCount = 0;
+    String source = stream->buffer;
+    
+    while (!stream->done && (pairCount < maxPairCount)) {
+        u8* data = source.data;
+        
+        if (!stream->inPairs) {
+            u8* open = (u8*)memchr(data + stream->at, '[', stream->end - stream->at);
+            if (open) {
+                stream->at = (open - data) + 1;
+                stream->inPairs = true;
+            } else if (stream->endOfFile) {
+                pair_stream_error(stream, "No pairs array in stream");
+            } else {
+                stream->at = stream->end;
+                refill_pair_stream(stream);
+            }
+            
+            continue;
+        }
+        
+        while ((stream->at < stream->end) && is_json_whitespace(source, stream->at)) {
+            ++stream->at;
+        }
+        
+        if (stream->at == stream->end) {
+            if (stream->endOfFile) {
+                pair_stream_error(stream, "Stream ended inside the pairs array");
+            } else {
+                refill_pair_stream(stream);
+            }
+            
+            continue;
+        }
+        
+        // Exactly one comma between pairs, none before the "]"
+        u8 val = data[stream->at];
+        if (stream->afterPair) {
+            if (val == ',') {
+                ++stream->at;
+                stream->afterPair = false;
+                stream->afterComma = true;
+            } else if (val == ']') {
+                stream->done = true;
+            } else {
+                pair_stream_error(stream, "Expected \",\" or \"]\" after a pair object");
+            }
+            
+            continue;
+        }
+        
+        if ((val == ']') && !stream->afterComma) {
+            stream->done = true;
+            break;
+        }
+        
+        if (val != '{') {
+            pair_stream_error(stream, "Expected a pair object");
+            break;
+        }
+        
+        String window = {stream->end - stream->at, data + stream->at};
+        u64 objectEnd = find_json_container_end(window, 1);
+        if (objectEnd == U64Max) {
+            if (stream->endOfFile) {
+                pair_stream_error(stream, "Stream ended inside a pair object");
+            } else if ((stream->at == 0) && (stream->end == source.count)) {
+                pair_stream_error(stream, "Pair object doesn't fit the stream buffer");
+            } else {
+                refill_pair_stream(stream);
+            }
+            
+            continue;
+        }
+        
+        String object = {objectEnd, window.data};
+        JsonElement* element = parse_json_strict(object);
+        if (element) {
+            convert_haversine_pair(element, pairs + pairCount++);
+        } else {
+            pair_stream_error(stream, "Malformed pair object");
+        }
+        free_json(element);
+        
+        stream->at += object.count;
+        stream->afterPair = true;
+        stream->afterComma = false;
+    }
+    
+    return pairCount;
+}
\ No newline at end of file
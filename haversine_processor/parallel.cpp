@@ -0,0 +1,254 @@
+// NOTE(alex): Minimal fork/join helper. Tasks are handed out in index order through a shared
+// counter, so a task's index (not the thread that ran it) is what callers should key results on.
+//
+// On machines with more than one NUMA node the threads are pinned, spread evenly over the nodes,
+// and the tasks are split into one contiguous range per node. A node's threads take tasks from
+// its own range first and only then help with the others. Callers pass a buffer over in
+// proportional chunks (task i of n covers bytes [i * size / n, (i + 1) * size / n)), so the part
+// of a buffer a node works on is the same from one pass to the next; spread_memory_over_nodes
+// puts those pages on that node.
+
+#define MAX_THREAD_COUNT 256
+
+typedef void parallel_task_func(void* context, u64 taskIndex, u32 threadIndex);
+
+struct ParallelState {
+    bool initialized;
+    bool numaDisabled;
+    NumaTopology topology;
+};
+
+static ParallelState gParallel;
+
+// One per node, a cache line each so the nodes don't share their counters' line.
+struct ParallelNodeQueue {
+    volatile u64 nextTask;
+    u64 endTask;
+    u8 padding[48];
+};
+
+struct ParallelWork {
+    parallel_task_func* func;
+    void* context;
+    u64 taskCount;
+    
+    u32 nodeCount;
+    ParallelNodeQueue queues[MAX_NUMA_NODE_COUNT];
+};
+
+struct ParallelWorker {
+    ParallelWork* work;
+    u32 threadIndex;
+    u32 node;          // Index into the queues (and gParallel.topology.nodes when pinned)
+    bool pin;
+    
+    u64 taskCount;     // Tasks this worker ran
+    u64 finishTsc;
+};
+
+static void parallel_worker(void* data) {
+    ParallelWorker* worker = (ParallelWorker*)data;
+    ParallelWork* work = worker->work;
+    
+    if (worker->pin) {
+        pin_thread_to_node(gParallel.topology.nodes + worker->node, 0);
+    }
+    
+    for (u32 i = 0; i < work->nodeCount; i++) {
+        ParallelNodeQueue* queue = work->queues + ((worker->node + i) % work->nodeCount);
+        
+        while (true) {
+            u64 taskIndex = atomic_add_u64(&queue->nextTask, 1);
+            if (taskIndex >= queue->endTask) {
+                break;
+            }
+            
+            work->func(work->context, taskIndex, worker->threadIndex);
+            worker->taskCount++;
+        }
+    }
+    
+    worker->finishTsc = read_cpu_timer();
+}
+
+static void init_parallel() {
+    if (!gParallel.initialized) {
+        gParallel.topology = get_numa_topology();
+        gParallel.initialized = true;
+    }
+}
+
+// For --no-numa, to compare against the OS placing threads and memory on its own.
+static void disable_numa() {
+    gParallel.numaDisabled = true;
+}
+
+static u32 clamp_thread_count(u32 threadCount) {
+    if (threadCount == 0) {
+        threadCount = get_logical_processor_count();
+    }
+    
+    if (threadCount > MAX_THREAD_COUNT) {
+        threadCount = MAX_THREAD_COUNT;
+    }
+    
+    return threadCount;
+}
+
+// Nodes run_parallel splits the work over with threadCount (already clamped) threads, 1 when it
+// doesn't pin at all.
+static u32 get_parallel_node_count(u32 threadCount) {
+    init_parallel();
+    
+    u32 result = gParallel.topology.nodeCount;
+    if (gParallel.numaDisabled || (result < 2) || (threadCount < 2)) {
+        result = 1;
+    } else if (result > threadCount) {
+        result = threadCount;
+    }
+    
+    return result;
+}
+
+// Like run_parallel. With a label the time and bytes (byteCount over all tasks, assumed spread
+// evenly) each node took are added to the profile, see PROFILE_NODE_WORK.
+static void run_parallel_data(u32 threadCount, u64 taskCount, parallel_task_func* func, void* context,
+                              const char* label, u64 byteCount) {
+    ParallelWork work = {};
+    work.func = func;
+    work.context = context;
+    work.taskCount = taskCount;
+    
+    threadCount = clamp_thread_count(threadCount);
+    if ((u64)threadCount > taskCount) {
+        threadCount = taskCount ? (u32)taskCount : 1;
+    }
+    
+    work.nodeCount = get_parallel_node_count(threadCount);
+    for (u32 i = 0; i < work.nodeCount; i++) {
+        work.queues[i].nextTask = taskCount * i / work.nodeCount;
+        work.queues[i].endTask = taskCount * (i + 1) / work.nodeCount;
+    }
+    
+    bool pin = (work.nodeCount > 1);
+    
+    Thread threads[MAX_THREAD_COUNT];
+    ParallelWorker workers[MAX_THREAD_COUNT];
+    u32 startedCount = 0;
+    
+    u64 startTsc = read_cpu_timer();
+    
+    // NOTE(alex): workers[0] is the calling thread. Threads i * nodeCount / threadCount, so each
+    // node gets the same number of threads give or take one.
+    for (u32 i = 0; i < threadCount; i++) {
+        ParallelWorker* worker = workers + i;
+        *worker = {};
+        worker->work = &work;
+        worker->threadIndex = i;
+        worker->node = (u32)((u64)i * work.nodeCount / threadCount);
+        worker->pin = pin;
+    }
+    
+    for (u32 i = 1; i < threadCount; i++) {
+        if (create_thread(threads + startedCount, parallel_worker, workers + i)) {
+            startedCount++;
+        }
+    }
+    
+    // The calling thread goes back to where it was allowed to run afterwards
+    ThreadAffinity previousAffinity;
+    bool pinnedSelf = pin && pin_thread_to_node(gParallel.topology.nodes + workers[0].node, &previousAffinity);
+    workers[0].pin = false;
+    
+    parallel_worker(workers);
+    
+    if (pinnedSelf) {
+        restore_thread_affinity(&previousAffinity);
+    }
+    
+    for (u32 i = 0; i < startedCount; i++) {
+        join_thread(threads + i);
+    }
+    
+    if (label && taskCount) {
+        for (u32 node = 0; node < work.nodeCount; node++) {
+            u64 nodeTaskCount = 0;
+            u64 finishTsc = startTsc;
+            
+            for (u32 i = 0; i < threadCount; i++) {
+                if (workers[i].node == node) {
+                    nodeTaskCount += workers[i].taskCount;
+                    finishTsc = (workers[i].finishTsc > finishTsc) ? workers[i].finishTsc : finishTsc;
+                }
+            }
+            
+            u32 osNode = pin ? gParallel.topology.nodes[node].id : 0;
+            PROFILE_NODE_WORK(label, osNode, nodeTaskCount, byteCount * nodeTaskCount / taskCount, finishTsc - startTsc);
+        }
+    }
+}
+
+// The calling thread takes part as thread 0.
+static void run_parallel(u32 threadCount, u64 taskCount, parallel_task_func* func, void* context) {
+    run_parallel_data(threadCount, taskCount, func, context, 0, 0);
+}
+
+#define NUMA_TOUCH_CHUNK_SIZE (2ull * 1024 * 1024)
+
+struct NumaTouch {
+    u8* data;
+    u64 size;
+    u64 pageSize;
+    u64 chunkCount;
+};
+
+static void numa_touch_task(void* context, u64 taskIndex, u32 threadIndex) {
+    (void)threadIndex;
+    NumaTouch* touch = (NumaTouch*)context;
+    
+    u64 start = touch->size * taskIndex / touch->chunkCount;
+    u64 end = touch->size * (taskIndex + 1) / touch->chunkCount;
+    
+    // Writing the byte back is what makes the OS back a page, reading alone maps a shared zero page
+    for (u64 at = start; at < end; at += touch->pageSize) {
+        volatile u8* byte = touch->data + at;
+        *byte = *byte;
+    }
+    
+    if (end > start) {
+        volatile u8* last = touch->data + end - 1;
+        *last = *last;
+    }
+}
+
+// Places the pages of data on the nodes that will work on them in a run_parallel pass over it in
+// proportional chunks with threadCount threads. Pages that were already touched only move where
+// the OS can bind existing memory (Linux); elsewhere this only works on fresh allocations, which
+// it first touches from the right node.
+static void spread_memory_over_nodes(u32 threadCount, u8* data, u64 size) {
+    threadCount = clamp_thread_count(threadCount);
+    u32 nodeCount = get_parallel_node_count(threadCount);
+    
+    if ((nodeCount < 2) || !size) {
+        return;
+    }
+    
+    PROFILE_FUNC_DATA(size);
+    
+    bool bound = true;
+    for (u32 i = 0; (i < nodeCount) && bound; i++) {
+        u64 start = size * i / nodeCount;
+        u64 end = size * (i + 1) / nodeCount;
+        bound = bind_memory_to_node(data + start, end - start, gParallel.topology.nodes + i);
+    }
+    
+    if (!bound) {
+        NumaTouch touch = {};
+        touch.data = data;
+        touch.size = size;
+        touch.pageSize = 4096;
+        touch.chunkCount = (size + NUMA_TOUCH_CHUNK_SIZE - 1) / NUMA_TOUCH_CHUNK_SIZE;
+        
+        run_parallel(threadCount, touch.chunkCount, numa_touch_task, &touch);
+    }
+}
\ No newline at end of file
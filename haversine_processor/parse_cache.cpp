@@ -0,0 +1,309 @@
+// Sidecar cache of parsed pairs, written next to the JSON as "<input>.pairs".
+//
+// The file is a ParseCacheHeader followed by the HaversinePair array, in the native layout, so a
+// later run can map it and hand the pairs straight to the rest of the pipeline. The header holds
+// a fingerprint of the JSON it was made from; any mismatch means the cache is ignored and
+// rewritten.
+//
+// Inputs that only grow by pairs appended to the array can be picked up incrementally instead
+// (--incremental): the header also records where the array ended and a SumCheckpoint, so only
+// the new tail is parsed and summed and the new pairs are appended to the cache in place.
+
+#define PARSE_CACHE_MAGIC 0x43505648 // "HVPC"
+#define PARSE_CACHE_VERSION 2
+#define PARSE_CACHE_SAMPLE_SIZE 4096
+#define PARSE_CACHE_SAMPLE_COUNT 64
+#define PARSE_CACHE_MAX_PATH 1024
+
+struct FileFingerprint {
+    u64 size;
+    u64 modifiedTime;
+    u64 sampleHash;
+};
+
+struct ParseCacheHeader {
+    u32 magic;
+    u32 version;
+    u64 headerSize; // Pairs start right after the header
+    
+    FileFingerprint source;
+    
+    u64 pairCount;
+    
+    u32 hasSum;
+    u32 sumMode;
+    double sum;
+    
+    // Resume point for appended inputs
+    u64 hasCheckpoint;
+    u64 appendPoint; // See find_pairs_append_point
+    u64 prefixHash;  // sample_hash of the input up to appendPoint
+    SumCheckpoint checkpoint;
+};
+
+struct ParseCache {
+    MappedFile file;
+    ParseCacheHeader* header;
+    HaversinePair* pairs;
+};
+
+static u64 hash_bytes(u64 hash, u8* data, u64 count) {
+    u64 i = 0;
+    for (; (i + 8) <= count; i += 8) {
+        u64 word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 32;
+    }
+    
+    for (; i < count; i++) {
+        hash = (hash ^ data[i]) * 0x100000001B3ull;
+    }
+    
+    hash ^= count;
+    
+    return hash;
+}
+
+// NOTE(alex): Hashing the whole input would cost about as much as the read we're trying to skip,
+// so only PARSE_CACHE_SAMPLE_COUNT blocks spread evenly over the data are hashed (always
+// including the first and the last). Together with the size and mtime that catches regenerated
+// files; an in-place edit that keeps the size and mtime and misses every sample won't be seen.
+static u64 sample_hash(String data) {
+    u64 result = 0xCBF29CE484222325ull;
+    
+    if (data.count <= (PARSE_CACHE_SAMPLE_SIZE * PARSE_CACHE_SAMPLE_COUNT)) {
+        result = hash_bytes(result, data.data, data.count);
+    } else {
+        u64 lastStart = data.count - PARSE_CACHE_SAMPLE_SIZE;
+        for (u64 i = 0; i < PARSE_CACHE_SAMPLE_COUNT; i++) {
+            u64 start = (lastStart * i) / (PARSE_CACHE_SAMPLE_COUNT - 1);
+            result = hash_bytes(result, data.data + start, PARSE_CACHE_SAMPLE_SIZE);
+        }
+    }
+    
+    return result;
+}
+
+static bool fingerprint_file(const char* path, FileFingerprint* fingerprint) {
+    PROFILE_FUNC();
+    
+    bool result = false;
+    
+    FileInfo info = get_file_info(path);
+    MappedFile file = map_file(path);
+    
+    if (info.exists && (file.data.count == info.size)) {
+        fingerprint->size = info.size;
+        fingerprint->modifiedTime = info.modifiedTime;
+        fingerprint->sampleHash = sample_hash(file.data);
+        result = true;
+    }
+    
+    unmap_file(&file);
+    
+    return result;
+}
+
+static bool are_equal(FileFingerprint* a, FileFingerprint* b) {
+    bool result = ((a->size == b->size) &&
+                   (a->modifiedTime == b->modifiedTime) &&
+                   (a->sampleHash == b->sampleHash));
+    return result;
+}
+
+static bool make_parse_cache_path(const char* inputPath, char* buffer, u64 bufferSize) {
+    int length = snprintf(buffer, bufferSize, "%s.pairs", inputPath);
+    bool result = (length > 0) && ((u64)length < bufferSize);
+    return result;
+}
+
+// Returns a cache with pairs set only if the file exists and is well formed. Whether it matches
+// the input is up to the caller.
+static ParseCache open_parse_cache(const char* cachePath) {
+    PROFILE_FUNC();
+    
+    ParseCache result = {};
+    result.file = map_file(cachePath);
+    
+    if (result.file.data.count >= sizeof(ParseCacheHeader)) {
+        ParseCacheHeader* header = (ParseCacheHeader*)result.file.data.data;
+        
+        u64 expectedSize = sizeof(ParseCacheHeader) + header->pairCount * sizeof(HaversinePair);
+        if ((header->magic == PARSE_CACHE_MAGIC) &&
+            (header->version == PARSE_CACHE_VERSION) &&
+            (header->headerSize == sizeof(ParseCacheHeader)) &&
+            (header->pairCount <= (result.file.data.count / sizeof(HaversinePair))) &&
+            (result.file.data.count == expectedSize)) {
+            result.header = header;
+            result.pairs = (HaversinePair*)(result.file.data.data + header->headerSize);
+        }
+    }
+    
+    if (!result.pairs) {
+        unmap_file(&result.file);
+    }
+    
+    return result;
+}
+
+static void close_parse_cache(ParseCache* cache) {
+    unmap_file(&cache->file);
+    *cache = {};
+}
+
+// Writes to a temporary file first and swaps it in, so a reader never maps a half written cache.
+static bool write_parse_cache(const char* cachePath, ParseCacheHeader* header, HaversinePair* pairs) {
+    PROFILE_FUNC_DATA(header->pairCount * sizeof(HaversinePair));
+    
+    bool result = false;
+    
+    char tempPath[PARSE_CACHE_MAX_PATH];
+    if (snprintf(tempPath, sizeof(tempPath), "%s.tmp", cachePath) >= (int)sizeof(tempPath)) {
+        return result;
+    }
+    
+    header->magic = PARSE_CACHE_MAGIC;
+    header->version = PARSE_CACHE_VERSION;
+    header->headerSize = sizeof(ParseCacheHeader);
+    
+    FILE* file = fopen(tempPath, "wb");
+    if (file) {
+        bool written = (fwrite(header, sizeof(*header), 1, file) == 1);
+        if (written && header->pairCount) {
+            written = (fwrite(pairs, header->pairCount * sizeof(HaversinePair), 1, file) == 1);
+        }
+        
+        written = (fclose(file) == 0) && written;
+        
+        if (written) {
+            result = replace_file(tempPath, cachePath);
+        }
+        
+        if (!result) {
+            remove(tempPath);
+        }
+    }
+    
+    if (!result) {
+        fprintf(stderr, "ERROR: Can't write parse cache \"%s\"\n", cachePath);
+    }
+    
+    return result;
+}
+
+// NOTE(alex): The pairs go on the end first and the header is rewritten last. If anything fails
+// in between the file is longer than the old header says, which open_parse_cache rejects, so the
+// next run just starts over.
+static bool append_parse_cache(const char* cachePath, ParseCacheHeader* header, u64 newPairCount, HaversinePair* newPairs) {
+    PROFILE_FUNC_DATA(newPairCount * sizeof(HaversinePair));
+    
+    bool result = false;
+    
+    FILE* file = fopen(cachePath, "ab");
+    if (file) {
+        bool written = !newPairCount || (fwrite(newPairs, newPairCount * sizeof(HaversinePair), 1, file) == 1);
+        result = (fclose(file) == 0) && written;
+    }
+    
+    if (result) {
+        file = fopen(cachePath, "r+b");
+        result = false;
+        if (file) {
+            bool written = (fwrite(header, sizeof(*header), 1, file) == 1);
+            result = (fclose(file) == 0) && written;
+        }
+    }
+    
+    if (!result) {
+        fprintf(stderr, "ERROR: Can't update parse cache \"%s\"\n", cachePath);
+    }
+    
+    return result;
+}
+
+// Records where pairs would be appended to inputJson and sums the pairs up to the last whole sum
+// block, so a later run can resume from there.
+static void checkpoint_parse_cache(ParseCacheHeader* header, u32 threadCount, String inputJson, HaversinePair* pairs) {
+    PROFILE_FUNC_DATA(header->pairCount * sizeof(HaversinePair));
+    
+    u64 appendPoint = find_pairs_append_point(inputJson);
+    if (appendPoint != U64Max) {
+        String prefix = {appendPoint, inputJson.data};
+        
+        header->hasCheckpoint = true;
+        header->appendPoint = appendPoint;
+        header->prefixHash = sample_hash(prefix);
+        header->checkpoint = {};
+        resume_neumaier_sum(threadCount, header->pairCount, pairs, &header->checkpoint, 0);
+    }
+}
+
+// Brings a cache made from an earlier version of the input up to date when the input only had
+// pairs appended since. On success the cache is mapped again and matches fingerprint.
+static bool resume_parse_cache(ParseCache* cache, u32 threadCount, const char* inputPath, const char* cachePath,
+                               FileFingerprint* fingerprint) {
+    PROFILE_FUNC();
+    
+    ParseCacheHeader header = *cache->header;
+    if (!header.hasCheckpoint || (fingerprint->size < header.appendPoint)) {
+        return false;
+    }
+    
+    bool result = false;
+    
+    MappedFile input = map_file(inputPath);
+    String prefix = {header.appendPoint, input.data.data};
+    
+    if ((input.data.count == fingerprint->size) && (sample_hash(prefix) == header.prefixHash)) {
+        // The pairs after the checkpoint's last whole block are summed again, ahead of the new ones
+        u64 carryCount = header.pairCount - header.checkpoint.pairCount;
+        u32 minimumJsonPairEncoding = 6 * 4;
+        u64 maxNewPairCount = (input.data.count - header.appendPoint) / minimumJsonPairEncoding;
+        
+        String pairMemory = allocate_string((carryCount + maxNewPairCount) * sizeof(HaversinePair));
+        if (pairMemory.data) {
+            HaversinePair* pairs = (HaversinePair*)pairMemory.data;
+            memcpy(pairs, cache->pairs + header.checkpoint.pairCount, carryCount * sizeof(HaversinePair));
+            
+            u64 appendPoint = 0;
+            u64 newPairCount = parse_haversine_pair_tail(input.data, header.appendPoint, header.pairCount != 0,
+                                                         maxNewPairCount, pairs + carryCount, &appendPoint);
+            
+            if (newPairCount != U64Max) {
+                u64 oldPairCount = header.pairCount;
+                u64 oldAppendPoint = header.appendPoint;
+                
+                double total = resume_neumaier_sum(threadCount, carryCount + newPairCount, pairs, &header.checkpoint, 0);
+                prefix.count = appendPoint;
+                
+                header.source = *fingerprint;
+                header.pairCount += newPairCount;
+                header.sumMode = SumMode_Neumaier;
+                header.sum = header.pairCount ? (total / (double)header.pairCount) : 0.0;
+                
+                // NOTE(alex): resume_neumaier_sum gives NaN when it couldn't allocate, that mustn't
+                // be served as the cached sum on every run after.
+                header.hasSum = isfinite(header.sum);
+                header.appendPoint = appendPoint;
+                header.prefixHash = sample_hash(prefix);
+                
+                close_parse_cache(cache);
+                
+                if (append_parse_cache(cachePath, &header, newPairCount, pairs + carryCount)) {
+                    *cache = open_parse_cache(cachePath);
+                    result = (cache->pairs != 0) && are_equal(&cache->header->source, fingerprint);
+                    
+                    fprintf(stdout, "Parse cache: resumed %llu pairs at byte %llu, %llu new pairs\n",
+                            oldPairCount, oldAppendPoint, newPairCount);
+                }
+            }
+        }
+        
+        free_string(&pairMemory);
+    }
+    
+    unmap_file(&input);
+    
+    return result;
+}
\ No newline at end of file
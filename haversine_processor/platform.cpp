@@ -0,0 +1,806 @@
+#if _WIN32
+// windows.h comes in through metrics.cpp
+#include <winsock2.h> // socket(), needs ws2_32.lib
+#include <afunix.h> // sockaddr_un, Windows 10 1803 and later
+#else
+#include <pthread.h>
+#include <fcntl.h> // open()
+#include <sys/mman.h> // mmap()
+#include <glob.h> // glob()
+#include <sys/socket.h> // socket()
+#include <sys/un.h> // sockaddr_un
+#include <sys/time.h> // timeval
+#include <sched.h> // cpu_set_t
+#endif
+
+#define MAX_NUMA_NODE_COUNT 64
+
+typedef void file_match_func(void* context, const char* path);
+
+struct FileInfo {
+    bool exists;
+    u64 size;
+    u64 modifiedTime; // OS specific units, only meant for equality checks
+};
+
+struct MappedFile {
+    String data;
+#if _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int file;
+#endif
+};
+
+struct Mutex {
+#if _WIN32
+    SRWLOCK lock;
+#else
+    pthread_mutex_t lock;
+#endif
+};
+
+// Stream socket on a filesystem path (AF_UNIX)
+struct LocalSocket {
+#if _WIN32
+    SOCKET handle;
+#else
+    int handle;
+#endif
+    bool valid;
+};
+
+struct NumaNode {
+    u32 id; // The OS's node number
+    u32 cpuCount;
+#if _WIN32
+    GROUP_AFFINITY affinity;
+#else
+    cpu_set_t cpus;
+#endif
+};
+
+// Nodes with at least one CPU this process may run on
+struct NumaTopology {
+    u32 nodeCount;
+    NumaNode nodes[MAX_NUMA_NODE_COUNT];
+};
+
+#if _WIN32
+
+static u64 atomic_add_u64(volatile u64* value, u64 addend) {
+    u64 result = (u64)InterlockedExchangeAdd64((volatile LONG64*)value, (LONG64)addend);
+    return result;
+}
+
+static u32 atomic_add_u32(volatile u32* value, u32 addend) {
+    u32 result = (u32)InterlockedExchangeAdd((volatile LONG*)value, (LONG)addend);
+    return result;
+}
+
+// Sets value to desired if it was expected. Returns whether it did.
+static bool atomic_compare_exchange_u32(volatile u32* value, u32 expected, u32 desired) {
+    bool result = (u32)InterlockedCompareExchange((volatile LONG*)value, (LONG)desired, (LONG)expected) == expected;
+    return result;
+}
+
+static NumaTopology get_numa_topology() {
+    NumaTopology result = {};
+    
+    ULONG highestNode = 0;
+    if (GetNumaHighestNodeNumber(&highestNode)) {
+        for (u32 id = 0; (id <= highestNode) && (result.nodeCount < MAX_NUMA_NODE_COUNT); id++) {
+            NumaNode node = {};
+            node.id = id;
+            
+            if (GetNumaNodeProcessorMaskEx((USHORT)id, &node.affinity)) {
+                for (KAFFINITY mask = node.affinity.Mask; mask; mask &= mask - 1) {
+                    node.cpuCount++;
+                }
+            }
+            
+            if (node.cpuCount) {
+                result.nodes[result.nodeCount++] = node;
+            }
+        }
+    }
+    
+    return result;
+}
+
+// Restricts the calling thread to node's CPUs. previous (optional) gets what it was before.
+static bool pin_thread_to_node(NumaNode* node, ThreadAffinity* previous) {
+    bool result = SetThreadGroupAffinity(GetCurrentThread(), &node->affinity, previous ? &previous->affinity : 0) != 0;
+    return result;
+}
+
+// NOTE(alex): Windows can only choose the node of memory when it's allocated (VirtualAllocExNuma),
+// not for a range that already exists. Callers fall back to touching the pages from the node.
+static bool bind_memory_to_node(u8* memory, u64 size, NumaNode* node) {
+    (void)memory;
+    (void)size;
+    (void)node;
+    return false;
+}
+
+// Calls func with every file (not directory) matching pattern. Wildcards only work in the last
+// path component.
+static void for_each_matching_file(const char* pattern, file_match_func* func, void* context) {
+    const char* lastSeparator = 0;
+    for (const char* at = pattern; *at; at++) {
+        if ((*at == '/') || (*at == '\\')) {
+            lastSeparator = at;
+        }
+    }
+    int directoryLength = lastSeparator ? (int)(lastSeparator - pattern + 1) : 0;
+    
+    WIN32_FIND_DATAA found;
+    HANDLE search = FindFirstFileA(pattern, &found);
+    if (search != INVALID_HANDLE_VALUE) {
+        do {
+            if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+                char path[2 * MAX_PATH];
+                if (snprintf(path, sizeof(path), "%.*s%s", directoryLength, pattern, found.cFileName) < (int)sizeof(path)) {
+                    func(context, path);
+                }
+            }
+        } while (FindNextFileA(search, &found));
+        
+        FindClose(search);
+    }
+}
+
+static FileInfo get_file_info(const char* path) {
+    FileInfo result = {};
+    
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (GetFileAttributesExA(path, GetFileExInfoStandard, &data)) {
+        result.exists = true;
+        result.size = ((u64)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+        result.modifiedTime = ((u64)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+    }
+    
+    return result;
+}
+
+// Atomically puts from in place of to, replacing to if it exists.
+static bool replace_file(const char* from, const char* to) {
+    bool result = MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+    return result;
+}
+
+static MappedFile map_file(const char* path) {
+    MappedFile result = {};
+    
+    result.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (result.file == INVALID_HANDLE_VALUE) {
+        result.file = 0;
+        return result;
+    }
+    
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(result.file, &size) && size.QuadPart) {
+        result.mapping = CreateFileMappingA(result.file, 0, PAGE_READONLY, 0, 0, 0);
+        if (result.mapping) {
+            result.data.data = (u8*)MapViewOfFile(result.mapping, FILE_MAP_READ, 0, 0, 0);
+            if (result.data.data) {
+                result.data.count = size.QuadPart;
+            }
+        }
+    }
+    
+    return result;
+}
+
+static void unmap_file(MappedFile* file) {
+    if (file->data.data) {
+        UnmapViewOfFile(file->data.data);
+    }
+    
+    if (file->mapping) {
+        CloseHandle(file->mapping);
+    }
+    
+    if (file->file) {
+        CloseHandle(file->file);
+    }
+    
+    *file = {};
+}
+
+// Address space only, nothing is backed until commit_memory.
+static u8* reserve_memory(u64 size) {
+    u8* result = (u8*)VirtualAlloc(0, size, MEM_RESERVE, PAGE_READWRITE);
+    return result;
+}
+
+// NOTE(alex): Large pages on Windows have to be allocated whole and locked, with
+// SeLockMemoryPrivilege, which doesn't fit memory committed a piece at a time. hugePages is
+// ignored here.
+static bool commit_memory(u8* memory, u64 size, bool hugePages) {
+    (void)hugePages;
+    bool result = VirtualAlloc(memory, size, MEM_COMMIT, PAGE_READWRITE) != 0;
+    return result;
+}
+
+static void release_memory(u8* memory, u64 size) {
+    (void)size; // MEM_RELEASE always frees the whole reservation
+    VirtualFree(memory, 0, MEM_RELEASE);
+}
+
+// Maps size bytes of a new file at path for writing, so the pages can be written out to it
+// instead of the page file. The file is sparse and goes away with unmap_file. Fails if anything
+// is at path already rather than replacing it.
+static MappedFile map_spill_file(const char* path, u64 size) {
+    MappedFile result = {};
+    
+    result.file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_NEW,
+                              FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, 0);
+    if (result.file == INVALID_HANDLE_VALUE) {
+        result.file = 0;
+        return result;
+    }
+    
+    DWORD ignored;
+    DeviceIoControl(result.file, FSCTL_SET_SPARSE, 0, 0, 0, 0, &ignored, 0);
+    
+    result.mapping = CreateFileMappingA(result.file, 0, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, 0);
+    if (result.mapping) {
+        result.data.data = (u8*)MapViewOfFile(result.mapping, FILE_MAP_WRITE, 0, 0, 0);
+        if (result.data.data) {
+            result.data.count = size;
+        }
+    }
+    
+    return result;
+}
+
+static void init_mutex(Mutex* mutex) {
+    InitializeSRWLock(&mutex->lock);
+}
+
+static void lock_mutex(Mutex* mutex) {
+    AcquireSRWLockExclusive(&mutex->lock);
+}
+
+static void unlock_mutex(Mutex* mutex) {
+    ReleaseSRWLockExclusive(&mutex->lock);
+}
+
+static void destroy_mutex(Mutex* mutex) {
+    (void)mutex; // SRW locks have nothing to free
+}
+
+static bool init_sockets() {
+    static bool initialized = false;
+    
+    if (!initialized) {
+        WSADATA data;
+        initialized = (WSAStartup(MAKEWORD(2, 2), &data) == 0);
+    }
+    
+    return initialized;
+}
+
+static bool make_local_address(const char* path, sockaddr_un* address) {
+    *address = {};
+    address->sun_family = AF_UNIX;
+    
+    bool result = strlen(path) < sizeof(address->sun_path);
+    if (result) {
+        strcpy(address->sun_path, path);
+    }
+    
+    return result;
+}
+
+// Replaces a socket file left behind by a previous run.
+static bool listen_local_socket(const char* path, LocalSocket* result) {
+    *result = {};
+    
+    sockaddr_un address;
+    if (!init_sockets() || !make_local_address(path, &address)) {
+        return false;
+    }
+    
+    result->handle = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (result->handle == INVALID_SOCKET) {
+        return false;
+    }
+    result->valid = true;
+    
+    DeleteFileA(path);
+    
+    bool listening = ((bind(result->handle, (sockaddr*)&address, sizeof(address)) == 0) &&
+                      (listen(result->handle, SOMAXCONN) == 0));
+    if (!listening) {
+        closesocket(result->handle);
+        *result = {};
+    }
+    
+    return listening;
+}
+
+static bool accept_local_socket(LocalSocket* listener, LocalSocket* result) {
+    *result = {};
+    
+    result->handle = accept(listener->handle, 0, 0);
+    result->valid = (result->handle != INVALID_SOCKET);
+    
+    return result->valid;
+}
+
+static bool connect_local_socket(const char* path, LocalSocket* result) {
+    *result = {};
+    
+    sockaddr_un address;
+    if (!init_sockets() || !make_local_address(path, &address)) {
+        return false;
+    }
+    
+    result->handle = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (result->handle == INVALID_SOCKET) {
+        return false;
+    }
+    result->valid = true;
+    
+    if (connect(result->handle, (sockaddr*)&address, sizeof(address)) != 0) {
+        closesocket(result->handle);
+        *result = {};
+    }
+    
+    return result->valid;
+}
+
+static bool send_all(LocalSocket* socket, void* data, u64 size) {
+    u8* at = (u8*)data;
+    
+    while (size) {
+        int sent = send(socket->handle, (char*)at, (size > INT_MAX) ? INT_MAX : (int)size, 0);
+        if (sent <= 0) {
+            return false;
+        }
+        at += sent;
+        size -= sent;
+    }
+    
+    return true;
+}
+
+// False if the peer closed or failed before size bytes arrived.
+static bool receive_all(LocalSocket* socket, void* data, u64 size) {
+    u8* at = (u8*)data;
+    
+    while (size) {
+        int received = recv(socket->handle, (char*)at, (size > INT_MAX) ? INT_MAX : (int)size, 0);
+        if (received <= 0) {
+            return false;
+        }
+        at += received;
+        size -= received;
+    }
+    
+    return true;
+}
+
+// Receives waiting longer than milliseconds for data fail, as if the peer had closed.
+static void set_local_socket_timeout(LocalSocket* socket, u32 milliseconds) {
+    DWORD timeout = milliseconds;
+    setsockopt(socket->handle, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+}
+
+// Fails sends and receives on socket, including ones already blocked in another thread. The
+// handle stays open until close_local_socket.
+static void shutdown_local_socket(LocalSocket* socket) {
+    if (socket->valid) {
+        shutdown(socket->handle, SD_BOTH);
+    }
+}
+
+static void close_local_socket(LocalSocket* socket) {
+    if (socket->valid) {
+        closesocket(socket->handle);
+    }
+    
+    *socket = {};
+}
+
+static void remove_local_socket(const char* path) {
+    DeleteFileA(path);
+}
+
+#else // _WIN32
+
+static u64 atomic_add_u64(volatile u64* value, u64 addend) {
+    u64 result = __atomic_fetch_add(value, addend, __ATOMIC_SEQ_CST);
+    return result;
+}
+
+static u32 atomic_add_u32(volatile u32* value, u32 addend) {
+    u32 result = __atomic_fetch_add(value, addend, __ATOMIC_SEQ_CST);
+    return result;
+}
+
+// Sets value to desired if it was expected. Returns whether it did.
+static bool atomic_compare_exchange_u32(volatile u32* value, u32 expected, u32 desired) {
+    bool result = __atomic_compare_exchange_n(value, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return result;
+}
+
+// Reads a sysfs list like "0-3,8-11" into cpus (which also works for node lists).
+static bool read_cpu_list(const char* path, cpu_set_t* cpus, u32* count) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    
+    char text[4096];
+    u64 length = fread(text, 1, sizeof(text) - 1, file);
+    text[length] = 0;
+    fclose(file);
+    
+    CPU_ZERO(cpus);
+    *count = 0;
+    
+    char* at = text;
+    while ((*at >= '0') && (*at <= '9')) {
+        u64 first = strtoull(at, &at, 10);
+        u64 last = first;
+        if (*at == '-') {
+            last = strtoull(at + 1, &at, 10);
+        }
+        
+        for (u64 i = first; (i <= last) && (i < CPU_SETSIZE); i++) {
+            CPU_SET(i, cpus);
+            ++*count;
+        }
+        
+        if (*at == ',') {
+            ++at;
+        }
+    }
+    
+    return true;
+}
+
+// NOTE(alex): Straight from sysfs so there's no libnuma dependency. Machines (or containers)
+// without /sys/devices/system/node come out as no nodes, which callers treat as one.
+static NumaTopology get_numa_topology() {
+    NumaTopology result = {};
+    
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return result;
+    }
+    
+    cpu_set_t onlineNodes;
+    u32 onlineCount = 0;
+    if (!read_cpu_list("/sys/devices/system/node/online", &onlineNodes, &onlineCount)) {
+        return result;
+    }
+    
+    for (u32 id = 0; (id < MAX_NUMA_NODE_COUNT) && (result.nodeCount < MAX_NUMA_NODE_COUNT); id++) {
+        if (!CPU_ISSET(id, &onlineNodes)) {
+            continue;
+        }
+        
+        char path[128];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", id);
+        
+        NumaNode node = {};
+        node.id = id;
+        
+        u32 cpuCount = 0;
+        if (read_cpu_list(path, &node.cpus, &cpuCount)) {
+            CPU_AND(&node.cpus, &node.cpus, &allowed);
+            node.cpuCount = CPU_COUNT(&node.cpus);
+        }
+        
+        if (node.cpuCount) {
+            result.nodes[result.nodeCount++] = node;
+        }
+    }
+    
+    return result;
+}
+
+// Restricts the calling thread to node's CPUs. previous (optional) gets what it was before.
+static bool pin_thread_to_node(NumaNode* node, ThreadAffinity* previous) {
+    if (previous) {
+        pthread_getaffinity_np(pthread_self(), sizeof(previous->cpus), &previous->cpus);
+    }
+    
+    bool result = (pthread_setaffinity_np(pthread_self(), sizeof(node->cpus), &node->cpus) == 0);
+    return result;
+}
+
+#define NUMA_MPOL_PREFERRED 1
+#define NUMA_MPOL_MF_MOVE (1 << 1)
+
+// Prefers node for the pages of memory, moving the ones already touched elsewhere. Only whole
+// pages inside the range are affected. mbind through syscall(), again to avoid libnuma.
+static bool bind_memory_to_node(u8* memory, u64 size, NumaNode* node) {
+    u64 pageSize = (u64)sysconf(_SC_PAGESIZE);
+    u64 start = ((u64)memory + pageSize - 1) & ~(pageSize - 1);
+    u64 end = ((u64)memory + size) & ~(pageSize - 1);
+    
+    if (end <= start) {
+        return true;
+    }
+    
+    unsigned long mask[MAX_NUMA_NODE_COUNT / (8 * sizeof(unsigned long))] = {};
+    mask[node->id / (8 * sizeof(unsigned long))] |= 1ul << (node->id % (8 * sizeof(unsigned long)));
+    
+    bool result = (syscall(SYS_mbind, start, end - start, NUMA_MPOL_PREFERRED, mask, MAX_NUMA_NODE_COUNT + 1,
+                           NUMA_MPOL_MF_MOVE) == 0);
+    return result;
+}
+
+// Calls func with every file (not directory) matching pattern, in sorted order.
+static void for_each_matching_file(const char* pattern, file_match_func* func, void* context) {
+    glob_t matches = {};
+    
+    if (glob(pattern, GLOB_MARK, 0, &matches) == 0) {
+        for (size_t i = 0; i < matches.gl_pathc; i++) {
+            const char* path = matches.gl_pathv[i];
+            size_t length = strlen(path);
+            
+            // GLOB_MARK puts a slash after directories
+            if (length && (path[length - 1] != '/')) {
+                func(context, path);
+            }
+        }
+    }
+    
+    globfree(&matches);
+}
+
+static FileInfo get_file_info(const char* path) {
+    FileInfo result = {};
+    
+    struct stat info;
+    if (stat(path, &info) == 0) {
+        result.exists = true;
+        result.size = info.st_size;
+        result.modifiedTime = (u64)info.st_mtim.tv_sec * 1000000000ull + (u64)info.st_mtim.tv_nsec;
+    }
+    
+    return result;
+}
+
+// Atomically puts from in place of to, replacing to if it exists.
+static bool replace_file(const char* from, const char* to) {
+    bool result = (rename(from, to) == 0);
+    return result;
+}
+
+static MappedFile map_file(const char* path) {
+    MappedFile result = {};
+    
+    result.file = open(path, O_RDONLY);
+    if (result.file == -1) {
+        result.file = 0;
+        return result;
+    }
+    
+    struct stat stat;
+    if ((fstat(result.file, &stat) == 0) && stat.st_size) {
+        void* data = mmap(0, stat.st_size, PROT_READ, MAP_PRIVATE, result.file, 0);
+        if (data != MAP_FAILED) {
+            result.data.data = (u8*)data;
+            result.data.count = stat.st_size;
+        }
+    }
+    
+    return result;
+}
+
+static void unmap_file(MappedFile* file) {
+    if (file->data.data) {
+        munmap(file->data.data, file->data.count);
+    }
+    
+    if (file->file) {
+        close(file->file);
+    }
+    
+    *file = {};
+}
+
+// Address space only, nothing is backed until commit_memory.
+static u8* reserve_memory(u64 size) {
+    void* result = mmap(0, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (result != MAP_FAILED) ? (u8*)result : 0;
+}
+
+// NOTE(alex): hugePages asks for transparent huge pages. The kernel may still use small pages,
+// so failing that isn't an error.
+static bool commit_memory(u8* memory, u64 size, bool hugePages) {
+    bool result = (mprotect(memory, size, PROT_READ | PROT_WRITE) == 0);
+    
+#ifdef MADV_HUGEPAGE
+    if (result && hugePages) {
+        madvise(memory, size, MADV_HUGEPAGE);
+    }
+#endif
+    
+    return result;
+}
+
+static void release_memory(u8* memory, u64 size) {
+    munmap(memory, size);
+}
+
+// Maps size bytes of a new file at path for writing, so the pages can be written out to it
+// instead of swap. The file is sparse and is unlinked right away, unmap_file frees it. Fails if
+// anything is at path already (a symlink included) rather than replacing it.
+static MappedFile map_spill_file(const char* path, u64 size) {
+    MappedFile result = {};
+    
+    result.file = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    if (result.file == -1) {
+        result.file = 0;
+        return result;
+    }
+    
+    unlink(path);
+    
+    if (ftruncate(result.file, size) == 0) {
+        void* data = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, result.file, 0);
+        if (data != MAP_FAILED) {
+            result.data.data = (u8*)data;
+            result.data.count = size;
+        }
+    }
+    
+    return result;
+}
+
+static void init_mutex(Mutex* mutex) {
+    pthread_mutex_init(&mutex->lock, 0);
+}
+
+static void lock_mutex(Mutex* mutex) {
+    pthread_mutex_lock(&mutex->lock);
+}
+
+static void unlock_mutex(Mutex* mutex) {
+    pthread_mutex_unlock(&mutex->lock);
+}
+
+static void destroy_mutex(Mutex* mutex) {
+    pthread_mutex_destroy(&mutex->lock);
+}
+
+static bool make_local_address(const char* path, sockaddr_un* address) {
+    *address = {};
+    address->sun_family = AF_UNIX;
+    
+    bool result = strlen(path) < sizeof(address->sun_path);
+    if (result) {
+        strcpy(address->sun_path, path);
+    }
+    
+    return result;
+}
+
+// Replaces a socket file left behind by a previous run.
+static bool listen_local_socket(const char* path, LocalSocket* result) {
+    *result = {};
+    
+    sockaddr_un address;
+    if (!make_local_address(path, &address)) {
+        return false;
+    }
+    
+    result->handle = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (result->handle == -1) {
+        return false;
+    }
+    result->valid = true;
+    
+    unlink(path);
+    
+    bool listening = ((bind(result->handle, (sockaddr*)&address, sizeof(address)) == 0) &&
+                      (listen(result->handle, SOMAXCONN) == 0));
+    if (!listening) {
+        close(result->handle);
+        *result = {};
+    }
+    
+    return listening;
+}
+
+static bool accept_local_socket(LocalSocket* listener, LocalSocket* result) {
+    *result = {};
+    
+    result->handle = accept(listener->handle, 0, 0);
+    result->valid = (result->handle != -1);
+    
+    return result->valid;
+}
+
+static bool connect_local_socket(const char* path, LocalSocket* result) {
+    *result = {};
+    
+    sockaddr_un address;
+    if (!make_local_address(path, &address)) {
+        return false;
+    }
+    
+    result->handle = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (result->handle == -1) {
+        return false;
+    }
+    result->valid = true;
+    
+    if (connect(result->handle, (sockaddr*)&address, sizeof(address)) != 0) {
+        close(result->handle);
+        *result = {};
+    }
+    
+    return result->valid;
+}
+
+// NOTE(alex): MSG_NOSIGNAL so a client that went away is an error here instead of a SIGPIPE.
+static bool send_all(LocalSocket* socket, void* data, u64 size) {
+    u8* at = (u8*)data;
+    
+    while (size) {
+        ssize_t sent = send(socket->handle, at, size, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        at += sent;
+        size -= sent;
+    }
+    
+    return true;
+}
+
+// False if the peer closed or failed before size bytes arrived.
+static bool receive_all(LocalSocket* socket, void* data, u64 size) {
+    u8* at = (u8*)data;
+    
+    while (size) {
+        ssize_t received = recv(socket->handle, at, size, 0);
+        if (received <= 0) {
+            return false;
+        }
+        at += received;
+        size -= received;
+    }
+    
+    return true;
+}
+
+// Receives waiting longer than milliseconds for data fail, as if the peer had closed.
+static void set_local_socket_timeout(LocalSocket* socket, u32 milliseconds) {
+    timeval timeout = {};
+    timeout.tv_sec = milliseconds / 1000;
+    timeout.tv_usec = (milliseconds % 1000) * 1000;
+    setsockopt(socket->handle, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+// Fails sends and receives on socket, including ones already blocked in another thread. The
+// handle stays open until close_local_socket.
+static void shutdown_local_socket(LocalSocket* socket) {
+    if (socket->valid) {
+        shutdown(socket->handle, SHUT_RDWR);
+    }
+}
+
+static void close_local_socket(LocalSocket* socket) {
+    if (socket->valid) {
+        close(socket->handle);
+    }
+    
+    *socket = {};
+}
+
+static void remove_local_socket(const char* path) {
+    unlink(path);
+}
+
+#endif // _WIN32
\ No newline at end of file
@@ -2,23 +2,64 @@
 #define PROFILER 0
 #endif
 
+// NOTE(alex): A custom block timer without its own _FREQ gets calibrated against the OS timer at
+// the end of the run (estimate_block_timer_freq).
 #ifndef PROFILER_BLOCK_TIMER
 #define PROFILER_BLOCK_TIMER read_cpu_timer
+#define PROFILER_BLOCK_TIMER_FREQ get_cpu_timer_freq
+#endif
+
+#ifndef PROFILER_BLOCK_TIMER_FREQ
+#define PROFILER_BLOCK_TIMER_FREQ estimate_block_timer_freq
+#endif
+
+// NOTE(alex): Snapshotting counters costs a couple of syscalls per block, so it's opt-in.
+#ifndef PROFILER_COUNTERS
+#define PROFILER_COUNTERS 0
 #endif
 
 #if PROFILER
 
+enum ProfileCounter {
+    ProfileCounter_PageFaults,
+    ProfileCounter_LlcMisses,
+    ProfileCounter_DtlbMisses,
+    
+    ProfileCounter_Count,
+};
+
+static_assert(ProfileCounter_Count == 1 + HwCounter_Count, "Profile counters must mirror the hardware counters");
+
+#if PROFILER_COUNTERS
+static void read_profile_counters(u64* values) {
+    values[ProfileCounter_PageFaults] = read_os_page_fault_count();
+    read_hardware_counters(values + ProfileCounter_LlcMisses);
+}
+#endif
+
 struct ProfileAnchor {
     u64 tscElapsedExclusive; // Does NOT include children
     u64 tscElapsedInclusive; // DOES include children
     u64 hitCount;
     u64 processedByteCount;
+    
+    u64 allocCount;
+    u64 allocByteCount;
+    u64 freeCount;
+    u64 peakLiveByteCount; // Highest live byte count seen while the block was open
+    
+    u64 counterExclusive[ProfileCounter_Count];
+    u64 counterInclusive[ProfileCounter_Count];
+    
     const char* label;
 };
 
 static ProfileAnchor gProfileAnchors[4096];
 static u32 gProfilerParent;
 
+static u64 gProfilerLiveByteCount;
+static u64 gProfilerPeakLiveByteCount;
+
 struct ProfileBlock {
     ProfileBlock(const char* label_, u32 anchorIndex_, u64 byteCount) {
         parentIndex = gProfilerParent;
@@ -30,7 +71,18 @@ struct ProfileBlock {
         oldTscElapsedInclusive = anchor->tscElapsedInclusive;
         anchor->processedByteCount += byteCount;
         
+        oldPeakLiveByteCount = gProfilerPeakLiveByteCount;
+        gProfilerPeakLiveByteCount = gProfilerLiveByteCount;
+        
         gProfilerParent = anchorIndex;
+        
+#if PROFILER_COUNTERS
+        for (u32 i = 0; i < ProfileCounter_Count; i++) {
+            oldCounterInclusive[i] = anchor->counterInclusive[i];
+        }
+        read_profile_counters(startCounters);
+#endif
+        
         startTsc = PROFILER_BLOCK_TIMER();
     }
     
@@ -41,20 +93,98 @@ struct ProfileBlock {
         ProfileAnchor* parent = &gProfileAnchors[parentIndex];
         ProfileAnchor* anchor = &gProfileAnchors[anchorIndex];
         
+#if PROFILER_COUNTERS
+        u64 endCounters[ProfileCounter_Count];
+        read_profile_counters(endCounters);
+        
+        // Same exclusive/inclusive bookkeeping as the TSC below
+        for (u32 i = 0; i < ProfileCounter_Count; i++) {
+            u64 counted = endCounters[i] - startCounters[i];
+            parent->counterExclusive[i] -= counted;
+            anchor->counterExclusive[i] += counted;
+            anchor->counterInclusive[i] = oldCounterInclusive[i] + counted;
+        }
+#endif
+        
         parent->tscElapsedExclusive -= elapsed;
         anchor->tscElapsedExclusive += elapsed;
         anchor->tscElapsedInclusive = oldTscElapsedInclusive + elapsed;
         anchor->hitCount++;
         anchor->label = label;
+        
+        if (anchor->peakLiveByteCount < gProfilerPeakLiveByteCount) {
+            anchor->peakLiveByteCount = gProfilerPeakLiveByteCount;
+        }
+        
+        // NOTE(alex): The enclosing block was open for our whole lifetime, so our peak is also its peak.
+        if (gProfilerPeakLiveByteCount < oldPeakLiveByteCount) {
+            gProfilerPeakLiveByteCount = oldPeakLiveByteCount;
+        }
     }
     
     const char* label;
     u64 oldTscElapsedInclusive;
+    u64 oldPeakLiveByteCount;
+#if PROFILER_COUNTERS
+    u64 oldCounterInclusive[ProfileCounter_Count];
+    u64 startCounters[ProfileCounter_Count];
+#endif
     u64 startTsc;
     u32 parentIndex;
     u32 anchorIndex;
 };
 
+// NOTE(alex): Allocations are attributed to the innermost open block. The ones made outside of
+// any block land on anchor 0.
+static void profile_allocation(u64 byteCount) {
+    ProfileAnchor* anchor = gProfileAnchors + gProfilerParent;
+    anchor->allocCount++;
+    anchor->allocByteCount += byteCount;
+    
+    gProfilerLiveByteCount += byteCount;
+    if (gProfilerPeakLiveByteCount < gProfilerLiveByteCount) {
+        gProfilerPeakLiveByteCount = gProfilerLiveByteCount;
+    }
+}
+
+static void profile_free(u64 byteCount) {
+    ProfileAnchor* anchor = gProfileAnchors + gProfilerParent;
+    anchor->freeCount++;
+    
+    gProfilerLiveByteCount -= byteCount;
+}
+
+static void print_allocations(ProfileAnchor* anchor) {
+    if (anchor->allocCount || anchor->freeCount) {
+        printf(" %-10llu %-14llu %-10llu %-14llu", anchor->allocCount, anchor->allocByteCount, anchor->freeCount, anchor->peakLiveByteCount);
+    } else {
+        printf(" %-10s %-14s %-10s %-14s", "", "", "", "");
+    }
+}
+
+static bool is_profile_counter_available(u32 counter) {
+    bool result = PROFILER_COUNTERS && ((counter == ProfileCounter_PageFaults) || gMetrics.hardwareCountersAvailable);
+    return result;
+}
+
+static const char* describe_profile_counter(u32 counter) {
+    const char* result = "PF";
+    
+    if (counter != ProfileCounter_PageFaults) {
+        result = describe_hardware_counter((HardwareCounter)(counter - ProfileCounter_LlcMisses));
+    }
+    
+    return result;
+}
+
+static void print_counters(ProfileAnchor* anchor) {
+    for (u32 i = 0; i < ProfileCounter_Count; i++) {
+        if (is_profile_counter_available(i)) {
+            printf(" %-12llu %-12llu", anchor->counterExclusive[i], anchor->counterInclusive[i]);
+        }
+    }
+}
+
 static void print_elapsed_time(u64 totalTscElapsed, u64 timerFreq, ProfileAnchor* anchor) {
     printf("%-30s %-10llu %-12llu ", anchor->label, anchor->hitCount, anchor->tscElapsedExclusive);
     
@@ -70,6 +200,9 @@ static void print_elapsed_time(u64 totalTscElapsed, u64 timerFreq, ProfileAnchor
     
     printf("%-30s", buf);
     
+    print_allocations(anchor);
+    print_counters(anchor);
+    
     if (anchor->processedByteCount) {
         double megabyte = 1024.0f * 1024.0f;
         double gigabyte = megabyte * 1024.0f;
@@ -88,8 +221,26 @@ static void print_elapsed_time(u64 totalTscElapsed, u64 timerFreq, ProfileAnchor
 static void print_anchor_data(u64 totalCpuElapsed, u64 timerFreq) {
     // Table header
     printf("\n");
-    printf("%-30s %-10s %-12s %-30s %-15s\n", "Label", "Hit count", "Tsc Exc.", "%", "Bandwidth");
-    printf("------------------------------ ---------- ------------ ------------------------------ ---------------\n");
+    printf("%-30s %-10s %-12s %-30s %-10s %-14s %-10s %-14s",
+           "Label", "Hit count", "Tsc Exc.", "%", "Allocs", "Alloc bytes", "Frees", "Peak live");
+    for (u32 i = 0; i < ProfileCounter_Count; i++) {
+        if (is_profile_counter_available(i)) {
+            char exc[32];
+            char inc[32];
+            sprintf(exc, "%s Exc.", describe_profile_counter(i));
+            sprintf(inc, "%s Inc.", describe_profile_counter(i));
+            printf(" %-12s %-12s", exc, inc);
+        }
+    }
+    printf(" %-15s\n", "Bandwidth");
+    
+    printf("------------------------------ ---------- ------------ ------------------------------ ---------- -------------- ---------- --------------");
+    for (u32 i = 0; i < ProfileCounter_Count; i++) {
+        if (is_profile_counter_available(i)) {
+            printf(" ------------ ------------");
+        }
+    }
+    printf(" ---------------\n");
     
     for (int i = 0; i < ARRAY_COUNT(gProfileAnchors); i++) {
         ProfileAnchor* anchor = &gProfileAnchors[i];
@@ -97,6 +248,79 @@ static void print_anchor_data(u64 totalCpuElapsed, u64 timerFreq) {
             print_elapsed_time(totalCpuElapsed, timerFreq, anchor);
         }
     }
+    
+    // Anchor 0 only ever collects allocations made outside of any block
+    ProfileAnchor* outside = &gProfileAnchors[0];
+    outside->peakLiveByteCount = gProfilerPeakLiveByteCount;
+    if (outside->allocCount || outside->freeCount) {
+        printf("%-30s %-10s %-12s %-30s", "(outside blocks)", "", "", "");
+        print_allocations(outside);
+        printf("\n");
+    }
+    
+    // NOTE(alex): The hardware counters are opened for the thread that called begin_profile, the
+    // pool workers' misses in a parallel stage don't show up in them. Page faults are process wide.
+    if (is_profile_counter_available(ProfileCounter_LlcMisses)) {
+        printf("\nLLC and dTLB misses are the main thread's only, page faults cover all threads.\n");
+    }
+    
+    printf("\nLive bytes at exit: %llu\n", gProfilerLiveByteCount);
+}
+
+// Per NUMA node totals of the parallel stages that report their bytes (run_parallel_data), so
+// the profile shows whether a node is starved for bandwidth. Filled in by the thread that called
+// run_parallel, after the workers are joined.
+struct ProfileNodeWork {
+    const char* label;
+    u32 node;
+    u64 runCount;
+    u64 taskCount;
+    u64 byteCount;
+    u64 tscElapsed; // From the start of a run until the node's last worker finished
+};
+
+static ProfileNodeWork gProfileNodeWork[256];
+static u32 gProfileNodeWorkCount;
+
+static void profile_node_work(const char* label, u32 node, u64 taskCount, u64 byteCount, u64 tscElapsed) {
+    ProfileNodeWork* work = 0;
+    for (u32 i = 0; (i < gProfileNodeWorkCount) && !work; i++) {
+        if ((gProfileNodeWork[i].label == label) && (gProfileNodeWork[i].node == node)) {
+            work = gProfileNodeWork + i;
+        }
+    }
+    
+    if (!work && (gProfileNodeWorkCount < ARRAY_COUNT(gProfileNodeWork))) {
+        work = gProfileNodeWork + gProfileNodeWorkCount++;
+        work->label = label;
+        work->node = node;
+    }
+    
+    if (work) {
+        work->runCount++;
+        work->taskCount += taskCount;
+        work->byteCount += byteCount;
+        work->tscElapsed += tscElapsed;
+    }
+}
+
+static void print_node_work(u64 timerFreq) {
+    if (!gProfileNodeWorkCount || !timerFreq) {
+        return;
+    }
+    
+    printf("\n%-30s %-6s %-10s %-12s %-14s %-15s\n", "Parallel stage", "Node", "Runs", "Tasks", "Bytes", "Bandwidth");
+    printf("------------------------------ ------ ---------- ------------ -------------- ---------------\n");
+    
+    for (u32 i = 0; i < gProfileNodeWorkCount; i++) {
+        ProfileNodeWork* work = gProfileNodeWork + i;
+        
+        double seconds = (double)work->tscElapsed / (double)timerFreq;
+        double gigabytesPerSecond = seconds ? ((double)work->byteCount / seconds) / (1024.0 * 1024.0 * 1024.0) : 0.0;
+        
+        printf("%-30s %-6u %-10llu %-12llu %-14llu %.2fgb/s\n", work->label, work->node, work->runCount,
+               work->taskCount, work->byteCount, gigabytesPerSecond);
+    }
 }
 
 #define NAME_CONCAT2(A, B) A##B
@@ -107,15 +331,23 @@ static void print_anchor_data(u64 totalCpuElapsed, u64 timerFreq) {
 #define PROFILE_FUNC() PROFILE_SCOPE(__func__)
 #define PROFILE_FUNC_DATA(bytes) PROFILE_SCOPE_DATA(__func__, bytes)
 
+#define PROFILE_ALLOCATION(bytes) profile_allocation(bytes)
+#define PROFILE_FREE(bytes) profile_free(bytes)
+#define PROFILE_NODE_WORK(label, node, tasks, bytes, tsc) profile_node_work(label, node, tasks, bytes, tsc)
+
 #define PROFILER_ASSERT static_assert(__COUNTER__ < ARRAY_COUNT(gProfileAnchors), "Number of profile points exceeds size of Profiler::Anchors")
 
 #else // PROFILER
 
 #define PROFILE_SCOPE(name)
-#define PROFILE_SCOPE_data(name, bytes)
+#define PROFILE_SCOPE_DATA(name, bytes)
 #define PROFILE_FUNC()
 #define PROFILE_FUNC_DATA(bytes)
+#define PROFILE_ALLOCATION(bytes)
+#define PROFILE_FREE(bytes)
+#define PROFILE_NODE_WORK(label, node, tasks, bytes, tsc)
 #define print_anchor_data(...)
+#define print_node_work(...)
 
 #define PROFILER_ASSERT
 
@@ -155,12 +387,20 @@ static u64 estimate_block_timer_freq() {
 }
 
 static void begin_profile() {
+#if PROFILER_COUNTERS
+    init_os_metrics();
+    
+    if (!gMetrics.hardwareCountersAvailable) {
+        fprintf(stderr, "WARNING: Hardware counters unavailable, only page faults will be reported.\n");
+    }
+#endif
+    
     gProfiler.startTsc = PROFILER_BLOCK_TIMER();
 }
 
 static void end_profile_and_print() {
     gProfiler.endTsc = PROFILER_BLOCK_TIMER();
-    u64 timerFreq = estimate_block_timer_freq();
+    u64 timerFreq = PROFILER_BLOCK_TIMER_FREQ();
     u64 totalCpuElapsed = gProfiler.endTsc - gProfiler.startTsc;
     
     if (timerFreq) {
@@ -168,4 +408,8 @@ static void end_profile_and_print() {
     }
     
     print_anchor_data(totalCpuElapsed, timerFreq);
+    print_node_work(timerFreq);
+    
+    u64 peakMemory = read_os_peak_memory_bytes();
+    printf("Peak RSS: %llu (%0.3fmb)\n", peakMemory, (double)peakMemory / (1024.0 * 1024.0));
 }
\ No newline at end of file
@@ -0,0 +1,575 @@
+// Resident service: keeps parsed inputs in memory and answers requests about them over a local
+// (AF_UNIX) socket, so repeated questions about the same file skip the read, the parse and the
+// sum.
+//
+// Datasets are cached by path and FileFingerprint. Loading one parses it, then sums it and gathers
+// DistanceStats in one pass, so sum and stats requests afterwards are a lookup. When the file's
+// size or mtime changes the dataset is loaded again. Least recently used datasets are dropped to
+// stay under the memory budget.
+//
+// A fixed number of workers each accept a connection and serve its requests until the client
+// closes it, so a client that keeps its connection pays only the round trip per request. A
+// connection that sits idle for SERVICE_IDLE_TIMEOUT_MS is closed so idle clients can't hold every
+// worker, and a shutdown request shuts down the connections other workers are serving.
+//
+// NOTE(alex): The profiler and allocate_string aren't thread safe, so the cache and everything
+// that loads into it runs under one mutex. Workers only do socket I/O outside of it. A cold load
+// holds up the other workers' requests until it's done.
+//
+// Protocol, all little-endian: a ServiceRequestHeader followed by pathLength bytes of path (no
+// terminator), answered by one ServiceResponse. Connections stay open for more requests.
+
+#define SERVICE_MAGIC 0x56534850 // "PHSV"
+#define SERVICE_VERSION 1
+#define SERVICE_MAX_PATH 1024
+#define SERVICE_MAX_DATASETS 64
+#define SERVICE_MAX_WORKERS 64
+#define SERVICE_VALUE_COUNT 8
+#define SERVICE_IDLE_TIMEOUT_MS 10000
+
+enum ServiceRequestType {
+    ServiceRequest_Sum,      // values[0] mean distance
+    ServiceRequest_Stats,    // min, max, mean, variance, p50, p90, p99, p99.9
+    ServiceRequest_Pair,     // x0, y0, x1, y1, distance of pair argument
+    ServiceRequest_Evict,    // Drops the dataset, nothing loaded
+    ServiceRequest_Shutdown, // No path
+    
+    ServiceRequest_Count,
+};
+
+enum ServiceStatus {
+    ServiceStatus_Ok,
+    ServiceStatus_BadRequest,
+    ServiceStatus_CantLoad,
+    ServiceStatus_OutOfRange,
+    
+    ServiceStatus_Count,
+};
+
+#define SERVICE_FLAG_CACHED 0x1 // Answered from a dataset that was already loaded
+
+struct ServiceRequestHeader {
+    u32 magic;
+    u16 version;
+    u16 type;
+    u32 pathLength;
+    u32 reserved;
+    u64 argument;
+};
+
+struct ServiceResponse {
+    u32 magic;
+    u16 status;
+    u16 type;
+    u32 flags;
+    u32 reserved;
+    u64 pairCount;
+    u64 serviceNanoseconds; // From the request arriving to the answer being ready
+    double values[SERVICE_VALUE_COUNT];
+};
+
+static_assert(sizeof(ServiceRequestHeader) == 24, "ServiceRequestHeader layout is part of the protocol");
+static_assert(sizeof(ServiceResponse) == 96, "ServiceResponse layout is part of the protocol");
+
+// Reads path into a new PairStore and sums it, gathering stats on the way. Returns false if it
+// can't be read or parsed.
+typedef bool service_load_func(void* context, char* path, PairStore* store, double* sum, DistanceStats* stats);
+
+struct ServiceDataset {
+    char path[SERVICE_MAX_PATH];
+    FileFingerprint fingerprint;
+    
+    PairStore store;
+    double sum;
+    DistanceStats stats;
+    
+    u64 lastUsed;
+};
+
+struct Service {
+    char* socketPath;
+    LocalSocket listener;
+    u32 workerCount;
+    
+    service_load_func* load;
+    void* loadContext;
+    
+    Mutex lock;
+    ServiceDataset datasets[SERVICE_MAX_DATASETS];
+    u32 datasetCount;
+    u64 memoryBudget;
+    u64 memoryUsed;
+    u64 useClock;
+    
+    // Under lock
+    u64 requestCount;
+    u64 hitCount;
+    u64 loadCount;
+    u64 evictionCount;
+    LocalSocket* connections[SERVICE_MAX_WORKERS]; // The one each worker is serving, if any
+    
+    volatile u32 stopping;
+};
+
+struct ServiceWorker {
+    Service* service;
+    u32 index;
+};
+
+static const char* describe_service_request(ServiceRequestType type) {
+    const char* result;
+    
+    switch(type) {
+        case ServiceRequest_Sum: { result = "sum"; } break;
+        case ServiceRequest_Stats: { result = "stats"; } break;
+        case ServiceRequest_Pair: { result = "pair"; } break;
+        case ServiceRequest_Evict: { result = "evict"; } break;
+        case ServiceRequest_Shutdown: { result = "shutdown"; } break;
+        default: { result = "UNKNOWN"; } break;
+    }
+    
+    return result;
+}
+
+static bool parse_service_request(const char* name, ServiceRequestType* type) {
+    for (u32 i = 0; i < ServiceRequest_Count; i++) {
+        if (strcmp(name, describe_service_request((ServiceRequestType)i)) == 0) {
+            *type = (ServiceRequestType)i;
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+static const char* describe_service_status(ServiceStatus status) {
+    const char* result;
+    
+    switch(status) {
+        case ServiceStatus_Ok: { result = "ok"; } break;
+        case ServiceStatus_BadRequest: { result = "bad request"; } break;
+        case ServiceStatus_CantLoad: { result = "can't load input"; } break;
+        case ServiceStatus_OutOfRange: { result = "pair index out of range"; } break;
+        default: { result = "UNKNOWN"; } break;
+    }
+    
+    return result;
+}
+
+//
+// Cache (everything here runs under service->lock)
+//
+
+static void drop_service_dataset(Service* service, u32 index) {
+    ServiceDataset* dataset = service->datasets + index;
+    service->memoryUsed -= dataset->store.committedSize;
+    
+    close_pair_store(&dataset->store);
+    
+    *dataset = service->datasets[--service->datasetCount];
+    ++service->evictionCount;
+}
+
+// keep is an index not to drop, or datasetCount to allow any. Returns the index dropped (which
+// now holds what was the last dataset).
+static u32 drop_least_recent_dataset(Service* service, u32 keep) {
+    u32 oldest = service->datasetCount;
+    for (u32 i = 0; i < service->datasetCount; i++) {
+        if ((i != keep) && ((oldest == service->datasetCount) || (service->datasets[i].lastUsed < service->datasets[oldest].lastUsed))) {
+            oldest = i;
+        }
+    }
+    
+    if (oldest != service->datasetCount) {
+        drop_service_dataset(service, oldest);
+    }
+    
+    return oldest;
+}
+
+static ServiceDataset* find_service_dataset(Service* service, char* path) {
+    for (u32 i = 0; i < service->datasetCount; i++) {
+        if (strcmp(service->datasets[i].path, path) == 0) {
+            return service->datasets + i;
+        }
+    }
+    
+    return 0;
+}
+
+// The dataset for path, loaded if it isn't cached or the file changed. 0 if it can't be loaded.
+//
+// NOTE(alex): Cached datasets are only checked against the size and mtime; mapping the file for
+// the sample hash costs more than the rest of a warm request. The full fingerprint is taken when
+// a dataset is loaded.
+static ServiceDataset* get_service_dataset(Service* service, char* path, bool* cached) {
+    *cached = false;
+    
+    FileInfo info = get_file_info(path);
+    if (!info.exists) {
+        return 0;
+    }
+    
+    ServiceDataset* result = find_service_dataset(service, path);
+    if (result && ((result->fingerprint.size != info.size) || (result->fingerprint.modifiedTime != info.modifiedTime))) {
+        drop_service_dataset(service, (u32)(result - service->datasets));
+        result = 0;
+    }
+    
+    if (result) {
+        *cached = true;
+        ++service->hitCount;
+    } else {
+        if (service->datasetCount == SERVICE_MAX_DATASETS) {
+            drop_least_recent_dataset(service, service->datasetCount);
+        }
+        
+        result = service->datasets + service->datasetCount;
+        *result = {};
+        strcpy(result->path, path);
+        if (!fingerprint_file(path, &result->fingerprint)) {
+            return 0;
+        }
+        
+        init_distance_stats(&result->stats);
+        if (!service->load(service->loadContext, path, &result->store, &result->sum, &result->stats)) {
+            close_pair_store(&result->store);
+            return 0;
+        }
+        
+        ++service->datasetCount;
+        ++service->loadCount;
+        
+        service->memoryUsed += result->store.committedSize;
+        u32 index = (u32)(result - service->datasets);
+        while ((service->memoryUsed > service->memoryBudget) && (service->datasetCount > 1)) {
+            u32 dropped = drop_least_recent_dataset(service, index);
+            
+            // The last dataset moves into the dropped one's place
+            if (index == service->datasetCount) {
+                index = dropped;
+            }
+        }
+        result = service->datasets + index;
+    }
+    
+    result->lastUsed = ++service->useClock;
+    
+    return result;
+}
+
+//
+// Requests
+//
+
+static void answer_service_request(Service* service, ServiceRequestHeader* request, char* path, ServiceResponse* response) {
+    lock_mutex(&service->lock);
+    ++service->requestCount;
+    
+    switch((ServiceRequestType)request->type) {
+        case ServiceRequest_Sum:
+        case ServiceRequest_Stats:
+        case ServiceRequest_Pair: {
+            bool cached;
+            ServiceDataset* dataset = get_service_dataset(service, path, &cached);
+            
+            if (!dataset) {
+                response->status = ServiceStatus_CantLoad;
+                break;
+            }
+            
+            response->flags = cached ? SERVICE_FLAG_CACHED : 0;
+            response->pairCount = dataset->store.count;
+            
+            if (request->type == ServiceRequest_Sum) {
+                response->values[0] = dataset->sum;
+            } else if (request->type == ServiceRequest_Stats) {
+                DistanceStats* stats = &dataset->stats;
+                response->values[0] = stats->min;
+                response->values[1] = stats->max;
+                response->values[2] = stats->mean;
+                response->values[3] = (stats->count > 1) ? (stats->m2 / (double)(stats->count - 1)) : 0.0;
+                response->values[4] = get_distance_percentile(stats, 50.0);
+                response->values[5] = get_distance_percentile(stats, 90.0);
+                response->values[6] = get_distance_percentile(stats, 99.0);
+                response->values[7] = get_distance_percentile(stats, 99.9);
+            } else if (request->argument < dataset->store.count) {
+                HaversinePair* pair = dataset->store.pairs + request->argument;
+                response->values[0] = pair->x0;
+                response->values[1] = pair->y0;
+                response->values[2] = pair->x1;
+                response->values[3] = pair->y1;
+                haversine_distances(1, pair, response->values + 4);
+            } else {
+                response->status = ServiceStatus_OutOfRange;
+            }
+        } break;
+        
+        case ServiceRequest_Evict: {
+            ServiceDataset* dataset = find_service_dataset(service, path);
+            if (dataset) {
+                drop_service_dataset(service, (u32)(dataset - service->datasets));
+            }
+        } break;
+        
+        case ServiceRequest_Shutdown: {
+            service->stopping = true;
+        } break;
+        
+        default: {
+            response->status = ServiceStatus_BadRequest;
+        } break;
+    }
+    
+    unlock_mutex(&service->lock);
+}
+
+// Requests on one connection until the client closes it (or sends something malformed).
+static void serve_service_connection(Service* service, LocalSocket* connection) {
+    ServiceRequestHeader request;
+    char path[SERVICE_MAX_PATH];
+    
+    while (!service->stopping && receive_all(connection, &request, sizeof(request))) {
+        u64 start = read_os_timer();
+        
+        ServiceResponse response = {};
+        response.magic = SERVICE_MAGIC;
+        response.type = request.type;
+        
+        bool wellFormed = ((request.magic == SERVICE_MAGIC) && (request.version == SERVICE_VERSION) &&
+                           (request.pathLength < sizeof(path)));
+        if (!wellFormed || !receive_all(connection, path, request.pathLength)) {
+            response.status = ServiceStatus_BadRequest;
+            send_all(connection, &response, sizeof(response));
+            break;
+        }
+        path[request.pathLength] = 0;
+        
+        answer_service_request(service, &request, path, &response);
+        
+        double seconds = (double)(read_os_timer() - start) / (double)get_os_timer_freq();
+        response.serviceNanoseconds = (u64)(seconds * 1e9);
+        if (!send_all(connection, &response, sizeof(response))) {
+            break;
+        }
+    }
+}
+
+static void service_worker(void* data) {
+    ServiceWorker* worker = (ServiceWorker*)data;
+    Service* service = worker->service;
+    
+    while (!service->stopping) {
+        LocalSocket connection;
+        if (accept_local_socket(&service->listener, &connection)) {
+            set_local_socket_timeout(&connection, SERVICE_IDLE_TIMEOUT_MS);
+            
+            // NOTE(alex): Checked again under the lock so a connection accepted while another
+            // worker is shutting the others down isn't missed.
+            lock_mutex(&service->lock);
+            bool serve = !service->stopping;
+            if (serve) {
+                service->connections[worker->index] = &connection;
+            }
+            unlock_mutex(&service->lock);
+            
+            if (serve) {
+                serve_service_connection(service, &connection);
+                
+                lock_mutex(&service->lock);
+                service->connections[worker->index] = 0;
+                unlock_mutex(&service->lock);
+            }
+            close_local_socket(&connection);
+        }
+    }
+    
+    // Workers blocked receiving on a client's connection see it fail
+    lock_mutex(&service->lock);
+    for (u32 i = 0; i < service->workerCount; i++) {
+        if (service->connections[i]) {
+            shutdown_local_socket(service->connections[i]);
+        }
+    }
+    unlock_mutex(&service->lock);
+    
+    // Workers still waiting in accept get a connection of their own to notice the shutdown
+    for (u32 i = 0; i < service->workerCount; i++) {
+        LocalSocket wake;
+        if (connect_local_socket(service->socketPath, &wake)) {
+            close_local_socket(&wake);
+        }
+    }
+}
+
+// Serves requests on socketPath until a shutdown request. Returns false if it couldn't listen.
+static bool run_service(char* socketPath, u32 workerCount, u64 memoryBudget, service_load_func* load, void* loadContext) {
+    String serviceMemory = allocate_string(sizeof(Service));
+    if (!serviceMemory.data) {
+        return false;
+    }
+    memset(serviceMemory.data, 0, serviceMemory.count);
+    
+    Service* service = (Service*)serviceMemory.data;
+    service->socketPath = socketPath;
+    service->workerCount = (workerCount < 1) ? 1 : ((workerCount > SERVICE_MAX_WORKERS) ? SERVICE_MAX_WORKERS : workerCount);
+    service->memoryBudget = memoryBudget;
+    service->load = load;
+    service->loadContext = loadContext;
+    init_mutex(&service->lock);
+    
+    bool result = listen_local_socket(socketPath, &service->listener);
+    
+    if (result) {
+        fprintf(stdout, "Service: listening on \"%s\" with %u workers, %.0fmb for datasets\n",
+                socketPath, service->workerCount, (double)memoryBudget / (1024.0 * 1024.0));
+        fflush(stdout);
+        
+        Thread threads[SERVICE_MAX_WORKERS];
+        ServiceWorker workers[SERVICE_MAX_WORKERS];
+        u32 startedCount = 0;
+        
+        for (u32 i = 1; i < service->workerCount; i++) {
+            workers[startedCount].service = service;
+            workers[startedCount].index = i;
+            if (create_thread(threads + startedCount, service_worker, workers + startedCount)) {
+                startedCount++;
+            }
+        }
+        
+        ServiceWorker self = {};
+        self.service = service;
+        service_worker(&self);
+        
+        for (u32 i = 0; i < startedCount; i++) {
+            join_thread(threads + i);
+        }
+        
+        fprintf(stdout, "Service: %llu requests, %llu cache hits, %llu loads, %llu evictions\n",
+                service->requestCount, service->hitCount, service->loadCount, service->evictionCount);
+    } else {
+        fprintf(stderr, "ERROR: Can't listen on \"%s\"\n", socketPath);
+    }
+    
+    while (service->datasetCount) {
+        drop_service_dataset(service, 0);
+    }
+    
+    close_local_socket(&service->listener);
+    if (result) {
+        remove_local_socket(socketPath);
+    }
+    destroy_mutex(&service->lock);
+    free_string(&serviceMemory);
+    
+    return result;
+}
+
+//
+// Client
+//
+
+// Sends one request over connection and waits for the answer.
+static bool send_service_request(LocalSocket* connection, ServiceRequestType type, const char* path, u64 argument,
+                                 ServiceResponse* response) {
+    ServiceRequestHeader request = {};
+    request.magic = SERVICE_MAGIC;
+    request.version = SERVICE_VERSION;
+    request.type = (u16)type;
+    request.pathLength = path ? (u32)strlen(path) : 0;
+    request.argument = argument;
+    
+    bool result = (send_all(connection, &request, sizeof(request)) &&
+                   send_all(connection, (void*)path, request.pathLength) &&
+                   receive_all(connection, response, sizeof(*response)) &&
+                   (response->magic == SERVICE_MAGIC));
+    return result;
+}
+
+static void print_service_response(ServiceResponse* response, u64 argument) {
+    if (response->status != ServiceStatus_Ok) {
+        fprintf(stdout, "Service error: %s\n", describe_service_status((ServiceStatus)response->status));
+        return;
+    }
+    
+    switch((ServiceRequestType)response->type) {
+        case ServiceRequest_Sum: {
+            fprintf(stdout, "Pair count: %llu\n", response->pairCount);
+            fprintf(stdout, "Haversine sum: %.16f\n", response->values[0]);
+        } break;
+        
+        case ServiceRequest_Stats: {
+            fprintf(stdout, "Distance count: %llu\n", response->pairCount);
+            fprintf(stdout, "Distance min: %.16f\n", response->values[0]);
+            fprintf(stdout, "Distance max: %.16f\n", response->values[1]);
+            fprintf(stdout, "Distance mean: %.16f\n", response->values[2]);
+            fprintf(stdout, "Distance variance: %.16f (std dev %.16f)\n", response->values[3], sqrt(response->values[3]));
+            fprintf(stdout, "Distance percentiles (histogram estimates): p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f\n",
+                    response->values[4], response->values[5], response->values[6], response->values[7]);
+        } break;
+        
+        case ServiceRequest_Pair: {
+            fprintf(stdout, "Pair %llu of %llu: x0 %.16f y0 %.16f x1 %.16f y1 %.16f\n", argument, response->pairCount,
+                    response->values[0], response->values[1], response->values[2], response->values[3]);
+            fprintf(stdout, "Distance: %.16f\n", response->values[4]);
+        } break;
+        
+        default: {
+            fprintf(stdout, "Service: %s done\n", describe_service_request((ServiceRequestType)response->type));
+        } break;
+    }
+}
+
+// Sends the request repeatCount times over one connection and prints the last answer, plus the
+// round trip times when repeated. Returns false if the service couldn't be reached or refused.
+static bool run_service_client(char* socketPath, ServiceRequestType type, char* path, u64 argument, u64 repeatCount) {
+    LocalSocket connection;
+    if (!connect_local_socket(socketPath, &connection)) {
+        fprintf(stderr, "ERROR: Can't connect to \"%s\"\n", socketPath);
+        return false;
+    }
+    
+    u64 osFreq = get_os_timer_freq();
+    u64 minTime = U64Max;
+    u64 totalTime = 0;
+    u64 firstTime = 0;
+    u64 minServiceNs = U64Max;
+    
+    ServiceResponse response = {};
+    bool result = true;
+    
+    repeatCount = repeatCount ? repeatCount : 1;
+    for (u64 i = 0; result && (i < repeatCount); i++) {
+        u64 start = read_os_timer();
+        result = send_service_request(&connection, type, path, argument, &response);
+        u64 elapsed = read_os_timer() - start;
+        
+        if (i == 0) {
+            firstTime = elapsed;
+        } else {
+            minTime = (elapsed < minTime) ? elapsed : minTime;
+            totalTime += elapsed;
+            minServiceNs = (response.serviceNanoseconds < minServiceNs) ? response.serviceNanoseconds : minServiceNs;
+        }
+    }
+    
+    close_local_socket(&connection);
+    
+    if (!result) {
+        fprintf(stderr, "ERROR: No answer from \"%s\"\n", socketPath);
+        return false;
+    }
+    
+    print_service_response(&response, argument);
+    
+    double microsecondsPerTick = 1000000.0 / (double)osFreq;
+    fprintf(stdout, "First request: %.3fus\n", (double)firstTime * microsecondsPerTick);
+    if (repeatCount > 1) {
+        fprintf(stdout, "Repeated %llu times: min %.3fus, mean %.3fus round trip, min %.3fus in the service\n",
+                repeatCount - 1, (double)minTime * microsecondsPerTick,
+                (double)totalTime * microsecondsPerTick / (double)(repeatCount - 1), (double)minServiceNs / 1000.0);
+    }
+    
+    result = (response.status == ServiceStatus_Ok);
+    return result;
+}
\ No newline at end of file
@@ -0,0 +1,417 @@
+// In-memory index over the parsed points for radius and k-nearest queries.
+//
+// Points go into an equirectangular lat/lon cell grid stored CSR-style: one flat array of points
+// sorted by cell and a prefix array of where each cell starts. A query walks only the cells that
+// can overlap its spherical cap and refines the candidates with reference_haversine.
+//
+// Point ids are pairIndex * 2 + 0 for (x0, y0) and pairIndex * 2 + 1 for (x1, y1).
+
+#define SPATIAL_EARTH_RADIUS 6372.8
+#define SPATIAL_POINTS_PER_CELL 4
+#define SPATIAL_BUILD_CHUNK 16384
+
+struct SpatialIndex {
+    double cellDegrees;
+    u32 rowCount;    // Latitude bands, cellDegrees each
+    u32 columnCount; // Longitude columns, always 2 * rowCount so the columns wrap exactly
+    
+    u64 cellCount;
+    u64 pointCount;
+    
+    u64* cellStart; // cellCount + 1 entries
+    double* xs;     // Points sorted by cell, ids ascending within a cell
+    double* ys;
+    u64* ids;
+    
+    String memory;
+};
+
+struct SpatialResult {
+    u64 pointId;
+    double distance;
+};
+
+static u32 spatial_row(SpatialIndex* index, double y) {
+    s64 row = (s64)floor((y + 90.0) / index->cellDegrees);
+    if (row < 0) {
+        row = 0;
+    } else if (row >= (s64)index->rowCount) {
+        row = index->rowCount - 1;
+    }
+    
+    return (u32)row;
+}
+
+static u32 spatial_column(SpatialIndex* index, double x) {
+    s64 column = (s64)floor((x + 180.0) / index->cellDegrees);
+    if (column < 0) {
+        column = 0;
+    } else if (column >= (s64)index->columnCount) {
+        column = index->columnCount - 1;
+    }
+    
+    return (u32)column;
+}
+
+static u32 spatial_cell(SpatialIndex* index, double x, double y) {
+    u32 result = spatial_row(index, y) * index->columnCount + spatial_column(index, x);
+    return result;
+}
+
+//
+// Bulk build
+//
+
+struct SpatialBuildContext {
+    SpatialIndex* index;
+    HaversinePair* pairs;
+    u64 pairCount;
+    
+    u32* pointCells;
+    volatile u32* cellCounts;
+    volatile u64* cellCursors;
+};
+
+static void spatial_count_task(void* data, u64 taskIndex, u32 threadIndex) {
+    (void)threadIndex;
+    SpatialBuildContext* context = (SpatialBuildContext*)data;
+    SpatialIndex* index = context->index;
+    
+    u64 first = taskIndex * SPATIAL_BUILD_CHUNK;
+    u64 end = first + SPATIAL_BUILD_CHUNK;
+    if (end > context->pairCount) {
+        end = context->pairCount;
+    }
+    
+    for (u64 i = first; i < end; i++) {
+        u32 cell0 = spatial_cell(index, context->pairs[i].x0, context->pairs[i].y0);
+        u32 cell1 = spatial_cell(index, context->pairs[i].x1, context->pairs[i].y1);
+        
+        context->pointCells[2 * i + 0] = cell0;
+        context->pointCells[2 * i + 1] = cell1;
+        
+        atomic_add_u32(context->cellCounts + cell0, 1);
+        atomic_add_u32(context->cellCounts + cell1, 1);
+    }
+}
+
+static void spatial_scatter_task(void* data, u64 taskIndex, u32 threadIndex) {
+    (void)threadIndex;
+    SpatialBuildContext* context = (SpatialBuildContext*)data;
+    SpatialIndex* index = context->index;
+    
+    u64 first = taskIndex * SPATIAL_BUILD_CHUNK;
+    u64 end = first + SPATIAL_BUILD_CHUNK;
+    if (end > context->pairCount) {
+        end = context->pairCount;
+    }
+    
+    for (u64 i = first; i < end; i++) {
+        u64 slot0 = atomic_add_u64(context->cellCursors + context->pointCells[2 * i + 0], 1);
+        index->xs[slot0] = context->pairs[i].x0;
+        index->ys[slot0] = context->pairs[i].y0;
+        index->ids[slot0] = 2 * i + 0;
+        
+        u64 slot1 = atomic_add_u64(context->cellCursors + context->pointCells[2 * i + 1], 1);
+        index->xs[slot1] = context->pairs[i].x1;
+        index->ys[slot1] = context->pairs[i].y1;
+        index->ids[slot1] = 2 * i + 1;
+    }
+}
+
+// The scatter order depends on thread timing, sorting each cell by id makes the layout (and so
+// the order of query results) deterministic again. Cells hold a handful of points each.
+static void spatial_sort_task(void* data, u64 taskIndex, u32 threadIndex) {
+    (void)threadIndex;
+    SpatialBuildContext* context = (SpatialBuildContext*)data;
+    SpatialIndex* index = context->index;
+    
+    u64 firstCell = taskIndex * SPATIAL_BUILD_CHUNK;
+    u64 endCell = firstCell + SPATIAL_BUILD_CHUNK;
+    if (endCell > index->cellCount) {
+        endCell = index->cellCount;
+    }
+    
+    for (u64 cell = firstCell; cell < endCell; cell++) {
+        u64 start = index->cellStart[cell];
+        u64 end = index->cellStart[cell + 1];
+        
+        for (u64 i = start + 1; i < end; i++) {
+            double x = index->xs[i];
+            double y = index->ys[i];
+            u64 id = index->ids[i];
+            
+            u64 j = i;
+            while ((j > start) && (index->ids[j - 1] > id)) {
+                index->xs[j] = index->xs[j - 1];
+                index->ys[j] = index->ys[j - 1];
+                index->ids[j] = index->ids[j - 1];
+                --j;
+            }
+            
+            index->xs[j] = x;
+            index->ys[j] = y;
+            index->ids[j] = id;
+        }
+    }
+}
+
+static SpatialIndex build_spatial_index(u32 threadCount, u64 pairCount, HaversinePair* pairs) {
+    PROFILE_FUNC_DATA(pairCount * sizeof(HaversinePair));
+    
+    SpatialIndex result = {};
+    result.pointCount = 2 * pairCount;
+    
+    // Aim for a few points per cell, within sane bounds on cell size
+    double cellDegrees = sqrt((180.0 * 360.0 * SPATIAL_POINTS_PER_CELL) / (double)(result.pointCount ? result.pointCount : 1));
+    cellDegrees = fmin(fmax(cellDegrees, 0.1), 10.0);
+    
+    result.rowCount = (u32)ceil(180.0 / cellDegrees);
+    result.columnCount = 2 * result.rowCount;
+    result.cellDegrees = 180.0 / (double)result.rowCount;
+    result.cellCount = (u64)result.rowCount * result.columnCount;
+    
+    u64 pointBytes = result.pointCount * (2 * sizeof(double) + sizeof(u64));
+    result.memory = allocate_string((result.cellCount + 1) * sizeof(u64) + pointBytes);
+    
+    String scratch = allocate_string(result.pointCount * sizeof(u32) +
+                                     result.cellCount * (sizeof(u32) + sizeof(u64)));
+    
+    if (result.memory.data && scratch.data) {
+        u8* at = result.memory.data;
+        result.cellStart = (u64*)at; at += (result.cellCount + 1) * sizeof(u64);
+        result.xs = (double*)at; at += result.pointCount * sizeof(double);
+        result.ys = (double*)at; at += result.pointCount * sizeof(double);
+        result.ids = (u64*)at;
+        
+        SpatialBuildContext context = {};
+        context.index = &result;
+        context.pairs = pairs;
+        context.pairCount = pairCount;
+        
+        at = scratch.data;
+        context.cellCursors = (u64*)at; at += result.cellCount * sizeof(u64);
+        context.pointCells = (u32*)at; at += result.pointCount * sizeof(u32);
+        context.cellCounts = (u32*)at;
+        memset((void*)context.cellCounts, 0, result.cellCount * sizeof(u32));
+        
+        u64 pairTaskCount = (pairCount + SPATIAL_BUILD_CHUNK - 1) / SPATIAL_BUILD_CHUNK;
+        run_parallel(threadCount, pairTaskCount, spatial_count_task, &context);
+        
+        u64 total = 0;
+        for (u64 cell = 0; cell < result.cellCount; cell++) {
+            result.cellStart[cell] = total;
+            context.cellCursors[cell] = total;
+            total += context.cellCounts[cell];
+        }
+        result.cellStart[result.cellCount] = total;
+        
+        run_parallel(threadCount, pairTaskCount, spatial_scatter_task, &context);
+        
+        u64 cellTaskCount = (result.cellCount + SPATIAL_BUILD_CHUNK - 1) / SPATIAL_BUILD_CHUNK;
+        run_parallel(threadCount, cellTaskCount, spatial_sort_task, &context);
+    } else {
+        free_string(&result.memory);
+        result = {};
+    }
+    
+    free_string(&scratch);
+    
+    return result;
+}
+
+static void free_spatial_index(SpatialIndex* index) {
+    free_string(&index->memory);
+    *index = {};
+}
+
+//
+// Queries
+//
+
+typedef void spatial_visit_func(void* context, u64 pointId, double distance);
+
+// Calls visit for every point within radiusKm of (x, y), in cell order.
+static void visit_points_in_radius(SpatialIndex* index, double x, double y, double radiusKm,
+                                   spatial_visit_func* visit, void* context) {
+    if (!index->pointCount) {
+        return;
+    }
+    
+    double angle = radiusKm / SPATIAL_EARTH_RADIUS;
+    double angleDegrees = angle * (180.0 / 3.14159265358979323846);
+    
+    // A hair of slack so points sitting exactly on a cell boundary are never skipped
+    double slack = 1e-9;
+    double latMin = y - angleDegrees - slack;
+    double latMax = y + angleDegrees + slack;
+    
+    // The widest longitude span of a cap centered at latitude y is asin(sin(angle) / cos(y)),
+    // unless the cap reaches over a pole, in which case it covers every longitude.
+    double lonHalfWidth = 180.0;
+    if ((latMin > -90.0) && (latMax < 90.0)) {
+        double s = sin(angle) / cos(radians_from_degrees(y));
+        if (s < 1.0) {
+            lonHalfWidth = asin(s) * (180.0 / 3.14159265358979323846) + slack;
+        }
+    }
+    
+    u32 rowMin = spatial_row(index, latMin);
+    u32 rowMax = spatial_row(index, latMax);
+    
+    s64 columnMin = 0;
+    s64 columnMax = (s64)index->columnCount - 1;
+    if (lonHalfWidth < 180.0) {
+        columnMin = (s64)floor((x - lonHalfWidth + 180.0) / index->cellDegrees);
+        columnMax = (s64)floor((x + lonHalfWidth + 180.0) / index->cellDegrees);
+        
+        if ((columnMax - columnMin + 1) >= (s64)index->columnCount) {
+            columnMin = 0;
+            columnMax = (s64)index->columnCount - 1;
+        }
+    }
+    
+    for (u32 row = rowMin; row <= rowMax; row++) {
+        for (s64 c = columnMin; c <= columnMax; c++) {
+            // Columns wrap around the antimeridian
+            s64 column = c % (s64)index->columnCount;
+            if (column < 0) {
+                column += index->columnCount;
+            }
+            
+            u64 cell = (u64)row * index->columnCount + (u64)column;
+            for (u64 i = index->cellStart[cell]; i < index->cellStart[cell + 1]; i++) {
+                double distance = reference_haversine(x, y, index->xs[i], index->ys[i], SPATIAL_EARTH_RADIUS);
+                if (distance <= radiusKm) {
+                    visit(context, index->ids[i], distance);
+                }
+            }
+        }
+    }
+}
+
+struct RadiusQuery {
+    u64 foundCount;
+    u64 maxResultCount;
+    SpatialResult* results;
+};
+
+static void radius_visit(void* data, u64 pointId, double distance) {
+    RadiusQuery* query = (RadiusQuery*)data;
+    
+    if (query->foundCount < query->maxResultCount) {
+        query->results[query->foundCount].pointId = pointId;
+        query->results[query->foundCount].distance = distance;
+    }
+    
+    query->foundCount++;
+}
+
+// Returns how many points are within radiusKm, fills in at most maxResultCount of them.
+static u64 spatial_within_radius(SpatialIndex* index, double x, double y, double radiusKm,
+                                 u64 maxResultCount, SpatialResult* results) {
+    RadiusQuery query = {};
+    query.maxResultCount = maxResultCount;
+    query.results = results;
+    
+    visit_points_in_radius(index, x, y, radiusKm, radius_visit, &query);
+    
+    return query.foundCount;
+}
+
+struct NearestQuery {
+    u64 k;
+    u64 foundCount;
+    u64 heapCount;
+    SpatialResult* heap; // Max-heap on distance, ties broken on id
+};
+
+static bool is_farther(SpatialResult a, SpatialResult b) {
+    bool result = (a.distance > b.distance) || ((a.distance == b.distance) && (a.pointId > b.pointId));
+    return result;
+}
+
+static void sift_down(SpatialResult* heap, u64 count, u64 at) {
+    while (true) {
+        u64 largest = at;
+        u64 left = 2 * at + 1;
+        u64 right = left + 1;
+        
+        if ((left < count) && is_farther(heap[left], heap[largest])) {
+            largest = left;
+        }
+        if ((right < count) && is_farther(heap[right], heap[largest])) {
+            largest = right;
+        }
+        
+        if (largest == at) {
+            break;
+        }
+        
+        SpatialResult temp = heap[at];
+        heap[at] = heap[largest];
+        heap[largest] = temp;
+        at = largest;
+    }
+}
+
+static void nearest_visit(void* data, u64 pointId, double distance) {
+    NearestQuery* query = (NearestQuery*)data;
+    query->foundCount++;
+    
+    SpatialResult candidate = {pointId, distance};
+    
+    if (query->heapCount < query->k) {
+        // Sift up
+        u64 at = query->heapCount++;
+        query->heap[at] = candidate;
+        while (at && is_farther(query->heap[at], query->heap[(at - 1) / 2])) {
+            u64 parent = (at - 1) / 2;
+            SpatialResult temp = query->heap[at];
+            query->heap[at] = query->heap[parent];
+            query->heap[parent] = temp;
+            at = parent;
+        }
+    } else if (is_farther(query->heap[0], candidate)) {
+        query->heap[0] = candidate;
+        sift_down(query->heap, query->heapCount, 0);
+    }
+}
+
+// Fills results with the k nearest points, closest first. Returns how many were found (less
+// than k only if the index holds fewer points).
+static u64 spatial_nearest(SpatialIndex* index, double x, double y, u64 k, SpatialResult* results) {
+    NearestQuery query = {};
+    query.k = k;
+    query.heap = results;
+    
+    if (k && index->pointCount) {
+        // Grow the search cap until it holds k points; everything closer than the k-th point
+        // is then guaranteed to be inside it.
+        double halfCircumference = 3.14159265358979323846 * SPATIAL_EARTH_RADIUS;
+        double radiusKm = radians_from_degrees(index->cellDegrees) * SPATIAL_EARTH_RADIUS;
+        
+        while (true) {
+            query.foundCount = 0;
+            query.heapCount = 0;
+            
+            visit_points_in_radius(index, x, y, radiusKm, nearest_visit, &query);
+            
+            if ((query.foundCount >= k) || (radiusKm >= halfCircumference)) {
+                break;
+            }
+            
+            radiusKm *= 2.0;
+        }
+        
+        // Heap sort in place, farthest ends up last
+        for (u64 end = query.heapCount; end > 1; end--) {
+            SpatialResult temp = results[0];
+            results[0] = results[end - 1];
+            results[end - 1] = temp;
+            sift_down(results, end - 1, 0);
+        }
+    }
+    
+    return query.heapCount;
+}
\ No newline at end of file
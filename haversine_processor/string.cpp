@@ -1,3 +1,9 @@
+// NOTE(alex): string.cpp is also used without the profiler (see repetition_testing).
+#ifndef PROFILE_ALLOCATION
+#define PROFILE_ALLOCATION(bytes)
+#define PROFILE_FREE(bytes)
+#endif
+
 struct String {
     u64 count;
     u8* data;
@@ -30,6 +36,7 @@ static String allocate_string(size_t count) {
     
     if (result.data) {
         result.count = count;
+        PROFILE_ALLOCATION(count);
     } else {
         fprintf(stderr, "ERROR: Unable to allocate %llu bytes.\n", count);
     }
@@ -39,6 +46,7 @@ static String allocate_string(size_t count) {
 
 static void free_string(String* string) {
     if (string->data) {
+        PROFILE_FREE(string->count);
         free(string->data);
     }
     
@@ -0,0 +1,821 @@
+#include <emmintrin.h> // SSE2
+
+// Summation of per-pair distances. Everything except SumMode_Naive works on fixed blocks of
+// SUM_BLOCK_PAIR_COUNT distances and combines the blocks in block order, so the result only
+// depends on the input, never on how many threads ran or which thread got which block.
+
+// NOTE(alex): build.bat compiles with -fp:fast, which lets MSVC reassociate the compensation
+// terms away. Everything in here needs strict IEEE evaluation.
+#if _MSC_VER
+#pragma float_control(precise, on, push)
+#endif
+
+enum SumMode {
+    SumMode_Naive,    // The generator's loop: sequential, sum += coeff * dist
+    SumMode_Pairwise, // Pairwise tree over SIMD lanes, O(log n) error growth
+    SumMode_Neumaier, // Compensated (Kahan-Babuska-Neumaier) over SIMD lanes
+    SumMode_Exact,    // Fixed-point superaccumulator, correctly rounded
+    
+    SumMode_Count,
+};
+
+#define SUM_BLOCK_PAIR_COUNT 4096
+#define PAIRWISE_BASE_COUNT 128
+
+static const char* describe_sum_mode(SumMode mode) {
+    const char* result;
+    
+    switch(mode) {
+        case SumMode_Naive: { result = "naive"; } break;
+        case SumMode_Pairwise: { result = "pairwise"; } break;
+        case SumMode_Neumaier: { result = "neumaier"; } break;
+        case SumMode_Exact: { result = "exact"; } break;
+        default: { result = "UNKNOWN"; } break;
+    }
+    
+    return result;
+}
+
+static bool parse_sum_mode(const char* name, SumMode* mode) {
+    for (u32 i = 0; i < SumMode_Count; i++) {
+        if (strcmp(name, describe_sum_mode((SumMode)i)) == 0) {
+            *mode = (SumMode)i;
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+//
+// Pairwise
+//
+
+static double sum_pairwise(u64 count, double* values) {
+    double result = 0.0;
+    
+    if (count <= PAIRWISE_BASE_COUNT) {
+        // Eight independent lanes, folded as a balanced tree at the end
+        __m128d lanes0 = _mm_setzero_pd();
+        __m128d lanes1 = _mm_setzero_pd();
+        __m128d lanes2 = _mm_setzero_pd();
+        __m128d lanes3 = _mm_setzero_pd();
+        
+        u64 i = 0;
+        for (; (i + 8) <= count; i += 8) {
+            lanes0 = _mm_add_pd(lanes0, _mm_loadu_pd(values + i + 0));
+            lanes1 = _mm_add_pd(lanes1, _mm_loadu_pd(values + i + 2));
+            lanes2 = _mm_add_pd(lanes2, _mm_loadu_pd(values + i + 4));
+            lanes3 = _mm_add_pd(lanes3, _mm_loadu_pd(values + i + 6));
+        }
+        
+        __m128d lanes = _mm_add_pd(_mm_add_pd(lanes0, lanes1), _mm_add_pd(lanes2, lanes3));
+        result = _mm_cvtsd_f64(_mm_add_sd(lanes, _mm_unpackhi_pd(lanes, lanes)));
+        
+        for (; i < count; i++) {
+            result += values[i];
+        }
+    } else {
+        // Split on a lane-width boundary so the base case stays unrolled
+        u64 half = ((count / 2) + 7) & ~(u64)7;
+        result = sum_pairwise(half, values) + sum_pairwise(count - half, values + half);
+    }
+    
+    return result;
+}
+
+//
+// Neumaier
+//
+
+struct CompensatedSum {
+    double sum;
+    double compensation;
+};
+
+static void add_compensated(CompensatedSum* accum, double value) {
+    double sum = accum->sum;
+    double t = sum + value;
+    
+    if (fabs(sum) >= fabs(value)) {
+        accum->compensation += (sum - t) + value;
+    } else {
+        accum->compensation += (value - t) + sum;
+    }
+    
+    accum->sum = t;
+}
+
+// Four compensated lanes, branchless so it stays in SSE registers
+static CompensatedSum sum_neumaier(u64 count, double* values) {
+    __m128d signMask = _mm_set1_pd(-0.0);
+    __m128d sum0 = _mm_setzero_pd();
+    __m128d sum1 = _mm_setzero_pd();
+    __m128d comp0 = _mm_setzero_pd();
+    __m128d comp1 = _mm_setzero_pd();
+    
+    u64 i = 0;
+    for (; (i + 4) <= count; i += 4) {
+        __m128d x0 = _mm_loadu_pd(values + i + 0);
+        __m128d x1 = _mm_loadu_pd(values + i + 2);
+        
+        __m128d t0 = _mm_add_pd(sum0, x0);
+        __m128d t1 = _mm_add_pd(sum1, x1);
+        
+        // (|s| >= |x|) ? (s - t) + x : (x - t) + s
+        __m128d sumIsBigger0 = _mm_cmpge_pd(_mm_andnot_pd(signMask, sum0), _mm_andnot_pd(signMask, x0));
+        __m128d sumIsBigger1 = _mm_cmpge_pd(_mm_andnot_pd(signMask, sum1), _mm_andnot_pd(signMask, x1));
+        
+        __m128d big0 = _mm_or_pd(_mm_and_pd(sumIsBigger0, sum0), _mm_andnot_pd(sumIsBigger0, x0));
+        __m128d big1 = _mm_or_pd(_mm_and_pd(sumIsBigger1, sum1), _mm_andnot_pd(sumIsBigger1, x1));
+        __m128d small0 = _mm_or_pd(_mm_and_pd(sumIsBigger0, x0), _mm_andnot_pd(sumIsBigger0, sum0));
+        __m128d small1 = _mm_or_pd(_mm_and_pd(sumIsBigger1, x1), _mm_andnot_pd(sumIsBigger1, sum1));
+        
+        comp0 = _mm_add_pd(comp0, _mm_add_pd(_mm_sub_pd(big0, t0), small0));
+        comp1 = _mm_add_pd(comp1, _mm_add_pd(_mm_sub_pd(big1, t1), small1));
+        
+        sum0 = t0;
+        sum1 = t1;
+    }
+    
+    double sums[4];
+    double comps[4];
+    _mm_storeu_pd(sums + 0, sum0);
+    _mm_storeu_pd(sums + 2, sum1);
+    _mm_storeu_pd(comps + 0, comp0);
+    _mm_storeu_pd(comps + 2, comp1);
+    
+    CompensatedSum result = {};
+    for (u32 lane = 0; lane < 4; lane++) {
+        add_compensated(&result, sums[lane]);
+        result.compensation += comps[lane];
+    }
+    
+    for (; i < count; i++) {
+        add_compensated(&result, values[i]);
+    }
+    
+    return result;
+}
+
+//
+// Exact
+//
+
+// NOTE(alex): Every finite double is an integer multiple of 2^-1074 below 2^1024, so a 2098-bit
+// fixed-point number holds any of them exactly. It's stored as 32-bit digits in signed 64-bit
+// limbs, which leaves room for 2^31 additions before the carries have to be propagated.
+#define EXACT_LIMB_BITS 32
+#define EXACT_LIMB_COUNT 68
+#define EXACT_ADDS_BEFORE_CARRY (1u << 30)
+
+struct ExactSum {
+    s64 limbs[EXACT_LIMB_COUNT];
+    u32 pendingAddCount;
+};
+
+static void exact_propagate_carries(ExactSum* accum) {
+    for (u32 i = 0; i < (EXACT_LIMB_COUNT - 1); i++) {
+        s64 carry = accum->limbs[i] >> EXACT_LIMB_BITS;
+        accum->limbs[i] -= carry * ((s64)1 << EXACT_LIMB_BITS);
+        accum->limbs[i + 1] += carry;
+    }
+    
+    accum->pendingAddCount = 0;
+}
+
+static void exact_add(ExactSum* accum, double value) {
+    u64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    
+    u64 biasedExponent = (bits >> 52) & 0x7FF;
+    u64 mantissa = bits & ((1ull << 52) - 1);
+    
+    // Bit position of the mantissa's lowest bit, counted up from 2^-1074
+    u64 position = 0;
+    if (biasedExponent) {
+        mantissa |= (1ull << 52);
+        position = biasedExponent - 1;
+    }
+    
+    u32 limb = (u32)(position / EXACT_LIMB_BITS);
+    u32 shift = (u32)(position % EXACT_LIMB_BITS);
+    
+    // 53 + 31 bits spread over three limbs
+    u64 low = (mantissa << shift) & 0xFFFFFFFF;
+    u64 mid = (mantissa >> EXACT_LIMB_BITS) & 0xFFFFFFFF;
+    u64 high = 0;
+    if (shift) {
+        mid = (mantissa >> (EXACT_LIMB_BITS - shift)) & 0xFFFFFFFF;
+        high = (mantissa >> (2 * EXACT_LIMB_BITS - shift));
+    }
+    
+    if (bits >> 63) {
+        accum->limbs[limb + 0] -= (s64)low;
+        accum->limbs[limb + 1] -= (s64)mid;
+        accum->limbs[limb + 2] -= (s64)high;
+    } else {
+        accum->limbs[limb + 0] += (s64)low;
+        accum->limbs[limb + 1] += (s64)mid;
+        accum->limbs[limb + 2] += (s64)high;
+    }
+    
+    if (++accum->pendingAddCount == EXACT_ADDS_BEFORE_CARRY) {
+        exact_propagate_carries(accum);
+    }
+}
+
+static void exact_add_values(ExactSum* accum, u64 count, double* values) {
+    for (u64 i = 0; i < count; i++) {
+        exact_add(accum, values[i]);
+    }
+}
+
+static void exact_merge(ExactSum* accum, ExactSum* other) {
+    exact_propagate_carries(accum);
+    exact_propagate_carries(other);
+    
+    for (u32 i = 0; i < EXACT_LIMB_COUNT; i++) {
+        accum->limbs[i] += other->limbs[i];
+    }
+    
+    exact_propagate_carries(accum);
+}
+
+// Correctly rounded (round to nearest even) conversion of the accumulated value.
+static double exact_to_double(ExactSum* accum) {
+    ExactSum value = *accum;
+    exact_propagate_carries(&value);
+    
+    // After propagation every limb but the top one is in [0, 2^32), the top one carries the sign
+    double sign = 1.0;
+    if (value.limbs[EXACT_LIMB_COUNT - 1] < 0) {
+        sign = -1.0;
+        for (u32 i = 0; i < EXACT_LIMB_COUNT; i++) {
+            value.limbs[i] = -value.limbs[i];
+        }
+        exact_propagate_carries(&value);
+    }
+    
+    s32 top = EXACT_LIMB_COUNT - 1;
+    while ((top >= 0) && (value.limbs[top] == 0)) {
+        --top;
+    }
+    
+    double result = 0.0;
+    
+    if (top >= 0) {
+        u64 l2 = (u64)value.limbs[top];
+        u64 l1 = (top >= 1) ? (u64)value.limbs[top - 1] : 0;
+        u64 l0 = (top >= 2) ? (u64)value.limbs[top - 2] : 0;
+        
+        u32 leadingZeros = 0;
+        while (!(l2 & (1ull << (EXACT_LIMB_BITS - 1 - leadingZeros)))) {
+            ++leadingZeros;
+        }
+        
+        // 64-bit window starting at the leading one, everything below it folds into a sticky bit
+        u64 window = (l2 << (EXACT_LIMB_BITS + leadingZeros)) | (l1 << leadingZeros);
+        u64 sticky = 0;
+        if (leadingZeros) {
+            window |= l0 >> (EXACT_LIMB_BITS - leadingZeros);
+            sticky |= l0 & ((1ull << (EXACT_LIMB_BITS - leadingZeros)) - 1);
+        } else {
+            sticky |= l0;
+        }
+        
+        for (s32 i = 0; i < (top - 2); i++) {
+            sticky |= (u64)value.limbs[i];
+        }
+        
+        window |= (sticky != 0);
+        
+        // The u64 -> double conversion does the rounding, the sticky bit makes the ties exact
+        s32 windowExponent = (top * EXACT_LIMB_BITS) + (EXACT_LIMB_BITS - 1 - leadingZeros) - 63 - 1074;
+        result = sign * ldexp((double)window, windowExponent);
+    }
+    
+    return result;
+}
+
+//
+// Distance statistics
+//
+
+// NOTE(alex): Histogram buckets split each power of two of kilometers into 16, straight from the
+// exponent and top mantissa bits, so a bucket is never more than 6.25% wide. Below about a meter
+// everything goes in the first bucket, above 2^15 km (more than half the circumference) in the
+// last one.
+#define DISTANCE_HISTOGRAM_MIN_EXPONENT -10
+#define DISTANCE_HISTOGRAM_MAX_EXPONENT 15
+#define DISTANCE_HISTOGRAM_SUB_BITS 4
+#define DISTANCE_HISTOGRAM_BUCKET_COUNT \
+    (2 + ((DISTANCE_HISTOGRAM_MAX_EXPONENT - DISTANCE_HISTOGRAM_MIN_EXPONENT) << DISTANCE_HISTOGRAM_SUB_BITS))
+
+// Count, mean and sum of squared deviations of one block, merged in block order like the sums.
+struct DistanceMoments {
+    u64 count;
+    double mean;
+    double m2;
+};
+
+// Everything that doesn't depend on the order: extremes and bucket counts.
+struct DistanceExtremes {
+    double min;
+    double max;
+    u64 histogram[DISTANCE_HISTOGRAM_BUCKET_COUNT];
+};
+
+struct DistanceStats {
+    u64 count;
+    double mean;
+    double m2;
+    
+    double min;
+    double max;
+    u64 histogram[DISTANCE_HISTOGRAM_BUCKET_COUNT];
+};
+
+static u32 get_distance_bucket(double value) {
+    u64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    
+    s32 exponent = (s32)((bits >> 52) & 0x7FF) - 1023;
+    u32 sub = (u32)(bits >> (52 - DISTANCE_HISTOGRAM_SUB_BITS)) & ((1 << DISTANCE_HISTOGRAM_SUB_BITS) - 1);
+    
+    u32 result;
+    if (!(value >= 0.0) || (exponent < DISTANCE_HISTOGRAM_MIN_EXPONENT)) {
+        result = 0;
+    } else if (exponent >= DISTANCE_HISTOGRAM_MAX_EXPONENT) {
+        result = DISTANCE_HISTOGRAM_BUCKET_COUNT - 1;
+    } else {
+        result = 1 + (((exponent - DISTANCE_HISTOGRAM_MIN_EXPONENT) << DISTANCE_HISTOGRAM_SUB_BITS) | sub);
+    }
+    
+    return result;
+}
+
+// Smallest distance that lands in bucket
+static double get_distance_bucket_start(u32 bucket) {
+    double result = 0.0;
+    
+    if (bucket) {
+        u32 index = bucket - 1;
+        s32 exponent = DISTANCE_HISTOGRAM_MIN_EXPONENT + (s32)(index >> DISTANCE_HISTOGRAM_SUB_BITS);
+        u32 sub = index & ((1 << DISTANCE_HISTOGRAM_SUB_BITS) - 1);
+        result = ldexp(1.0 + (double)sub / (double)(1 << DISTANCE_HISTOGRAM_SUB_BITS), exponent);
+    }
+    
+    return result;
+}
+
+static void init_distance_extremes(DistanceExtremes* extremes) {
+    memset(extremes, 0, sizeof(*extremes));
+    extremes->min = INFINITY;
+    extremes->max = -INFINITY;
+}
+
+// Runs on a block of distances the sum just went over, while they're still in L1.
+static void accumulate_distance_stats(u64 count, double* values, DistanceMoments* moments, DistanceExtremes* extremes) {
+    __m128d sum = _mm_setzero_pd();
+    __m128d min = _mm_set1_pd(extremes->min);
+    __m128d max = _mm_set1_pd(extremes->max);
+    
+    u64 i = 0;
+    for (; (i + 2) <= count; i += 2) {
+        __m128d x = _mm_loadu_pd(values + i);
+        sum = _mm_add_pd(sum, x);
+        min = _mm_min_pd(min, x);
+        max = _mm_max_pd(max, x);
+    }
+    
+    double sums[2];
+    double mins[2];
+    double maxs[2];
+    _mm_storeu_pd(sums, sum);
+    _mm_storeu_pd(mins, min);
+    _mm_storeu_pd(maxs, max);
+    
+    double total = sums[0] + sums[1];
+    extremes->min = (mins[0] < mins[1]) ? mins[0] : mins[1];
+    extremes->max = (maxs[0] > maxs[1]) ? maxs[0] : maxs[1];
+    
+    for (; i < count; i++) {
+        total += values[i];
+        extremes->min = (values[i] < extremes->min) ? values[i] : extremes->min;
+        extremes->max = (values[i] > extremes->max) ? values[i] : extremes->max;
+    }
+    
+    // Deviations from the block's own mean, a second pass over L1 instead of a sum of squares
+    // that cancels badly when the spread is small next to the mean
+    double mean = count ? (total / (double)count) : 0.0;
+    __m128d meanLanes = _mm_set1_pd(mean);
+    __m128d m2 = _mm_setzero_pd();
+    
+    i = 0;
+    for (; (i + 2) <= count; i += 2) {
+        __m128d delta = _mm_sub_pd(_mm_loadu_pd(values + i), meanLanes);
+        m2 = _mm_add_pd(m2, _mm_mul_pd(delta, delta));
+    }
+    
+    double m2s[2];
+    _mm_storeu_pd(m2s, m2);
+    double m2Total = m2s[0] + m2s[1];
+    
+    for (; i < count; i++) {
+        double delta = values[i] - mean;
+        m2Total += delta * delta;
+    }
+    
+    for (i = 0; i < count; i++) {
+        ++extremes->histogram[get_distance_bucket(values[i])];
+    }
+    
+    moments->count = count;
+    moments->mean = mean;
+    moments->m2 = m2Total;
+}
+
+// Chan et al. parallel update. Only depends on the order moments are merged in.
+static void merge_distance_moments(DistanceStats* stats, DistanceMoments* moments) {
+    if (moments->count) {
+        u64 count = stats->count + moments->count;
+        double delta = moments->mean - stats->mean;
+        double weight = (double)moments->count / (double)count;
+        
+        stats->mean += delta * weight;
+        stats->m2 += moments->m2 + delta * delta * (double)stats->count * weight;
+        stats->count = count;
+    }
+}
+
+static void merge_distance_extremes(DistanceStats* stats, DistanceExtremes* extremes) {
+    stats->min = (extremes->min < stats->min) ? extremes->min : stats->min;
+    stats->max = (extremes->max > stats->max) ? extremes->max : stats->max;
+    
+    for (u32 i = 0; i < DISTANCE_HISTOGRAM_BUCKET_COUNT; i++) {
+        stats->histogram[i] += extremes->histogram[i];
+    }
+}
+
+static void init_distance_stats(DistanceStats* stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->min = INFINITY;
+    stats->max = -INFINITY;
+}
+
+// Estimated from the histogram, interpolating linearly inside the bucket the rank falls in.
+static double get_distance_percentile(DistanceStats* stats, double percentile) {
+    double result = 0.0;
+    
+    if (stats->count) {
+        double rank = percentile / 100.0 * (double)(stats->count - 1);
+        
+        u64 below = 0;
+        for (u32 bucket = 0; bucket < DISTANCE_HISTOGRAM_BUCKET_COUNT; bucket++) {
+            u64 inBucket = stats->histogram[bucket];
+            if (inBucket && ((double)(below + inBucket) > rank)) {
+                double start = get_distance_bucket_start(bucket);
+                double end = (bucket + 1 < DISTANCE_HISTOGRAM_BUCKET_COUNT) ? get_distance_bucket_start(bucket + 1) : stats->max;
+                result = start + (end - start) * ((rank - (double)below + 0.5) / (double)inBucket);
+                break;
+            }
+            below += inBucket;
+        }
+        
+        result = (result < stats->min) ? stats->min : result;
+        result = (result > stats->max) ? stats->max : result;
+    }
+    
+    return result;
+}
+
+static void print_distance_stats(DistanceStats* stats) {
+    fprintf(stdout, "Distance count: %llu\n", stats->count);
+    
+    if (stats->count) {
+        double variance = (stats->count > 1) ? (stats->m2 / (double)(stats->count - 1)) : 0.0;
+        
+        fprintf(stdout, "Distance min: %.16f\n", stats->min);
+        fprintf(stdout, "Distance max: %.16f\n", stats->max);
+        fprintf(stdout, "Distance mean: %.16f\n", stats->mean);
+        fprintf(stdout, "Distance variance: %.16f (std dev %.16f)\n", variance, sqrt(variance));
+        fprintf(stdout, "Distance percentiles (histogram estimates): p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f\n",
+                get_distance_percentile(stats, 50.0), get_distance_percentile(stats, 90.0),
+                get_distance_percentile(stats, 99.0), get_distance_percentile(stats, 99.9));
+        
+        // One line per power of two, the sub-buckets only feed the percentiles
+        u32 perOctave = 1 << DISTANCE_HISTOGRAM_SUB_BITS;
+        fprintf(stdout, "Distance histogram:\n");
+        for (u32 bucket = 0; bucket < DISTANCE_HISTOGRAM_BUCKET_COUNT;) {
+            u32 last = (bucket == 0) ? 0 : bucket + perOctave - 1;
+            if (last >= DISTANCE_HISTOGRAM_BUCKET_COUNT) {
+                last = DISTANCE_HISTOGRAM_BUCKET_COUNT - 1;
+            }
+            
+            u64 count = 0;
+            for (u32 i = bucket; i <= last; i++) {
+                count += stats->histogram[i];
+            }
+            
+            if (count) {
+                double start = get_distance_bucket_start(bucket);
+                if (last + 1 < DISTANCE_HISTOGRAM_BUCKET_COUNT) {
+                    fprintf(stdout, "  [%12.6f, %12.6f) %12llu %7.3f%%\n", start, get_distance_bucket_start(last + 1),
+                            count, 100.0 * (double)count / (double)stats->count);
+                } else {
+                    fprintf(stdout, "  [%12.6f, ...         ) %12llu %7.3f%%\n", start,
+                            count, 100.0 * (double)count / (double)stats->count);
+                }
+            }
+            
+            bucket = last + 1;
+        }
+    }
+}
+
+//
+// Blocked driver
+//
+
+struct SumContext {
+    SumMode mode;
+    
+    HaversinePair* pairs; // Distances are computed from these...
+    double* values;       // ...unless they were given up front
+    
+    u64 valueCount;
+    u64 blockCount;
+    
+    CompensatedSum* blockSums;
+    ExactSum threadExact[MAX_THREAD_COUNT];
+    
+    // Only when statistics were asked for
+    DistanceMoments* blockMoments;
+    DistanceExtremes* threadExtremes;
+    u32 extremesCount;
+};
+
+static void sum_task(void* data, u64 taskIndex, u32 threadIndex) {
+    SumContext* context = (SumContext*)data;
+    
+    u64 first = taskIndex * SUM_BLOCK_PAIR_COUNT;
+    u64 count = context->valueCount - first;
+    if (count > SUM_BLOCK_PAIR_COUNT) {
+        count = SUM_BLOCK_PAIR_COUNT;
+    }
+    
+    double distances[SUM_BLOCK_PAIR_COUNT];
+    double* values = distances;
+    if (context->values) {
+        values = context->values + first;
+    } else {
+        haversine_distances(count, context->pairs + first, distances);
+    }
+    
+    CompensatedSum* block = context->blockSums + taskIndex;
+    
+    switch(context->mode) {
+        case SumMode_Pairwise: {
+            block->sum = sum_pairwise(count, values);
+            block->compensation = 0.0;
+        } break;
+        
+        case SumMode_Neumaier: {
+            *block = sum_neumaier(count, values);
+        } break;
+        
+        case SumMode_Exact: {
+            // Integer addition is associative, a per-thread accumulator is still order-independent
+            exact_add_values(context->threadExact + threadIndex, count, values);
+        } break;
+        
+        default: {
+        } break;
+    }
+    
+    if (context->blockMoments) {
+        accumulate_distance_stats(count, values, context->blockMoments + taskIndex, context->threadExtremes + threadIndex);
+    }
+}
+
+// Sets up the per-block moments and per-thread extremes sum_task fills when stats are wanted.
+static String begin_sum_stats(SumContext* context, u32 threadCount, DistanceStats* stats) {
+    String result = {};
+    
+    if (stats) {
+        context->extremesCount = clamp_thread_count(threadCount);
+        result = allocate_string(context->blockCount * sizeof(DistanceMoments) +
+                                 context->extremesCount * sizeof(DistanceExtremes));
+    }
+    
+    if (result.data) {
+        context->threadExtremes = (DistanceExtremes*)result.data;
+        context->blockMoments = (DistanceMoments*)(context->threadExtremes + context->extremesCount);
+        
+        for (u32 i = 0; i < context->extremesCount; i++) {
+            init_distance_extremes(context->threadExtremes + i);
+        }
+    }
+    
+    return result;
+}
+
+// Merges what sum_task gathered onto stats, moments in block order so the result doesn't depend
+// on the thread count.
+static void end_sum_stats(SumContext* context, String* memory, DistanceStats* stats) {
+    if (memory->data) {
+        for (u64 i = 0; i < context->blockCount; i++) {
+            merge_distance_moments(stats, context->blockMoments + i);
+        }
+        
+        for (u32 i = 0; i < context->extremesCount; i++) {
+            merge_distance_extremes(stats, context->threadExtremes + i);
+        }
+    }
+    
+    free_string(memory);
+}
+
+static double sum_blocks_pairwise(u64 count, CompensatedSum* blocks) {
+    double result = 0.0;
+    
+    if (count == 1) {
+        result = blocks[0].sum;
+    } else if (count > 1) {
+        u64 half = count / 2;
+        result = sum_blocks_pairwise(half, blocks) + sum_blocks_pairwise(count - half, blocks + half);
+    }
+    
+    return result;
+}
+
+// Returns the plain total (not the mean) of the values or of the pair distances, NaN if there
+// wasn't memory for the blocks. When stats is given the distances are also merged onto it, in the
+// same pass.
+static double sum_blocked(SumMode mode, u32 threadCount, u64 count, HaversinePair* pairs, double* values,
+                          DistanceStats* stats) {
+    String contextMemory = allocate_string(sizeof(SumContext));
+    if (!contextMemory.data) {
+        return NAN;
+    }
+    memset(contextMemory.data, 0, contextMemory.count);
+    
+    SumContext* context = (SumContext*)contextMemory.data;
+    context->mode = mode;
+    context->pairs = pairs;
+    context->values = values;
+    context->valueCount = count;
+    context->blockCount = (count + SUM_BLOCK_PAIR_COUNT - 1) / SUM_BLOCK_PAIR_COUNT;
+    
+    String blockMemory = allocate_string(context->blockCount * sizeof(CompensatedSum));
+    if (!blockMemory.data) {
+        free_string(&contextMemory);
+        return NAN;
+    }
+    context->blockSums = (CompensatedSum*)blockMemory.data;
+    
+    String statsMemory = begin_sum_stats(context, threadCount, stats);
+    
+    u64 byteCount = count * (pairs ? sizeof(HaversinePair) : sizeof(double));
+    run_parallel_data(threadCount, context->blockCount, sum_task, context, "Sum blocks", byteCount);
+    
+    end_sum_stats(context, &statsMemory, stats);
+    
+    double result = 0.0;
+    
+    switch(mode) {
+        case SumMode_Pairwise: {
+            result = sum_blocks_pairwise(context->blockCount, context->blockSums);
+        } break;
+        
+        case SumMode_Neumaier: {
+            CompensatedSum total = {};
+            for (u64 i = 0; i < context->blockCount; i++) {
+                add_compensated(&total, context->blockSums[i].sum);
+                total.compensation += context->blockSums[i].compensation;
+            }
+            result = total.sum + total.compensation;
+        } break;
+        
+        case SumMode_Exact: {
+            ExactSum* total = context->threadExact;
+            for (u32 i = 1; i < MAX_THREAD_COUNT; i++) {
+                exact_merge(total, context->threadExact + i);
+            }
+            result = exact_to_double(total);
+        } break;
+        
+        default: {
+        } break;
+    }
+    
+    free_string(&blockMemory);
+    free_string(&contextMemory);
+    
+    return result;
+}
+
+static double sum_naive(u64 count, HaversinePair* pairs, double* values) {
+    double sum = 0;
+    
+    double sumCoeff = 1 / (double)count;
+    for (u64 i = 0; i < count; i++) {
+        double dist;
+        if (values) {
+            dist = values[i];
+        } else {
+            haversine_distances(1, pairs + i, &dist);
+        }
+        sum += sumCoeff * dist;
+    }
+    
+    return sum;
+}
+
+// Where a Neumaier sum over blocks left off: the fold of the first pairCount pairs, which is
+// always a whole number of blocks.
+struct SumCheckpoint {
+    u64 pairCount;
+    CompensatedSum total;
+};
+
+// Folds the blocks of count pairs (pair checkpoint->pairCount onwards) onto the checkpoint and
+// returns the total. The checkpoint then points at the last whole block, so summing pairs that
+// are appended later can start there and still give the bitwise same total as sum_blocked in
+// SumMode_Neumaier over everything. Without memory for the blocks the checkpoint stays as it was
+// and the result is NaN.
+static double resume_neumaier_sum(u32 threadCount, u64 count, HaversinePair* pairs, SumCheckpoint* checkpoint,
+                                  DistanceStats* stats) {
+    String contextMemory = allocate_string(sizeof(SumContext));
+    if (!contextMemory.data) {
+        return NAN;
+    }
+    memset(contextMemory.data, 0, contextMemory.count);
+    
+    SumContext* context = (SumContext*)contextMemory.data;
+    context->mode = SumMode_Neumaier;
+    context->pairs = pairs;
+    context->valueCount = count;
+    context->blockCount = (count + SUM_BLOCK_PAIR_COUNT - 1) / SUM_BLOCK_PAIR_COUNT;
+    
+    String blockMemory = allocate_string(context->blockCount * sizeof(CompensatedSum));
+    if (!blockMemory.data) {
+        free_string(&contextMemory);
+        return NAN;
+    }
+    context->blockSums = (CompensatedSum*)blockMemory.data;
+    
+    String statsMemory = begin_sum_stats(context, threadCount, stats);
+    
+    u64 byteCount = count * sizeof(HaversinePair);
+    run_parallel_data(threadCount, context->blockCount, sum_task, context, "Sum blocks", byteCount);
+    
+    end_sum_stats(context, &statsMemory, stats);
+    
+    u64 wholeBlockCount = count / SUM_BLOCK_PAIR_COUNT;
+    
+    CompensatedSum total = checkpoint->total;
+    for (u64 i = 0; i < context->blockCount; i++) {
+        add_compensated(&total, context->blockSums[i].sum);
+        total.compensation += context->blockSums[i].compensation;
+        
+        if ((i + 1) == wholeBlockCount) {
+            checkpoint->total = total;
+        }
+    }
+    checkpoint->pairCount += wholeBlockCount * SUM_BLOCK_PAIR_COUNT;
+    
+    double result = total.sum + total.compensation;
+    
+    free_string(&blockMemory);
+    free_string(&contextMemory);
+    
+    return result;
+}
+
+// Mean of the distances. Either pairs or values is given.
+// NOTE(alex): The naive loop isn't blocked, so with stats it takes a second pass that only
+// gathers them.
+static double mean_of_distances(SumMode mode, u32 threadCount, u64 count, HaversinePair* pairs, double* values,
+                                DistanceStats* stats) {
+    double result = 0.0;
+    
+    if (count) {
+        if (mode == SumMode_Naive) {
+            result = sum_naive(count, pairs, values);
+            
+            if (stats) {
+                sum_blocked(mode, threadCount, count, pairs, values, stats);
+            }
+        } else {
+            result = sum_blocked(mode, threadCount, count, pairs, values, stats) / (double)count;
+        }
+    }
+    
+    return result;
+}
+
+#if _MSC_VER
+#pragma float_control(pop)
+#endif
\ No newline at end of file
@@ -0,0 +1,144 @@
+// Threads, sleeping and pinning to a CPU. Kept apart from platform.cpp so tools that only need
+// these (rdtsc_test) don't pull in sockets, NUMA and file mapping with it.
+
+#if _WIN32
+// windows.h comes in through metrics.cpp
+#else
+#include <pthread.h>
+#include <sched.h> // cpu_set_t
+#include <time.h> // nanosleep()
+#include <unistd.h> // sysconf()
+#endif
+
+typedef void thread_proc(void* data);
+
+struct Thread {
+#if _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+    thread_proc* proc;
+    void* data;
+};
+
+struct ThreadAffinity {
+#if _WIN32
+    GROUP_AFFINITY affinity;
+#else
+    cpu_set_t cpus;
+#endif
+};
+
+#if _WIN32
+
+static DWORD WINAPI thread_entry(LPVOID param) {
+    Thread* thread = (Thread*)param;
+    thread->proc(thread->data);
+    return 0;
+}
+
+// NOTE(alex): thread must stay alive until join_thread, the OS thread reads proc/data from it.
+static bool create_thread(Thread* thread, thread_proc* proc, void* data) {
+    thread->proc = proc;
+    thread->data = data;
+    thread->handle = CreateThread(0, 0, thread_entry, thread, 0, 0);
+    
+    bool result = (thread->handle != 0);
+    return result;
+}
+
+static void join_thread(Thread* thread) {
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+    thread->handle = 0;
+}
+
+static void sleep_milliseconds(u32 milliseconds) {
+    Sleep(milliseconds);
+}
+
+static u32 get_logical_processor_count() {
+    u32 result = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    return result ? result : 1;
+}
+
+static void restore_thread_affinity(ThreadAffinity* previous) {
+    SetThreadGroupAffinity(GetCurrentThread(), &previous->affinity, 0);
+}
+
+// cpu counts logical processors across the processor groups in order.
+static bool pin_thread_to_cpu(u32 cpu, ThreadAffinity* previous) {
+    GROUP_AFFINITY affinity = {};
+    
+    WORD groupCount = GetActiveProcessorGroupCount();
+    while ((affinity.Group < groupCount) && (cpu >= GetActiveProcessorCount(affinity.Group))) {
+        cpu -= GetActiveProcessorCount(affinity.Group);
+        affinity.Group++;
+    }
+    
+    if (affinity.Group == groupCount) {
+        return false;
+    }
+    affinity.Mask = (KAFFINITY)1 << cpu;
+    
+    bool result = SetThreadGroupAffinity(GetCurrentThread(), &affinity, previous ? &previous->affinity : 0) != 0;
+    return result;
+}
+
+#else // _WIN32
+
+static void* thread_entry(void* param) {
+    Thread* thread = (Thread*)param;
+    thread->proc(thread->data);
+    return 0;
+}
+
+// NOTE(alex): thread must stay alive until join_thread, the OS thread reads proc/data from it.
+static bool create_thread(Thread* thread, thread_proc* proc, void* data) {
+    thread->proc = proc;
+    thread->data = data;
+    
+    bool result = (pthread_create(&thread->handle, 0, thread_entry, thread) == 0);
+    return result;
+}
+
+static void join_thread(Thread* thread) {
+    pthread_join(thread->handle, 0);
+}
+
+static void sleep_milliseconds(u32 milliseconds) {
+    timespec duration = {};
+    duration.tv_sec = milliseconds / 1000;
+    duration.tv_nsec = (long)(milliseconds % 1000) * 1000000;
+    nanosleep(&duration, 0);
+}
+
+static u32 get_logical_processor_count() {
+    long result = sysconf(_SC_NPROCESSORS_ONLN);
+    return (result > 0) ? (u32)result : 1;
+}
+
+static void restore_thread_affinity(ThreadAffinity* previous) {
+    pthread_setaffinity_np(pthread_self(), sizeof(previous->cpus), &previous->cpus);
+}
+
+// cpu is the OS's number for it. Fails for CPUs that are offline or outside the process's mask.
+static bool pin_thread_to_cpu(u32 cpu, ThreadAffinity* previous) {
+    if (cpu >= CPU_SETSIZE) {
+        return false;
+    }
+    
+    if (previous) {
+        pthread_getaffinity_np(pthread_self(), sizeof(previous->cpus), &previous->cpus);
+    }
+    
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    
+    bool result = (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0);
+    return result;
+}
+
+#endif // _WIN32
\ No newline at end of file
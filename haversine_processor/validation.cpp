@@ -0,0 +1,225 @@
+#include <emmintrin.h> // SSE2
+#include <float.h> // DBL_MIN
+
+// Per-pair check of the distance kernel against the doubles written by haversine_generator.
+// The answers file is mapped and streamed in blocks, each block is re-computed with
+// haversine_distances and compared against its reference values.
+
+#define VALIDATION_BLOCK_PAIR_COUNT 4096
+
+struct PairValidation {
+    // NOTE(alex): Set when a check couldn't run (no memory for it), the counts below then only
+    // cover what did.
+    bool failed;
+    
+    u64 pairCount;
+    
+    double maxAbsError;
+    u64 maxAbsErrorIndex;
+    
+    double maxRelError;
+    u64 maxRelErrorIndex;
+    
+    u64 maxUlpDistance;
+    u64 maxUlpIndex;
+};
+
+struct ValidationContext {
+    HaversinePair* pairs;
+    double* answers;
+    u64 pairCount;
+    
+    PairValidation threadResults[MAX_THREAD_COUNT];
+};
+
+// NOTE(alex): Maps the bit patterns onto a line where adjacent doubles are adjacent integers, so
+// the difference is the number of representable values between a and b. NaNs land far away from
+// any finite value, which is exactly what a gate wants.
+static u64 ulp_distance(double a, double b) {
+    s64 ia;
+    s64 ib;
+    memcpy(&ia, &a, sizeof(ia));
+    memcpy(&ib, &b, sizeof(ib));
+    
+    ia ^= (ia >> 63) & INT64_MAX;
+    ib ^= (ib >> 63) & INT64_MAX;
+    
+    u64 result = (ia > ib) ? ((u64)ia - (u64)ib) : ((u64)ib - (u64)ia);
+    return result;
+}
+
+static void validate_block(PairValidation* result, u64 firstIndex, u64 count, double* computed, double* reference) {
+    // SSE2 pass for the block maxima. The scalar scan for the index only happens when the block
+    // beats the current worst, which is rare after the first few blocks.
+    __m128d signMask = _mm_set1_pd(-0.0);
+    __m128d minRef = _mm_set1_pd(DBL_MIN);
+    __m128d maxAbs = _mm_setzero_pd();
+    __m128d maxRel = _mm_setzero_pd();
+    
+    u64 i = 0;
+    for (; (i + 2) <= count; i += 2) {
+        __m128d c = _mm_loadu_pd(computed + i);
+        __m128d r = _mm_loadu_pd(reference + i);
+        
+        __m128d absError = _mm_andnot_pd(signMask, _mm_sub_pd(c, r));
+        __m128d absRef = _mm_max_pd(_mm_andnot_pd(signMask, r), minRef);
+        
+        maxAbs = _mm_max_pd(maxAbs, absError);
+        maxRel = _mm_max_pd(maxRel, _mm_div_pd(absError, absRef));
+    }
+    
+    double blockMaxAbs = _mm_cvtsd_f64(_mm_max_sd(maxAbs, _mm_unpackhi_pd(maxAbs, maxAbs)));
+    double blockMaxRel = _mm_cvtsd_f64(_mm_max_sd(maxRel, _mm_unpackhi_pd(maxRel, maxRel)));
+    
+    for (; i < count; i++) {
+        double absError = fabs(computed[i] - reference[i]);
+        double absRef = fmax(fabs(reference[i]), DBL_MIN);
+        blockMaxAbs = fmax(blockMaxAbs, absError);
+        blockMaxRel = fmax(blockMaxRel, absError / absRef);
+    }
+    
+    if (blockMaxAbs > result->maxAbsError) {
+        for (u64 j = 0; j < count; j++) {
+            if (fabs(computed[j] - reference[j]) == blockMaxAbs) {
+                result->maxAbsError = blockMaxAbs;
+                result->maxAbsErrorIndex = firstIndex + j;
+                break;
+            }
+        }
+    }
+    
+    if (blockMaxRel > result->maxRelError) {
+        for (u64 j = 0; j < count; j++) {
+            if ((fabs(computed[j] - reference[j]) / fmax(fabs(reference[j]), DBL_MIN)) == blockMaxRel) {
+                result->maxRelError = blockMaxRel;
+                result->maxRelErrorIndex = firstIndex + j;
+                break;
+            }
+        }
+    }
+    
+    for (u64 j = 0; j < count; j++) {
+        u64 ulps = ulp_distance(computed[j], reference[j]);
+        if (ulps > result->maxUlpDistance) {
+            result->maxUlpDistance = ulps;
+            result->maxUlpIndex = firstIndex + j;
+        }
+    }
+    
+    result->pairCount += count;
+}
+
+static void validation_task(void* data, u64 taskIndex, u32 threadIndex) {
+    ValidationContext* context = (ValidationContext*)data;
+    
+    u64 first = taskIndex * VALIDATION_BLOCK_PAIR_COUNT;
+    u64 count = context->pairCount - first;
+    if (count > VALIDATION_BLOCK_PAIR_COUNT) {
+        count = VALIDATION_BLOCK_PAIR_COUNT;
+    }
+    
+    double computed[VALIDATION_BLOCK_PAIR_COUNT];
+    haversine_distances(count, context->pairs + first, computed);
+    
+    validate_block(context->threadResults + threadIndex, first, count, computed, context->answers + first);
+}
+
+// Ties go to the lowest pair index so the report doesn't depend on the thread count.
+static void merge_validation(PairValidation* result, PairValidation* other) {
+    result->pairCount += other->pairCount;
+    
+    if ((other->maxAbsError > result->maxAbsError) ||
+        ((other->maxAbsError == result->maxAbsError) && (other->maxAbsErrorIndex < result->maxAbsErrorIndex))) {
+        result->maxAbsError = other->maxAbsError;
+        result->maxAbsErrorIndex = other->maxAbsErrorIndex;
+    }
+    
+    if ((other->maxRelError > result->maxRelError) ||
+        ((other->maxRelError == result->maxRelError) && (other->maxRelErrorIndex < result->maxRelErrorIndex))) {
+        result->maxRelError = other->maxRelError;
+        result->maxRelErrorIndex = other->maxRelErrorIndex;
+    }
+    
+    if ((other->maxUlpDistance > result->maxUlpDistance) ||
+        ((other->maxUlpDistance == result->maxUlpDistance) && (other->maxUlpIndex < result->maxUlpIndex))) {
+        result->maxUlpDistance = other->maxUlpDistance;
+        result->maxUlpIndex = other->maxUlpIndex;
+    }
+}
+
+static PairValidation validate_pair_distances(u32 threadCount, u64 pairCount, HaversinePair* pairs, double* answers) {
+    PROFILE_FUNC_DATA(pairCount * (sizeof(HaversinePair) + sizeof(double)));
+    
+    String contextMemory = allocate_string(sizeof(ValidationContext));
+    if (!contextMemory.data) {
+        PairValidation failed = {};
+        failed.failed = true;
+        return failed;
+    }
+    memset(contextMemory.data, 0, contextMemory.count);
+    
+    ValidationContext* context = (ValidationContext*)contextMemory.data;
+    context->pairs = pairs;
+    context->answers = answers;
+    context->pairCount = pairCount;
+    
+    u64 taskCount = (pairCount + VALIDATION_BLOCK_PAIR_COUNT - 1) / VALIDATION_BLOCK_PAIR_COUNT;
+    run_parallel(threadCount, taskCount, validation_task, context);
+    
+    PairValidation result = {};
+    result.maxAbsErrorIndex = U64Max;
+    result.maxRelErrorIndex = U64Max;
+    result.maxUlpIndex = U64Max;
+    
+    for (u32 i = 0; i < MAX_THREAD_COUNT; i++) {
+        if (context->threadResults[i].pairCount) {
+            merge_validation(&result, context->threadResults + i);
+        }
+    }
+    
+    free_string(&contextMemory);
+    
+    return result;
+}
+
+// Folds the validation of a block that starts at pair firstIndex into result, for inputs that are
+// checked a block at a time.
+static void accumulate_validation(PairValidation* result, PairValidation* block, u64 firstIndex) {
+    if (block->failed) {
+        result->failed = true;
+    } else if (block->pairCount) {
+        block->maxAbsErrorIndex += firstIndex;
+        block->maxRelErrorIndex += firstIndex;
+        block->maxUlpIndex += firstIndex;
+        
+        if (result->pairCount) {
+            merge_validation(result, block);
+        } else {
+            bool failed = result->failed;
+            *result = *block;
+            result->failed = failed;
+        }
+    }
+}
+
+// pairs can be null when they're no longer around, the worst pair is just not shown then.
+static void print_pair_validation(PairValidation* validation, HaversinePair* pairs, double* answers) {
+    fprintf(stdout, "Pairs checked: %llu\n", validation->pairCount);
+    
+    if (validation->pairCount) {
+        fprintf(stdout, "Max abs error: %.17g (pair %llu)\n", validation->maxAbsError, validation->maxAbsErrorIndex);
+        fprintf(stdout, "Max rel error: %.17g (pair %llu)\n", validation->maxRelError, validation->maxRelErrorIndex);
+        fprintf(stdout, "Max ULP distance: %llu (pair %llu)\n", validation->maxUlpDistance, validation->maxUlpIndex);
+        
+        if (validation->maxUlpDistance && pairs) {
+            u64 worst = validation->maxUlpIndex;
+            HaversinePair pair = pairs[worst];
+            
+            double computed;
+            haversine_distances(1, pairs + worst, &computed);
+            
+            fprintf(stdout, "Worst pair: x0 %.16f y0 %.16f x1 %.16f y1 %.16f\n", pair.x0, pair.y0, pair.x1, pair.y1);
+            fprintf(stdout, "            computed %.17g, reference %.17g\n", computed, answers[worst]);
+        }
+    }
+}
\ No newline at end of file
@@ -1,65 +1,434 @@
 #include <stdio.h>
 #include <stdint.h>
-#include <intrin.h> // __rdtsc()
-
-#include <windows.h> // QueryPerformanceFrequency(), ...
+#include <stdlib.h>
+#include <string.h>
 
 typedef uint8_t u8;
 typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
+typedef int64_t s64;
+
+#define ARRAY_COUNT(arr) (sizeof(arr) / sizeof(arr[0]))
+
+#include "../haversine_processor/string.cpp"
+#include "../haversine_processor/metrics.cpp"
+#include "../haversine_processor/threads.cpp"
+
+//
+// Diagnostics (--diagnose): whether TSC deltas can be trusted on this machine
+//
+
+#define SKEW_SAMPLE_COUNT 2000
+#define SKEW_MAX_CPUS 256
+#define SKEW_MATRIX_MAX_CPUS 16 // Above this only each CPU against the first is printed
+#define OVERHEAD_READ_COUNT (1 << 20)
+#define DRIFT_DEFAULT_SECONDS 120
+#define DRIFT_ROW_COUNT 20
+
+// rdtsc can run before earlier instructions finish and after later ones start, the fences keep
+// it in place.
+static u64 read_cpu_timer_fenced() {
+    _mm_lfence();
+    u64 result = __rdtsc();
+    _mm_lfence();
+    return result;
+}
+
+// Waits for earlier instructions, but later ones can still start before it.
+static u64 read_cpu_timer_p() {
+    u32 processor;
+    u64 result = __rdtscp(&processor);
+    return result;
+}
+
+static u64 read_cpu_timer_plain() {
+    return read_cpu_timer();
+}
+
+static void print_tsc_features() {
+    u32 registers[4];
+    
+    read_cpuid(1, 0, registers);
+    bool hasTsc = (registers[3] >> 4) & 1;
+    bool underHypervisor = (registers[2] >> 31) & 1;
+    
+    u32 maxExtendedLeaf = get_max_cpuid_leaf(0x80000000);
+    
+    bool hasRdtscp = false;
+    if (maxExtendedLeaf >= 0x80000001) {
+        read_cpuid(0x80000001, 0, registers);
+        hasRdtscp = (registers[3] >> 27) & 1;
+    }
+    
+    bool invariant = false;
+    if (maxExtendedLeaf >= 0x80000007) {
+        read_cpuid(0x80000007, 0, registers);
+        invariant = (registers[3] >> 8) & 1;
+    }
+    
+    bool hasTscAdjust = false;
+    if (get_max_cpuid_leaf(0) >= 7) {
+        read_cpuid(7, 0, registers);
+        hasTscAdjust = (registers[1] >> 1) & 1;
+    }
+    
+    printf("%-24s %s\n", "Feature", "Present");
+    printf("%-24s %s\n", "TSC", hasTsc ? "yes" : "no");
+    printf("%-24s %s\n", "Invariant TSC", invariant ? "yes" : "NO, rate changes with P/C-states");
+    printf("%-24s %s\n", "RDTSCP", hasRdtscp ? "yes" : "no");
+    printf("%-24s %s\n", "TSC_ADJUST MSR", hasTscAdjust ? "yes" : "no");
+    printf("%-24s %s\n", "Hypervisor", underHypervisor ? "yes, the TSC may be virtualized" : "no");
+}
 
-inline u64 read_cpu_timer() {
-    return __rdtsc();
+typedef u64 timer_read_func();
+
+struct TimerCandidate {
+    const char* name;
+    timer_read_func* read;
+    u64 freq; // Units per second of what read returns
+};
+
+// Cost per read from back to back calls, and resolution as the smallest step seen between two.
+static void print_timer_overheads(u64 cpuFreq) {
+    TimerCandidate timers[] = {
+        { "rdtsc", read_cpu_timer_plain, cpuFreq },
+        { "rdtscp", read_cpu_timer_p, cpuFreq },
+        { "lfence+rdtsc+lfence", read_cpu_timer_fenced, cpuFreq },
+#if _WIN32
+        { "QueryPerformanceCounter", read_os_timer, get_os_timer_freq() },
+#else
+        { "clock_gettime (vDSO)", read_os_timer, get_os_timer_freq() },
+#endif
+    };
+    
+    printf("%-24s %-14s %-12s %s\n", "Timer", "Cycles/read", "ns/read", "Resolution");
+    
+    for (u32 i = 0; i < ARRAY_COUNT(timers); i++) {
+        TimerCandidate* timer = timers + i;
+        
+        u64 minStep = UINT64_MAX;
+        u64 previous = timer->read();
+        
+        u64 start = read_cpu_timer_fenced();
+        for (u32 j = 0; j < OVERHEAD_READ_COUNT; j++) {
+            u64 value = timer->read();
+            u64 step = value - previous;
+            if (step && (step < minStep)) {
+                minStep = step;
+            }
+            previous = value;
+        }
+        u64 elapsed = read_cpu_timer_fenced() - start;
+        
+        double cyclesPerRead = (double)elapsed / (double)OVERHEAD_READ_COUNT;
+        double nsPerRead = 1e9 * cyclesPerRead / (double)cpuFreq;
+        double resolutionNs = (minStep != UINT64_MAX) ? (1e9 * (double)minStep / (double)timer->freq) : 0.0;
+        
+        printf("%-24s %-14.1f %-12.2f %.2fns (%llu ticks)\n", timer->name, cyclesPerRead, nsPerRead, resolutionNs,
+               (minStep != UINT64_MAX) ? minStep : 0);
+    }
+    
+    printf("(Reads go through a function pointer, which adds a couple of cycles to each.)\n");
+}
+
+// Both threads bounce this line: the initiator writes an odd sequence, the responder reads its
+// TSC, stores it and writes the next even one.
+struct alignas(64) SkewLine {
+    volatile u64 sequence;
+    volatile u64 responderTsc;
+    volatile u32 ready; // 1 once the responder is pinned, 2 if it couldn't be
+};
+
+struct SkewResponder {
+    SkewLine line;
+    u32 cpu;
+};
+
+struct SkewResult {
+    bool measured;
+    bool consistent; // False if no offset fits every sample, the TSCs moved during the test
+    s64 offset;      // Responder TSC minus initiator TSC
+    s64 uncertainty;
+    u64 minRoundTrip;
+};
+
+static void skew_responder(void* data) {
+    SkewResponder* responder = (SkewResponder*)data;
+    SkewLine* line = &responder->line;
+    
+    bool pinned = pin_thread_to_cpu(responder->cpu, 0);
+    line->ready = pinned ? 1 : 2;
+    
+    if (pinned) {
+        for (u64 i = 0; i < SKEW_SAMPLE_COUNT; i++) {
+            u64 ping = 2 * i + 1;
+            while (line->sequence != ping) {
+                _mm_pause();
+            }
+            
+            line->responderTsc = read_cpu_timer_fenced();
+            line->sequence = ping + 1;
+        }
+    }
 }
 
-static u64 get_os_timer_freq() {
-    LARGE_INTEGER freq;
-    QueryPerformanceFrequency(&freq);
-    return freq.QuadPart;
+// NOTE(alex): Each sample bounds the offset from both sides: the responder read its TSC after
+// we sent (t0) and before we saw the answer (t1), so responderTsc - t1 <= offset <=
+// responderTsc - t0. Keeping the tightest bounds over all samples gives the offset to within
+// half the fastest round trip, whatever the latency of the other round trips was.
+static SkewResult measure_tsc_skew(u32 initiatorCpu, u32 responderCpu) {
+    SkewResult result = {};
+    
+    if (!pin_thread_to_cpu(initiatorCpu, 0)) {
+        return result;
+    }
+    
+    SkewResponder responder = {};
+    responder.cpu = responderCpu;
+    SkewLine* line = &responder.line;
+    
+    Thread thread;
+    if (!create_thread(&thread, skew_responder, &responder)) {
+        return result;
+    }
+    
+    while (!line->ready) {
+        _mm_pause();
+    }
+    
+    if (line->ready == 1) {
+        s64 lower = INT64_MIN;
+        s64 upper = INT64_MAX;
+        u64 minRoundTrip = UINT64_MAX;
+        
+        for (u64 i = 0; i < SKEW_SAMPLE_COUNT; i++) {
+            u64 pong = 2 * i + 2;
+            
+            u64 t0 = read_cpu_timer_fenced();
+            line->sequence = pong - 1;
+            while (line->sequence != pong) {
+                _mm_pause();
+            }
+            u64 t1 = read_cpu_timer_fenced();
+            
+            u64 responderTsc = line->responderTsc;
+            s64 sampleLower = (s64)(responderTsc - t1);
+            s64 sampleUpper = (s64)(responderTsc - t0);
+            
+            lower = (sampleLower > lower) ? sampleLower : lower;
+            upper = (sampleUpper < upper) ? sampleUpper : upper;
+            minRoundTrip = ((t1 - t0) < minRoundTrip) ? (t1 - t0) : minRoundTrip;
+        }
+        
+        result.measured = true;
+        result.consistent = (lower <= upper);
+        result.offset = lower / 2 + upper / 2;
+        result.uncertainty = result.consistent ? (upper - lower) / 2 : (lower - upper) / 2;
+        result.minRoundTrip = minRoundTrip;
+    }
+    
+    join_thread(&thread);
+    
+    return result;
 }
 
-static u64 read_os_timer() {
-    LARGE_INTEGER value;
-    QueryPerformanceCounter(&value);
-    return value.QuadPart;
+static void print_tsc_skew(u64 cpuFreq) {
+    u32 cpuCount = get_logical_processor_count();
+    if (cpuCount > SKEW_MAX_CPUS) {
+        cpuCount = SKEW_MAX_CPUS;
+    }
+    
+    if (cpuCount < 2) {
+        printf("Only one logical processor, nothing to compare.\n");
+        return;
+    }
+    
+    String resultMemory = allocate_string((u64)cpuCount * cpuCount * sizeof(SkewResult));
+    if (!resultMemory.data) {
+        return;
+    }
+    memset(resultMemory.data, 0, resultMemory.count);
+    SkewResult* results = (SkewResult*)resultMemory.data;
+    
+    ThreadAffinity previousAffinity;
+    bool restore = pin_thread_to_cpu(0, &previousAffinity);
+    
+    SkewResult* worst = 0;
+    u32 worstA = 0;
+    u32 worstB = 0;
+    u32 inconsistentCount = 0;
+    
+    for (u32 a = 0; a < cpuCount; a++) {
+        for (u32 b = a + 1; b < cpuCount; b++) {
+            SkewResult* result = results + a * cpuCount + b;
+            *result = measure_tsc_skew(a, b);
+            
+            // The other direction is the same measurement
+            SkewResult* mirror = results + b * cpuCount + a;
+            *mirror = *result;
+            mirror->offset = -result->offset;
+            
+            if (result->measured) {
+                s64 magnitude = (result->offset < 0) ? -result->offset : result->offset;
+                s64 worstMagnitude = worst ? ((worst->offset < 0) ? -worst->offset : worst->offset) : -1;
+                if (magnitude > worstMagnitude) {
+                    worst = result;
+                    worstA = a;
+                    worstB = b;
+                }
+                
+                inconsistentCount += !result->consistent;
+            }
+        }
+    }
+    
+    if (restore) {
+        restore_thread_affinity(&previousAffinity);
+    }
+    
+    double nsPerCycle = 1e9 / (double)cpuFreq;
+    
+    if (cpuCount <= SKEW_MATRIX_MAX_CPUS) {
+        printf("TSC offset in cycles, column CPU minus row CPU (\"-\" if either couldn't be pinned):\n");
+        printf("%6s", "");
+        for (u32 b = 0; b < cpuCount; b++) {
+            printf(" %8u", b);
+        }
+        printf("\n");
+        
+        for (u32 a = 0; a < cpuCount; a++) {
+            printf("%6u", a);
+            for (u32 b = 0; b < cpuCount; b++) {
+                SkewResult* result = results + a * cpuCount + b;
+                if (a == b) {
+                    printf(" %8s", "0");
+                } else if (result->measured) {
+                    printf(" %8lld", result->offset);
+                } else {
+                    printf(" %8s", "-");
+                }
+            }
+            printf("\n");
+        }
+    } else {
+        printf("%-6s %-14s %-14s %-16s %s\n", "CPU", "Offset (cyc)", "+/- (cyc)", "Min round trip", "Consistent");
+        for (u32 b = 1; b < cpuCount; b++) {
+            SkewResult* result = results + b;
+            if (result->measured) {
+                printf("%-6u %-14lld %-14lld %-16llu %s\n", b, result->offset, result->uncertainty,
+                       result->minRoundTrip, result->consistent ? "yes" : "NO");
+            } else {
+                printf("%-6u %s\n", b, "couldn't be pinned");
+            }
+        }
+    }
+    
+    if (worst) {
+        printf("\nLargest offset: CPU %u -> CPU %u, %lld cycles (%.1fns) +/- %lld, min round trip %llu cycles\n",
+               worstA, worstB, worst->offset, (double)worst->offset * nsPerCycle, worst->uncertainty, worst->minRoundTrip);
+        
+        s64 magnitude = (worst->offset < 0) ? -worst->offset : worst->offset;
+        if (magnitude > worst->uncertainty) {
+            printf("WARNING: TSCs differ by more than the measurement can explain, don't compare TSC values across threads.\n");
+        }
+    }
+    
+    if (inconsistentCount) {
+        printf("WARNING: %u pairs had no offset consistent with every sample, their TSCs moved relative to each other.\n",
+               inconsistentCount);
+    }
+    
+    free_string(&resultMemory);
 }
 
-static u64 estimate_cpu_timer_freq() {
-    u64 millisToWait = 100;
+// Keeps sampling both timers and shows how far the TSC, converted with the frequency from
+// get_cpu_timer_freq, has moved away from the OS timer.
+static void print_tsc_drift(u64 seconds, u64 cpuFreq) {
     u64 osFreq = get_os_timer_freq();
+    u64 rowMillis = (seconds * 1000) / DRIFT_ROW_COUNT;
+    rowMillis = rowMillis ? rowMillis : 1;
     
-    u64 cpuStart = read_cpu_timer();
-    u64 osStart = read_os_timer();
-    u64 osEnd = 0;
-    u64 osElapsed = 0;
-    u64 osWaitTime = osFreq * millisToWait / 1000;
+    u64 cpuStart = 0;
+    u64 osStart = 0;
+    sample_cpu_and_os_timers(&cpuStart, &osStart);
     
-    while (osElapsed < osWaitTime) {
-        osEnd = read_os_timer();
-        osElapsed = osEnd - osStart;
+    u64 cpuLast = cpuStart;
+    u64 osLast = osStart;
+    u64 firstIntervalFreq = 0;
+    
+    printf("%-10s %-16s %-16s %-18s %s\n", "Elapsed", "Freq overall", "Freq interval", "Interval vs first", "TSC - OS time");
+    
+    for (u32 row = 0; row < DRIFT_ROW_COUNT; row++) {
+        sleep_milliseconds((u32)rowMillis);
+        
+        u64 cpuNow = 0;
+        u64 osNow = 0;
+        sample_cpu_and_os_timers(&cpuNow, &osNow);
+        
+        double osSeconds = (double)(osNow - osStart) / (double)osFreq;
+        u64 overallFreq = (u64)((double)(cpuNow - cpuStart) / osSeconds);
+        u64 intervalFreq = (u64)((double)(cpuNow - cpuLast) * (double)osFreq / (double)(osNow - osLast));
+        firstIntervalFreq = firstIntervalFreq ? firstIntervalFreq : intervalFreq;
+        
+        double intervalPpm = 1e6 * ((double)intervalFreq - (double)firstIntervalFreq) / (double)firstIntervalFreq;
+        double driftUs = 1e6 * ((double)(cpuNow - cpuStart) / (double)cpuFreq - osSeconds);
+        
+        printf("%8.1fs  %-16llu %-16llu %+14.2fppm %+12.2fus\n", osSeconds, overallFreq, intervalFreq, intervalPpm, driftUs);
+        
+        cpuLast = cpuNow;
+        osLast = osNow;
     }
+}
+
+static int run_diagnostics(u64 driftSeconds) {
+    u64 cpuFreq = get_cpu_timer_freq();
+    printf("CPU timer frequency: %llu (from %s)\n", cpuFreq, describe_cpu_timer_freq_source(get_cpu_timer_freq_source()));
     
-    u64 cpuEnd = read_cpu_timer();
-    u64 cpuElapsed = cpuEnd - cpuStart;
-    u64 cpuFreq = 0;
+    printf("\n--- TSC features ---\n");
+    print_tsc_features();
     
-    if (osElapsed) {
-        cpuFreq = osFreq * cpuElapsed / osElapsed;
+    printf("\n--- Timer overhead and resolution ---\n");
+    print_timer_overheads(cpuFreq);
+    
+    printf("\n--- Cross-core TSC offset (%u samples per pair) ---\n", SKEW_SAMPLE_COUNT);
+    print_tsc_skew(cpuFreq);
+    
+    if (driftSeconds) {
+        printf("\n--- Drift against the OS timer over %llus ---\n", driftSeconds);
+        print_tsc_drift(driftSeconds, cpuFreq);
     }
     
-    return cpuFreq;
+    return 0;
+}
+
+static void print_usage(char* exe) {
+    fprintf(stderr, "Usage: %s [milliseconds to measure, default 1000]\n", exe);
+    fprintf(stderr, "       %s --diagnose [seconds to sample drift, default %u, 0 to skip]\n", exe, DRIFT_DEFAULT_SECONDS);
 }
 
 int main(int argc, char** argv) {
     u64 millisToWait = 1000;
     
+    if ((argc >= 2) && (strcmp(argv[1], "--diagnose") == 0)) {
+        u64 driftSeconds = (argc >= 3) ? strtoull(argv[2], 0, 10) : DRIFT_DEFAULT_SECONDS;
+        return run_diagnostics(driftSeconds);
+    } else if ((argc >= 2) && (argv[1][0] == '-')) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
     if (argc == 2) {
         millisToWait = atol(argv[1]);
     }
     
     int result = 1;
     
+    // Looked up first, so the time it takes isn't hidden by the long calibration below
+    u64 lookupStart = read_os_timer();
+    u64 timerFreq = get_cpu_timer_freq();
+    u64 lookupElapsed = read_os_timer() - lookupStart;
+    
     u64 osFreq = get_os_timer_freq();
     
     u64 cpuStart = read_cpu_timer();
@@ -87,5 +456,27 @@ int main(int argc, char** argv) {
     printf("CPU Timer: %llu -> %llu = %llu elapsed\n", cpuStart, cpuEnd, cpuElapsed);
     printf(" CPU Freq: %llu (guessed)\n", cpuFreq);
     
+    printf("\n CPU Freq: %llu from %s in %.3fms (what the profiler and repetition tester use)\n",
+           timerFreq, describe_cpu_timer_freq_source(get_cpu_timer_freq_source()),
+           1000.0 * (double)lookupElapsed / (double)osFreq);
+    
+    // Every source against the calibration above
+    printf("\n%-12s %-14s %-12s %s\n", "Source", "Frequency", "Off by", "Took");
+    for (u32 i = 0; i < TimerFreqSource_Count; i++) {
+        CpuTimerFreqSource source = (CpuTimerFreqSource)i;
+        
+        u64 sourceStart = read_os_timer();
+        u64 freq = read_cpu_timer_freq_from(source, TIMER_FREQ_CALIBRATION_MAX_MS);
+        u64 sourceElapsed = read_os_timer() - sourceStart;
+        double millis = 1000.0 * (double)sourceElapsed / (double)osFreq;
+        
+        if (freq) {
+            double ppm = cpuFreq ? (1000000.0 * ((double)freq - (double)cpuFreq) / (double)cpuFreq) : 0.0;
+            printf("%-12s %-14llu %+9.1fppm %.3fms\n", describe_cpu_timer_freq_source(source), freq, ppm, millis);
+        } else {
+            printf("%-12s %-14s %-12s %.3fms\n", describe_cpu_timer_freq_source(source), "n/a", "", millis);
+        }
+    }
+    
     return result;
 }
\ No newline at end of file
@@ -0,0 +1,449 @@
+// NOTE(alex): Bandwidth and latency over working sets from 4KB up to main memory. Each probe
+// passes over the same buffer prefix again and again, so the plateaus in the table line up with
+// the cache levels the prefix fits in. These are the ceilings the parse and haversine kernels get
+// measured against.
+
+#if _WIN32
+// MSVC emits any intrinsic without flags, whether the CPU has it is checked at run time.
+#define TARGET_AVX
+#define TARGET_AVX512
+#define TARGET_XSAVE
+#else
+#define TARGET_AVX __attribute__((target("avx")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#define TARGET_XSAVE __attribute__((target("xsave")))
+#endif
+
+#define PROBE_MIN_SIZE (4ull * 1024)
+#define PROBE_DEFAULT_MAX_MB 1024
+#define PROBE_MIN_BYTES_PER_TEST (64ull * 1024 * 1024) // Small sets are repeated up to this
+#define PROBE_CHASE_STEP_COUNT (1ull << 20)
+#define PROBE_LINE_SIZE 64
+
+enum ProbeFeature {
+    ProbeFeature_None,
+    ProbeFeature_Avx,
+    ProbeFeature_Avx512,
+};
+
+struct BandwidthParams {
+    u8* data;          // PROBE_LINE_SIZE aligned
+    u64 size;          // Working set, a multiple of PROBE_MIN_SIZE
+    u64 repeatCount;
+    u64 chaseLine;     // Where the pointer chase left off
+};
+
+// Returns the bytes it moved, in whole cache lines for the probes that skip over parts of them.
+typedef u64 bandwidth_kernel_func(BandwidthParams* params);
+
+struct BandwidthProbe {
+    const char* name;
+    bandwidth_kernel_func* kernel;
+    ProbeFeature feature;
+    bool chase; // Reported as latency per load instead of bandwidth
+};
+
+static volatile u64 gProbeSink; // Keeps the loads from being optimized away
+
+//
+// Reads
+//
+
+static u64 read_8(BandwidthParams* params) {
+    u64 acc = 0;
+    
+    // volatile so the compiler can't turn this into wider loads
+    for (u64 repeat = 0; repeat < params->repeatCount; repeat++) {
+        volatile u64* data = (volatile u64*)params->data;
+        for (u64 i = 0; i < params->size / 8; i += 4) {
+            acc |= data[i + 0] | data[i + 1] | data[i + 2] | data[i + 3];
+        }
+    }
+    
+    gProbeSink = acc;
+    return params->size * params->repeatCount;
+}
+
+static u64 read_16(BandwidthParams* params) {
+    __m128i acc0 = _mm_setzero_si128();
+    __m128i acc1 = _mm_setzero_si128();
+    
+    for (u64 repeat = 0; repeat < params->repeatCount; repeat++) {
+        for (u64 at = 0; at < params->size; at += 64) {
+            __m128i* line = (__m128i*)(params->data + at);
+            acc0 = _mm_or_si128(acc0, _mm_load_si128(line + 0));
+            acc1 = _mm_or_si128(acc1, _mm_load_si128(line + 1));
+            acc0 = _mm_or_si128(acc0, _mm_load_si128(line + 2));
+            acc1 = _mm_or_si128(acc1, _mm_load_si128(line + 3));
+        }
+    }
+    
+    gProbeSink = (u64)_mm_cvtsi128_si64(_mm_or_si128(acc0, acc1));
+    return params->size * params->repeatCount;
+}
+
+TARGET_AVX static u64 read_32(BandwidthParams* params) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    
+    for (u64 repeat = 0; repeat < params->repeatCount; repeat++) {
+        for (u64 at = 0; at < params->size; at += 128) {
+            float* lines = (float*)(params->data + at);
+            acc0 = _mm256_or_ps(acc0, _mm256_load_ps(lines + 0));
+            acc1 = _mm256_or_ps(acc1, _mm256_load_ps(lines + 8));
+            acc0 = _mm256_or_ps(acc0, _mm256_load_ps(lines + 16));
+            acc1 = _mm256_or_ps(acc1, _mm256_load_ps(lines + 24));
+        }
+    }
+    
+    gProbeSink = (u64)_mm256_movemask_ps(_mm256_or_ps(acc0, acc1));
+    return params->size * params->repeatCount;
+}
+
+TARGET_AVX512 static u64 read_64(BandwidthParams* params) {
+    __m512i acc0 = _mm512_setzero_si512();
+    __m512i acc1 = _mm512_setzero_si512();
+    
+    for (u64 repeat = 0; repeat < params->repeatCount; repeat++) {
+        for (u64 at = 0; at < params->size; at += 128) {
+            acc0 = _mm512_or_si512(acc0, _mm512_load_si512(params->data + at));
+            acc1 = _mm512_or_si512(acc1, _mm512_load_si512(params->data + at + 64));
+        }
+    }
+    
+    u64 lanes[8];
+    _mm512_storeu_si512(lanes, _mm512_or_si512(acc0, acc1));
+    gProbeSink = lanes[0];
+    return params->size * params->repeatCount;
+}
+
+//
+// Writes
+//
+
+static u64 write_8(BandwidthParams* params) {
+    for (u64 repeat = 0; repeat < params->repeatCount; repeat++) {
+        volatile u64* data = (volatile u64*)params->data;
+        for (u64 i = 0; i < params->size / 8; i += 4) {
+            data[i + 0] = repeat;
+            data[i + 1] = repeat;
+            data[i + 2] = repeat;
+            data[i + 3] = repeat;
+        }
+    }
+    
+    return params->size * params->repeatCount;
+}
+
+static u64 write_16(BandwidthParams* params) {
+    for (u64 repeat = 0; repeat < params->repeatCount; repeat++) {
+        __m128i value = _mm_set1_epi64x((s64)repeat);
+        for (u64 at = 0; at < params->size; at += 64) {
+            __m128i* line = (__m128i*)(params->data + at);
+            _mm_store_si128(line + 0, value);
+            _mm_store_si128(line + 1, value);
+            _mm_store_si128(line + 2, value);
+            _mm_store_si128(line + 3, value);
+        }
+    }
+    
+    return params->size * params->repeatCount;
+}
+
+TARGET_AVX static u64 write_32(BandwidthParams* params) {
+    for (u64 repeat = 0; repeat < params->repeatCount; repeat++) {
+        __m256 value = _mm256_set1_ps((float)repeat);
+        for (u64 at = 0; at < params->size; at += 128) {
+            float* lines = (float*)(params->data + at);
+            _mm256_store_ps(lines + 0, value);
+            _mm256_store_ps(lines + 8, value);
+            _mm256_store_ps(lines + 16, value);
+            _mm256_store_ps(lines + 24, value);
+        }
+    }
+    
+    return params->size * params->repeatCount;
+}
+
+TARGET_AVX512 static u64 write_64(BandwidthParams* params) {
+    for (u64 repeat = 0; repeat < params->repeatCount; repeat++) {
+        __m512i value = _mm512_set1_epi64((s64)repeat);
+        for (u64 at = 0; at < params->size; at += 128) {
+            _mm512_store_si512(params->data + at, value);
+            _mm512_store_si512(params->data + at + 64, value);
+        }
+    }
+    
+    return params->size * params->repeatCount;
+}
+
+// Non-temporal stores skip the caches (no read for ownership), the fence makes sure they are done
+// before the timer stops.
+static u64 write_nt_16(BandwidthParams* params) {
+    for (u64 repeat = 0; repeat < params->repeatCount; repeat++) {
+        __m128i value = _mm_set1_epi64x((s64)repeat);
+        for (u64 at = 0; at < params->size; at += 64) {
+            __m128i* line = (__m128i*)(params->data + at);
+            _mm_stream_si128(line + 0, value);
+            _mm_stream_si128(line + 1, value);
+            _mm_stream_si128(line + 2, value);
+            _mm_stream_si128(line + 3, value);
+        }
+    }
+    _mm_sfence();
+    
+    return params->size * params->repeatCount;
+}
+
+TARGET_AVX static u64 write_nt_32(BandwidthParams* params) {
+    for (u64 repeat = 0; repeat < params->repeatCount; repeat++) {
+        __m256 value = _mm256_set1_ps((float)repeat);
+        for (u64 at = 0; at < params->size; at += 64) {
+            float* line = (float*)(params->data + at);
+            _mm256_stream_ps(line + 0, value);
+            _mm256_stream_ps(line + 8, value);
+        }
+    }
+    _mm_sfence();
+    
+    return params->size * params->repeatCount;
+}
+
+//
+// Strided and dependent reads
+//
+
+// One load per stride, counted as the whole line it brings in.
+static u64 read_strided(BandwidthParams* params, u64 stride) {
+    u64 acc = 0;
+    u64 lineCount = 0;
+    
+    for (u64 repeat = 0; repeat < params->repeatCount; repeat++) {
+        for (u64 at = 0; at < params->size; at += stride) {
+            acc |= *(volatile u64*)(params->data + at);
+            lineCount++;
+        }
+    }
+    
+    gProbeSink = acc;
+    return lineCount * PROBE_LINE_SIZE;
+}
+
+// Every fourth line, the adjacent line prefetcher still pulls in the one next to it
+static u64 read_stride_256(BandwidthParams* params) {
+    return read_strided(params, 256);
+}
+
+// A page and a line apart, so each load also lands on a new page and in a different set
+static u64 read_stride_4160(BandwidthParams* params) {
+    return read_strided(params, 4096 + 64);
+}
+
+// NOTE(alex): Each line holds the offset of the next one, in a random order that visits every line
+// of the working set once (Sattolo's shuffle gives a single cycle). No load can start before the
+// previous one finished and the prefetchers can't guess the next line, so the time per step is the
+// load latency of whatever level the working set fits in.
+static void build_pointer_chase(BandwidthParams* params) {
+    u64 lineCount = params->size / PROBE_LINE_SIZE;
+    u64* lines = (u64*)params->data;
+    u64 stride = PROBE_LINE_SIZE / sizeof(u64);
+    
+    // The chain is built in place: first the identity, then shuffled
+    for (u64 i = 0; i < lineCount; i++) {
+        lines[i * stride] = i;
+    }
+    
+    u64 random = 0x9E3779B97F4A7C15ull ^ params->size;
+    for (u64 i = lineCount - 1; i > 0; i--) {
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        
+        u64 j = random % i;
+        u64 swap = lines[i * stride];
+        lines[i * stride] = lines[j * stride];
+        lines[j * stride] = swap;
+    }
+    
+    params->chaseLine = 0;
+}
+
+static u64 chase_pointers(BandwidthParams* params) {
+    u64* lines = (u64*)params->data;
+    u64 stride = PROBE_LINE_SIZE / sizeof(u64);
+    
+    // Carries on from the last test, so a chain longer than one test's steps is still walked in full
+    u64 line = params->chaseLine;
+    for (u64 i = 0; i < PROBE_CHASE_STEP_COUNT; i++) {
+        line = lines[line * stride];
+    }
+    params->chaseLine = line;
+    
+    return PROBE_CHASE_STEP_COUNT * PROBE_LINE_SIZE;
+}
+
+static BandwidthProbe gBandwidthProbes[] = {
+    { "Read 8", read_8, ProbeFeature_None, false },
+    { "Read 16", read_16, ProbeFeature_None, false },
+    { "Read 32", read_32, ProbeFeature_Avx, false },
+    { "Read 64", read_64, ProbeFeature_Avx512, false },
+    { "Write 8", write_8, ProbeFeature_None, false },
+    { "Write 16", write_16, ProbeFeature_None, false },
+    { "Write 32", write_32, ProbeFeature_Avx, false },
+    { "Write 64", write_64, ProbeFeature_Avx512, false },
+    { "NT 16", write_nt_16, ProbeFeature_None, false },
+    { "NT 32", write_nt_32, ProbeFeature_Avx, false },
+    { "Stride 256", read_stride_256, ProbeFeature_None, false },
+    { "Stride 4160", read_stride_4160, ProbeFeature_None, false },
+    { "Chase (ns)", chase_pointers, ProbeFeature_None, true },
+};
+
+TARGET_XSAVE static u64 read_enabled_register_state() {
+    u64 result = _xgetbv(0);
+    return result;
+}
+
+// The CPU has to support the instructions and the OS has to save the registers they use.
+static bool is_probe_feature_available(ProbeFeature feature) {
+    u32 registers[4];
+    read_cpuid(1, 0, registers);
+    
+    bool hasAvx = (registers[2] >> 28) & 1;
+    bool hasXsave = (registers[2] >> 27) & 1; // OSXSAVE, xgetbv works
+    
+    u64 enabledState = hasXsave ? read_enabled_register_state() : 0;
+    bool osSavesAvx = (enabledState & 0x6) == 0x6; // SSE and upper halves of the YMM registers
+    bool osSavesAvx512 = (enabledState & 0xE6) == 0xE6; // Plus the opmask and upper ZMM registers
+    
+    bool hasAvx512 = false;
+    if (get_max_cpuid_leaf(0) >= 7) {
+        read_cpuid(7, 0, registers);
+        hasAvx512 = (registers[1] >> 16) & 1;
+    }
+    
+    bool result;
+    switch (feature) {
+        case ProbeFeature_None: { result = true; } break;
+        case ProbeFeature_Avx: { result = hasAvx && osSavesAvx; } break;
+        case ProbeFeature_Avx512: { result = hasAvx512 && osSavesAvx512; } break;
+        default: { result = false; } break;
+    }
+    
+    return result;
+}
+
+static void run_bandwidth_probe(RepetitionTester* tester, BandwidthParams* params, BandwidthProbe* probe) {
+    while (tester_is_testing(tester)) {
+        tester_begin_time(tester);
+        u64 byteCount = probe->kernel(params);
+        tester_end_time(tester);
+        
+        count_bytes(tester, byteCount);
+    }
+}
+
+static void print_size(u64 size) {
+    if (size >= (1024 * 1024 * 1024)) {
+        printf("%6lluGB", size / (1024 * 1024 * 1024));
+    } else if (size >= (1024 * 1024)) {
+        printf("%6lluMB", size / (1024 * 1024));
+    } else {
+        printf("%6lluKB", size / 1024);
+    }
+}
+
+// Runs every probe at working sets of 4KB, 8KB, ... up to maxSize and prints the best result of
+// each as GB/s, or ns per load for the pointer chase.
+static void run_bandwidth_probes(u64 cpuTimerFreq, u64 maxSize, u32 secondsPerProbe) {
+    u32 sizeCount = 0;
+    for (u64 size = PROBE_MIN_SIZE; size <= maxSize; size *= 2) {
+        sizeCount++;
+    }
+    
+    if (!sizeCount) {
+        fprintf(stderr, "ERROR: Largest working set must be at least %llu bytes\n", PROBE_MIN_SIZE);
+        return;
+    }
+    
+    u64 bufferSize = PROBE_MIN_SIZE << (sizeCount - 1);
+    String buffer = allocate_string(bufferSize + PROBE_LINE_SIZE);
+    String results = allocate_string(sizeCount * ARRAY_COUNT(gBandwidthProbes) * sizeof(double));
+    if (!buffer.data || !results.data) {
+        free_string(&buffer);
+        free_string(&results);
+        return;
+    }
+    
+    double* bestResults = (double*)results.data;
+    
+    BandwidthParams params = {};
+    params.data = (u8*)(((u64)buffer.data + PROBE_LINE_SIZE - 1) & ~(u64)(PROBE_LINE_SIZE - 1));
+    
+    // Faults every page in up front, the probes should only see the memory hierarchy
+    memset(params.data, 1, bufferSize);
+    
+    for (u32 sizeIndex = 0; sizeIndex < sizeCount; sizeIndex++) {
+        params.size = PROBE_MIN_SIZE << sizeIndex;
+        params.repeatCount = (params.size < PROBE_MIN_BYTES_PER_TEST) ? (PROBE_MIN_BYTES_PER_TEST / params.size) : 1;
+        
+        for (u32 probeIndex = 0; probeIndex < ARRAY_COUNT(gBandwidthProbes); probeIndex++) {
+            BandwidthProbe* probe = gBandwidthProbes + probeIndex;
+            double* best = bestResults + sizeIndex * ARRAY_COUNT(gBandwidthProbes) + probeIndex;
+            *best = 0;
+            
+            if (!is_probe_feature_available(probe->feature)) {
+                continue;
+            }
+            
+            if (probe->chase) {
+                build_pointer_chase(&params);
+            }
+            
+            printf("\n--- %s, ", probe->name);
+            print_size(params.size);
+            printf(" ---\n");
+            
+            // NOTE(alex): The kernels tell how many bytes they moved only after the first run, the
+            // tester wants it up front. They always move the same amount for the same params.
+            BandwidthParams firstParams = params;
+            u64 byteCount = probe->kernel(&firstParams);
+            params.chaseLine = firstParams.chaseLine;
+            
+            RepetitionTester tester = {};
+            new_test_wave(&tester, byteCount, cpuTimerFreq, secondsPerProbe);
+            run_bandwidth_probe(&tester, &params, probe);
+            
+            RepetitionValue min = tester.results.min;
+            double seconds = seconds_from_cpu_time((double)min.e[RepValue_CpuTimer], cpuTimerFreq);
+            if (probe->chase) {
+                *best = 1e9 * seconds / (double)PROBE_CHASE_STEP_COUNT;
+            } else if (seconds > 0) {
+                *best = (double)min.e[RepValue_ByteCount] / (1024.0 * 1024.0 * 1024.0 * seconds);
+            }
+        }
+    }
+    
+    printf("\n%8s", "Size");
+    for (u32 probeIndex = 0; probeIndex < ARRAY_COUNT(gBandwidthProbes); probeIndex++) {
+        printf(" %11s", gBandwidthProbes[probeIndex].name);
+    }
+    printf("\n");
+    
+    for (u32 sizeIndex = 0; sizeIndex < sizeCount; sizeIndex++) {
+        print_size(PROBE_MIN_SIZE << sizeIndex);
+        
+        for (u32 probeIndex = 0; probeIndex < ARRAY_COUNT(gBandwidthProbes); probeIndex++) {
+            double best = bestResults[sizeIndex * ARRAY_COUNT(gBandwidthProbes) + probeIndex];
+            if (best > 0) {
+                printf(" %11.2f", best);
+            } else {
+                printf(" %11s", "n/a");
+            }
+        }
+        printf("\n");
+    }
+    printf("(GB/s in 2^30 bytes, strided probes count every line they touch in full)\n");
+    
+    free_string(&results);
+    free_string(&buffer);
+}
\ No newline at end of file
@@ -1,5 +1,10 @@
 #include <fcntl.h>
+#include <limits.h> // INT_MAX
+#if _WIN32
 #include <io.h>
+#else
+#include <unistd.h> // read()
+#endif
 
 enum AllocationType {
     AllocType_None,
@@ -82,6 +87,8 @@ static void read_via_fread(RepetitionTester* tester, ReadParams* params) {
     }
 }
 
+#if _WIN32
+
 static void read_via_read(RepetitionTester* tester, ReadParams* params) {
     while (tester_is_testing(tester)) {
         int file = _open(params->fileName, _O_BINARY | _O_RDONLY);
@@ -159,4 +166,47 @@ static void read_via_read_file(RepetitionTester* tester, ReadParams* params) {
             tester_error(tester, "CreateFileA failed");
         }
     }
-}
\ No newline at end of file
+}
+
+#else // _WIN32
+
+static void read_via_read(RepetitionTester* tester, ReadParams* params) {
+    while (tester_is_testing(tester)) {
+        int file = open(params->fileName, O_RDONLY);
+        if (file != -1) {
+            String destBuffer = params->dest;
+            handle_allocation(params, &destBuffer);
+            
+            u8* dest = destBuffer.data;
+            u64 sizeRemaining = destBuffer.count;
+            
+            while (sizeRemaining) {
+                u32 readSize = INT_MAX;
+                if ((u64)readSize > sizeRemaining) {
+                    readSize = (u32)sizeRemaining;
+                }
+                
+                tester_begin_time(tester);
+                ssize_t result = read(file, dest, readSize);
+                tester_end_time(tester);
+                
+                if (result == (ssize_t)readSize) {
+                    count_bytes(tester, readSize);
+                } else{
+                    tester_error(tester, "read failed");
+                    break;
+                }
+                
+                sizeRemaining -= readSize;
+                dest += readSize;
+            }
+            
+            handle_deallocation(params, &destBuffer);
+            close(file);
+        } else {
+            tester_error(tester, "open failed");
+        }
+    }
+}
+
+#endif // _WIN32
\ No newline at end of file
@@ -12,6 +12,9 @@ enum RepetitionValueType {
     RepValue_MemPageFaults,
     RepValue_ByteCount,
     
+    RepValue_CoreCycles,
+    RepValue_RefCycles, // At gMetrics.refCycleFreq, see read_cycle_counters
+    
     RepValue_Count,
 };
 
@@ -37,8 +40,15 @@ struct RepetitionTester {
     u32 openBlockCount;
     u32 closeBlockCount;
     
+    // A wave whose effective frequency differs from the first one by more than this fraction is
+    // thrown away, 0 keeps every wave.
+    double maxFreqDeviation;
+    double referenceGhz;
+    u32 rejectedWaveCount;
+    
     RepetitionValue accumulatedOnThisTest;
     RepetitionTestResults results;
+    RepetitionTestResults resultsBeforeWave;
 };
 
 static double seconds_from_cpu_time(double cpuTime, u64 cpuTimerFreq) {
@@ -51,6 +61,18 @@ static double seconds_from_cpu_time(double cpuTime, u64 cpuTimerFreq) {
     return result;
 }
 
+// How fast the core actually ran, 0 without cycle counters.
+static double get_effective_ghz(RepetitionValue value, u64 cpuTimerFreq) {
+    double result = 0.0;
+    
+    u64 refCycleFreq = gMetrics.refCycleFreq ? gMetrics.refCycleFreq : cpuTimerFreq;
+    if (value.e[RepValue_RefCycles]) {
+        result = ((double)value.e[RepValue_CoreCycles] / (double)value.e[RepValue_RefCycles]) * ((double)refCycleFreq / 1e9);
+    }
+    
+    return result;
+}
+
 static void tester_print_value(const char* label, RepetitionValue value, u64 cpuTimerFreq) {
     u64 testCount = value.e[RepValue_TestCount];
     double divisor = testCount ? (double)testCount : 1;
@@ -79,6 +101,11 @@ static void tester_print_value(const char* label, RepetitionValue value, u64 cpu
                e[RepValue_MemPageFaults],
                e[RepValue_ByteCount] / (e[RepValue_MemPageFaults] * 1024.0));
     }
+    
+    double ghz = get_effective_ghz(value, cpuTimerFreq);
+    if (ghz > 0) {
+        printf(" %.2fGHz", ghz);
+    }
 }
 
 static void print_results(RepetitionTestResults results, u64 cpuTimerFreq) {
@@ -116,6 +143,7 @@ static void new_test_wave(RepetitionTester* tester, u64 targetProcessedByteCount
         }
     }
     
+    tester->resultsBeforeWave = tester->results;
     tester->tryForTime = secondsToTry * cpuTimerFreq;
     tester->testsStartedAt = read_cpu_timer();
 }
@@ -124,6 +152,12 @@ static void tester_begin_time(RepetitionTester* tester) {
     tester->openBlockCount++;
     
     RepetitionValue* accum = &tester->accumulatedOnThisTest;
+    
+    u64 coreCycles, refCycles;
+    read_cycle_counters(&coreCycles, &refCycles);
+    accum->e[RepValue_CoreCycles] -= coreCycles;
+    accum->e[RepValue_RefCycles] -= refCycles;
+    
     accum->e[RepValue_MemPageFaults] -= read_os_page_fault_count();
     accum->e[RepValue_CpuTimer] -= read_cpu_timer();
 }
@@ -133,6 +167,11 @@ static void tester_end_time(RepetitionTester* tester) {
     accum->e[RepValue_CpuTimer] += read_cpu_timer();
     accum->e[RepValue_MemPageFaults] += read_os_page_fault_count();
     
+    u64 coreCycles, refCycles;
+    read_cycle_counters(&coreCycles, &refCycles);
+    accum->e[RepValue_CoreCycles] += coreCycles;
+    accum->e[RepValue_RefCycles] += refCycles;
+    
     tester->closeBlockCount++;
 }
 
@@ -141,6 +180,33 @@ static void count_bytes(RepetitionTester* tester, u64 byteCount) {
     accum->e[RepValue_ByteCount] += byteCount;
 }
 
+// NOTE(alex): TSC based times are only comparable between waves that ran at the same clock. The
+// first wave sets the reference, later ones that turbo or throttle away from it are dropped as a
+// whole, minimums included, so a change in min time points at the code and not at the cooling.
+static void check_wave_frequency(RepetitionTester* tester) {
+    RepetitionValue wave = tester->results.total;
+    for (u32 eIndex = 0; eIndex < ARRAY_COUNT(wave.e); ++eIndex) {
+        wave.e[eIndex] -= tester->resultsBeforeWave.total.e[eIndex];
+    }
+    
+    double ghz = get_effective_ghz(wave, tester->cpuTimerFreq);
+    
+    if ((ghz > 0) && (tester->maxFreqDeviation > 0)) {
+        if (tester->referenceGhz == 0) {
+            tester->referenceGhz = ghz;
+        } else {
+            double deviation = (ghz - tester->referenceGhz) / tester->referenceGhz;
+            if ((deviation > tester->maxFreqDeviation) || (-deviation > tester->maxFreqDeviation)) {
+                tester->results = tester->resultsBeforeWave;
+                tester->rejectedWaveCount++;
+                
+                printf("REJECTED: wave ran at %.2fGHz, %+.1f%% off the first wave's %.2fGHz (%u rejected so far)\n",
+                       ghz, 100.0 * deviation, tester->referenceGhz, tester->rejectedWaveCount);
+            }
+        }
+    }
+}
+
 static bool tester_is_testing(RepetitionTester* tester) {
     if (tester->mode == TestMode_Testing) {
         RepetitionValue accum = tester->accumulatedOnThisTest;
@@ -193,6 +259,7 @@ static bool tester_is_testing(RepetitionTester* tester) {
             tester->mode = TestMode_Completed;
             
             printf("                                                          \r");
+            check_wave_frequency(tester);
             print_results(tester->results, tester->cpuTimerFreq);
         }
     }
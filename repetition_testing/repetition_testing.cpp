@@ -8,6 +8,8 @@ typedef uint16_t u16;
 typedef uint32_t u32;
 typedef uint64_t u64;
 
+typedef int64_t s64;
+
 #define ARRAY_COUNT(arr) (sizeof(arr) / sizeof(arr[0]))
 
 #include "../haversine_processor/string.cpp"
@@ -15,6 +17,7 @@ typedef uint64_t u64;
 #include "repetition_tester.cpp"
 #include "read_overhead_test.cpp"
 #include "pagefault_overhead_test.cpp"
+#include "bandwidth_probe_test.cpp"
 
 struct TestFunction {
     const char* name;
@@ -24,23 +27,45 @@ struct TestFunction {
 TestFunction gTestFunctions[] = {
     { "write_to_all_bytes", write_to_all_bytes },
     { "fread", read_via_fread },
+#if _WIN32
     { "_read", read_via_read },
     { "ReadFile", read_via_read_file },
+#else
+    { "read", read_via_read },
+#endif
 };
 
 int main(int argc, char** argv) {
     init_os_metrics();
-    u64 cpuTimerFreq = estimate_cpu_timer_freq();
+    u64 cpuTimerFreq = get_cpu_timer_freq();
+    
+    if ((argc >= 2) && (strcmp(argv[1], "--bandwidth") == 0)) {
+        u64 maxMegabytes = (argc >= 3) ? strtoull(argv[2], 0, 10) : PROBE_DEFAULT_MAX_MB;
+        u32 secondsPerProbe = (argc >= 4) ? (u32)atoi(argv[3]) : 1;
+        run_bandwidth_probes(cpuTimerFreq, maxMegabytes * 1024 * 1024, secondsPerProbe);
+        return 0;
+    }
     
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s [existing filename]\n", argv[0]);
+    if ((argc != 2) && (argc != 3)) {
+        fprintf(stderr, "Usage: %s [existing filename] [max frequency deviation between waves in %%, default 0 = off]\n", argv[0]);
+        fprintf(stderr, "       %s --bandwidth [largest working set in MB, default %u] [seconds per probe, default 1]\n", argv[0], PROBE_DEFAULT_MAX_MB);
         return 0;
     }
     
     char* fileName = argv[1];
+    double maxFreqDeviation = (argc == 3) ? (atof(argv[2]) / 100.0) : 0.0;
+    
+    if (!gMetrics.cycleCountersAvailable) {
+        fprintf(stderr, "WARNING: No cycle counters to measure the effective frequency with, it isn't reported or checked.\n");
+    }
     
+#if _WIN32
     struct __stat64 stat;
     _stat64(fileName, &stat);
+#else
+    struct stat stat = {};
+    ::stat(fileName, &stat);
+#endif
     
     ReadParams params = {};
     params.dest = allocate_string(stat.st_size);
@@ -59,6 +84,7 @@ int main(int argc, char** argv) {
                 params.allocType = (AllocationType)allocType;
                 
                 RepetitionTester* tester = &testers[funcIndex][allocType];
+                tester->maxFreqDeviation = maxFreqDeviation;
                 TestFunction testFunc = gTestFunctions[funcIndex];
                 
                 printf("\n--- %s%s%s ---\n",